@@ -0,0 +1,497 @@
+#include "doc_bitmap.h"
+#include "forward_index.h"
+
+// container data is padded to 8 bytes, so bitsets can be read a word at a time
+#define BITMAP_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+static size_t bm_containerSize(BitmapContainer *c) {
+    return c->type == BITMAP_CONTAINER_BITSET ? BITMAP_WORDS * sizeof(u_int64_t) :
+                                                c->card * sizeof(u_int16_t);
+}
+
+static void bm_pad(BufferWriter *bw) {
+    static char zeros[8] = {0};
+    size_t off = BufferOffset(bw->buf);
+    if (BITMAP_ALIGN(off) > off) {
+        bw->Write(bw->buf, zeros, BITMAP_ALIGN(off) - off);
+    }
+}
+
+u_int32_t DocBitmap_Build(IndexReader *ir, BufferWriter *bw) {
+    u_int32_t cap = ir->header.numDocs, n = 0;
+    if (cap == 0) {
+        return 0;
+    }
+
+    t_docId *docIds = malloc(cap * sizeof(t_docId));
+    float *freqs = malloc(cap * sizeof(float));
+    u_char *flags = malloc(cap);
+    t_docId docId;
+    float freq;
+    u_char fl;
+    while (n < cap && IR_GenericRead(ir, &docId, &freq, &fl, NULL) == INDEXREAD_OK) {
+        // a bitmap can't hold the same docId twice, so we keep the first entry of a document
+        if (n > 0 && docId <= docIds[n - 1]) {
+            continue;
+        }
+        docIds[n] = docId;
+        freqs[n] = freq;
+        flags[n] = fl;
+        n++;
+    }
+    if (n == 0) {
+        free(docIds);
+        free(freqs);
+        free(flags);
+        return 0;
+    }
+
+    // split the docIds into containers by their high bits
+    u_int32_t nc = 0;
+    for (u_int32_t i = 0; i < n; i++) {
+        if (i == 0 || docIds[i] >> 16 != docIds[i - 1] >> 16) nc++;
+    }
+    BitmapContainer *cs = calloc(nc, sizeof(BitmapContainer));
+    int c = -1;
+    for (u_int32_t i = 0; i < n; i++) {
+        if (c < 0 || docIds[i] >> 16 != cs[c].key) {
+            cs[++c].key = docIds[i] >> 16;
+            cs[c].rank = i;
+        }
+        cs[c].card++;
+    }
+    size_t off = BITMAP_ALIGN(sizeof(DocBitmapHeader) + nc * sizeof(BitmapContainer));
+    for (c = 0; c < nc; c++) {
+        cs[c].type = cs[c].card > BITMAP_ARRAY_MAX ? BITMAP_CONTAINER_BITSET : BITMAP_CONTAINER_ARRAY;
+        cs[c].offset = off;
+        off += BITMAP_ALIGN(bm_containerSize(&cs[c]));
+    }
+
+    DocBitmapHeader h = {ir->header.numDocs, ir->header.lastId, nc, off};
+    bw->Write(bw->buf, &h, sizeof(h));
+    bw->Write(bw->buf, cs, nc * sizeof(BitmapContainer));
+    bm_pad(bw);
+
+    u_int64_t *words = malloc(BITMAP_WORDS * sizeof(u_int64_t));
+    u_int16_t *lows = malloc(BITMAP_ARRAY_MAX * sizeof(u_int16_t));
+    for (c = 0; c < nc; c++) {
+        t_docId *ids = docIds + cs[c].rank;
+        if (cs[c].type == BITMAP_CONTAINER_BITSET) {
+            memset(words, 0, BITMAP_WORDS * sizeof(u_int64_t));
+            for (u_int32_t i = 0; i < cs[c].card; i++) {
+                words[(ids[i] & 0xffff) >> 6] |= 1ULL << (ids[i] & 63);
+            }
+            bw->Write(bw->buf, words, BITMAP_WORDS * sizeof(u_int64_t));
+        } else {
+            for (u_int32_t i = 0; i < cs[c].card; i++) {
+                lows[i] = ids[i] & 0xffff;
+            }
+            bw->Write(bw->buf, lows, cs[c].card * sizeof(u_int16_t));
+        }
+        bm_pad(bw);
+    }
+    bw->Write(bw->buf, freqs, n * sizeof(float));
+    bw->Write(bw->buf, flags, n);
+
+    free(words);
+    free(lows);
+    free(cs);
+    free(docIds);
+    free(freqs);
+    free(flags);
+    return n;
+}
+
+DocBitmap *NewDocBitmap(Buffer *b) {
+    DocBitmapHeader h;
+    if (b == NULL || b->cap < sizeof(DocBitmapHeader)) {
+        return NULL;
+    }
+    memcpy(&h, b->data, sizeof(h));
+    if (h.numContainers == 0 ||
+        b->cap < sizeof(DocBitmapHeader) + h.numContainers * sizeof(BitmapContainer)) {
+        return NULL;
+    }
+
+    BitmapContainer *cs = (BitmapContainer *)(b->data + sizeof(DocBitmapHeader));
+    BitmapContainer *last = &cs[h.numContainers - 1];
+    u_int32_t num = last->rank + last->card;
+    if (last->offset + bm_containerSize(last) > h.freqsOffset ||
+        b->cap < h.freqsOffset + num * (sizeof(float) + 1)) {
+        return NULL;
+    }
+
+    DocBitmap *bm = malloc(sizeof(DocBitmap));
+    bm->buf = b;
+    bm->header = h;
+    bm->containers = cs;
+    bm->freqs = (float *)(b->data + h.freqsOffset);
+    bm->flags = (u_char *)(bm->freqs + num);
+    bm->num = num;
+    return bm;
+}
+
+int DocBitmap_Matches(DocBitmap *bm, const IndexHeader *h) {
+    return bm->header.numDocs == h->numDocs && bm->header.lastId == h->lastId;
+}
+
+void DocBitmap_Free(DocBitmap *bm) {
+    membufferRelease(bm->buf);
+    free(bm);
+}
+
+
+/* Count the set bits of a bitset in the range [from, to) */
+static inline u_int32_t bits_count(const u_int64_t *words, u_int32_t from, u_int32_t to) {
+    if (from >= to) {
+        return 0;
+    }
+    u_int32_t wf = from >> 6, wt = to >> 6;
+    u_int64_t first = words[wf] & (~0ULL << (from & 63));
+    if (wf == wt) {
+        return __builtin_popcountll(first & ((1ULL << (to & 63)) - 1));
+    }
+    u_int32_t n = __builtin_popcountll(first);
+    for (u_int32_t w = wf + 1; w < wt; w++) {
+        n += __builtin_popcountll(words[w]);
+    }
+    if (to & 63) {
+        n += __builtin_popcountll(words[wt] & ((1ULL << (to & 63)) - 1));
+    }
+    return n;
+}
+
+static inline void *br_data(DocBitmap *bm, BitmapContainer *c) {
+    return bm->buf->data + c->offset;
+}
+
+/* Move the reader to the start of a container. The position does not hold a docId yet */
+static inline void br_enter(BitmapReader *r, u_int32_t ci) {
+    r->ci = ci;
+    r->pos = 0;
+    if (ci < r->bm->header.numContainers) {
+        r->rank = r->bm->containers[ci].rank;
+    }
+}
+
+/* Find the first container from ci on with a key of at least key */
+static u_int32_t br_findContainer(DocBitmap *bm, u_int32_t ci, u_int32_t key) {
+    u_int32_t lo = ci, hi = bm->header.numContainers;
+    while (lo < hi) {
+        u_int32_t mid = lo + (hi - lo) / 2;
+        if (bm->containers[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Position the reader on the first docId of its current container, from its position on, whose
+low bits are at least low. Returns 0 if there is none */
+static int br_seekInContainer(BitmapReader *r, u_int32_t low) {
+    BitmapContainer *c = &r->bm->containers[r->ci];
+
+    if (c->type == BITMAP_CONTAINER_ARRAY) {
+        u_int16_t *lows = br_data(r->bm, c);
+        u_int32_t lo = r->pos, hi = c->card;
+        while (lo < hi) {
+            u_int32_t mid = lo + (hi - lo) / 2;
+            if (lows[mid] < low) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == c->card) {
+            return 0;
+        }
+        r->pos = lo;
+        r->rank = c->rank + lo;
+        r->docId = (t_docId)c->key << 16 | lows[lo];
+        return 1;
+    }
+
+    // in bitsets the rank is kept as the container's rank plus the bits set before pos
+    u_int64_t *words = br_data(r->bm, c);
+    u_int32_t start = low > r->pos ? low : r->pos;
+    u_int32_t w = start >> 6;
+    u_int64_t word = words[w] & (~0ULL << (start & 63));
+    while (!word) {
+        if (++w == BITMAP_WORDS) {
+            return 0;
+        }
+        word = words[w];
+    }
+    u_int32_t bit = w * 64 + __builtin_ctzll(word);
+    r->rank += bits_count(words, r->pos, bit);
+    r->pos = bit;
+    r->docId = (t_docId)c->key << 16 | bit;
+    return 1;
+}
+
+/* Position the reader on its first docId that is at least target. If the reader is already
+there it does not move. Returns 0 at the end of the bitmap */
+static int br_seek(BitmapReader *r, t_docId target) {
+    if (r->eof) {
+        return 0;
+    }
+    if (r->docId >= target) {
+        return 1;
+    }
+    DocBitmap *bm = r->bm;
+    u_int32_t key = target >> 16;
+    while (r->ci < bm->header.numContainers) {
+        if (bm->containers[r->ci].key < key) {
+            br_enter(r, br_findContainer(bm, r->ci + 1, key));
+            continue;
+        }
+        u_int32_t low = bm->containers[r->ci].key > key ? 0 : target & 0xffff;
+        if (br_seekInContainer(r, low)) {
+            return 1;
+        }
+        br_enter(r, r->ci + 1);
+    }
+    r->eof = 1;
+    return 0;
+}
+
+void BR_SetTotalDocs(BitmapReader *r, size_t totalDocs) {
+    r->idf = IDF(totalDocs, r->bm->header.numDocs);
+}
+
+void BR_SetNorms(BitmapReader *r, DocNorms *norms, size_t totalDocs) {
+    r->norms = norms;
+    r->idf = BM25_IDF(totalDocs, r->bm->header.numDocs);
+}
+
+BitmapReader *NewBitmapReader(DocBitmap *bm, u_char fieldMask) {
+    BitmapReader *r = malloc(sizeof(BitmapReader));
+    r->bm = bm;
+    r->docId = 0;
+    r->eof = 0;
+    r->fieldMask = fieldMask;
+    r->idf = IDF(TOTALDOCS_PLACEHOLDER, bm->header.numDocs);
+    r->norms = NULL;
+    br_enter(r, 0);
+    return r;
+}
+
+/* The score of the docId the reader is positioned on */
+static inline double br_score(BitmapReader *r) {
+    return DocNorms_Weight(r->norms, r->docId, r->bm->freqs[r->rank]) * r->idf;
+}
+
+/* Read the docId the reader is positioned on into a hit, like ir_readEntry does */
+static inline int br_readHit(BitmapReader *r, IndexHit *hit) {
+    hit->docId = r->docId;
+    hit->flags = r->bm->flags[r->rank];
+    hit->type = H_RAW;
+    // bitmaps have no offset vectors
+    hit->offsets = NULL;
+    hit->numOffsets = 0;
+    if (!(hit->flags & r->fieldMask)) {
+        return INDEXREAD_NOTFOUND;
+    }
+    hit->totalFreq += br_score(r);
+    return INDEXREAD_OK;
+}
+
+int BR_Read(void *ctx, IndexHit *hit) {
+    BitmapReader *r = ctx;
+    if (!br_seek(r, r->docId + 1)) {
+        return INDEXREAD_EOF;
+    }
+    return br_readHit(r, hit);
+}
+
+int BR_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit) {
+    BitmapReader *r = ctx;
+    // like index readers, we always move past the docId we've already read
+    if (!br_seek(r, docId > r->docId ? docId : r->docId + 1)) {
+        return INDEXREAD_EOF;
+    }
+    int rc = br_readHit(r, hit);
+    if (rc == INDEXREAD_OK && r->docId != docId) {
+        return INDEXREAD_NOTFOUND;
+    }
+    return rc;
+}
+
+int BR_ReadBatch(void *ctx, IndexHitBatch *b) {
+    BitmapReader *r = ctx;
+    b->num = 0;
+    while (b->num < INDEX_BATCH_SIZE && br_seek(r, r->docId + 1)) {
+        u_char flags = r->bm->flags[r->rank];
+        if (flags & r->fieldMask) {
+            IndexHitBatch_Append(b, r->docId, br_score(r), flags, 1);
+        }
+    }
+    return b->num;
+}
+
+int BR_HasNext(void *ctx) {
+    BitmapReader *r = ctx;
+    return !r->eof && (r->docId == 0 ? r->bm->num > 0 : r->rank + 1 < r->bm->num);
+}
+
+t_docId BR_LastDocId(void *ctx) {
+    return ((BitmapReader *)ctx)->docId;
+}
+
+size_t BR_Len(void *ctx) {
+    return ((BitmapReader *)ctx)->bm->num;
+}
+
+IndexIterator *NewBitmapIterator(BitmapReader *br) {
+    IndexIterator *it = malloc(sizeof(IndexIterator));
+    it->ctx = br;
+    it->Read = BR_Read;
+    it->SkipTo = BR_SkipTo;
+    it->LastDocId = BR_LastDocId;
+    it->HasNext = BR_HasNext;
+    it->Free = BitmapIterator_Free;
+    it->ReadBatch = BR_ReadBatch;
+    // bitmaps don't keep their maximal frequency, so they can't bound their scores
+    it->MaxScore = NULL;
+    it->SetMinScore = NULL;
+    it->Len = BR_Len;
+    return it;
+}
+
+void BitmapIterator_Free(IndexIterator *it) {
+    if (it == NULL) return;
+
+    BitmapReader *r = it->ctx;
+    DocBitmap_Free(r->bm);
+    free(r);
+    free(it);
+}
+
+int IsBitmapIterator(IndexIterator *it) {
+    return it != NULL && it->Read == BR_Read;
+}
+
+/* If all the readers are in the bitset container of target, AND their words to find the
+first docId from target on that all of them have. Otherwise just return target */
+static t_docId br_andBitsets(BitmapReader **rs, int num, t_docId target) {
+    u_int64_t *words[num];
+    for (int i = 0; i < num; i++) {
+        if (rs[i]->eof) {
+            return target;
+        }
+        BitmapContainer *c = &rs[i]->bm->containers[rs[i]->ci];
+        if (c->type != BITMAP_CONTAINER_BITSET || c->key != target >> 16) {
+            return target;
+        }
+        words[i] = br_data(rs[i]->bm, c);
+    }
+
+    u_int32_t w = (target & 0xffff) >> 6;
+    u_int64_t mask = ~0ULL << (target & 63);
+    for (; w < BITMAP_WORDS; w++, mask = ~0ULL) {
+        u_int64_t word = mask;
+        for (int i = 0; i < num && word; i++) {
+            word &= words[i][w];
+        }
+        if (word) {
+            return (target & ~(t_docId)0xffff) | (w * 64 + __builtin_ctzll(word));
+        }
+    }
+    // nothing in common left in this container, go on from the next one
+    return target >> 16 == 0xffff ? target | 0xffff : (target | 0xffff) + 1;
+}
+
+int BR_IntersectBatch(IndexIterator **its, int num, u_char fieldMask, IndexHitBatch *b) {
+    BitmapReader *rs[num];
+    for (int i = 0; i < num; i++) {
+        rs[i] = its[i]->ctx;
+    }
+    b->num = 0;
+
+    // all the readers are on the last docId we returned, so we go on from the one after it
+    t_docId target = rs[0]->docId + 1;
+    while (b->num < INDEX_BATCH_SIZE) {
+        int i;
+        for (i = 0; i < num; i++) {
+            if (!br_seek(rs[i], target)) {
+                return b->num;
+            }
+            // leapfrog to the docId the reader is on, trying to jump ahead on whole words
+            if (rs[i]->docId > target) {
+                target = br_andBitsets(rs, num, rs[i]->docId);
+                break;
+            }
+        }
+        if (i < num) {
+            continue;
+        }
+
+        // all the readers are on target - sum it up like II_Read does
+        double totalFreq = 0;
+        u_char flags = 0xff;
+        int found = 1;
+        for (i = 0; i < num; i++) {
+            u_char f = rs[i]->bm->flags[rs[i]->rank];
+            found &= (f & rs[i]->fieldMask) != 0;
+            flags &= f;
+            totalFreq += br_score(rs[i]);
+        }
+        if (found && (flags & fieldMask)) {
+            IndexHitBatch_Append(b, target, totalFreq, flags, 1);
+        }
+        target++;
+    }
+    return b->num;
+}
+
+int BR_UnionBatch(IndexIterator **its, int num, IndexHitBatch *b) {
+    BitmapReader *rs[num];
+    // the readers that have not ended are on or after the last docId we returned
+    t_docId target = 0;
+    int started = 0;
+    for (int i = 0; i < num; i++) {
+        rs[i] = its[i]->ctx;
+        if (!rs[i]->eof && (!started || rs[i]->docId < target)) {
+            target = rs[i]->docId;
+            started = 1;
+        }
+    }
+    target++;
+    b->num = 0;
+
+    while (b->num < INDEX_BATCH_SIZE) {
+        t_docId minDocId = 0;
+        int minIdx = -1;
+        for (int i = 0; i < num; i++) {
+            if (br_seek(rs[i], target) && (minIdx == -1 || rs[i]->docId < minDocId)) {
+                minDocId = rs[i]->docId;
+                minIdx = i;
+            }
+        }
+        if (minIdx == -1) {
+            break;
+        }
+
+        // the hit is taken from the reader that scores the docId highest, like UI_ReadBatch does
+        int best = -1;
+        double bestFreq = 0;
+        for (int i = minIdx; i < num; i++) {
+            BitmapReader *r = rs[i];
+            if (r->eof || r->docId != minDocId || !(r->bm->flags[r->rank] & r->fieldMask)) {
+                continue;
+            }
+            double freq = br_score(r);
+            if (best == -1 || freq > bestFreq) {
+                best = i;
+                bestFreq = freq;
+            }
+        }
+        if (best != -1) {
+            IndexHitBatch_Append(b, minDocId, bestFreq, rs[best]->bm->flags[rs[best]->rank], 1);
+        }
+        target = minDocId + 1;
+    }
+    return b->num;
+}
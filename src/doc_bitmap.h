@@ -0,0 +1,132 @@
+#ifndef __DOC_BITMAP_H__
+#define __DOC_BITMAP_H__
+
+#include "buffer.h"
+#include "types.h"
+#include "index.h"
+
+/*
+A DocBitmap is an alternative representation of the inverted index of a very frequent term.
+The docIds are kept in a roaring style bitmap: they are split into containers by their high 16
+bits, and each container holds the low 16 bits of its docIds either as a sorted array, or as a
+65536 bit bitset if the container is dense. The frequencies and flags of the documents are kept
+in arrays parallel to the docIds, so the n-th docId of the bitmap has the n-th frequency.
+
+Bitmaps do not hold offset vectors, so they are only used by queries that do not need them.
+They are built by FT.OPTIMIZE for dense terms, and kept in their own key next to the term's
+inverted index, which remains the source of truth. A bitmap records the number of docs and the
+last docId of the index it was built from, and is ignored once the index has moved on.
+*/
+
+// Containers with more docs than this are kept as bitsets
+#define BITMAP_ARRAY_MAX 4096
+// The number of 64 bit words in a bitset container
+#define BITMAP_WORDS 1024
+
+#define BITMAP_CONTAINER_ARRAY 0
+#define BITMAP_CONTAINER_BITSET 1
+
+// Only terms with at least this many docs get a bitmap
+#define BITMAP_MIN_DOCS 1000
+// ...and only if at least one in every BITMAP_MIN_DENSITY docIds up to their last one has them
+#define BITMAP_MIN_DENSITY 16
+
+#pragma pack(4)
+typedef struct {
+    // the number of docs and the last docId of the inverted index the bitmap was built from
+    u_int32_t numDocs;
+    t_docId lastId;
+    u_int32_t numContainers;
+    // the offset of the frequencies array from the start of the bitmap. The flags follow it
+    u_int32_t freqsOffset;
+} DocBitmapHeader;
+
+typedef struct {
+    // the high 16 bits of the container's docIds
+    u_int16_t key;
+    // BITMAP_CONTAINER_ARRAY or BITMAP_CONTAINER_BITSET
+    u_int16_t type;
+    // the number of docIds in the container
+    u_int32_t card;
+    // the number of docIds in all the containers before this one
+    u_int32_t rank;
+    // the offset of the container's data from the start of the bitmap
+    u_int32_t offset;
+} BitmapContainer;
+#pragma pack()
+
+typedef struct {
+    Buffer *buf;
+    DocBitmapHeader header;
+    BitmapContainer *containers;
+    float *freqs;
+    u_char *flags;
+    // the number of docIds in the bitmap
+    u_int32_t num;
+} DocBitmap;
+
+/* Should a term with the given number of docs and last docId get a bitmap */
+#define BITMAP_SHOULD_BUILD(numDocs, lastId) \
+    ((numDocs) >= BITMAP_MIN_DOCS && (u_int64_t)(numDocs) * BITMAP_MIN_DENSITY >= (lastId))
+
+/* Read all the entries of an index reader and write them as a bitmap.
+Returns the number of docs written, 0 if the index is empty */
+u_int32_t DocBitmap_Build(IndexReader *ir, BufferWriter *bw);
+
+/* Open a bitmap on a buffer. Returns NULL if the buffer does not hold a valid bitmap */
+DocBitmap *NewDocBitmap(Buffer *b);
+
+/* Was the bitmap built from the current state of an inverted index */
+int DocBitmap_Matches(DocBitmap *bm, const IndexHeader *h);
+
+/* Free a bitmap and its buffer */
+void DocBitmap_Free(DocBitmap *bm);
+
+
+/* A BitmapReader iterates a bitmap like an IndexReader iterates an inverted index */
+typedef struct {
+    DocBitmap *bm;
+    // the current container
+    u_int32_t ci;
+    // the position of the current docId in its container: an index into an array container,
+    // or a bit of a bitset container
+    u_int32_t pos;
+    // the rank of the current docId in the whole bitmap, i.e. the index of its frequency
+    u_int32_t rank;
+    // the current docId, 0 before the first read
+    t_docId docId;
+    int eof;
+    double idf;
+    // the document norms of BM25 scoring, NULL for tf-idf scoring
+    DocNorms *norms;
+    u_char fieldMask;
+} BitmapReader;
+
+BitmapReader *NewBitmapReader(DocBitmap *bm, u_char fieldMask);
+/* Set the number of documents in the index, which the idf of the bitmap's term depends on */
+void BR_SetTotalDocs(BitmapReader *r, size_t totalDocs);
+/* Score the bitmap's documents with BM25 using the document norms, like IR_SetNorms */
+void BR_SetNorms(BitmapReader *r, DocNorms *norms, size_t totalDocs);
+
+int BR_Read(void *ctx, IndexHit *hit);
+int BR_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit);
+int BR_ReadBatch(void *ctx, IndexHitBatch *b);
+int BR_HasNext(void *ctx);
+t_docId BR_LastDocId(void *ctx);
+size_t BR_Len(void *ctx);
+
+/* Create an iterator over a bitmap reader */
+IndexIterator *NewBitmapIterator(BitmapReader *br);
+void BitmapIterator_Free(IndexIterator *it);
+
+/* Is the iterator reading a bitmap */
+int IsBitmapIterator(IndexIterator *it);
+
+/* Intersect bitmap iterators directly on their bitmaps. Dense containers are intersected
+a 64 bit word at a time. The hits are scored and filtered like II_ReadBatch does */
+int BR_IntersectBatch(IndexIterator **its, int num, u_char fieldMask, IndexHitBatch *b);
+
+/* Merge bitmap iterators directly on their bitmaps, like UI_ReadBatch merges batches */
+int BR_UnionBatch(IndexIterator **its, int num, IndexHitBatch *b);
+
+#endif
@@ -0,0 +1,72 @@
+#include <math.h>
+#include <string.h>
+#include "doc_norms.h"
+
+u_char DocNorm_Quantize(double v) {
+    if (v <= 0) {
+        return 0;
+    }
+    double q = round(8 * log2(1.0 + v));
+    return q > 255 ? 255 : (q < 1 ? 1 : (u_char)q);
+}
+
+double DocNorm_Value(u_char q) {
+    return exp2(q / 8.0) - 1;
+}
+
+void DocNorm_Init(DocNorm *n, u_int32_t len, float maxFreq, float score) {
+    // documents with a score of 0 have postings with a frequency of 0, which the score of 1 unit
+    // keeps scoring 0
+    double s = round(score * DOCNORM_SCORE_SCALE);
+    n->score = s < 1 ? 1 : (s > DOCNORM_SCORE_SCALE ? DOCNORM_SCORE_SCALE : (u_int16_t)s);
+    n->maxFreq = DocNorm_Quantize(maxFreq);
+    n->len = DocNorm_Quantize(len);
+}
+
+DocNorms *NewDocNorms(const char *data, size_t len) {
+    DocNorms *n = calloc(1, sizeof(DocNorms));
+    if (data != NULL && len >= sizeof(DocNormsHeader)) {
+        memcpy(&n->header, data, sizeof(DocNormsHeader));
+        n->docs = (DocNorm *)(data + sizeof(DocNormsHeader));
+        n->numIds = (len - sizeof(DocNormsHeader)) / sizeof(DocNorm);
+    }
+
+    double avgLen = n->header.numDocs ? (double)n->header.totalLen / n->header.numDocs : 0;
+    for (int i = 0; i < 256; i++) {
+        // documents of an empty index can't be longer than the average
+        double rel = avgLen > 0 ? DocNorm_Value(i) / avgLen : 1;
+        n->lenFactor[i] = BM25_K1 * (1 - BM25_B + BM25_B * rel);
+        n->maxFreq[i] = DocNorm_Value(i);
+    }
+    return n;
+}
+
+void DocNorms_WeighBatch(const DocNorms *n, const t_docId *docIds, double *freqs, int num, 
+                         double idf) {
+    float x[num], score[num], k[num];
+    for (int i = 0; i < num; i++) {
+        t_docId id = docIds[i];
+        if (id < n->numIds && n->docs[id].len) {
+            DocNorm d = n->docs[id];
+            x[i] = freqs[i] * n->maxFreq[d.maxFreq];
+            score[i] = DocNorm_Score(&d);
+            k[i] = n->lenFactor[d.len];
+        } else {
+            x[i] = freqs[i];
+            score[i] = 1;
+            k[i] = BM25_K1;
+        }
+    }
+    for (int i = 0; i < num; i++) {
+        freqs[i] = (BM25_K1 + 1) * x[i] * score[i] / (x[i] + k[i] * score[i]) * idf;
+    }
+}
+
+void DocNorms_Free(DocNorms *n) {
+    free(n);
+}
+
+double BM25_IDF(double totalDocs, u_int32_t docFreq) {
+    // the +1 keeps the idf of terms in more than half of the documents positive
+    return log(1.0 + (totalDocs - docFreq + 0.5) / (docFreq + 0.5));
+}
@@ -0,0 +1,121 @@
+#ifndef __DOC_NORMS_H__
+#define __DOC_NORMS_H__
+
+#include <stdlib.h>
+#include "types.h"
+
+/*
+Document norms are what BM25 scoring needs to know about every document: its length, and how to
+turn the frequencies stored in its postings back into term frequencies. They are kept per index
+in a DMA string key next to the document metadata table, as a header followed by an array of
+fixed size records indexed by docId, so scoring a posting reads its document's record directly
+and does no hash lookups.
+
+Postings store freq/maxFreq*docScore (see ForwardIndex_NormalizeFreq and IW_WriteEntry), so a
+record keeps maxFreq and docScore to recover the term frequency, and BM25 scores are multiplied
+by the document score like tf-idf scores are. Records are 4 bytes, so that scoring the postings
+of frequent terms reads as few cache lines of the array as possible: the length and maxFreq are
+quantized to a byte each on a log scale, and the score to 16 bits. The length part of BM25 is
+computed once per query for each of the 256 lengths.
+*/
+
+#define DOCNORMS_KEY_FMT "__dn:%s__"
+
+// BM25 term frequency saturation and length normalization parameters
+#define BM25_K1 1.2
+#define BM25_B 0.75
+
+#pragma pack(4)
+typedef struct {
+    // the number of documents with a record, and the sum of their lengths in tokens
+    u_int32_t numDocs;
+    u_int64_t totalLen;
+    // the highest document score of the records, which bounds the BM25 score of every posting
+    float maxScore;
+} DocNormsHeader;
+#pragma pack()
+
+typedef struct {
+    // the document score in units of 1/DOCNORM_SCORE_SCALE, at least 1
+    u_int16_t score;
+    // the highest frequency of a term in the document, quantized with DocNorm_Quantize
+    u_char maxFreq;
+    // the length of the document in tokens, quantized with DocNorm_Quantize. Records of docIds 
+    // that were never written are zeroed, so 0 means the document has no record
+    u_char len;
+} DocNorm;
+
+#define DOCNORM_SCORE_SCALE 0xFFFF
+
+/* The norms of an index, loaded for a query */
+typedef struct {
+    DocNormsHeader header;
+    // the records, pointing into the DMA string of the key. numIds is the number of docIds they
+    // cover, all the docIds from 0
+    DocNorm *docs;
+    t_docId numIds;
+    // k1 * (1 - b + b * len / avgLen) of every quantized length
+    float lenFactor[256];
+    // the value of every quantized maxFreq
+    float maxFreq[256];
+} DocNorms;
+
+/* Quantize a positive value to a byte, with 8 steps for every doubling of the value, so it is 
+kept within about 4% up to 2^31. Every value above 0 is quantized to at least 1 */
+u_char DocNorm_Quantize(double v);
+/* The value a quantized byte stands for */
+double DocNorm_Value(u_char q);
+
+/* Fill a record for a document */
+void DocNorm_Init(DocNorm *n, u_int32_t len, float maxFreq, float score);
+/* The score of a document a record was filled with */
+static inline float DocNorm_Score(const DocNorm *n) {
+    return (float)n->score / DOCNORM_SCORE_SCALE;
+}
+
+/* Load the norms from the contents of their key, and compute the length factors from the
+average length. data is referenced, not copied. A NULL or short data loads empty norms */
+DocNorms *NewDocNorms(const char *data, size_t len);
+void DocNorms_Free(DocNorms *n);
+
+/* The BM25 inverse document frequency of a term that appears in docFreq of totalDocs documents */
+double BM25_IDF(double totalDocs, u_int32_t docFreq);
+
+/* The weight of a posting's stored frequency in the score of its document, which is multiplied by
+the idf of the term. With no norms (tf-idf scoring) this is the stored frequency itself. With norms
+it is the document score times the BM25 saturated term frequency. Documents that have no record,
+e.g. ones indexed before norms were kept, are scored as if they had the average length and the
+stored frequency were their term frequency */
+static inline double DocNorms_Weight(const DocNorms *n, t_docId docId, float freq) {
+    if (n == NULL) {
+        return freq;
+    }
+    if (docId >= n->numIds || n->docs[docId].len == 0) {
+        return freq * (BM25_K1 + 1) / (freq + BM25_K1);
+    }
+    // with tf = freq * maxFreq / score, score * tf * (k1 + 1) / (tf + K) takes a single division
+    DocNorm d = n->docs[docId];
+    float x = freq * n->maxFreq[d.maxFreq];
+    float score = DocNorm_Score(&d);
+    return (BM25_K1 + 1) * x * score / (x + n->lenFactor[d.len] * score);
+}
+
+/* Replace the stored frequencies of a batch of postings of a term with their weights times the
+term's idf, like DocNorms_Weight does one by one. The records of all the documents are read
+before any of them is weighed, so the reads overlap and the arithmetic is vectorized */
+void DocNorms_WeighBatch(const DocNorms *n, const t_docId *docIds, double *freqs, int num, 
+                         double idf);
+
+/* An upper bound of the weight of any posting of any term, given the stored frequency freq is an
+upper bound of the posting's stored frequency. Without norms that's freq itself, but the BM25
+weight of a posting does not grow with its stored frequency alone, so with norms it's the
+highest weight a posting can have in any document */
+static inline double DocNorms_MaxWeight(const DocNorms *n, float freq) {
+    if (n == NULL) {
+        return freq;
+    }
+    double max = (BM25_K1 + 1) * n->header.maxScore;
+    return max > 1 ? max : 1;
+}
+
+#endif
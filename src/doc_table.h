@@ -24,6 +24,8 @@ typedef struct {
 int InitDocTable(RedisSearchCtx *ctx, DocTable *t); 
 int DocTable_GetMetadata(DocTable *t, t_docId docId, DocumentMetadata *md);
 int DocTable_PutDocument(DocTable *t, t_docId docId, double score, u_short flags);
+/* The number of documents in the index, as every document has an entry in the table */
+size_t DocTable_NumDocs(DocTable *t);
 
  
 #endif
\ No newline at end of file
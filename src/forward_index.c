@@ -14,7 +14,7 @@ ForwardIndex *NewForwardIndex(Document doc) {
     idx->docId = doc.docId;
     idx->totalFreq = 0;
     idx->maxFreq = 0;
-    idx->stemmer = NewStemmer(SnowballStemmer, doc.language);
+    idx->stemmer = GetStemmer(SnowballStemmer, doc.language);
     
     return idx;
 }
@@ -26,7 +26,8 @@ void ForwardIndexFree(ForwardIndex *idx) {
          ForwardIndexEntry *ent = kh_value(idx->hits , k);
          free((void *)ent->term);
          kh_del(32, idx->hits, k);
-         VVW_Free(ent->vw);
+         // the offsets of entries kept in a write segment are owned by the segment
+         if (ent->vw) VVW_Free(ent->vw);
          free(ent);
       }
    }
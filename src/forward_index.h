@@ -32,6 +32,7 @@ typedef struct {
     float maxFreq;
     float docScore;
     int uniqueTokens;
+    // from the stemmer pool, so it is not freed with the forward index
     Stemmer *stemmer;
 } ForwardIndex;
 
@@ -1,80 +1,329 @@
 #include "index.h"
 #include "varint.h"
 #include "forward_index.h"
+#include "stream_vbyte.h"
+#include "pfor.h"
+#include "doc_bitmap.h"
 #include <sys/param.h>
 #include <math.h>
 
 inline int IR_HasNext(void *ctx) {
     IndexReader *ir = ctx;
     //LG_DEBUG("ir %p size %d, offset %d. has next? %d\n", ir, ir->header.size, ir->buf->offset, ir->header.size > ir->buf->offset);
-    return ir->header.size > ir->buf->offset; 
+    return ir->decoded.pos < ir->decoded.num || ir->header.size > ir->buf->offset; 
 }
 
-inline int IR_GenericRead(IndexReader *ir, t_docId *docId, float *freq, u_char *flags, 
-                            VarintVector *offsets) {
-    if (!IR_HasNext(ir)) {
+/* Allocate the memory of a reader or iterator from an arena, or with malloc without one */
+static inline void *iter_alloc(Arena *arena, size_t size) {
+    return arena ? Arena_Alloc(arena, size) : malloc(size);
+}
+
+static inline void *iter_calloc(Arena *arena, size_t num, size_t size) {
+    return arena ? Arena_Calloc(arena, num, size) : calloc(num, size);
+}
+
+/* Jump the reader to an offset of the index, counting the bytes it went over since its last jump.
+Readers only move forward between jumps */
+static inline void ir_jump(IndexReader *ir, t_offset offset) {
+    ir->stats.bytes += BufferOffset(ir->buf) - ir->jumpedTo;
+    BufferSeek(ir->buf, offset);
+    ir->jumpedTo = offset;
+}
+
+/* Read the block header at the current position of a block encoded index reader */
+static inline int ir_readBlockHeader(IndexReader *ir) {
+    if (!IR_HasNext(ir) || 
+        BufferRead(ir->buf, &ir->block, sizeof(IndexBlockHeader)) != sizeof(IndexBlockHeader)) {
         return INDEXREAD_EOF;
     }
+    ir->blockEnd = BufferOffset(ir->buf) + ir->block.len;
+    ir->lastId = ir->block.firstId;
+    ir->decoded.pos = ir->decoded.num = 0;
+    ir->offsetsPos = ir->block.offsetsStart;
+    return INDEXREAD_OK;
+}
+
+/* Reference the offset vector of an entry, at a given offset of the index buffer, or of the 
+offsets stream if the index has one. If the stream has not been loaded the vector is empty */
+static inline void ir_refOffsets(IndexReader *ir, t_offset pos, u_int32_t len, 
+                                 OffsetVectorRef *offsets) {
+    if (ir->header.version != INDEX_VERSION_SPLIT) {
+        offsets->data = ir->buf->data + pos;
+        offsets->len = len;
+    } else if (ir->offsetsBuf) {
+        offsets->data = ir->offsetsBuf->data + pos;
+        offsets->len = len;
+    } else {
+        offsets->data = NULL;
+        offsets->len = 0;
+    }
+}
+
+/* Decode all the columns of a column encoded block, leaving the buffer at the end of the block.
+Only the offset vectors are left in place, and we just record where they start */
+static int ir_decodeBlock(IndexReader *ir) {
+    DecodedBlock *d = &ir->decoded;
+    u_int32_t n = ir->block.numEntries;
+    const u_char *p = (u_char *)ir->buf->pos;
+    const u_char *end = (u_char *)ir->buf->data + ir->blockEnd;
+    size_t sz;
     
-    *docId = ReadVarint(ir->buf) + ir->lastId;
-    int len = ReadVarint(ir->buf);
-   
-    int quantizedScore = ReadVarint(ir->buf);
-    if (freq != NULL) {
-        *freq = (float)quantizedScore/FREQ_QUANTIZE_FACTOR;
-        //LG_DEBUG("READ Quantized score %d, freq %f", quantizedScore, *freq);
+    if (ir->block.codec == BLOCK_CODEC_PFOR) {
+        sz = PFOR_DecodeDelta(p, end, n, ir->block.firstId, d->docIds);
+    } else {
+        sz = SVB_DecodeDelta(p, end, n, ir->block.firstId, d->docIds);
     }
+    if (!sz) return INDEXREAD_EOF;
+    p += sz;
+    ir->stats.decoded += n;
     
-    BufferReadByte(ir->buf, (char*)flags);
+    // columns the entry layout leaves out keep the defaults the reader was created with
+    u_int32_t ef = ir->header.entryFlags;
+    if (!(ef & INDEX_ENTRY_NOFREQS)) {
+        if (!(sz = SVB_Decode(p, end, n, d->freqs))) return INDEXREAD_EOF;
+        p += sz;
+    }
+    if (!(ef & INDEX_ENTRY_NOOFFSETS)) {
+        if (!(sz = SVB_Decode(p, end, n, d->offsetsLen))) return INDEXREAD_EOF;
+        p += sz;
+    }
+    if (!(ef & INDEX_ENTRY_NOFIELDS)) {
+        if (p + n > end) return INDEXREAD_EOF;
+        memcpy(d->flags, p, n);
+        p += n;
+    }
     
-    size_t offsetsLen = ReadVarint(ir->buf); 
-        
-    // If needed - read offset vectors
-    if (offsets != NULL && !ir->singleWordMode) {
-            
-        offsets->cap = offsetsLen;
-        offsets->data = ir->buf->pos;
-        offsets->pos = offsets->data;
-        offsets->ctx = NULL;
-        offsets->offset = 0;
-        offsets->type = BUFFER_READ;
-    } 
+    d->offsetsPos = ir->header.version == INDEX_VERSION_SPLIT ? ir->block.offsetsStart : 
+                                                                  (char *)p - ir->buf->data;
+    d->pos = 0;
+    d->num = n;
+    BufferSeek(ir->buf, ir->blockEnd);
+    return INDEXREAD_OK;
+}
+
+/* Can none of the entries of the current block score above the reader's minimal score */
+static inline int ir_blockPruned(IndexReader *ir) {
+    return ir->minScore >= 0 && 
+        DocNorms_MaxWeight(ir->norms, (float)ir->block.maxFreq/FREQ_QUANTIZE_FACTOR) * ir->idf <= 
+            ir->minScore;
+}
+
+/* Read the header of the next block at the current position that is not pruned, skipping the 
+pruned ones without decoding them */
+static inline int ir_nextBlock(IndexReader *ir) {
+    while (ir_readBlockHeader(ir) == INDEXREAD_OK) {
+        if (!ir_blockPruned(ir)) {
+            return INDEXREAD_OK;
+        }
+        ir->stats.blocksSkipped++;
+        ir_jump(ir, ir->blockEnd);
+    }
+    return INDEXREAD_EOF;
+}
+
+/* Make sure a block encoded index reader is positioned on an entry of a block, 
+moving into the next block if the current one has been consumed, and decoding it if needed */
+static inline int ir_enterBlock(IndexReader *ir) {
+    if (ir->decoded.pos < ir->decoded.num) {
+        return INDEXREAD_OK;
+    }
+    if (BufferOffset(ir->buf) >= ir->blockEnd && ir_nextBlock(ir) == INDEXREAD_EOF) {
+        return INDEXREAD_EOF;
+    }
+    if (ir->block.codec != BLOCK_CODEC_RAW) {
+        return ir_decodeBlock(ir);
+    }
+    return INDEXREAD_OK;
+}
+
+/* Read the next entry of a decoded block */
+static inline int ir_readDecoded(IndexReader *ir, t_docId *docId, float *freq, u_char *flags, 
+                                 OffsetVectorRef *offsets) {
+    DecodedBlock *d = &ir->decoded;
+    u_int32_t i = d->pos++;
+    
+    *docId = d->docIds[i];
+    if (freq != NULL) {
+        *freq = (float)d->freqs[i]/FREQ_QUANTIZE_FACTOR;
+    }
+    *flags = d->flags[i];
     
-    BufferSkip(ir->buf, offsetsLen);
+    if (offsets != NULL) {
+        ir_refOffsets(ir, d->offsetsPos, d->offsetsLen[i], offsets);
+    }
+    d->offsetsPos += d->offsetsLen[i];
     ir->lastId = *docId;
     return INDEXREAD_OK;
 }
 
+inline int IR_GenericRead(IndexReader *ir, t_docId *docId, float *freq, u_char *flags, 
+                            OffsetVectorRef *offsets) {
+    if (!IR_HasNext(ir)) {
+        return INDEXREAD_EOF;
+    }
+    
+    if (INDEX_BLOCK_ENCODED(ir->header.version)) {
+        if (ir_enterBlock(ir) == INDEXREAD_EOF) {
+            return INDEXREAD_EOF;
+        }
+        if (ir->decoded.pos < ir->decoded.num) {
+            return ir_readDecoded(ir, docId, freq, flags, offsets);
+        }
+    }
+    
+    ir->stats.decoded++;
+    return ir->readRaw(ir, docId, freq, flags, offsets);
+}
 
+/* Generate a decoder of raw entries for one entry layout, see INDEX_ENTRY_*. The parts the 
+layout leaves out are constants in each instance, so reading an entry never tests the layout.
+Each layout gets two decoders: name reads a whole entry, and name##Rest reads the rest of an 
+entry whose docId has already been read into docId */
+#define IR_RAW_READER(name, hasFreqs, hasFields, hasOffsets)                                      \
+static int name##Rest(IndexReader *ir, t_docId *docId, float *freq, u_char *flags,                \
+                      OffsetVectorRef *offsets) {                                                 \
+    if (hasOffsets) {                                                                             \
+        /* the entry length is only needed to skip entries */                                     \
+        ReadVarint(ir->buf);                                                                      \
+    }                                                                                             \
+    int quantizedScore = hasFreqs ? ReadVarint(ir->buf) : FREQ_QUANTIZE_FACTOR;                   \
+    if (freq != NULL) {                                                                           \
+        *freq = (float)quantizedScore/FREQ_QUANTIZE_FACTOR;                                       \
+    }                                                                                             \
+    if (hasFields) {                                                                              \
+        BufferReadByte(ir->buf, (char*)flags);                                                    \
+    } else {                                                                                      \
+        *flags = 0xff;                                                                            \
+    }                                                                                             \
+    if (hasOffsets) {                                                                             \
+        size_t offsetsLen = ReadVarint(ir->buf);                                                  \
+        /* If needed - reference the offset vector, it is decoded only if needed */               \
+        if (ir->header.version == INDEX_VERSION_SPLIT) {                                          \
+            if (offsets != NULL) {                                                                \
+                ir_refOffsets(ir, ir->offsetsPos, offsetsLen, offsets);                           \
+            }                                                                                     \
+            ir->offsetsPos += offsetsLen;                                                         \
+        } else {                                                                                  \
+            if (offsets != NULL) {                                                                \
+                offsets->data = ir->buf->pos;                                                     \
+                offsets->len = offsetsLen;                                                        \
+            }                                                                                     \
+            BufferSkip(ir->buf, offsetsLen);                                                      \
+        }                                                                                         \
+    } else if (offsets != NULL) {                                                                 \
+        offsets->data = NULL;                                                                     \
+        offsets->len = 0;                                                                         \
+    }                                                                                             \
+    ir->lastId = *docId;                                                                          \
+    return INDEXREAD_OK;                                                                          \
+}                                                                                                 \
+static int name(IndexReader *ir, t_docId *docId, float *freq, u_char *flags,                      \
+                OffsetVectorRef *offsets) {                                                       \
+    *docId = ReadVarint(ir->buf) + ir->lastId;                                                    \
+    return name##Rest(ir, docId, freq, flags, offsets);                                           \
+}
 
-inline int IR_TryRead(IndexReader *ir, t_docId *docId, t_docId expectedDocId) {
-  if (!IR_HasNext(ir)) {
-    return INDEXREAD_EOF;
-  }
+IR_RAW_READER(ir_readRawFull, 1, 1, 1)
+IR_RAW_READER(ir_readRawNoOffsets, 1, 1, 0)
+IR_RAW_READER(ir_readRawNoFields, 1, 0, 1)
+IR_RAW_READER(ir_readRawNoOffsetsFields, 1, 0, 0)
+IR_RAW_READER(ir_readRawNoFreqs, 0, 1, 1)
+IR_RAW_READER(ir_readRawNoOffsetsFreqs, 0, 1, 0)
+IR_RAW_READER(ir_readRawNoFieldsFreqs, 0, 0, 1)
+IR_RAW_READER(ir_readRawIdsOnly, 0, 0, 0)
+
+/* The raw entry decoders, indexed by the entry layout */
+static int (*ir_rawReaders[])(IndexReader *, t_docId *, float *, u_char *, OffsetVectorRef *) = {
+    ir_readRawFull, 
+    ir_readRawNoOffsets, 
+    ir_readRawNoFields, 
+    ir_readRawNoOffsetsFields,
+    ir_readRawNoFreqs, 
+    ir_readRawNoOffsetsFreqs, 
+    ir_readRawNoFieldsFreqs, 
+    ir_readRawIdsOnly,
+};
+
+/* The decoders of the rest of raw entries, indexed by the entry layout */
+static int (*ir_rawRestReaders[])(IndexReader *, t_docId *, float *, u_char *, 
+                                  OffsetVectorRef *) = {
+    ir_readRawFullRest, 
+    ir_readRawNoOffsetsRest, 
+    ir_readRawNoFieldsRest, 
+    ir_readRawNoOffsetsFieldsRest,
+    ir_readRawNoFreqsRest, 
+    ir_readRawNoOffsetsFreqsRest, 
+    ir_readRawNoFieldsFreqsRest, 
+    ir_readRawIdsOnlyRest,
+};
+
+/* Skip the rest of a raw entry whose docId has been read, without decoding it */
+static inline void ir_skipRawRest(IndexReader *ir) {
+    u_int32_t ef = ir->header.entryFlags;
+    if (ef & INDEX_ENTRY_NOOFFSETS) {
+        // entries without offsets have no length, but they're just a frequency and flags
+        if (!(ef & INDEX_ENTRY_NOFREQS)) ReadVarint(ir->buf);
+        if (!(ef & INDEX_ENTRY_NOFIELDS)) BufferSkip(ir->buf, 1);
+        return;
+    }
+    int len = ReadVarint(ir->buf);
+    if (ir->header.version == INDEX_VERSION_SPLIT) {
+        // the offset vector is in the offsets stream, and we need its length to keep our place there
+        if (!(ef & INDEX_ENTRY_NOFREQS)) ReadVarint(ir->buf);
+        if (!(ef & INDEX_ENTRY_NOFIELDS)) BufferSkip(ir->buf, 1);
+        ir->offsetsPos += ReadVarint(ir->buf);
+    } else {
+        BufferSkip(ir->buf, len);
+    }
+}
 
-  *docId = ReadVarint(ir->buf) + ir->lastId;
-  int len = ReadVarint(ir->buf);
 
-  ir->lastId = *docId;
-  if (*docId != expectedDocId) {
-    BufferSkip(ir->buf, len);
-    return INDEXREAD_NOTFOUND;
-  }
 
-  return INDEXREAD_OK;
+double IDF(double totalDocs, u_int32_t docFreq) {
+    return log2(1.0 + totalDocs/(docFreq ? docFreq : (double)1));
 }
 
+/* Prepare a hit for reading an entry into it, returning where the entry's offsets should be
+referenced, or NULL if the reader does not need them */
+static inline OffsetVectorRef *ir_hitOffsets(IndexReader *ir, IndexHit *e) {
+    if (ir->singleWordMode) {
+        return NULL;
+    }
+    e->offsets = NULL;
+    e->numOffsets = 1; 
+    return &e->termOffsets;
+}
 
+/* Filter and score a hit an entry has been read into with rc */
+static inline int ir_scoreHit(IndexReader *ir, IndexHit *e, int rc, float freq) {
+    // add tf-idf score of the entry to the hit
+    if (rc == INDEXREAD_OK) {
+        //LG_DEBUG("docId %d Flags 0x%x, field mask 0x%x, intersection: %x", e->docId, e->flags, ir->fieldMask, e->flags & ir->fieldMask);
+        if (!(e->flags & ir->fieldMask)) {
+            //LG_DEBUG("Skipping %d", e->docId);
+            return INDEXREAD_NOTFOUND;
+        }
+
+        e->totalFreq += DocNorms_Weight(ir->norms, e->docId, freq) * ir->idf;
+    }
+    e->type = H_RAW;
+    
+    //LG_DEBUG("Read docId %d, rc %d",e->docId, rc);
+    return rc;
+}
 
-inline double tfidf(float freq, u_int32_t docFreq) {
-    double idf =logb(1.0F + TOTALDOCS_PLACEHOLDER/(docFreq ? docFreq : (double)1)); //IDF  
-    //LG_DEBUG("FREQ: %f  IDF: %.04f, TFIDF: %f",freq, idf, freq*idf);
-    return freq*idf;
+/* Read the entry at the reader's current position into an index hit */
+static int ir_readEntry(IndexReader *ir, IndexHit *e) {
+    float freq;
+    OffsetVectorRef *offsets = ir_hitOffsets(ir, e);
+    int rc = IR_GenericRead(ir, &e->docId, &freq, &e->flags, offsets);
+    return ir_scoreHit(ir, e, rc, freq);
 }
 
+static int ir_blockSkipTo(IndexReader *ir, t_docId docId, IndexHit *hit);
+
 int IR_Read(void *ctx, IndexHit *e) {
     
-    float freq;
     IndexReader *ir = ctx;
     
     if (ir->useScoreIndex && ir->scoreIndex) {
@@ -84,34 +333,157 @@ int IR_Read(void *ctx, IndexHit *e) {
             return INDEXREAD_EOF;
         }
         
+        if (INDEX_BLOCK_ENCODED(ir->header.version)) {
+            // in block encoded indexes the score entry points at the block of the entry,
+            // so we enter the block and scan to the entry inside it
+            IR_Seek(ir, ent->offset, 0);
+            ir->blockEnd = 0;
+            return ir_blockSkipTo(ir, ent->docId, e);
+        }
         IR_Seek(ir, ent->offset, ent->docId);
         
     }
     
-    VarintVector *offsets = NULL;
-    if (!ir->singleWordMode) {
-        offsets = &e->offsetVecs[0];
-        e->numOffsetVecs = 1; 
+    return ir_readEntry(ir, e);
+}
+
+/* Generate a Read function for one combination of reader modes. IR_Read checks the modes for 
+every entry, while each instance has them as constants, so reading an entry only tests what the
+reader actually needs. useScoreIndex readers jump to the entries of the score index, withOffsets 
+readers reference the offset vectors of hits, and filterFields readers drop the hits that are not
+in the reader's field mask */
+#define IR_READER(name, useScoreIndex, withOffsets, filterFields)                                 \
+static int name(void *ctx, IndexHit *e) {                                                         \
+    IndexReader *ir = ctx;                                                                        \
+    if (useScoreIndex) {                                                                          \
+        ScoreIndexEntry *ent = ScoreIndex_Next(ir->scoreIndex);                                   \
+        if (ent == NULL) {                                                                        \
+            return INDEXREAD_EOF;                                                                 \
+        }                                                                                         \
+        if (INDEX_BLOCK_ENCODED(ir->header.version)) {                                            \
+            IR_Seek(ir, ent->offset, 0);                                                          \
+            ir->blockEnd = 0;                                                                     \
+            return ir_blockSkipTo(ir, ent->docId, e);                                             \
+        }                                                                                         \
+        IR_Seek(ir, ent->offset, ent->docId);                                                     \
+    }                                                                                             \
+    float freq;                                                                                   \
+    OffsetVectorRef *offsets = NULL;                                                              \
+    if (withOffsets) {                                                                            \
+        offsets = &e->termOffsets;                                                                \
+        e->offsets = NULL;                                                                        \
+        e->numOffsets = 1;                                                                        \
+    }                                                                                             \
+    e->type = H_RAW;                                                                              \
+    int rc = IR_GenericRead(ir, &e->docId, &freq, &e->flags, offsets);                            \
+    if (rc == INDEXREAD_OK) {                                                                     \
+        if (filterFields && !(e->flags & ir->fieldMask)) {                                        \
+            return INDEXREAD_NOTFOUND;                                                            \
+        }                                                                                         \
+        e->totalFreq += DocNorms_Weight(ir->norms, e->docId, freq) * ir->idf;                     \
+    }                                                                                             \
+    return rc;                                                                                    \
+}
+
+// the score index is only used in single word mode without a field mask, so it has one variant
+IR_READER(ir_readScoreIndex, 1, 0, 0)
+IR_READER(ir_readHits, 0, 0, 0)
+IR_READER(ir_readFilteredHits, 0, 0, 1)
+IR_READER(ir_readHitsWithOffsets, 0, 1, 0)
+IR_READER(ir_readFilteredHitsWithOffsets, 0, 1, 1)
+
+/* Pick the Read variant specialized for the reader's modes */
+static int (*ir_readFunc(IndexReader *ir))(void *, IndexHit *) {
+    if (ir->useScoreIndex && ir->scoreIndex) {
+        return ir_readScoreIndex;
     }
-    
-    int rc = IR_GenericRead(ir, &e->docId, &freq, &e->flags, offsets);
-        
-    // add tf-idf score of the entry to the hit
-    if (rc == INDEXREAD_OK) {
-        //LG_DEBUG("docId %d Flags 0x%x, field mask 0x%x, intersection: %x", e->docId, e->flags, ir->fieldMask, e->flags & ir->fieldMask);
-        if (!(e->flags & ir->fieldMask)) {
-            //LG_DEBUG("Skipping %d", e->docId);
-            return INDEXREAD_NOTFOUND;
+    int filter = ir->fieldMask != 0xff;
+    if (ir->singleWordMode) {
+        return filter ? ir_readFilteredHits : ir_readHits;
+    }
+    return filter ? ir_readFilteredHitsWithOffsets : ir_readHitsWithOffsets;
+}
+
+/* Fill a batch by reading hits one by one with a Read function */
+static int batch_readHits(int (*Read)(void *ctx, IndexHit *e), void *ctx, IndexHitBatch *b) {
+    IndexHit h;
+    b->num = 0;
+    while (b->num < INDEX_BATCH_SIZE) {
+        IndexHit_Init(&h);
+        int rc = Read(ctx, &h);
+        if (rc == INDEXREAD_EOF) {
+            break;
+        } else if (rc == INDEXREAD_NOTFOUND) {
+            continue;
         }
+        // for exact hits we don't need to calculate minimal offset dist, and neither for hits 
+        // that can't score above the batch's minScore whatever their distance is
+        int md = h.type == H_EXACT || h.totalFreq <= b->minScore ? 1 : IndexHit_MinDistance(&h);
+        IndexHitBatch_Append(b, h.docId, h.totalFreq, h.flags, md);
+    }
+    return b->num;
+}
 
-        e->totalFreq += tfidf(freq, ir->header.numDocs);
+int IndexIterator_ReadBatch(IndexIterator *it, IndexHitBatch *batch) {
+    if (it->ReadBatch) {
+        return it->ReadBatch(it->ctx, batch);
     }
-    e->type = H_RAW;
-    
-    //LG_DEBUG("Read docId %d, rc %d",e->docId, rc);
-    return rc;
+    return batch_readHits(it->Read, it->ctx, batch);
 }
 
+double IndexIterator_MaxScore(IndexIterator *it) {
+    return it->MaxScore ? it->MaxScore(it->ctx) : HUGE_VAL;
+}
+
+int IR_ReadBatch(void *ctx, IndexHitBatch *b) {
+    IndexReader *ir = ctx;
+    
+    // score index reads jump around the index, so we just read them one by one
+    if (ir->useScoreIndex && ir->scoreIndex) {
+        return batch_readHits(ir_readScoreIndex, ir, b);
+    }
+    
+    // BM25 batches are weighed at the end all at once, so their hits start as the stored freqs
+    DocNorms *norms = ir->norms;
+    double idf = norms ? 1 : ir->idf;
+    b->num = 0;
+    while (b->num < INDEX_BATCH_SIZE) {
+        if (INDEX_BLOCK_ENCODED(ir->header.version)) {
+            if (ir_enterBlock(ir) == INDEXREAD_EOF) {
+                break;
+            }
+            // copy whatever we can straight from a decoded block
+            DecodedBlock *d = &ir->decoded;
+            if (d->pos < d->num) {
+                while (d->pos < d->num && b->num < INDEX_BATCH_SIZE) {
+                    u_int32_t i = d->pos++;
+                    d->offsetsPos += d->offsetsLen[i];
+                    if (d->flags[i] & ir->fieldMask) {
+                        IndexHitBatch_Append(b, d->docIds[i], 
+                                             (float)d->freqs[i]/FREQ_QUANTIZE_FACTOR * idf,
+                                             d->flags[i], 1);
+                    }
+                }
+                ir->lastId = d->docIds[d->pos - 1];
+                continue;
+            }
+        }
+        
+        t_docId docId;
+        float freq;
+        u_char flags;
+        if (IR_GenericRead(ir, &docId, &freq, &flags, NULL) == INDEXREAD_EOF) {
+            break;
+        }
+        if (flags & ir->fieldMask) {
+            IndexHitBatch_Append(b, docId, freq * idf, flags, 1);
+        }
+    }
+    if (norms) {
+        DocNorms_WeighBatch(norms, b->docIds, b->totalFreq, b->num, ir->idf);
+    }
+    return b->num;
+}
 
 int IR_Next(void *ctx) {
     
@@ -124,17 +496,18 @@ int IR_Next(void *ctx) {
 
 inline void IR_Seek(IndexReader *ir, t_offset offset, t_docId docId) {
     //LG_DEBUG("Seeking to %d, lastId %d", offset, docId);
-    BufferSeek(ir->buf, offset);
+    ir_jump(ir, offset);
     ir->lastId = docId;
+    ir->decoded.pos = ir->decoded.num = 0;
 }
 
 
 void IndexHit_Init(IndexHit *h) {
      h->docId = 0;
-     h->numOffsetVecs = 0;
+     h->offsets = NULL;
+     h->numOffsets = 0;
      h->totalFreq = 0; 
      h->type = H_RAW;
-     h->hasMetadata = 0;
 }
 
 IndexHit NewIndexHit() {
@@ -144,13 +517,111 @@ IndexHit NewIndexHit() {
 }
 
 
-int IndexHit_LoadMetadata(IndexHit *h, DocTable *dt) {
+int IndexHit_MinDistance(IndexHit *h) {
+    if (h->numOffsets <= 1) {
+        return 1;
+    }
     
-    int rc = 0;
-    if ((rc = DocTable_GetMetadata(dt, h->docId, &h->metadata)) == REDISMODULE_OK) {
-        h->hasMetadata = 1;
+    // wrap the referenced vectors in read buffers on the stack
+    OffsetVectorRef *refs = IndexHit_Offsets(h);
+    VarintVector vs[h->numOffsets];
+    for (int i = 0; i < h->numOffsets; i++) {
+        vs[i] = (VarintVector){refs[i].data, refs[i].len, refs[i].data, BUFFER_READ, 0, NULL};
     }
-    return rc;
+    return VV_MinDistance(vs, h->numOffsets);
+}
+
+/* Scan the reader forward to docId, or the first entry after it, and read that entry into hit. 
+Only the docIds of the entries before it are decoded, and the entry we stop at is read on from 
+its docId, so no entry is decoded twice */
+static int ir_scanTo(IndexReader *ir, t_docId docId, IndexHit *hit) {
+    while (IR_HasNext(ir)) {
+        t_docId readId = ReadVarint(ir->buf) + ir->lastId;
+        ir->stats.decoded++;
+        if (readId >= docId) {
+            float freq;
+            OffsetVectorRef *offsets = ir_hitOffsets(ir, hit);
+            hit->docId = readId;
+            int rc = ir->readRawRest(ir, &hit->docId, &freq, &hit->flags, offsets);
+            return ir_scoreHit(ir, hit, rc, freq);
+        }
+        ir_skipRawRest(ir);
+        ir->lastId = readId;
+    }
+    return INDEXREAD_EOF;
+}
+
+/* Find the first of the sorted ids from pos on that is at or after id, or num if there's none.
+We gallop from pos with doubling steps and then binary search the last step, so finding an id 
+k places ahead takes O(log k) comparisons */
+static inline u_int32_t ir_gallop(const t_docId *ids, u_int32_t pos, u_int32_t num, t_docId id) {
+    u_int32_t lo = pos, step = 1;
+    if (lo >= num || ids[lo] >= id) {
+        return lo;
+    }
+    // ids[lo] < id all along
+    u_int32_t hi = lo + 1;
+    while (hi < num && ids[hi] < id) {
+        lo = hi;
+        step <<= 1;
+        hi = lo + step;
+    }
+    if (hi > num) hi = num;
+    while (hi - lo > 1) {
+        u_int32_t mid = lo + (hi - lo) / 2;
+        if (ids[mid] < id) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return hi;
+}
+
+/* SkipTo implementation for block encoded indexes. The skip index has an entry for every block, 
+so we gallop over it to the block that may contain docId, and hop over the blocks it doesn't know 
+of using their headers alone. Only entries inside the block that may contain docId are scanned */
+static int ir_blockSkipTo(IndexReader *ir, t_docId docId, IndexHit *hit) {
+    
+    SkipEntry *ent = SkipIndex_Find(ir->skipIdx, docId, &ir->skipIdxPos);
+    if (ent != NULL && ent->offset > BufferOffset(ir->buf) && ent->offset >= ir->blockEnd) {
+        // the entry points at a block header, and the docIds after it are all above its docId
+        ir->stats.skipIndexHits++;
+        IR_Seek(ir, ent->offset, ent->docId);
+        ir->blockEnd = ent->offset;
+    }
+    
+    while (1) {
+        if (ir->decoded.pos >= ir->decoded.num && BufferOffset(ir->buf) >= ir->blockEnd &&
+            ir_nextBlock(ir) == INDEXREAD_EOF) {
+            return INDEXREAD_EOF;
+        }
+        if (ir->block.lastId >= docId) {
+            break;
+        }
+        // drop the rest of the block without decoding it
+        ir->decoded.pos = ir->decoded.num;
+        if (BufferOffset(ir->buf) < ir->blockEnd) {
+            ir->stats.blocksSkipped++;
+            ir_jump(ir, ir->blockEnd);
+        }
+    }
+    
+    // the block's last entry is at or after docId, so the scan ends inside the block
+    if (ir->block.codec == BLOCK_CODEC_RAW) {
+        return ir_scanTo(ir, docId, hit);
+    }
+    
+    if (ir_enterBlock(ir) == INDEXREAD_EOF) {
+        return INDEXREAD_EOF;
+    }
+    DecodedBlock *d = &ir->decoded;
+    u_int32_t pos = ir_gallop(d->docIds, d->pos, d->num, docId);
+    // we still have to keep our place in the offset vectors
+    while (d->pos < pos) {
+        d->offsetsPos += d->offsetsLen[d->pos++];
+    }
+    return ir_readEntry(ir, hit);
 }
 
 /**
@@ -163,32 +634,21 @@ Skip to the given docId, or one place after it
 int IR_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit) {  
     IndexReader *ir = ctx;
     
+    if (INDEX_BLOCK_ENCODED(ir->header.version)) {
+        return ir_blockSkipTo(ir, docId, hit);
+    }
+    
     SkipEntry *ent = SkipIndex_Find(ir->skipIdx, docId, &ir->skipIdxPos);
     
     if (ent != NULL || ir->skipIdx == NULL || ir->skipIdx->len == 0 
     || docId <= ir->skipIdx->entries[0].docId) {
         
         if (ent != NULL && ent->offset > BufferOffset(ir->buf)) {
+            ir->stats.skipIndexHits++;
             IR_Seek(ir, ent->offset, ent->docId);
         }
         
-        int rc;
-        t_docId lastId = ir->lastId, readId = 0;
-        t_offset offset = ir->buf->offset;
-
-        do {
-        // do a quick-read until we hit or pass the desired document
-        if ((rc = IR_TryRead(ir, &readId, docId)) == INDEXREAD_EOF) {
-            return rc;
-        }
-        // rewind 1 document and re-read it...
-        if (rc == INDEXREAD_OK || readId > docId) {
-            IR_Seek(ir, offset, lastId);
-            return IR_Read(ir, hit);
-        }
-        lastId = readId;
-        offset = ir->buf->offset;
-        } while (rc != INDEXREAD_EOF);
+        return ir_scanTo(ir, docId, hit);
     }
         
     
@@ -200,16 +660,58 @@ u_int32_t IR_NumDocs(IndexReader *ir) {
     return ir->header.numDocs;
 }
 
+double IR_MaxScore(void *ctx) {
+    IndexReader *ir = ctx;
+    // legacy headers don't bound the frequencies
+    if (ir->header.maxFreq == 0) return HUGE_VAL;
+    return DocNorms_MaxWeight(ir->norms, (float)ir->header.maxFreq/FREQ_QUANTIZE_FACTOR) * ir->idf;
+}
+
+void IR_GetStats(IndexReader *ir, IndexReaderStats *stats) {
+    *stats = ir->stats;
+    stats->bytes += BufferOffset(ir->buf) - ir->jumpedTo;
+}
+
+void IR_SetTotalDocs(IndexReader *ir, size_t totalDocs) {
+    ir->idf = IDF(totalDocs, ir->docFreq);
+}
+
+void IR_SetDocFreq(IndexReader *ir, u_int32_t docFreq) {
+    ir->docFreq = docFreq;
+}
+
+void IR_SetNorms(IndexReader *ir, DocNorms *norms, size_t totalDocs) {
+    ir->norms = norms;
+    ir->useScoreIndex = 0;
+    ir->idf = BM25_IDF(totalDocs, ir->docFreq);
+}
+
+size_t IR_Len(void *ctx) {
+    return ((IndexReader *)ctx)->header.numDocs;
+}
+
+void IR_SetMinScore(void *ctx, double minScore) {
+    IndexReader *ir = ctx;
+    // score index readers jump to blocks by their entries, so they never skip any. 
+    // Legacy indexes have no blocks to skip
+    if (ir->useScoreIndex || !INDEX_BLOCK_ENCODED(ir->header.version)) {
+        return;
+    }
+    ir->minScore = minScore;
+}
+
 
 IndexReader *NewIndexReader(void *data, size_t datalen, SkipIndex *si, DocTable *dt, 
                             int singleWordMode, u_char fieldMask) {
-    return NewIndexReaderBuf(NewBuffer(data, datalen, BUFFER_READ), si, dt, singleWordMode, NULL, fieldMask);
+    return NewIndexReaderBuf(NewBuffer(data, datalen, BUFFER_READ), si, dt, singleWordMode, NULL, fieldMask,
+                             NULL);
 } 
 
 IndexReader *NewIndexReaderBuf(Buffer *buf, SkipIndex *si, DocTable *dt, int singleWordMode, 
-                                ScoreIndex *sci, u_char fieldMask) {
+                                ScoreIndex *sci, u_char fieldMask, Arena *arena) {
     
-    IndexReader *ret = malloc(sizeof(IndexReader));
+    IndexReader *ret = iter_alloc(arena, sizeof(IndexReader));
+    ret->arena = arena;
     ret->buf = buf;
     
     
@@ -226,6 +728,28 @@ IndexReader *NewIndexReaderBuf(Buffer *buf, SkipIndex *si, DocTable *dt, int sin
     //LG_DEBUG("Load offsets %d, si: %p", singleWordMode, si);
     ret->skipIdx = si;
     ret->fieldMask = fieldMask;
+    ret->blockEnd = 0;
+    ret->decoded.pos = ret->decoded.num = 0;
+    ret->offsetsBuf = NULL;
+    ret->offsetsPos = 0;
+    ret->minScore = -1;
+    ret->docFreq = ret->header.numDocs;
+    ret->idf = IDF(TOTALDOCS_PLACEHOLDER, ret->docFreq);
+    ret->norms = NULL;
+    memset(&ret->stats, 0, sizeof(ret->stats));
+    ret->jumpedTo = BufferOffset(buf);
+    
+    u_int32_t ef = ret->header.entryFlags & (INDEX_ENTRY_NOOFFSETS | INDEX_ENTRY_NOFIELDS | 
+                                             INDEX_ENTRY_NOFREQS);
+    ret->readRaw = ir_rawReaders[ef];
+    ret->readRawRest = ir_rawRestReaders[ef];
+    // the parts the entries don't have are the same for all of them, so decoded blocks never 
+    // overwrite them
+    for (int i = 0; i < INDEX_BLOCK_SIZE; i++) {
+        ret->decoded.freqs[i] = FREQ_QUANTIZE_FACTOR;
+        ret->decoded.flags[i] = 0xff;
+        ret->decoded.offsetsLen[i] = 0;
+    }
     
     return ret;
 } 
@@ -237,21 +761,34 @@ void IR_Free(IndexReader *ir) {
         ScoreIndex_Free(ir->scoreIndex);
     }
     SkipIndex_Free(ir->skipIdx);
-    free(ir);
+    if (ir->offsetsBuf) {
+        membufferRelease(ir->offsetsBuf);
+    }
+    if (ir->arena == NULL) {
+        free(ir);
+    }
 }
 
 
 IndexIterator *NewReadIterator(IndexReader *ir) {
-    IndexIterator *ri = malloc(sizeof(IndexIterator));
+    IndexIterator *ri = iter_alloc(ir->arena, sizeof(IndexIterator));
     ri->ctx = ir;
-    ri->Read = IR_Read;
+    ri->Read = ir_readFunc(ir);
     ri->SkipTo = IR_SkipTo;
     ri->LastDocId = IR_LastDocId; 
     ri->HasNext = IR_HasNext;
     ri->Free = ReadIterator_Free;
+    ri->ReadBatch = IR_ReadBatch;
+    ri->MaxScore = IR_MaxScore;
+    ri->SetMinScore = IR_SetMinScore;
+    ri->Len = IR_Len;
     return ri;
 }
 
+int IsReadIterator(IndexIterator *it) {
+    return it != NULL && it->SkipTo == IR_SkipTo;
+}
+
 
 
 
@@ -263,45 +800,91 @@ size_t IW_Len(IndexWriter *w) {
 void writeIndexHeader(IndexWriter *w) {
     size_t offset = w->bw.buf->offset;
     BufferSeek(w->bw.buf, 0);
-    IndexHeader h = {offset, w->lastId, w->ndocs};
+    IndexHeader h = {offset, w->lastId, w->ndocs, INDEX_HEADER_MAGIC, w->version, w->blockOffset, 
+                     w->offsetsWriter.buf ? BufferOffset(w->offsetsWriter.buf) : 0, w->codec, 
+                     w->entryFlags, w->maxFreq};
+    // legacy indexes keep the header they were always written with
+    size_t len = INDEX_HEADER_SIZE(w->version, w->entryFlags);
+    if (len != INDEX_HEADER_LEGACY_SIZE) {
+        h.size |= INDEX_HEADER_EXTENDED;
+    }
     LG_DEBUG("Writing index header. offest %d , lastId %d, ndocs %d, will seek to %zd", h.size, h.lastId, w->ndocs, offset);
-    w->bw.Write(w->bw.buf, &h, sizeof(IndexHeader));
+    w->bw.Write(w->bw.buf, &h, len);
     BufferSeek(w->bw.buf, offset);
 
 }
 
-IndexWriter *NewIndexWriter(size_t cap) {
+/* Write the header of the currently open block of a block encoded index in place */
+void writeBlockHeader(IndexWriter *w) {
+    if (w->blockOffset == 0) {
+        return;
+    }
+    size_t offset = w->bw.buf->offset;
+    BufferSeek(w->bw.buf, w->blockOffset);
+    w->bw.Write(w->bw.buf, &w->block, sizeof(IndexBlockHeader));
+    BufferSeek(w->bw.buf, offset);
+}
+
+IndexWriter *NewIndexWriter(size_t cap, u_int32_t version, u_int32_t codec, u_int32_t entryFlags) {
     IndexWriter *w = malloc(sizeof(IndexWriter));
     w->bw = NewBufferWriter(NewMemoryBuffer(cap, BUFFER_WRITE));
     w->skipIndexWriter = NewBufferWriter(NewMemoryBuffer(cap, BUFFER_WRITE));
+    w->offsetsWriter = NewBufferWriter(version == INDEX_VERSION_SPLIT ? 
+                                        NewMemoryBuffer(cap, BUFFER_WRITE) : NULL);
     w->scoreWriter = NewScoreIndexWriter(NewBufferWriter(NewMemoryBuffer(2, BUFFER_WRITE)));
     w->scoreWriter.header.numEntries = 0;
     w->scoreWriter.header.lowestIndex = 0;
     w->scoreWriter.header.lowestScore = 0;
     w->ndocs = 0;
     w->lastId = 0;
+    w->version = version;
+    w->codec = codec;
+    w->entryFlags = entryFlags;
+    w->maxFreq = 0;
+    w->blockOffset = 0;
     writeIndexHeader(w);
-    BufferSeek(w->bw.buf, sizeof(IndexHeader));
+    BufferSeek(w->bw.buf, INDEX_HEADER_SIZE(version, entryFlags));
     return w;
 }
 
-IndexWriter *NewIndexWriterBuf(BufferWriter bw, BufferWriter skipIdnexWriter, ScoreIndexWriter siw) {
+IndexWriter *NewIndexWriterBuf(BufferWriter bw, BufferWriter skipIdnexWriter, BufferWriter offsetsWriter,
+                               ScoreIndexWriter siw, u_int32_t version, u_int32_t codec,
+                               u_int32_t entryFlags) {
     IndexWriter *w = malloc(sizeof(IndexWriter));
     w->bw = bw;
     w->skipIndexWriter = skipIdnexWriter;
+    w->offsetsWriter = offsetsWriter;
     w->ndocs = 0;
     w->lastId = 0;
     w->scoreWriter = siw;
+    w->version = version;
+    w->codec = codec;
+    w->entryFlags = entryFlags;
+    w->maxFreq = 0;
+    w->blockOffset = 0;
     
-    IndexHeader h = {0, 0, 0};
+    IndexHeader h;
     if (indexReadHeader(w->bw.buf, &h) && h.size > 0) {
         w->lastId = h.lastId;
         w->ndocs = h.numDocs;
+        w->version = h.version;
+        w->codec = h.codec;
+        w->entryFlags = h.entryFlags;
+        w->maxFreq = h.maxFreq;
+        if (w->offsetsWriter.buf) {
+            BufferSeek(w->offsetsWriter.buf, h.offsetsSize);
+        }
+        // reload the open block so we can keep appending to it
+        if (INDEX_BLOCK_ENCODED(h.version) && h.lastBlock > 0) {
+            w->blockOffset = h.lastBlock;
+            BufferSeek(w->bw.buf, h.lastBlock);
+            BufferRead(w->bw.buf, &w->block, sizeof(IndexBlockHeader));
+        }
         BufferSeek(w->bw.buf, h.size);
         
     } else {
         writeIndexHeader(w);
-        BufferSeek(w->bw.buf, sizeof(IndexHeader));    
+        BufferSeek(w->bw.buf, INDEX_HEADER_SIZE(version, entryFlags));
     }
     
     return w;
@@ -309,10 +892,20 @@ IndexWriter *NewIndexWriterBuf(BufferWriter bw, BufferWriter skipIdnexWriter, Sc
 
 int indexReadHeader(Buffer *b, IndexHeader *h) {
     
-    if (b->cap > sizeof(IndexHeader)) {
+    memset(h, 0, sizeof(IndexHeader));
+    if (b->cap > INDEX_HEADER_LEGACY_SIZE) {
         
         BufferSeek(b, 0);
-        BufferRead(b, h, sizeof(IndexHeader));
+        BufferRead(b, h, INDEX_HEADER_LEGACY_SIZE);
+        if (h->size & INDEX_HEADER_EXTENDED) {
+            if (b->cap < sizeof(IndexHeader) || 
+                !BufferRead(b, &h->magic, sizeof(IndexHeader) - INDEX_HEADER_LEGACY_SIZE) ||
+                h->magic != INDEX_HEADER_MAGIC) {
+                memset(h, 0, sizeof(IndexHeader));
+                return 0;
+            }
+            h->size &= ~INDEX_HEADER_EXTENDED;
+        }
         LG_DEBUG("read buffer header. size %d, lastId %d at pos %zd", h->size, h->lastId, b->offset);
         //BufferSeek(b, pos);
         return 1;     
@@ -327,8 +920,10 @@ void IW_WriteSkipIndexEntry(IndexWriter *w) {
      SkipEntry se = {w->lastId, BufferOffset(w->bw.buf)};
      Buffer *b = w->skipIndexWriter.buf;
      
-     u_int32_t num = 1 + (w->ndocs / SKIPINDEX_STEP);
+     // count the entries already written rather than deriving them from ndocs, as block encoded
+     // indexes written before they had skip indexes only have entries for their newer blocks
      size_t off = b->offset;
+     u_int32_t num = 1 + (off > sizeof(u_int32_t) ? (off - sizeof(u_int32_t)) / sizeof(SkipEntry) : 0);
      
      BufferSeek(b, 0);
      w->skipIndexWriter.Write(b, &num, sizeof(u_int32_t));
@@ -340,37 +935,170 @@ void IW_WriteSkipIndexEntry(IndexWriter *w) {
      
 }
 
+/* Re-encode the block the writer has just filled into columns with the writer's codec, see 
+BLOCK_CODEC_SVB and BLOCK_CODEC_PFOR. The block is the last thing in the buffer and is never 
+appended to again, so we rewrite it in place. If the columns do not come out smaller than the 
+raw entries, or the writer's codec is BLOCK_CODEC_RAW, we leave the block as it is */
+static void iw_sealBlock(IndexWriter *w) {
+    if (w->codec == BLOCK_CODEC_RAW) {
+        return;
+    }
+    u_int32_t n = w->block.numEntries;
+    u_int32_t docIds[INDEX_BLOCK_SIZE], freqs[INDEX_BLOCK_SIZE], offsetsLen[INDEX_BLOCK_SIZE];
+    u_char flags[INDEX_BLOCK_SIZE];
+    char *offsets[INDEX_BLOCK_SIZE];
+    
+    // the offset vectors of split indexes are not in the block, so there's nothing to move
+    int split = w->version == INDEX_VERSION_SPLIT;
+    int hasFreqs = !(w->entryFlags & INDEX_ENTRY_NOFREQS);
+    int hasFields = !(w->entryFlags & INDEX_ENTRY_NOFIELDS);
+    int hasOffsets = !(w->entryFlags & INDEX_ENTRY_NOOFFSETS);
+    t_offset start = w->blockOffset + sizeof(IndexBlockHeader);
+    Buffer b = {w->bw.buf->data + start, w->block.len, w->bw.buf->data + start, BUFFER_READ, 0, NULL};
+    t_docId lastId = w->block.firstId;
+    size_t totalOffsets = 0;
+    for (u_int32_t i = 0; i < n; i++) {
+        docIds[i] = lastId = ReadVarint(&b) + lastId;
+        if (hasOffsets) ReadVarint(&b);
+        if (hasFreqs) freqs[i] = ReadVarint(&b);
+        if (hasFields) BufferReadByte(&b, (char *)&flags[i]);
+        if (!hasOffsets) continue;
+        offsetsLen[i] = ReadVarint(&b);
+        if (!split) {
+            offsets[i] = b.pos;
+            BufferSkip(&b, offsetsLen[i]);
+            totalOffsets += offsetsLen[i];
+        }
+    }
+    
+    // the docIds column is the only one that depends on the codec
+    u_char idsColumn[PFOR_MAX_SIZE(INDEX_BLOCK_SIZE)];
+    size_t idsSize = w->codec == BLOCK_CODEC_PFOR ? 
+                        PFOR_EncodeDelta(docIds, n, w->block.firstId, idsColumn) :
+                        SVB_EncodeDelta(docIds, n, w->block.firstId, idsColumn);
+    
+    // columns of the parts the entries don't have are left out
+    size_t sz = idsSize + (hasFreqs ? SVB_EncodedSize(freqs, n) : 0) + 
+                (hasOffsets ? SVB_EncodedSize(offsetsLen, n) : 0) + (hasFields ? n : 0) + 
+                totalOffsets;
+    if (sz >= w->block.len) {
+        return;
+    }
+    
+    u_char *out = malloc(sz), *p = out;
+    memcpy(p, idsColumn, idsSize);
+    p += idsSize;
+    if (hasFreqs) {
+        p += SVB_Encode(freqs, n, p);
+    }
+    if (hasOffsets) {
+        p += SVB_Encode(offsetsLen, n, p);
+    }
+    if (hasFields) {
+        memcpy(p, flags, n);
+        p += n;
+    }
+    for (u_int32_t i = 0; i < n && hasOffsets && !split; i++) {
+        memcpy(p, offsets[i], offsetsLen[i]);
+        p += offsetsLen[i];
+    }
+    
+    BufferSeek(w->bw.buf, start);
+    w->bw.Write(w->bw.buf, out, sz);
+    free(out);
+    
+    w->block.len = sz;
+    w->block.codec = w->codec == BLOCK_CODEC_PFOR ? BLOCK_CODEC_PFOR : BLOCK_CODEC_SVB;
+}
+
 void IW_GenericWrite(IndexWriter *w, t_docId docId, float freq, 
                     u_char flags, VarintVector *offsets) {
 
-    ScoreIndexWriter_AddEntry(&w->scoreWriter, freq, BufferOffset(w->bw.buf), w->lastId);
+    // the id the entry's docId is delta encoded from
+    t_docId deltaBase = w->lastId;
+    if (INDEX_BLOCK_ENCODED(w->version)) {
+        // start a new block if we don't have one or the current one is full
+        if (w->blockOffset == 0 || w->block.numEntries >= INDEX_BLOCK_SIZE) {
+            if (w->blockOffset != 0) {
+                iw_sealBlock(w);
+            }
+            writeBlockHeader(w);
+            w->blockOffset = BufferOffset(w->bw.buf);
+            // every block has a skip entry, so skipping readers find the block of a docId 
+            // without walking the headers before it
+            if (w->skipIndexWriter.buf) {
+                IW_WriteSkipIndexEntry(w);
+            }
+            w->block = (IndexBlockHeader){docId, docId, 0, 0, BLOCK_CODEC_RAW, 
+                            w->offsetsWriter.buf ? BufferOffset(w->offsetsWriter.buf) : 0, 0};
+            w->bw.Write(w->bw.buf, &w->block, sizeof(IndexBlockHeader));
+        }
+        deltaBase = w->block.numEntries ? w->lastId : w->block.firstId;
+        // score entries of block encoded indexes point at the block, and we look up the 
+        // entry by its docId inside it
+        ScoreIndexWriter_AddEntry(&w->scoreWriter, freq, w->blockOffset, docId);
+    } else {
+        ScoreIndexWriter_AddEntry(&w->scoreWriter, freq, BufferOffset(w->bw.buf), w->lastId);
+    }
+    
     // quantize the score to compress it to max 4 bytes
     // freq is between 0 and 1
     int quantizedScore = floorl(freq * (double)FREQ_QUANTIZE_FACTOR);
     LG_DEBUG("docId %d, flags %x, Score %f, quantized score %d", docId, flags, freq, quantizedScore);
     
+    // the parts of the entry the index's layout keeps, see INDEX_ENTRY_*
+    int hasFreqs = !(w->entryFlags & INDEX_ENTRY_NOFREQS);
+    int hasFields = !(w->entryFlags & INDEX_ENTRY_NOFIELDS);
+    int hasOffsets = !(w->entryFlags & INDEX_ENTRY_NOOFFSETS);
+    
+    // keep the maximal frequency the entry is read back with, to bound the scores of hits
+    u_int32_t readFreq = hasFreqs ? quantizedScore : FREQ_QUANTIZE_FACTOR;
+    if (readFreq > w->maxFreq) {
+        w->maxFreq = readFreq;
+    }
+    
     size_t offsetsSz = VV_Size(offsets);
+    // split indexes write the offset vector to the offsets stream instead of the entry
+    int split = w->version == INDEX_VERSION_SPLIT;
     // // calculate the overall len
-    size_t len = varintSize(quantizedScore) + 1 + varintSize(offsetsSz) + offsetsSz;
-    
+    size_t len = (hasFreqs ? varintSize(quantizedScore) : 0) + (hasFields ? 1 : 0) + 
+                 varintSize(offsetsSz) + (split ? 0 : offsetsSz);
     
+    size_t sz = 0;
     // Write docId
-    WriteVarint(docId - w->lastId, &w->bw);
-    // encode len
-
-    WriteVarint(len, &w->bw);
+    sz += WriteVarint(docId - deltaBase, &w->bw);
+    // encode len, which is only needed to skip over offset vectors
+    if (hasOffsets) {
+        sz += WriteVarint(len, &w->bw);
+    }
     //encode freq
-    WriteVarint(quantizedScore, &w->bw);
+    if (hasFreqs) {
+        sz += WriteVarint(quantizedScore, &w->bw);
+    }
     //encode flags
-    w->bw.Write(w->bw.buf, &flags, 1);
+    if (hasFields) {
+        sz += w->bw.Write(w->bw.buf, &flags, 1);
+    }
     //write offsets size
-    WriteVarint(offsetsSz, &w->bw);
-    w->bw.Write(w->bw.buf, offsets->data, offsetsSz);
-    
+    if (hasOffsets) {
+        sz += WriteVarint(offsetsSz, &w->bw);
+        if (split) {
+            w->offsetsWriter.Write(w->offsetsWriter.buf, offsets->data, offsetsSz);
+        } else {
+            sz += w->bw.Write(w->bw.buf, offsets->data, offsetsSz);
+        }
+    }
     
     
     w->lastId = docId;
-    if (w->ndocs % SKIPINDEX_STEP == 0) {
+    if (INDEX_BLOCK_ENCODED(w->version)) {
+        w->block.lastId = docId;
+        w->block.len += sz;
+        w->block.numEntries++;
+        if (readFreq > w->block.maxFreq) {
+            w->block.maxFreq = readFreq;
+        }
+    } else if (w->ndocs % SKIPINDEX_STEP == 0) {
         IW_WriteSkipIndexEntry(w);        
     }
     
@@ -396,7 +1124,8 @@ size_t IW_Close(IndexWriter *w) {
 
     //w->bw.Truncate(w->bw.buf, 0);
     
-    // write the header at the beginning
+    // write the header at the beginning, and the header of the open block if any
+     writeBlockHeader(w);
      writeIndexHeader(w);
      
     
@@ -404,7 +1133,12 @@ size_t IW_Close(IndexWriter *w) {
 }
 
 void IW_Free(IndexWriter *w) {
-    w->skipIndexWriter.Release(w->skipIndexWriter.buf);
+    if (w->skipIndexWriter.buf) {
+        w->skipIndexWriter.Release(w->skipIndexWriter.buf);
+    }
+    if (w->offsetsWriter.buf) {
+        w->offsetsWriter.Release(w->offsetsWriter.buf);
+    }
     w->bw.Release(w->bw.buf);
     free(w);
 }
@@ -415,32 +1149,193 @@ inline t_docId IR_LastDocId(void* ctx) {
 }
 
 
+/* Are all the iterators bitmap iterators */
+static int its_allBitmaps(IndexIterator **its, int num) {
+    for (int i = 0; i < num; i++) {
+        if (!IsBitmapIterator(its[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 inline t_docId UI_LastDocId(void *ctx) {
     return ((UnionContext*)ctx)->minDocId;
 }
 
-IndexIterator *NewUnionIterator(IndexIterator **its, int num, DocTable *dt) {
+IndexIterator *NewUnionIterator(IndexIterator **its, int num, DocTable *dt, Arena *arena) {
     
     // create union context
-    UnionContext *ctx = calloc(1, sizeof(UnionContext));
+    UnionContext *ctx = iter_calloc(arena, 1, sizeof(UnionContext));
     ctx->its =its;
     ctx->num = num;
     ctx->docTable = dt;
-    ctx->currentHits = calloc(num, sizeof(IndexHit));
+    ctx->arena = arena;
+    ctx->currentHits = iter_calloc(arena, num, sizeof(IndexHit));
+    ctx->useHeap = num > UNION_HEAP_MIN_CHILDREN;
     
     // bind the union iterator calls
-    IndexIterator *it = malloc(sizeof(IndexIterator));
+    IndexIterator *it = iter_alloc(arena, sizeof(IndexIterator));
     it->ctx = ctx;
     it->LastDocId = UI_LastDocId;
     it->Read = UI_Read;
     it->SkipTo = UI_SkipTo;
     it->HasNext = UI_HasNext;
     it->Free = UnionIterator_Free;
+    it->ReadBatch = UI_ReadBatch;
+    it->MaxScore = UI_MaxScore;
+    it->SetMinScore = UI_SetMinScore;
+    it->Len = UI_Len;
     return it;
     
 }
 
 
+/* Restore the heap order of a union's heap from pos down, after the docId at pos has grown */
+static inline void uh_siftDown(UnionHeapNode *h, int n, int pos) {
+    UnionHeapNode node = h[pos];
+    while (1) {
+        int c = 2 * pos + 1;
+        if (c >= n) break;
+        if (c + 1 < n && h[c + 1].docId < h[c].docId) c++;
+        if (h[c].docId >= node.docId) break;
+        h[pos] = h[c];
+        pos = c;
+    }
+    h[pos] = node;
+}
+
+/* Remove the top of a union's heap, the child of which has ended */
+static inline void uh_pop(UnionHeapNode *h, int *n) {
+    h[0] = h[--*n];
+    uh_siftDown(h, *n, 0);
+}
+
+/* Put the children of a union's heap in heap order */
+static void uh_heapify(UnionHeapNode *h, int n) {
+    for (int i = n / 2 - 1; i >= 0; i--) {
+        uh_siftDown(h, n, i);
+    }
+}
+
+/* Read the next hit of a union's child, skipping the hits the child filters out */
+static inline int ui_readChild(UnionContext *ui, int i) {
+    int rc;
+    do {
+        // readers add up their score into the hit, so we don't carry over the last one
+        ui->currentHits[i].totalFreq = 0;
+        rc = ui->its[i]->Read(ui->its[i]->ctx, &ui->currentHits[i]);
+    } while (rc == INDEXREAD_NOTFOUND);
+    return rc;
+}
+
+/* Read the first hit of all the children of a union into its heap */
+static void ui_heapInit(UnionContext *ui) {
+    ui->heap = iter_alloc(ui->arena, ui->num * sizeof(UnionHeapNode));
+    ui->heapSize = 0;
+    for (int i = 0; i < ui->num; i++) {
+        if (ui->its[i] != NULL && ui_readChild(ui, i) == INDEXREAD_OK) {
+            ui->heap[ui->heapSize++] = (UnionHeapNode){ui->currentHits[i].docId, i};
+        }
+    }
+    uh_heapify(ui->heap, ui->heapSize);
+}
+
+/* Find the best scoring child of the ones at the top docId of the heap, from the node at pos down.
+The children at the top docId form a subtree at the top of the heap. Ties go to the first child, 
+like in the linear scan */
+static int ui_heapBest(UnionContext *ui, int pos, int best) {
+    for (int c = 2 * pos + 1; c <= 2 * pos + 2 && c < ui->heapSize; c++) {
+        if (ui->heap[c].docId != ui->heap[0].docId) continue;
+        int i = ui->heap[c].it;
+        if (ui->currentHits[i].totalFreq > ui->currentHits[best].totalFreq ||
+            (ui->currentHits[i].totalFreq == ui->currentHits[best].totalFreq && i < best)) {
+            best = i;
+        }
+        best = ui_heapBest(ui, c, best);
+    }
+    return best;
+}
+
+/* UI_Read of unions that keep their children in a heap. Like the linear scan, the children of the
+last hit are only moved on in the next call, since the hit may reference their offsets */
+static int ui_heapRead(UnionContext *ui, IndexHit *hit) {
+    if (ui->heap == NULL) {
+        ui_heapInit(ui);
+    }
+    UnionHeapNode *h = ui->heap;
+    while (ui->heapSize > 0 && h[0].docId <= ui->minDocId) {
+        int i = h[0].it;
+        if (ui_readChild(ui, i) == INDEXREAD_OK) {
+            h[0].docId = ui->currentHits[i].docId;
+            uh_siftDown(h, ui->heapSize, 0);
+        } else {
+            uh_pop(h, &ui->heapSize);
+        }
+    }
+    if (ui->heapSize == 0) {
+        return INDEXREAD_EOF;
+    }
+    
+    *hit = ui->currentHits[ui_heapBest(ui, 0, h[0].it)];
+    hit->type = H_UNION;
+    ui->minDocId = h[0].docId;
+    return INDEXREAD_OK;
+}
+
+/* UI_SkipTo of unions that keep their children in a heap. Only the children behind docId are 
+skipped, the others are already where they need to be */
+static int ui_heapSkipTo(UnionContext *ui, t_docId docId, IndexHit *hit) {
+    if (ui->heap == NULL) {
+        ui_heapInit(ui);
+    }
+    UnionHeapNode *h = ui->heap;
+    while (ui->heapSize > 0 && h[0].docId < docId) {
+        int i = h[0].it;
+        ui->currentHits[i].totalFreq = 0;
+        int rc = ui->its[i]->SkipTo(ui->its[i]->ctx, docId, &ui->currentHits[i]);
+        // the hit the child stopped at was filtered out, so we move on to its next one
+        if (rc == INDEXREAD_NOTFOUND) {
+            rc = ui_readChild(ui, i);
+        }
+        if (rc == INDEXREAD_EOF) {
+            uh_pop(h, &ui->heapSize);
+            continue;
+        }
+        h[0].docId = ui->currentHits[i].docId;
+        uh_siftDown(h, ui->heapSize, 0);
+    }
+    if (ui->heapSize == 0) {
+        return INDEXREAD_EOF;
+    }
+    
+    if (h[0].docId != docId) {
+        // we stopped after docId, at a hit we have not returned yet
+        *hit = ui->currentHits[h[0].it];
+        hit->type = H_UNION;
+        return INDEXREAD_NOTFOUND;
+    }
+    *hit = ui->currentHits[ui_heapBest(ui, 0, h[0].it)];
+    hit->type = H_UNION;
+    ui->minDocId = docId;
+    return INDEXREAD_OK;
+}
+
+/* Move a child of a union read in batches to its next docId, refilling its batch if needed.
+Returns 0 if the child has ended */
+static inline int ui_nextInBatch(UnionContext *ui, int i) {
+    UnionBatch *ub = &ui->batches[i];
+    if (++ub->pos < ub->batch.num) {
+        return 1;
+    }
+    ub->pos = 0;
+    if (IndexIterator_ReadBatch(ui->its[i], &ub->batch) == 0) {
+        ub->eof = 1;
+        return 0;
+    }
+    return 1;
+}
+
 int UI_Read(void *ctx, IndexHit *hit) {
     
     UnionContext *ui = ctx;
@@ -448,6 +1343,9 @@ int UI_Read(void *ctx, IndexHit *hit) {
     if (ui->num == 0) {
         return 0;
     }
+    if (ui->useHeap) {
+        return ui_heapRead(ui, hit);
+    }
     
     
     int minIdx = 0;
@@ -463,11 +1361,14 @@ int UI_Read(void *ctx, IndexHit *hit) {
             //if (it->HasNext(it->ctx)) {
                 // if this hit is behind the min id - read the next entry
                 if (ui->currentHits[i].docId <= ui->minDocId || ui->minDocId == 0) {
-                    if (it->Read(it->ctx, &ui->currentHits[i]) != INDEXREAD_OK) {
+                    if (ui_readChild(ui, i) != INDEXREAD_OK) {
                         continue;
                     }
                 }
-                if (ui->currentHits[i].docId < minDocId) {
+                // children with the same docId are merged into the best scoring one
+                if (ui->currentHits[i].docId < minDocId || 
+                    (ui->currentHits[i].docId == minDocId && 
+                     ui->currentHits[i].totalFreq > ui->currentHits[minIdx].totalFreq)) {
                     minDocId = ui->currentHits[i].docId;
                     minIdx = i;
                 }
@@ -492,6 +1393,71 @@ int UI_Read(void *ctx, IndexHit *hit) {
     
 }
 
+/* Merge the children's batches like UI_Read merges their hits: each docId is returned once,
+taken from the child that scores it highest. The children are kept in a heap by the next docIds 
+of their batches, which is faster than scanning them even for a union of two */
+int UI_ReadBatch(void *ctx, IndexHitBatch *b) {
+    UnionContext *ui = ctx;
+    b->num = 0;
+    if (ui->num == 0) {
+        return 0;
+    }
+    // bitmaps are merged directly, without going through their batches
+    if (its_allBitmaps(ui->its, ui->num)) {
+        return BR_UnionBatch(ui->its, ui->num, b);
+    }
+    if (ui->batches == NULL) {
+        ui->batches = iter_calloc(ui->arena, ui->num, sizeof(UnionBatch));
+    }
+    // a union hit scores like the child hit it takes
+    for (int i = 0; i < ui->num; i++) {
+        ui->batches[i].batch.minScore = b->minScore;
+    }
+    
+    UnionHeapNode *h = ui->heap;
+    if (h == NULL) {
+        h = ui->heap = iter_alloc(ui->arena, ui->num * sizeof(UnionHeapNode));
+        ui->heapSize = 0;
+        for (int i = 0; i < ui->num; i++) {
+            UnionBatch *ub = &ui->batches[i];
+            if (ui->its[i] == NULL || IndexIterator_ReadBatch(ui->its[i], &ub->batch) == 0) {
+                ub->eof = 1;
+                continue;
+            }
+            h[ui->heapSize++] = (UnionHeapNode){ub->batch.docIds[0], i};
+        }
+        uh_heapify(h, ui->heapSize);
+    }
+    
+    while (b->num < INDEX_BATCH_SIZE && ui->heapSize > 0) {
+        t_docId docId = h[0].docId;
+        // consume the docId from every child that has it, keeping the best scoring hit
+        double totalFreq = 0;
+        u_char flags = 0;
+        int minDist = 0, best = -1;
+        while (ui->heapSize > 0 && h[0].docId == docId) {
+            int i = h[0].it;
+            UnionBatch *ub = &ui->batches[i];
+            if (best == -1 || ub->batch.totalFreq[ub->pos] > totalFreq || 
+                (ub->batch.totalFreq[ub->pos] == totalFreq && i < best)) {
+                best = i;
+                totalFreq = ub->batch.totalFreq[ub->pos];
+                flags = ub->batch.flags[ub->pos];
+                minDist = ub->batch.minDist[ub->pos];
+            }
+            if (ui_nextInBatch(ui, i)) {
+                h[0].docId = ub->batch.docIds[ub->pos];
+                uh_siftDown(h, ui->heapSize, 0);
+            } else {
+                uh_pop(h, &ui->heapSize);
+            }
+        }
+        IndexHitBatch_Append(b, docId, totalFreq, flags, minDist);
+        ui->minDocId = docId;
+    }
+    return b->num;
+}
+
  int UI_Next(void *ctx) {
      IndexHit h = NewIndexHit();
      return UI_Read(ctx, &h);
@@ -520,18 +1486,32 @@ Skip to the given docId, or one place after it
 */
  int UI_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit) {
      UnionContext *ui = ctx;
+     if (ui->useHeap) {
+         return ui_heapSkipTo(ui, docId, hit);
+     }
      
      int n = 0;
+     int found = 0;
      int rc = INDEXREAD_EOF;
      // skip all iterators to docId
      for (int i = 0; i < ui->num; i++) {
          // this happens for non existent words
          if (ui->its[i] == NULL) continue;
          
+         ui->currentHits[i].totalFreq = 0;
          if ((rc = ui->its[i]->SkipTo(ui->its[i]->ctx, docId, &ui->currentHits[i])) == INDEXREAD_EOF) {
              continue;
          }
          
+         // once we found a hit, the rest of the children only compete on its score
+         if (found) {
+             if (rc == INDEXREAD_OK && ui->currentHits[i].totalFreq > hit->totalFreq) {
+                 *hit = ui->currentHits[i];
+                 hit->type = H_UNION;
+             }
+             continue;
+         }
+         
         // advance the minimal docId for reads 
         if (ui->minDocId < ui->currentHits[i].docId || rc == INDEXREAD_EOF) {
             ui->minDocId = ui->currentHits[i].docId;
@@ -539,13 +1519,13 @@ Skip to the given docId, or one place after it
              
          *hit = ui->currentHits[i];
          hit->type = H_UNION;
-         // we found a hit - no need to continue
-         if (rc == INDEXREAD_OK) {
-             return rc;
-         }
+         found = rc == INDEXREAD_OK;
          n++;
      }
      
+     if (found) {
+         return INDEXREAD_OK;
+     }
      // all iterators are at the end
      if (n == 0) {
          return INDEXREAD_EOF;
@@ -553,6 +1533,37 @@ Skip to the given docId, or one place after it
      
      return INDEXREAD_NOTFOUND;
  }
+
+double UI_MaxScore(void *ctx) {
+    UnionContext *ui = ctx;
+    double max = 0;
+    for (int i = 0; i < ui->num; i++) {
+        if (ui->its[i] != NULL) {
+            max = MAX(max, IndexIterator_MaxScore(ui->its[i]));
+        }
+    }
+    return max;
+}
+
+size_t UI_Len(void *ctx) {
+    UnionContext *ui = ctx;
+    size_t len = 0;
+    for (int i = 0; i < ui->num; i++) {
+        if (ui->its[i] != NULL) {
+            len += ui->its[i]->Len(ui->its[i]->ctx);
+        }
+    }
+    return len;
+}
+
+void UI_SetMinScore(void *ctx, double minScore) {
+    UnionContext *ui = ctx;
+    for (int i = 0; i < ui->num; i++) {
+        if (ui->its[i] != NULL && ui->its[i]->SetMinScore) {
+            ui->its[i]->SetMinScore(ui->its[i]->ctx, minScore);
+        }
+    }
+}
  
  void UnionIterator_Free(IndexIterator *it) {
      if (it == NULL) return;
@@ -564,7 +1575,10 @@ Skip to the given docId, or one place after it
           }
       }
      
+     if (ui->arena) return;
      free(ui->currentHits);
+     free(ui->batches);
+     free(ui->heap);
      free(ui->its);
      free(ui);
      free(it);
@@ -574,8 +1588,11 @@ Skip to the given docId, or one place after it
 void ReadIterator_Free(IndexIterator *it) {
     if (it==NULL) return;
        
+    Arena *arena = ((IndexReader *)it->ctx)->arena;
     IR_Free(it->ctx);
-    free(it);
+    if (arena == NULL) {
+        free(it);
+    }
 }
  
  void IntersectIterator_Free(IndexIterator *it) {
@@ -586,7 +1603,11 @@ void ReadIterator_Free(IndexIterator *it) {
             ui->its[i]->Free(ui->its[i]);
          }
      }
+     // the offsets grow with the hits, so they are always malloc'd
+     free(ui->offsets);
+     if (ui->arena) return;
      free(ui->currentHits);
+     free(ui->order);
      free(ui->its);
      free(it->ctx);
      free(it);
@@ -594,29 +1615,51 @@ void ReadIterator_Free(IndexIterator *it) {
  
  
  IndexIterator *NewIntersecIterator(IndexIterator **its, int num, int exact, DocTable *dt,
-                                    u_char fieldMask) {
+                                    u_char fieldMask, Arena *arena) {
      // create context
-    IntersectContext *ctx = calloc(1, sizeof(IntersectContext));
+    IntersectContext *ctx = iter_calloc(arena, 1, sizeof(IntersectContext));
     ctx->its =its;
     ctx->num = num;
     ctx->lastDocId = 0;
     ctx->exact = exact;
     ctx->fieldMask = fieldMask;
-    ctx->currentHits = calloc(num, sizeof(IndexHit));
+    ctx->arena = arena;
+    ctx->currentHits = iter_calloc(arena, num, sizeof(IndexHit));
     for (int i = 0; i < num; i++) {
         IndexHit_Init(&ctx->currentHits[i]);
     }
     ctx->docTable = dt;
-
+    
+    // let the rarest child lead. Bitmaps are cheap to probe but expensive to walk, so we put them
+    // after the other children. Missing terms have no hits at all, so they go first and end the
+    // intersection right away
+    ctx->order = iter_alloc(arena, num * sizeof(int));
+    size_t lens[num];
+    for (int i = 0; i < num; i++) {
+        lens[i] = its[i] == NULL ? 0 : its[i]->Len(its[i]->ctx);
+        int bitmap = IsBitmapIterator(its[i]);
+        int j = i;
+        while (j > 0 && (IsBitmapIterator(its[ctx->order[j - 1]]) > bitmap || 
+                         (IsBitmapIterator(its[ctx->order[j - 1]]) == bitmap && 
+                          lens[ctx->order[j - 1]] > lens[i]))) {
+            ctx->order[j] = ctx->order[j - 1];
+            j--;
+        }
+        ctx->order[j] = i;
+    }
     
     // bind the iterator calls
-    IndexIterator *it = malloc(sizeof(IndexIterator));
+    IndexIterator *it = iter_alloc(arena, sizeof(IndexIterator));
     it->ctx = ctx;
     it->LastDocId = II_LastDocId;
     it->Read = II_Read;
     it->SkipTo = II_SkipTo;
     it->HasNext = II_HasNext;
     it->Free = IntersectIterator_Free;
+    it->ReadBatch = II_ReadBatch;
+    it->MaxScore = II_MaxScore;
+    it->SetMinScore = II_SetMinScore;
+    it->Len = II_Len;
     return it;
 }
  
@@ -628,20 +1671,31 @@ int II_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit) {
      int nfound = 0;
      
      int rc = INDEXREAD_EOF;
-     // skip all iterators to docId
-     for (int i = 0; i < ic->num; i++) {
+     // skip all iterators to docId, starting from the rarest
+     for (int k = 0; k < ic->num; k++) {
+         int i = ic->order[k];
          IndexIterator *it = ic->its[i];
+         if (it == NULL) {
+             return INDEXREAD_EOF;
+         }
          
+         ic->currentHits[i].totalFreq = 0;
          rc = it->SkipTo(it->ctx, docId, &ic->currentHits[i]);
          if (rc == INDEXREAD_EOF) {
              return rc;
-         } else if (rc == INDEXREAD_OK) {
+         } else if (rc == INDEXREAD_OK && ic->currentHits[i].docId == docId) {
              // YAY! found!
              ic->lastDocId = docId;
              
              ++nfound;
-         } else if (ic->currentHits[i].docId > ic->lastDocId){
-             ic->lastDocId = ic->currentHits[i].docId;
+         } else {
+             // docId is not in this child, so there's no point in skipping the others to it. 
+             // The next hit can't be before where the child stopped
+             if (ic->currentHits[i].docId > ic->lastDocId) {
+                 ic->lastDocId = ic->currentHits[i].docId;
+             }
+             hit->docId = ic->lastDocId;
+             return INDEXREAD_NOTFOUND;
          }
          
      }
@@ -673,14 +1727,14 @@ int II_Read(void *ctx, IndexHit *hit) {
     do {
         //LG_DEBUG("II %p last docId %d", ic,     ic->lastDocId);
         nh = 0;    
-        for (i = 0; i < ic->num; i++) {
-            
+        for (int k = 0; k < ic->num; k++) {
+            i = ic->order[k];
             IndexHit *h = &ic->currentHits[i];
             //LG_DEBUG("h->docId: %d, ic->lastDocId: %d", h->docId, ic->lastDocId);
             // skip to the next
             int rc = INDEXREAD_OK;
             if (h->docId != ic->lastDocId || ic->lastDocId == 0) {
-                
+                h->totalFreq = 0;
                 if (ic->its[i] == NULL || 
                     (rc = ic->its[i]->SkipTo(ic->its[i]->ctx, ic->lastDocId, h)) == INDEXREAD_EOF) {
                     return INDEXREAD_EOF;
@@ -706,34 +1760,47 @@ int II_Read(void *ctx, IndexHit *hit) {
             
             // sum up all hits
             if (hit != NULL) {
-                hit->numOffsetVecs = 0;
                 hit->flags = 0xff;
                 hit->type = H_INTERSECTED;
                 hit->docId = ic->currentHits[0].docId;
+                
+                int numOffsets = 0;
+                for (int i = 0; i < nh; i++) {
+                    numOffsets += ic->currentHits[i].numOffsets;
+                }
+                if (numOffsets > ic->offsetsCap) {
+                    ic->offsetsCap = numOffsets;
+                    ic->offsets = realloc(ic->offsets, numOffsets * sizeof(OffsetVectorRef));
+                }
+                
+                hit->offsets = ic->offsets;
+                hit->numOffsets = 0;
                 for (int i = 0; i < nh; i++) {
                     IndexHit *hh = &ic->currentHits[i];
                     
                     hit->flags &= hh->flags;
                     hit->totalFreq += hh->totalFreq;
                     
-                    int n = 0;
-                    // Copy the offset vectors of the hits
-                    while(hit->numOffsetVecs < MAX_INTERSECT_WORDS && n < hh->numOffsetVecs) {
-                        hit->offsetVecs[hit->numOffsetVecs++] = hh->offsetVecs[n++];
-                    }
+                    // Copy the references to the offset vectors of the hits, before the children
+                    // move on and their own arrays change
+                    memcpy(hit->offsets + hit->numOffsets, IndexHit_Offsets(hh), 
+                           hh->numOffsets * sizeof(OffsetVectorRef));
+                    hit->numOffsets += hh->numOffsets;
                 } 
                 
                
             }
             
-            // advance to the next iterator
-            if (ic->its[0]->Read(ic->its[0]->ctx, &ic->currentHits[0]) == INDEXREAD_EOF) {
+            // advance the leading iterator
+            int lead = ic->order[0];
+            ic->currentHits[lead].totalFreq = 0;
+            if (ic->its[lead]->Read(ic->its[lead]->ctx, &ic->currentHits[lead]) == INDEXREAD_EOF) {
                 // if we're at the end we don't want to return EOF right now,
                 // but advancing docId makes sure we'll read the first iterator again in the next round
                 ic->lastDocId++;
             } else {
-                if (ic->currentHits[0].docId > ic->lastDocId) {
-                    ic->lastDocId = ic->currentHits[0].docId;    
+                if (ic->currentHits[lead].docId > ic->lastDocId) {
+                    ic->lastDocId = ic->currentHits[lead].docId;    
                 } else {
                     ic->lastDocId++;
                 }
@@ -747,7 +1814,7 @@ int II_Read(void *ctx, IndexHit *hit) {
             
             // In exact mode, make sure the minimal distance is the number of words
              if (ic->exact && hit != NULL) {
-                 int md = VV_MinDistance(hit->offsetVecs, hit->numOffsetVecs);
+                 int md = IndexHit_MinDistance(hit);
                  
                  if (md > ic->num - 1) {
                     continue;
@@ -765,6 +1832,15 @@ int II_Read(void *ctx, IndexHit *hit) {
     return INDEXREAD_EOF;
 }
 
+int II_ReadBatch(void *ctx, IndexHitBatch *b) {
+    IntersectContext *ic = ctx;
+    // bitmaps are intersected directly, dense parts a word at a time
+    if (!ic->exact && ic->num > 0 && its_allBitmaps(ic->its, ic->num)) {
+        return BR_IntersectBatch(ic->its, ic->num, ic->fieldMask, b);
+    }
+    return batch_readHits(II_Read, ctx, b);
+}
+
 int II_HasNext(void *ctx) {
     IntersectContext *ic = ctx;
     for (int i = 0; i < ic->num; i++) {
@@ -781,3 +1857,41 @@ int II_HasNext(void *ctx) {
 t_docId II_LastDocId(void *ctx) {
     return ((IntersectContext *)ctx)->lastDocId;
 }
+
+double II_MaxScore(void *ctx) {
+    IntersectContext *ic = ctx;
+    double sum = 0;
+    for (int i = 0; i < ic->num; i++) {
+        // a missing term means there are no hits at all
+        if (ic->its[i] == NULL) {
+            return 0;
+        }
+        sum += IndexIterator_MaxScore(ic->its[i]);
+    }
+    return sum;
+}
+
+void II_SetMinScore(void *ctx, double minScore) {
+    IntersectContext *ic = ctx;
+    for (int i = 0; i < ic->num; i++) {
+        IndexIterator *it = ic->its[i];
+        if (it == NULL || it->SetMinScore == NULL) continue;
+        double others = 0;
+        for (int j = 0; j < ic->num; j++) {
+            if (j != i && ic->its[j] != NULL) {
+                others += IndexIterator_MaxScore(ic->its[j]);
+            }
+        }
+        // if any of the others is unbounded this is negative infinity, and nothing is skipped
+        it->SetMinScore(it->ctx, minScore - others);
+    }
+}
+
+size_t II_Len(void *ctx) {
+    IntersectContext *ic = ctx;
+    // the children are ordered by their lengths, so the first one is the shortest
+    if (ic->num == 0 || ic->its[ic->order[0]] == NULL) {
+        return 0;
+    }
+    return ic->its[ic->order[0]]->Len(ic->its[ic->order[0]]->ctx);
+}
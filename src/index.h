@@ -10,12 +10,12 @@
 #include "forward_index.h"
 #include "util/logging.h"
 #include "doc_table.h"
+#include "doc_norms.h"
 #include "score_index.h"
 #include "skip_index.h"
+#include "util/arena.h"
 
 
-#define MAX_INTERSECT_WORDS 8
-
 /** HitType tells us what type of hit we're dealing with */
 typedef enum {
     // A raw term hit
@@ -30,19 +30,39 @@ typedef enum {
     H_UNION
 } HitType;
 
+/* A reference to the offset vector of a term in a document. The offsets are left encoded in 
+the index buffer, and are only decoded if we need them, e.g. to calculate term distances */
+typedef struct {
+    char *data;
+    u_int32_t len;
+} OffsetVectorRef;
+
 /* An IndexHit is the data structure used when reading indexes. 
-Each hit representsa single document entry in an inverted index */
+Each hit representsa single document entry in an inverted index. 
+Hits are kept small since they are copied around a lot, and their offset vectors are
+only referenced, never copied */
 typedef struct {
     t_docId docId;
     double totalFreq;
     u_char flags;
-    VarintVector offsetVecs[MAX_INTERSECT_WORDS];
-    int numOffsetVecs;
-    int hasMetadata;
-    DocumentMetadata metadata;
     HitType type;
+    // the offset vectors of the hit's terms. If NULL, the hit has a single term and its vector 
+    // is termOffsets. Otherwise it points at an array owned by the iterator that produced the 
+    // hit, which is only valid until that iterator's next read
+    OffsetVectorRef *offsets;
+    int numOffsets;
+    OffsetVectorRef termOffsets;
 } IndexHit;
 
+/* Get the offset vectors of a hit's terms, numOffsets of them */
+static inline OffsetVectorRef *IndexHit_Offsets(IndexHit *h) {
+    return h->offsets ? h->offsets : &h->termOffsets;
+}
+
+/* Calculate the minimal distance between the terms of a hit, decoding their offset vectors.
+See VV_MinDistance */
+int IndexHit_MinDistance(IndexHit *h);
+
 
 /** Reset the state of an existing index hit. This can be used to 
 recycle index hits during reads */
@@ -54,20 +74,136 @@ IndexHit NewIndexHit();
 this does not actually free the hit itself */
 void IndexHit_Terminate(IndexHit *h);
 
-/** Load document metadata for an index hit, marking it as having metadata.
-Currently has no effect due to performance issues */
-int IndexHit_LoadMetadata(IndexHit *h, DocTable *dt);
-
 
+/* On-disk encoding versions of inverted index records */
+// Entries are written one after the other, with skip entries kept in a separate skip index key
+#define INDEX_VERSION_LEGACY 0
+// Entries are grouped in blocks with inline skip headers, see IndexBlockHeader
+#define INDEX_VERSION_BLOCKS 1
+// Like INDEX_VERSION_BLOCKS, but the offset vectors are kept in a separate offsets stream, 
+// so scanning docIds and frequencies never has to step over them
+#define INDEX_VERSION_SPLIT 2
+
+// Is an index of the given version encoded in blocks
+#define INDEX_BLOCK_ENCODED(version) ((version) >= INDEX_VERSION_BLOCKS)
+
+// The number of entries in each block of a block encoded index
+#define INDEX_BLOCK_SIZE 128
+
+/* Optional parts of index entries, that indexes created with the matching FT.CREATE options
+leave out of all their entries. An entry is written as:
+
+    docId delta | length of the rest | frequency | flags | offsets length | offset vector
+
+where the length is only written if the entry has an offset vector */
+// All the parts are present. This is the layout of indexes created before layouts existed
+#define INDEX_ENTRY_FULL 0
+// No offset vectors. Hits are read with empty offset vectors
+#define INDEX_ENTRY_NOOFFSETS 0x01
+// No field flags. Hits are read as appearing in all the fields
+#define INDEX_ENTRY_NOFIELDS 0x02
+// No frequencies. Hits are read with the maximal frequency
+#define INDEX_ENTRY_NOFREQS 0x04
+
+/* The header of an inverted index record. Legacy indexes with full entries are written with the 
+first three fields only, the 12 byte header of the first versions of the module, and read with 
+the other fields zeroed. The others have the INDEX_HEADER_EXTENDED bit set in the size they are 
+written with, and INDEX_HEADER_MAGIC after numDocs, so the two are never confused */
 #pragma pack(4)
-/** The header of an inverted index record */
 typedef struct indexHeader  {
     t_offset size;
     t_docId lastId;
     u_int32_t numDocs;
+    // INDEX_HEADER_MAGIC in extended headers
+    u_int32_t magic;
+    // the entries encoding version, one of INDEX_VERSION_*
+    u_int32_t version;
+    // the offset of the last block of a block encoded index, 0 if there are no blocks yet
+    t_offset lastBlock;
+    // the length of the offsets stream of INDEX_VERSION_SPLIT indexes
+    t_offset offsetsSize;
+    // the codec full blocks of a block encoded index are sealed with, one of BLOCK_CODEC_*
+    u_int32_t codec;
+    // the parts left out of the entries, a mask of INDEX_ENTRY_*
+    u_int32_t entryFlags;
+    // the maximal quantized frequency of all the entries, bounding the score of any hit. 0 if
+    // unknown, as legacy headers don't keep it
+    u_int32_t maxFreq;
 } IndexHeader;
+
+// The size of the header of legacy indexes with full entries
+#define INDEX_HEADER_LEGACY_SIZE 12
+// Set in the size written in extended headers. Redis strings never get large enough to have it
+#define INDEX_HEADER_EXTENDED 0x80000000
+#define INDEX_HEADER_MAGIC 0x48584946
+
+// The size of the header of indexes of the given version and entry layout
+#define INDEX_HEADER_SIZE(version, entryFlags) \
+    ((version) == INDEX_VERSION_LEGACY && (entryFlags) == INDEX_ENTRY_FULL ? \
+        INDEX_HEADER_LEGACY_SIZE : sizeof(IndexHeader))
+
+/* Encodings of the entries inside a block */
+// Entries are written one after the other like in legacy indexes. The open block is always raw,
+// and so are all the blocks of an index whose codec is raw
+#define BLOCK_CODEC_RAW 0
+// The docId deltas, frequencies and offset vector lengths of all entries are written as Stream
+// VByte columns, followed by the flags of all entries and then their offset vectors.
+// Full blocks are re-encoded this way when they are sealed. If the offset vectors are kept in a 
+// separate stream, they are simply left out of the block. Columns of parts the entry layout 
+// leaves out are not written
+#define BLOCK_CODEC_SVB 1
+// Like BLOCK_CODEC_SVB, but the docId deltas are bit packed as a PForDelta frame, see pfor.h.
+// The frequencies and offset vector lengths are still Stream VByte columns
+#define BLOCK_CODEC_PFOR 2
+
+/** The header of a block of entries in a block encoded inverted index. 
+It holds everything needed to skip the whole block without decoding its entries. 
+The docId of the first entry in a block is delta encoded from firstId, so each block
+can be decoded on its own */
+typedef struct {
+    t_docId firstId;
+    t_docId lastId;
+    // the length in bytes of the entries following the header
+    u_int32_t len;
+    u_int16_t numEntries;
+    // the encoding of the entries, one of BLOCK_CODEC_*
+    u_int16_t codec;
+    // in INDEX_VERSION_SPLIT indexes, the offset in the offsets stream where the offset vectors
+    // of the block's entries start. They follow each other in the order of the entries
+    t_offset offsetsStart;
+    // the maximal quantized frequency of the block's entries, so readers looking only for hits 
+    // that score above some threshold can skip the whole block
+    u_int32_t maxFreq;
+} IndexBlockHeader;
 #pragma pack()
 
+/* A column encoded block decoded in one go, so its entries can be read without touching the
+index buffer. Only the offset vectors are left in the buffer */
+typedef struct {
+    t_docId docIds[INDEX_BLOCK_SIZE];
+    u_int32_t freqs[INDEX_BLOCK_SIZE];
+    u_int32_t offsetsLen[INDEX_BLOCK_SIZE];
+    u_char flags[INDEX_BLOCK_SIZE];
+    // the offset of the offset vector of the entry at pos, in the index buffer or the offsets 
+    // stream if the index has one
+    t_offset offsetsPos;
+    // the next entry to read, and the number of entries decoded
+    u_int32_t pos;
+    u_int32_t num;
+} DecodedBlock;
+
+
+/* Counters of the work an index reader did, for profiling queries */
+typedef struct {
+    // entries whose docId was decoded, including the ones scanned over
+    size_t decoded;
+    // bytes of the index the reader went over. What it jumped over is not counted
+    size_t bytes;
+    // skip index entries used to jump ahead
+    size_t skipIndexHits;
+    // blocks skipped by their headers alone, without decoding them
+    size_t blocksSkipped;
+} IndexReaderStats;
 
 /* An IndexReader wraps an inverted index record for reading and iteration */
 typedef struct indexReader {
@@ -87,6 +223,37 @@ typedef struct indexReader {
     ScoreIndex *scoreIndex;
     int useScoreIndex;
     u_char fieldMask;
+    // the current block of a block encoded index, and the offset where its entries end
+    IndexBlockHeader block;
+    t_offset blockEnd;
+    // the entries of the current block if it is column encoded
+    DecodedBlock decoded;
+    // the offsets stream of INDEX_VERSION_SPLIT indexes. It is only loaded if we need offsets,
+    // otherwise the hits we read have empty offset vectors
+    Buffer *offsetsBuf;
+    // the position of the next raw entry's offset vector in the offsets stream
+    t_offset offsetsPos;
+    // decodes the raw entry at the current position, specialized for the index's entry layout
+    int (*readRaw)(struct indexReader *ir, t_docId *docId, float *freq, u_char *flags, 
+                   OffsetVectorRef *offsets);
+    // decodes the rest of the raw entry whose docId has just been read
+    int (*readRawRest)(struct indexReader *ir, t_docId *docId, float *freq, u_char *flags, 
+                       OffsetVectorRef *offsets);
+    // blocks of block encoded indexes that can't score above minScore are skipped. 
+    // Negative if we read all the blocks
+    double minScore;
+    // the idf of the term, the same for all its entries
+    double idf;
+    // the number of documents of the term the idf is computed from. The number of documents in 
+    // the index, unless the term's postings are split between readers
+    u_int32_t docFreq;
+    // the document norms of BM25 scoring, NULL for tf-idf scoring
+    DocNorms *norms;
+    IndexReaderStats stats;
+    // where the reader last jumped to, so stats.bytes can count what it went over since
+    t_offset jumpedTo;
+    // the arena the reader and its read iterator were allocated from, NULL if they were malloc'd
+    Arena *arena;
 } IndexReader; 
 
 
@@ -99,8 +266,22 @@ typedef struct indexWriter {
     u_int32_t ndocs;
     // writer for the skip index
     BufferWriter skipIndexWriter;
+    // writer for the offsets stream of INDEX_VERSION_SPLIT indexes
+    BufferWriter offsetsWriter;
     // writer for the score index
     ScoreIndexWriter scoreWriter;
+    // the entries encoding version, one of INDEX_VERSION_*
+    u_int32_t version;
+    // the codec full blocks are sealed with, one of BLOCK_CODEC_*
+    u_int32_t codec;
+    // the parts left out of the entries, a mask of INDEX_ENTRY_*
+    u_int32_t entryFlags;
+    // the maximal quantized frequency written so far
+    u_int32_t maxFreq;
+    // the currently open block of a block encoded index and its offset. 
+    // blockOffset is 0 if no block has been opened yet
+    IndexBlockHeader block;
+    t_offset blockOffset;
 } IndexWriter;
 
 
@@ -109,8 +290,41 @@ typedef struct indexWriter {
 #define INDEXREAD_NOTFOUND 2
 
 
+// the number of documents readers assume the index has until they are told the real number
 #define TOTALDOCS_PLACEHOLDER (double)10000000
-double tfidf(float freq, u_int32_t docFreq);
+/* The inverse document frequency of a term that appears in docFreq of the index's totalDocs
+documents. The tf-idf score of an entry is its frequency times the idf of its term */
+double IDF(double totalDocs, u_int32_t docFreq);
+
+// The maximal number of hits returned by a single ReadBatch call
+#define INDEX_BATCH_SIZE 128
+
+/* A batch of hits read from an iterator in one call. The hits are laid out as arrays, so 
+consumers can loop over them without an indirect call or an IndexHit copy per document.
+Batches carry no offset vectors, so iterators that need offsets to score a hit (i.e. intersects)
+compute the minimal distance between the hit's terms themselves */
+typedef struct {
+    t_docId docIds[INDEX_BATCH_SIZE];
+    double totalFreq[INDEX_BATCH_SIZE];
+    u_char flags[INDEX_BATCH_SIZE];
+    // the minimal distance between the terms of each hit. 1 for single term hits and exact matches
+    int minDist[INDEX_BATCH_SIZE];
+    // the number of hits in the batch
+    int num;
+    // set by the caller: hits with a totalFreq of minScore or less can't make it into the results,
+    // so their minimal distance is not computed and is 1. Negative to compute it for all the hits
+    double minScore;
+} IndexHitBatch;
+
+/* Append a hit to a batch */
+static inline void IndexHitBatch_Append(IndexHitBatch *b, t_docId docId, double totalFreq, 
+                                        u_char flags, int minDist) {
+    b->docIds[b->num] = docId;
+    b->totalFreq[b->num] = totalFreq;
+    b->flags[b->num] = flags;
+    b->minDist[b->num] = minDist;
+    b->num++;
+}
 
 /* An abstract interface used by readers / intersectors / unioners etc.
 Basically query execution creates a tree of iterators that activate each other recursively */
@@ -127,8 +341,28 @@ typedef struct indexIterator {
     int (*HasNext)(void *ctx);
     // release the iterator's context and free everything needed
     void (*Free)(struct indexIterator *self);
+    // Read the next batch of up to INDEX_BATCH_SIZE hits. Returns the number of hits read, 
+    // 0 if at the end. Optional - may be NULL, see IndexIterator_ReadBatch.
+    // An iterator is consumed either with ReadBatch or with Read and SkipTo, never both
+    int (*ReadBatch)(void *ctx, IndexHitBatch *batch);
+    // An upper bound of the totalFreq of any hit the iterator yields. Optional - NULL if the 
+    // iterator can't bound its scores, see IndexIterator_MaxScore
+    double (*MaxScore)(void *ctx);
+    // Tell the iterator that hits with a totalFreq of minScore or less are not needed, so it may
+    // skip them without reading them. It may still yield some of them. Optional - may be NULL
+    void (*SetMinScore)(void *ctx, double minScore);
+    // An estimate of the number of hits the iterator yields, used to order the children of 
+    // intersections so the rarest one leads
+    size_t (*Len)(void *ctx);
 } IndexIterator;
 
+/* Read the next batch of hits from an iterator, using its ReadBatch if it has one, or reading
+the hits one by one with Read if it doesn't. Returns the number of hits read, 0 if at the end */
+int IndexIterator_ReadBatch(IndexIterator *it, IndexHitBatch *batch);
+
+/* The upper bound of the totalFreq of any hit of an iterator, or HUGE_VAL if it has none */
+double IndexIterator_MaxScore(IndexIterator *it);
+
 /* Free a union iterator */
 void UnionIterator_Free(IndexIterator *it);
 
@@ -145,17 +379,24 @@ IndexReader *NewIndexReader(void *data, size_t datalen, SkipIndex *si, DocTable
 /* Create a new index reader on an inverted index buffer, 
 * optionally with a skip index, docTable and scoreIndex.
 * If singleWordMode is set to 1, we ignore the skip index and use the score index.
+* The reader is allocated from the arena if one is given, and so is its read iterator. Only the 
+* reader itself is, and IR_Free still frees the buffer and indexes it was given.
 */                            
 IndexReader *NewIndexReaderBuf(Buffer *buf, SkipIndex *si, DocTable *docTable, int singleWordMode, 
-                              ScoreIndex *sci, u_char fieldMask);
+                              ScoreIndex *sci, u_char fieldMask, Arena *arena);
 /* free an index reader */
 void IR_Free(IndexReader *ir);
 
-/* Read an entry from an inverted index */ 
+/* Read an entry from an inverted index. Its offset vector is referenced only if offsets is not 
+NULL */ 
 int IR_GenericRead(IndexReader *ir, t_docId *docId, float *freq, u_char *flags, 
-                   VarintVector *offsets);
-/* Read an entry from an inverted index into IndexHit */
+                   OffsetVectorRef *offsets);
+/* Read an entry from an inverted index into IndexHit. Read iterators use variants of it 
+specialized for the reader's modes, see NewReadIterator */
 int IR_Read(void *ctx, IndexHit *e);
+/* Read a batch of entries from an inverted index. Column encoded blocks are copied over
+from their decoded arrays */
+int IR_ReadBatch(void *ctx, IndexHitBatch *batch);
 /* Move to the next entry in an inverted index, without reading the whole entry */
 int IR_Next(void *ctx);
 
@@ -166,17 +407,42 @@ int IR_HasNext(void *ctx);
 int IR_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit);
 /* The number of docs in an inverted index entry */
 u_int32_t IR_NumDocs(IndexReader *ir);
+/* The score of the best entry of an inverted index, from the maximal frequency in its header */
+double IR_MaxScore(void *ctx);
+/* The number of docs in the inverted index of a reader */
+size_t IR_Len(void *ctx);
+/* Skip the blocks whose maximal frequency can't score above minScore from now on. Readers of 
+legacy indexes and score index readers read everything */
+void IR_SetMinScore(void *ctx, double minScore);
 /* LastDocId of an inverted index stateful reader */
 t_docId IR_LastDocId(void* ctx);
 /* Seek the inverted index reader to a specific offset and set the last docId */
 void IR_Seek(IndexReader *ir, t_offset offset, t_docId docId);
+/* Set the number of documents in the index, which the idf of the reader's term depends on */
+void IR_SetTotalDocs(IndexReader *ir, size_t totalDocs);
+/* Set the number of documents of the reader's term, when they are more than the ones of the
+reader's index, e.g. when some of them are in the write segment. Must be called before 
+IR_SetTotalDocs or IR_SetNorms */
+void IR_SetDocFreq(IndexReader *ir, u_int32_t docFreq);
+/* Score the reader's postings with BM25 using the document norms, in an index of totalDocs 
+documents. The score index holds the top postings by tf-idf, so it is not used from then on. 
+Must be called before the reader's iterator is created */
+void IR_SetNorms(IndexReader *ir, DocNorms *norms, size_t totalDocs);
+/* Get the counters of the work the reader did so far */
+void IR_GetStats(IndexReader *ir, IndexReaderStats *stats);
 
 
 //void IW_MakeSkipIndex(IndexWriter *iw, Buffer *b);
+/* Read the header of an index of either layout into h. Returns 0, with h zeroed, if the buffer is 
+too short to have one or its extended header has no magic */
 int indexReadHeader(Buffer *b, IndexHeader *h);
 
-/* Create a reader iterator that iterates an inverted index record */
+/* Create a reader iterator that iterates an inverted index record. Its Read function is 
+specialized for the reader's score index, single word and field mask modes, so it does not 
+check them for every entry. It is allocated from the reader's arena, if it has one */
 IndexIterator *NewReadIterator(IndexReader *ir);
+/* Is the iterator a read iterator, with its reader as its context */
+int IsReadIterator(IndexIterator *it);
 
 /* Close an indexWriter */
 size_t IW_Close(IndexWriter *w);
@@ -189,13 +455,40 @@ size_t IW_Len(IndexWriter *w);
 
 /** Free the index writer and underlying data structures */
 void IW_Free(IndexWriter *w);
-/* Create a new index writer with a memory buffer of a given capacity. 
-NOTE: this is used for testing only */
-IndexWriter *NewIndexWriter(size_t cap);
+/* Create a new index writer with a memory buffer of a given capacity, encoding entries
+in the given version and entry layout, and sealing full blocks with the given codec if the 
+version is block encoded. NOTE: this is used for testing only */
+IndexWriter *NewIndexWriter(size_t cap, u_int32_t version, u_int32_t codec, u_int32_t entryFlags);
+
+/* Create a new index writer with the given buffers for the actual index, skip index, offsets
+stream and score index. If the index buffer is empty, entries will be encoded with the given 
+version, block codec and entry layout, otherwise those of the existing index are used. Block encoded indexes do not use 
+the skip index writer, and only INDEX_VERSION_SPLIT indexes use the offsets writer. 
+The buffers of unused writers may be NULL */
+IndexWriter *NewIndexWriterBuf(BufferWriter bw, BufferWriter skipIndexWriter, BufferWriter offsetsWriter,
+                               ScoreIndexWriter scoreWriter, u_int32_t version, u_int32_t codec,
+                               u_int32_t entryFlags);
+
+
+/* The current batch of a union's child, when the union is read in batches */
+typedef struct {
+    IndexHitBatch batch;
+    // the next hit of the batch to merge
+    int pos;
+    // set once the child has no more hits
+    int eof;
+} UnionBatch;
 
-/* Create a new index writer with the given buffers for the actual index, skip index, and score index */
-IndexWriter *NewIndexWriterBuf(BufferWriter bw, BufferWriter skipIndexWriter, ScoreIndexWriter scoreWriter);
+/* A child of a union in the union's heap, keyed by the docId the child is at */
+typedef struct {
+    t_docId docId;
+    int it;
+} UnionHeapNode;
 
+// Unions of more children than this keep them in a min-heap by their docIds when read with Read and
+// SkipTo, instead of scanning all of them for the minimal docId on every read. Batches are always
+// merged with a heap
+#define UNION_HEAP_MIN_CHILDREN 4
 
 /* UnionContext is used during the running of a union iterator */
 typedef struct {
@@ -205,17 +498,42 @@ typedef struct {
     t_docId minDocId;
     IndexHit *currentHits;
     DocTable *docTable;
+    // allocated on the first ReadBatch call
+    UnionBatch *batches;
+    // do Read and SkipTo merge the children with a heap, see UNION_HEAP_MIN_CHILDREN
+    int useHeap;
+    // the children that have not ended, allocated on the first read. When reading with Read and 
+    // SkipTo they are keyed by the docIds of their current hits, and when reading in batches by
+    // the next docIds of their batches
+    UnionHeapNode *heap;
+    int heapSize;
+    // the arena the union was allocated from, NULL if it was malloc'd
+    Arena *arena;
 } UnionContext;
 
 /* Create a new UnionIterator over a list of underlying child iterators. 
-It will return each document of the underlying iterators, exactly once */ 
-IndexIterator *NewUnionIterator(IndexIterator **its, int num, DocTable *t);
+It will return each document of the underlying iterators, exactly once, with the hit of the
+child that scores it highest. Above UNION_HEAP_MIN_CHILDREN children, finding the next docId takes 
+O(log n) instead of O(n). 
+The union owns the children and their array. If an arena is given, the union is allocated from it,
+and so is the array, which is not freed with the union */ 
+IndexIterator *NewUnionIterator(IndexIterator **its, int num, DocTable *t, Arena *arena);
 
 int UI_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit); 
 int UI_Next(void *ctx);
 int UI_Read(void *ctx, IndexHit *hit);
+/* Merge the batches of the union's children into a batch, keeping the children in a heap. If all 
+the children are bitmaps they are merged directly, see BR_UnionBatch */
+int UI_ReadBatch(void *ctx, IndexHitBatch *batch);
 int UI_HasNext(void *ctx);
 t_docId UI_LastDocId(void *ctx);
+/* A union hit scores as its best child, so it is bounded by the highest bound of the children */
+double UI_MaxScore(void *ctx);
+/* A child can skip whatever doesn't score above the union's minimal score, since no other child
+would make it score higher */
+void UI_SetMinScore(void *ctx, double minScore);
+/* A union has at most the hits of all its children */
+size_t UI_Len(void *ctx);
 
 /* The context used by the intersection methods during iterating an intersect iterator */
 typedef struct {
@@ -226,17 +544,40 @@ typedef struct {
     IndexHit *currentHits;
     DocTable *docTable;
     u_char fieldMask;
+    // the offset vectors of the current hit, gathered from all the child hits
+    OffsetVectorRef *offsets;
+    int offsetsCap;
+    // the order we advance the children in, from the one with the fewest hits to the one with the
+    // most, so the rarest leads and the others are skipped to its hits. The children themselves 
+    // stay in the query order, which is the order of the offset vectors of exact hits
+    int *order;
+    // the arena the intersection was allocated from, NULL if it was malloc'd
+    Arena *arena;
 } IntersectContext;
 
 /* Create a new intersect iterator over the given list of child iterators. If exact is one
-we will only yield results that are exact matches */
+we will only yield results that are exact matches. The children are advanced in the order of 
+their Len estimates, with bitmaps last since they are cheap to probe but expensive to walk. 
+The children and their array are owned like the children of a union, see NewUnionIterator */
 IndexIterator *NewIntersecIterator(IndexIterator **its, int num, int exact, DocTable *t,
-                                   u_char fieldMask);
+                                   u_char fieldMask, Arena *arena);
 int II_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit); 
 int II_Next(void *ctx);
 int II_Read(void *ctx, IndexHit *hit);
+/* Read a batch of intersection hits. Intersecting needs the offset vectors of the children, 
+so the hits are still produced one by one with II_Read, and only their scoring is batched.
+If all the children are bitmaps, they are intersected directly, see BR_IntersectBatch */
+int II_ReadBatch(void *ctx, IndexHitBatch *batch);
 int II_HasNext(void *ctx);
 t_docId II_LastDocId(void *ctx);
+/* An intersection hit sums the scores of its children, so it is bounded by the sum of their 
+bounds */
+double II_MaxScore(void *ctx);
+/* A child can skip what doesn't score above the minimal score even with all the other children
+at their bounds, i.e. above minScore minus the sum of the others' bounds */
+void II_SetMinScore(void *ctx, double minScore);
+/* An intersection has at most the hits of its rarest child */
+size_t II_Len(void *ctx);
 
 
 
@@ -15,15 +15,29 @@
 #include "rmutil/util.h"
 #include "rmutil/strings.h"
 #include "numeric_index.h"
+#include "rmutil/sds.h"
+#include "segment.h"
 
 
-
-int AddDocument(RedisSearchCtx *ctx, Document doc, const char **errorString, int nosave) {
-    
+/* Save a document and its metadata, index its numeric fields, and tokenize its text fields into a
+forward index with normalized frequencies, ready to be written to the inverted indexes of its 
+terms. The forward index is put in *out, and the caller should free it */
+static int prepareDocument(RedisSearchCtx *ctx, Document doc, const char **errorString, int nosave,
+                           ForwardIndex **out) {
     
     int isnew;
     t_docId docId = Redis_GetDocId(ctx, doc.docKey, &isnew);
     
+    // the postings of a document of a WRITEBUFFER index may have been lost with the write segment in 
+    // a restart, leaving it out of the index. It is added again under a new docId, as the postings 
+    // of the segment come after all the persisted ones
+    if (docId != 0 && !isnew && (ctx->spec->flags & Index_WriteBuffer) && 
+        Segment_IsLost(ctx, docId)) {
+        LG_DEBUG("Adding again doc %d, whose postings were lost\n", docId);
+        docId = Redis_NewDocId(ctx, doc.docKey);
+        isnew = 1;
+    }
+    
     // Make sure the document is not already in the index - it needs to be incremental!
     if (docId == 0 || !isnew) {
         *errorString = "Document already in index";
@@ -64,7 +78,8 @@ int AddDocument(RedisSearchCtx *ctx, Document doc, const char **errorString, int
         
         switch (fs->type) {
             case F_FULLTEXT:
-                totalTokens += tokenize(c, fs->weight, fs->id, idx, forwardIndexTokenFunc, idx->stemmer);
+                totalTokens += tokenize(c, fs->weight, fs->id, idx, forwardIndexTokenFunc, idx->stemmer,
+                                        ctx->spec->stopwords);
                 break;
             case F_NUMERIC: {
                 
@@ -91,25 +106,18 @@ int AddDocument(RedisSearchCtx *ctx, Document doc, const char **errorString, int
     
     LG_DEBUG("totaltokens :%d\n", totalTokens);
     if (totalTokens > 0) {
-        ForwardIndexIterator it = ForwardIndex_Iterate(idx);
-        
-        ForwardIndexEntry *entry = ForwardIndexIterator_Next(&it);
+        if (Redis_PutDocNorm(ctx, docId, totalTokens, idx->maxFreq, doc.score) == REDISMODULE_ERR) {
+            *errorString = "Could not save document norms";
+            goto error;
+        }
         
-        while (entry != NULL) {
-            LG_DEBUG("entry: %s freq %f\n", entry->term, entry->freq);
+        ForwardIndexIterator it = ForwardIndex_Iterate(idx);
+        ForwardIndexEntry *entry;
+        while ((entry = ForwardIndexIterator_Next(&it)) != NULL) {
             ForwardIndex_NormalizeFreq(idx, entry);
-            IndexWriter *w = Redis_OpenWriter(ctx, entry->term);
-            
-            IW_WriteEntry(w, entry);
-            
-            Redis_CloseWriter(w);
-            
-            entry = ForwardIndexIterator_Next(&it); 
         }
-        
-        
     }
-    ForwardIndexFree(idx);
+    *out = idx;
     return REDISMODULE_OK;
     
 error:
@@ -118,6 +126,147 @@ error:
     return REDISMODULE_ERR;
 }
 
+/* Get the write segment of an index created with WRITEBUFFER, for documents from docId on */
+static Segment *getWriteSegment(RedisSearchCtx *ctx, t_docId docId) {
+    Segment *s = Segment_Get(ctx, 1);
+    // docIds only grow, unless the db was flushed and the index was created again. The segment
+    // then has the postings of documents that are gone
+    if (docId <= s->lastDocId) {
+        Segment_Drop(ctx);
+        s = Segment_Get(ctx, 1);
+    }
+    Segment_AddDocuments(ctx, s, docId);
+    return s;
+}
+
+int AddDocument(RedisSearchCtx *ctx, Document doc, const char **errorString, int nosave) {
+    ForwardIndex *idx;
+    if (prepareDocument(ctx, doc, errorString, nosave, &idx) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+    
+    Segment *s = NULL;
+    if (ctx->spec->flags & Index_WriteBuffer) {
+        s = getWriteSegment(ctx, idx->docId);
+    }
+    
+    ForwardIndexIterator it = ForwardIndex_Iterate(idx);
+    ForwardIndexEntry *entry;
+    while ((entry = ForwardIndexIterator_Next(&it)) != NULL) {
+        LG_DEBUG("entry: %s freq %f\n", entry->term, entry->freq);
+        if (s) {
+            Segment_Add(ctx, s, entry);
+            continue;
+        }
+        IndexWriter *w = Redis_OpenWriter(ctx, entry->term);
+        
+        IW_WriteEntry(w, entry);
+        
+        Redis_CloseWriter(w);
+    }
+    ForwardIndexFree(idx);
+    
+    if (s && Segment_FlushDue(s)) {
+        Segment_Flush(ctx, s, SEGMENT_FLUSH_SLICE_MS);
+    }
+    return REDISMODULE_OK;
+}
+
+/* Order forward index entries by term, and the entries of a term by docId */
+static int cmpEntries(const void *p1, const void *p2) {
+    const ForwardIndexEntry *e1 = *(ForwardIndexEntry **)p1, *e2 = *(ForwardIndexEntry **)p2;
+    int rc = strcmp(e1->term, e2->term);
+    if (rc != 0) return rc;
+    return e1->docId < e2->docId ? -1 : (e1->docId > e2->docId ? 1 : 0);
+}
+
+/* The counters of a batch of documents added with AddDocuments */
+typedef struct {
+    // the documents indexed, and the ones that could not be
+    long long numDocs;
+    long long numFailed;
+    // the terms whose inverted indexes were written, and the postings written to them
+    long long numTerms;
+    long long numPostings;
+    // the time it took in nanoseconds, and how much of it went to writing the inverted indexes
+    double total;
+    double write;
+} AddDocumentsStats;
+
+/* Add a batch of documents. Each document is prepared like AddDocument does, and then their 
+postings are grouped by term, so the inverted index of each term is opened and closed once for 
+the whole batch, and its postings are appended in docId order. Documents that can't be added, 
+e.g. ones already in the index, are skipped and counted as failed */
+void AddDocuments(RedisSearchCtx *ctx, Document *docs, int num, int nosave, 
+                  AddDocumentsStats *stats) {
+    double start = Query_Now();
+    memset(stats, 0, sizeof(*stats));
+    
+    ForwardIndex **idxs = calloc(num, sizeof(ForwardIndex *));
+    size_t numEntries = 0;
+    t_docId firstId = 0;
+    for (int i = 0; i < num; i++) {
+        const char *msg = NULL;
+        if (prepareDocument(ctx, docs[i], &msg, nosave, &idxs[i]) == REDISMODULE_ERR) {
+            LG_DEBUG("Skipping doc %s: %s\n", RedisModule_StringPtrLen(docs[i].docKey, NULL), msg);
+            idxs[i] = NULL;
+            stats->numFailed++;
+            continue;
+        }
+        stats->numDocs++;
+        numEntries += kh_size(idxs[i]->hits);
+        if (firstId == 0) firstId = idxs[i]->docId;
+    }
+    
+    ForwardIndexEntry **entries = malloc(numEntries * sizeof(ForwardIndexEntry *));
+    size_t n = 0;
+    for (int i = 0; i < num; i++) {
+        if (idxs[i] == NULL) continue;
+        ForwardIndexIterator it = ForwardIndex_Iterate(idxs[i]);
+        ForwardIndexEntry *entry;
+        while ((entry = ForwardIndexIterator_Next(&it)) != NULL) {
+            entries[n++] = entry;
+        }
+    }
+    qsort(entries, n, sizeof(ForwardIndexEntry *), cmpEntries);
+    
+    // indexes with a write segment add the postings to it instead
+    Segment *s = NULL;
+    if ((ctx->spec->flags & Index_WriteBuffer) && n > 0) {
+        s = getWriteSegment(ctx, firstId);
+    }
+    
+    double writeStart = Query_Now();
+    for (size_t i = 0; i < n; ) {
+        size_t j = i;
+        if (s) {
+            for (; j < n && !strcmp(entries[j]->term, entries[i]->term); j++) {
+                Segment_Add(ctx, s, entries[j]);
+            }
+        } else {
+            IndexWriter *w = Redis_OpenWriter(ctx, entries[i]->term);
+            for (; j < n && !strcmp(entries[j]->term, entries[i]->term); j++) {
+                IW_WriteEntry(w, entries[j]);
+            }
+            Redis_CloseWriter(w);
+        }
+        stats->numTerms++;
+        stats->numPostings += j - i;
+        i = j;
+    }
+    if (s && Segment_FlushDue(s)) {
+        Segment_Flush(ctx, s, SEGMENT_FLUSH_SLICE_MS);
+    }
+    stats->write = Query_Now() - writeStart;
+    
+    for (int i = 0; i < num; i++) {
+        if (idxs[i]) ForwardIndexFree(idxs[i]);
+    }
+    free(entries);
+    free(idxs);
+    stats->total = Query_Now() - start;
+}
+
 /*
 ## FT.ADD <index> <docId> <score> [NOSAVE] FIELDS <field> <text> ....]
 Add a documet to the index.
@@ -224,45 +373,228 @@ cleanup:
     
 }
 
+/*
+## FT.MADD <index> [NOSAVE] [LANGUAGE lang] DOCS <docId> <score> <num> <field> <text> ... [<docId> ...]
+Add a batch of documents to the index. This is much faster than adding them one by one for bulk 
+loading, as the inverted index of each term is written once for the whole batch.
+
+## Parameters:
+
+    - index: The Fulltext index name. The index must be first created with FT.CREATE
+    
+    - NOSAVE, LANGUAGE: Like FT.ADD, for all the documents of the batch
+    
+    - DOCS: Following the DOCS specifier are the documents, each as its docId and score like in 
+    FT.ADD, followed by its number of fields and the <field> <text> pairs of the fields.
+    
+Returns an array of counters of the batch: the number of documents indexed, the number of ones 
+that could not be, e.g. because they are already in the index, the number of terms and postings 
+written, and the time it took in milliseconds. A malformed batch is an error, and adds nothing.
+*/
+int MultiAddDocumentsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    
+    // the options all come before DOCS
+    int docsIdx = RMUtil_ArgExists("docs", argv, argc, 2);
+    if (argc < 4 || docsIdx == 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+    int nosave = RMUtil_ArgExists("nosave", argv, docsIdx, 2) > 0;
+    const char *lang = NULL;
+    RMUtil_ParseArgsAfter("LANGUAGE", argv, docsIdx, "c", &lang);
+    
+    // count the documents, and check they are all there before anything is parsed
+    int num = 0;
+    for (int i = docsIdx + 1; i < argc; num++) {
+        long long numFields;
+        if (i + 3 > argc || RedisModule_StringToLongLong(argv[i + 2], &numFields) == REDISMODULE_ERR ||
+            numFields < 1 || i + 3 + 2 * numFields > argc) {
+            return RedisModule_WrongArity(ctx);
+        }
+        i += 3 + 2 * numFields;
+    }
+    
+    RedisModule_AutoMemory(ctx);
+    
+    IndexSpec sp;
+    // load the index by name
+    if (IndexSpec_Load(ctx, &sp, RedisModule_StringPtrLen(argv[1], NULL)) != REDISMODULE_OK) {        
+        RedisModule_ReplyWithError(ctx, "Index not defined or could not be loaded");
+        goto cleanup;
+    }
+    if (lang && !IsSupportedLanguage(lang, strlen(lang))) {
+        RedisModule_ReplyWithError(ctx, "Unsupported Language");
+        goto cleanup;
+    }
+    
+    RedisSearchCtx sctx = {ctx, &sp};
+    
+    Document *docs = calloc(num, sizeof(Document));
+    for (int i = docsIdx + 1, n = 0; n < num; n++) {
+        Document *doc = &docs[n];
+        double ds = 0;
+        if (RedisModule_StringToDouble(argv[i + 1], &ds) == REDISMODULE_ERR) {
+            RedisModule_ReplyWithError(ctx, "Could not parse document score");
+            goto free_docs;
+        }
+        if (ds > 1 || ds < 0) {
+            RedisModule_ReplyWithError(ctx, "Document scores must be normalized between 0.0 ... 1.0");
+            goto free_docs;
+        }
+        long long numFields;
+        RedisModule_StringToLongLong(argv[i + 2], &numFields);
+        
+        doc->docKey = argv[i];
+        doc->score = (float)ds;
+        doc->numFields = numFields;
+        doc->language = lang ? lang : DEFAULT_LANGUAGE;
+        // the fields are the name/text pairs that follow, like the ones of FT.ADD
+        doc->fields = calloc(numFields, sizeof(DocumentField));
+        for (int f = 0; f < numFields; f++) {
+            doc->fields[f].name = argv[i + 3 + 2 * f];
+            doc->fields[f].text = argv[i + 4 + 2 * f];
+        }
+        i += 3 + 2 * numFields;
+    }
+    
+    AddDocumentsStats stats;
+    AddDocuments(&sctx, docs, num, nosave, &stats);
+    
+    RedisModule_ReplyWithArray(ctx, 12);
+    RedisModule_ReplyWithSimpleString(ctx, "docs");
+    RedisModule_ReplyWithLongLong(ctx, stats.numDocs);
+    RedisModule_ReplyWithSimpleString(ctx, "failed");
+    RedisModule_ReplyWithLongLong(ctx, stats.numFailed);
+    RedisModule_ReplyWithSimpleString(ctx, "terms");
+    RedisModule_ReplyWithLongLong(ctx, stats.numTerms);
+    RedisModule_ReplyWithSimpleString(ctx, "postings");
+    RedisModule_ReplyWithLongLong(ctx, stats.numPostings);
+    RedisModule_ReplyWithSimpleString(ctx, "time ms");
+    RedisModule_ReplyWithDouble(ctx, stats.total / 1e6);
+    RedisModule_ReplyWithSimpleString(ctx, "writing time ms");
+    RedisModule_ReplyWithDouble(ctx, stats.write / 1e6);
+    
+free_docs:
+    for (int n = 0; n < num; n++) {
+        free(docs[n].fields);
+    }
+    free(docs);
+cleanup:
+    IndexSpec_Free(&sp);
+    return REDISMODULE_OK;
+}
+
 u_int32_t _getHitScore(void * ctx) {
     return ctx ? (u_int32_t)((IndexHit *)ctx)->totalFreq : 0;
 }
 
-/* 
-## FT.SEARCH <index> <query> [NOCONTENT] [LIMIT offset num] [INFIELDS num>field ...] [LANGUAGE lang] [VERBATIM]  
+// what searchCommand does with the query
+#define SEARCH_EXECUTE 0
+#define SEARCH_EXPLAIN 1
+#define SEARCH_PROFILE 2
+
+/* Reply with the profile of a query stage and its children, see FT.PROFILE */
+static void replyStageProfile(RedisModuleCtx *ctx, QueryStage *s) {
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    long n = 0;
+    
+    RedisModule_ReplyWithSimpleString(ctx, "stage");
+    switch (s->op) {
+        case Q_LOAD: 
+            RedisModule_ReplyWithSimpleString(ctx, s->value); 
+            break;
+        case Q_INTERSECT: 
+            RedisModule_ReplyWithSimpleString(ctx, "INTERSECT"); 
+            break;
+        case Q_EXACT: 
+            RedisModule_ReplyWithSimpleString(ctx, "EXACT"); 
+            break;
+        case Q_UNION: 
+            RedisModule_ReplyWithSimpleString(ctx, "UNION"); 
+            break;
+        case Q_NUMERIC: 
+            RedisModule_ReplyWithSimpleString(ctx, "NUMERIC"); 
+            break;
+    }
+    RedisModule_ReplyWithSimpleString(ctx, "estimated docs");
+    RedisModule_ReplyWithLongLong(ctx, s->numDocs == QUERYSTAGE_UNKNOWN_DOCS ? -1 : s->numDocs);
+    n += 4;
+    
+    QueryStageProfile *p = s->profile;
+    RedisModule_ReplyWithSimpleString(ctx, "opened");
+    RedisModule_ReplyWithLongLong(ctx, p != NULL && p->opened);
+    n += 2;
+    if (p != NULL && p->opened && !p->bitmap) {
+        RedisModule_ReplyWithSimpleString(ctx, "time ms");
+        RedisModule_ReplyWithDouble(ctx, p->time / 1e6);
+        RedisModule_ReplyWithSimpleString(ctx, "reads");
+        RedisModule_ReplyWithLongLong(ctx, p->numRead);
+        RedisModule_ReplyWithSimpleString(ctx, "skips");
+        RedisModule_ReplyWithLongLong(ctx, p->numSkipTo);
+        RedisModule_ReplyWithSimpleString(ctx, "batches");
+        RedisModule_ReplyWithLongLong(ctx, p->numBatches);
+        RedisModule_ReplyWithSimpleString(ctx, "hits");
+        RedisModule_ReplyWithLongLong(ctx, p->numHits);
+        n += 10;
+        if (s->op == Q_LOAD) {
+            RedisModule_ReplyWithSimpleString(ctx, "postings decoded");
+            RedisModule_ReplyWithLongLong(ctx, p->reader.decoded);
+            RedisModule_ReplyWithSimpleString(ctx, "bytes");
+            RedisModule_ReplyWithLongLong(ctx, p->reader.bytes);
+            RedisModule_ReplyWithSimpleString(ctx, "skip index hits");
+            RedisModule_ReplyWithLongLong(ctx, p->reader.skipIndexHits);
+            RedisModule_ReplyWithSimpleString(ctx, "blocks skipped");
+            RedisModule_ReplyWithLongLong(ctx, p->reader.blocksSkipped);
+            n += 8;
+        }
+    } else if (p != NULL && p->bitmap) {
+        RedisModule_ReplyWithSimpleString(ctx, "bitmap");
+        RedisModule_ReplyWithLongLong(ctx, 1);
+        n += 2;
+    }
     
-Seach the index with a textual query, returning either documents or just ids.
+    if (s->nchildren > 0) {
+        RedisModule_ReplyWithSimpleString(ctx, "children");
+        RedisModule_ReplyWithArray(ctx, s->nchildren);
+        for (int i = 0; i < s->nchildren; i++) {
+            replyStageProfile(ctx, s->children[i]);
+        }
+        n += 2;
+    }
+    RedisModule_ReplySetArrayLength(ctx, n);
+}
 
-### Parameters:
-   - index: The Fulltext index name. The index must be first created with FT.CREATE
-   
-   - query: the text query to search. If it's more than a single word, put it in quotes.
-   Basic syntax like quotes for exact matching is supported.
-   
-   - NOCONTENT: If it appears after the query, we only return the document ids and not 
-   the content. This is useful if rediseach is only an index on an external document collection
-   
-   - LIMIT fist num: If the parameters appear after the query, we limit the results to 
-   the offset and number of results given. The default is 0 10
-   
-   - INFIELDS num field1 field2 ...: If set, filter the results to ones appearing only in specific
-   fields of the document, like title or url. num is the number of specified field arguments 
-   
-   - VERBATIM: If set, we turn off stemming for the query processing. Faster but will yield less results
-   
-   - LANGUAGE lang: If set, we use a stemmer for the supplied langauge. Defaults to English. 
-   If an unsupported language is sent, the command returns an error. The supported languages are:
-  
-   > "arabic",  "danish",    "dutch",   "english",   "finnish",    "french",
-   > "german",  "hungarian", "italian", "norwegian", "portuguese", "romanian",
-   > "russian", "spanish",   "swedish", "tamil",     "turkish"
+/* Reply with the profile of a query execution, see FT.PROFILE */
+static void replyProfile(RedisModuleCtx *ctx, Query *q) {
+    QueryProfile *p = q->profile;
+    RedisModule_ReplyWithArray(ctx, 12);
+    RedisModule_ReplyWithSimpleString(ctx, "total time ms");
+    RedisModule_ReplyWithDouble(ctx, p->total / 1e6);
+    RedisModule_ReplyWithSimpleString(ctx, "iterators time ms");
+    RedisModule_ReplyWithDouble(ctx, p->iterate / 1e6);
+    RedisModule_ReplyWithSimpleString(ctx, "scoring time ms");
+    RedisModule_ReplyWithDouble(ctx, p->score / 1e6);
+    RedisModule_ReplyWithSimpleString(ctx, "heap time ms");
+    RedisModule_ReplyWithDouble(ctx, p->heap / 1e6);
+    RedisModule_ReplyWithSimpleString(ctx, "loading time ms");
+    RedisModule_ReplyWithDouble(ctx, p->load / 1e6);
+    RedisModule_ReplyWithSimpleString(ctx, "iterators");
+    replyStageProfile(ctx, q->root);
+}
 
-### Returns:
+/* Reply with the cursor of the next page of results, or a null reply if this is the last page */
+static void replyCursor(RedisModuleCtx *ctx, Query *q, QueryResult *r) {
+    if (r->numIds < q->limit) {
+        RedisModule_ReplyWithNull(ctx);
+        return;
+    }
+    char *s = QueryCursor_Format(&r->last);
+    RedisModule_ReplyWithStringBuffer(ctx, s, sdslen(s));
+    sdsfree(s);
+}
 
-    An array reply, where the first element is the total number of results, and then pairs of
-    document id, and a nested array of field/value, unless NOCONTENT was given   
-*/
-int SearchCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+/* Parse the arguments of FT.SEARCH, FT.EXPLAIN or FT.PROFILE, and explain or execute the query
+depending on mode */
+static int searchCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, int mode) {
     
     // at least one field, and number of field/text args must be even
     if (argc < 3) {
@@ -329,8 +661,35 @@ int SearchCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RMUtil_ParseArgsAfter("LANGUAGE", argv, argc, "c", &lang);
     if (lang && !IsSupportedLanguage(lang, strlen(lang))) {
         RedisModule_ReplyWithError(ctx, "Unsupported Stemmer Language");
+        if (nf) NumericFilter_Free(nf);
+        goto end;
+    }
+    
+    // Parse the SCORER argument
+    QueryScorer scorer = QUERY_SCORER_TFIDF;
+    const char *scorerName = NULL;
+    RMUtil_ParseArgsAfter("SCORER", argv, argc, "c", &scorerName);
+    if (scorerName) {
+        if (!strcasecmp(scorerName, "BM25")) {
+            scorer = QUERY_SCORER_BM25;
+        } else if (strcasecmp(scorerName, "TFIDF")) {
+            RedisModule_ReplyWithError(ctx, "Unknown scorer");
+            // the filter is only owned by the query once it is added to it
+            if (nf) NumericFilter_Free(nf);
+            goto end;
+        }
+    }
+    
+    // Parse the AFTER cursor. Paging with cursors replies with the cursor of each page
+    QueryCursor after;
+    const char *token = NULL;
+    RMUtil_ParseArgsAfter("AFTER", argv, argc, "c", &token);
+    if (token && QueryCursor_Parse(&after, token) != REDISMODULE_OK) {
+        RedisModule_ReplyWithError(ctx, "Invalid cursor");
+        if (nf) NumericFilter_Free(nf);
         goto end;
     }
+    int withCursor = token != NULL || RMUtil_ArgExists("WITHCURSOR", argv, argc, 3);
     
      // open the documents metadata table
     InitDocTable(&sctx, &dt);
@@ -338,12 +697,29 @@ int SearchCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     size_t len;
     const char *qs = RedisModule_StringPtrLen(argv[2], &len);
     Query *q = NewQuery(&sctx, (char *)qs, len, first, limit, fieldMask, verbatim, lang);
+    q->noTotal = RMUtil_ArgExists("NOTOTAL", argv, argc, 3) > 0;
+    q->scorer = scorer;
+    if (token) {
+        q->after = &after;
+    }
     Query_Tokenize(q);
     
     if (nf != NULL) {
-        QueryStage_AddChild(q->root, NewNumericStage(nf));
+        QueryStage_AddChild(q->root, NewNumericStage(q, nf));
     }
     q->docTable = &dt;
+    
+    if (mode == SEARCH_EXPLAIN) {
+        Query_Plan(q);
+        char *s = Query_Explain(q);
+        RedisModule_ReplyWithStringBuffer(ctx, s, sdslen(s));
+        sdsfree(s);
+        Query_Free(q);
+        goto end;
+    }
+    if (mode == SEARCH_PROFILE) {
+        Query_EnableProfile(q);
+    }
 
         
         
@@ -359,22 +735,35 @@ int SearchCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         goto cleanup;
     }
     
+    // the results are followed by the profile
+    if (mode == SEARCH_PROFILE) {
+        RedisModule_ReplyWithArray(ctx, 2);
+    }
+    
     // NOCONTENT mode - just return the ids
     if (nocontent) {
-        RedisModule_ReplyWithArray(ctx, r->numIds+1);
+        RedisModule_ReplyWithArray(ctx, r->numIds+1+withCursor);
         RedisModule_ReplyWithLongLong(ctx, (long long)r->totalResults);
         for (int i = 0; i < r->numIds; i++) {
             RedisModule_ReplyWithString(ctx, r->ids[i]);
         }
+        if (withCursor) {
+            replyCursor(ctx, q, r);
+        }
         
         goto cleanup;   
     }
     
     // With content mode - return and load the documents
     int ndocs;
+    double loadStart = Query_Now();
     Document *docs = Redis_LoadDocuments(&sctx, r->ids, r->numIds, &ndocs);
+    if (q->profile) {
+        q->profile->load = Query_Now() - loadStart;
+        q->profile->total += q->profile->load;
+    }
     // format response
-    RedisModule_ReplyWithArray(ctx, 2*ndocs+1);
+    RedisModule_ReplyWithArray(ctx, 2*ndocs+1+withCursor);
     RedisModule_ReplyWithLongLong(ctx, (long long)r->totalResults);
     
     
@@ -390,11 +779,16 @@ int SearchCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         
         Document_Free(doc);
     }
-    
+    if (withCursor) {
+        replyCursor(ctx, q, r);
+    }
     
     free(docs);
 
 cleanup:    
+    if (mode == SEARCH_PROFILE && r->errorString == NULL) {
+        replyProfile(ctx, q);
+    }
     QueryResult_Free(r);
     Query_Free(q);
 end:    
@@ -403,7 +797,94 @@ end:
 }
 
 /* 
-## FT.CREATE <index> <field> <weight>, ...
+## FT.SEARCH <index> <query> [NOCONTENT] [LIMIT offset num] [INFIELDS num>field ...] [LANGUAGE lang] [VERBATIM] [NOTOTAL] [SCORER {TFIDF|BM25}] [WITHCURSOR] [AFTER cursor]
+    
+Seach the index with a textual query, returning either documents or just ids.
+
+### Parameters:
+   - index: The Fulltext index name. The index must be first created with FT.CREATE
+   
+   - query: the text query to search. If it's more than a single word, put it in quotes.
+   Basic syntax like quotes for exact matching is supported.
+   
+   - NOCONTENT: If it appears after the query, we only return the document ids and not 
+   the content. This is useful if rediseach is only an index on an external document collection
+   
+   - LIMIT fist num: If the parameters appear after the query, we limit the results to 
+   the offset and number of results given. The default is 0 10
+   
+   - INFIELDS num field1 field2 ...: If set, filter the results to ones appearing only in specific
+   fields of the document, like title or url. num is the number of specified field arguments 
+   
+   - VERBATIM: If set, we turn off stemming for the query processing. Faster but will yield less results
+   
+   - NOTOTAL: If set, we don't count all the results, which lets us skip blocks of the inverted 
+   indexes that can't make it into the results we return. The total returned is then a lower bound
+   
+   - SCORER: How results are scored. TFIDF (the default) scores the term frequencies by the 
+   rarity of the terms. BM25 also saturates the term frequencies, and favors shorter documents
+   
+   - WITHCURSOR: If set, the reply ends with a cursor of the next page of results
+   
+   - AFTER cursor: If set, return the page of results that follows the cursor of the previous 
+   page, instead of the one at the offset of LIMIT. Only the results of the page are kept while
+   searching, so deep pages cost as much as the first one. Implies WITHCURSOR. Pass the other 
+   arguments of the first page as they were, or the cursor can point anywhere
+   
+   - LANGUAGE lang: If set, we use a stemmer for the supplied langauge. Defaults to English. 
+   If an unsupported language is sent, the command returns an error. The supported languages are:
+  
+   > "arabic",  "danish",    "dutch",   "english",   "finnish",    "french",
+   > "german",  "hungarian", "italian", "norwegian", "portuguese", "romanian",
+   > "russian", "spanish",   "swedish", "tamil",     "turkish"
+
+### Returns:
+
+    An array reply, where the first element is the total number of results, and then pairs of
+    document id, and a nested array of field/value, unless NOCONTENT was given. With WITHCURSOR
+    or AFTER, the last element is the cursor to pass to AFTER for the next page, or null if 
+    there are no more results   
+*/
+int SearchCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return searchCommand(ctx, argv, argc, SEARCH_EXECUTE);
+}
+
+/* 
+## FT.EXPLAIN <index> <query> [INFIELDS num field ...] [FILTER ...] [LANGUAGE lang] [VERBATIM]
+
+Plan a query without executing it, and return the plan. Takes the same arguments as FT.SEARCH. 
+
+### Returns:
+
+    A string with the planned tree of query stages, one per line, each with the number of 
+    documents it is estimated to match. Numeric filters also say whether they load their range 
+    or probe it for each candidate document.
+*/
+int ExplainCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return searchCommand(ctx, argv, argc, SEARCH_EXPLAIN);
+}
+
+/* 
+## FT.PROFILE <index> <query> [...]
+
+Execute a search like FT.SEARCH does with the same arguments, and profile its execution.
+
+### Returns:
+
+    An array of two elements: the reply FT.SEARCH would give, and the profile. The profile has the 
+    total time of the query, and the time spent in the iterators, in scoring hits, in keeping the 
+    top results and in loading their documents. It is followed by the tree of query stages, with
+    the calls to the iterator of each stage, the hits it returned and the time spent in it and 
+    its children. Terms also have the number of postings decoded, the bytes of their index read, 
+    and the skip index entries and blocks used to skip ahead. Stages that were not opened, like 
+    the other terms of an intersection with a term that is not in the index, have no counters.
+*/
+int ProfileCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return searchCommand(ctx, argv, argc, SEARCH_PROFILE);
+}
+
+/* 
+## FT.CREATE <index> [BLOCKS] [SPLITOFFSETS] [PFOR] [NOOFFSETS] [NOFIELDS] [NOFREQS] <field> <weight>, ...
 
 Creates an index with the given spec. The index name will be used in all the key names
 so keep it short!
@@ -412,6 +893,22 @@ so keep it short!
 
     - index: the index name to create. If it exists the old spec will be overwritten
     
+    - BLOCKS: If set, inverted indexes are encoded in blocks with inline skip headers, instead of 
+    keeping a separate skip index key per term. This makes intersections cheaper.
+    
+    - SPLITOFFSETS: Implies BLOCKS. The term offsets of each inverted index are kept in a separate
+    key, so queries that don't need offsets only scan the document ids and frequencies.
+    
+    - PFOR: Implies BLOCKS. The document ids of full blocks are bit packed with PForDelta instead of
+    Stream VByte, which is usually smaller. The codec is recorded in each index.
+    
+    - NOOFFSETS: Do not store term offsets in the index. This saves a lot of memory, but exact
+    phrases match their words anywhere in the document, and results are not ranked by proximity.
+    
+    - NOFIELDS: Do not store the fields each term appeared in. INFIELDS has no effect on such indexes.
+    
+    - NOFREQS: Do not store term frequencies. Results are scored by the rarity of their terms alone.
+    
     - field / weight pairs: pairs of field name and relative weight in scoring. 
     The weight is a double, but does not need to be normalized.
 
@@ -422,8 +919,8 @@ so keep it short!
 int CreateIndexCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     
   
-    // at least one field, and number of field/text args must be even
-    if (argc < 4 || argc % 2==1) {
+    // at least one field. the number of field/weight args is checked by the spec parser
+    if (argc < 4) {
         return RedisModule_WrongArity(ctx);
     }
     RedisModule_AutoMemory(ctx);
@@ -436,6 +933,21 @@ int CreateIndexCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     
     size_t len;
     sp.name = RedisModule_StringPtrLen(argv[1], &len);
+    
+    // the postings in the write segment of an index created before are flushed with the spec 
+    // they were written with. If there's no such index, a segment left is from a flushed db
+    IndexSpec old;
+    RedisSearchCtx sctx = {ctx, &old};
+    if (IndexSpec_Load(ctx, &old, sp.name) == REDISMODULE_OK) {
+        Segment *s = Segment_Get(&sctx, 0);
+        if (s) Segment_Flush(&sctx, s, 0);
+        IndexSpec_Free(&old);
+    } else {
+        sctx.spec = &sp;
+        Segment_Drop(&sctx);
+    }
+    // the stopwords loaded with the old spec may not be the new ones
+    IndexSpec_Forget(ctx, sp.name);
    
     if (IndexSpec_Save(ctx, &sp) == REDISMODULE_ERR) {
         RedisModule_ReplyWithError(ctx, "Could not save index spec");
@@ -452,6 +964,8 @@ int CreateIndexCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 /* FT.OPTIMIZE <index>
 *  After the index is built (and doesn't need to be updated again withuot a complete rebuild)
 *  we can optimize memory consumption by trimming all index buffers to their actual size.
+*  Very frequent terms also get a bitmap of their documents, used by queries that don't need 
+*  term offsets. Adding documents to a term makes its bitmap stale until the next optimize.
 *
 *  Warning 1: This will delete score indexes for small words (n < 5000), so updating the index after
 *  optimizing it might lead to screwed up results (TODO: rebuild score indexes if needed).
@@ -475,12 +989,17 @@ int OptimizeIndexCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
     }
     
     RedisSearchCtx sctx = {ctx, &sp};
+    // optimize everything, including what's in the write segment
+    Segment *s = Segment_Get(&sctx, 0);
+    if (s) Segment_Flush(&sctx, s, 0);
+    
     RedisModuleString *pf = fmtRedisTermKey(&sctx, "*");
     size_t len;
     const char *prefix = RedisModule_StringPtrLen(pf, &len);
     
     //RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
     int num = Redis_ScanKeys(ctx, prefix, Redis_OptimizeScanHandler, &sctx);
+    IndexSpec_Free(&sp);
     return RedisModule_ReplyWithLongLong(ctx, num);
     
 }
@@ -510,10 +1029,41 @@ int DropIndexCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisSearchCtx sctx = {ctx, &sp};
     
     Redis_DropIndex(&sctx, 1);
+    Segment_Drop(&sctx);
+    IndexSpec_Forget(ctx, sp.name);
+    IndexSpec_Free(&sp);
     return RedisModule_ReplyWithSimpleString(ctx, "OK");
     
 }
 
+/*
+* FT.FLUSH <index>
+* Append all the postings in the write segment of an index created with WRITEBUFFER to the 
+* inverted indexes of their terms. Writes to the index flush the segment a few milliseconds at a
+* time once it is due, and this flushes all of it at once, e.g. before saving or shutting down.
+* Returns the number of postings flushed.
+*/
+int FlushIndexCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+    
+    RedisModule_AutoMemory(ctx);
+    
+    IndexSpec sp;
+    // load the index by name
+    if (IndexSpec_Load(ctx, &sp, RedisModule_StringPtrLen(argv[1], NULL)) != REDISMODULE_OK) {
+        RedisModule_ReplyWithError(ctx, "Index not defined or could not be loaded");
+        return REDISMODULE_OK;
+    }
+    
+    RedisSearchCtx sctx = {ctx, &sp};
+    Segment *s = Segment_Get(&sctx, 0);
+    long long n = s ? Segment_Flush(&sctx, s, 0) : 0;
+    IndexSpec_Free(&sp);
+    return RedisModule_ReplyWithLongLong(ctx, n);
+}
+
 int RedisModule_OnLoad(RedisModuleCtx *ctx) {
     
   //  LOGGING_INIT(0xFFFFFFFF);
@@ -525,6 +1075,16 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx) {
         == REDISMODULE_ERR)
         return REDISMODULE_ERR;
         
+    if (RedisModule_CreateCommand(ctx,"ft.madd",
+        MultiAddDocumentsCommand, "write deny-oom no-cluster", 1,1,1)
+        == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+        
+    if (RedisModule_CreateCommand(ctx,"ft.flush",
+        FlushIndexCommand, "write no-cluster", 1,1,1)
+        == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+        
     if (RedisModule_CreateCommand(ctx,"ft.search", 
         SearchCommand,
         "readonly deny-oom no-cluster", 1,1,1)
@@ -532,6 +1092,18 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx) {
         return REDISMODULE_ERR;
    
    
+    if (RedisModule_CreateCommand(ctx,"ft.explain", 
+        ExplainCommand,
+        "readonly deny-oom no-cluster", 1,1,1)
+         == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+        
+    if (RedisModule_CreateCommand(ctx,"ft.profile", 
+        ProfileCommand,
+        "readonly deny-oom no-cluster", 1,1,1)
+         == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+   
    if (RedisModule_CreateCommand(ctx,"ft.create",
         CreateIndexCommand, "write no-cluster", 1,1,1)
         == REDISMODULE_ERR)
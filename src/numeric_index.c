@@ -68,12 +68,32 @@ int NumerIndex_Add(NumericIndex *idx, t_docId docId, double score) {
      
      Vector_Get(f->docIds, f->docIdsOffset++, &e->docId);
      e->flags = 0xFF;
-     e->numOffsetVecs = 0;
+     e->numOffsets = 0;
      e->totalFreq = 0;
      e->type = H_RAW;
      
      return INDEXREAD_EOF;
 }
+// Read a batch of docIds from a loaded range. 
+// Unloaded ranges can only be checked one docId at a time, so they have nothing to read
+int NumericFilter_ReadBatch(void *ctx, IndexHitBatch *b) {
+    NumericFilter *f = ctx;
+    b->num = 0;
+    if (f->idx->key == NULL || !f->isRangeLoaded) {
+        return 0;
+    }
+    
+    while (b->num < INDEX_BATCH_SIZE && NumericFilter_HasNext(f)) {
+        Vector_Get(f->docIds, f->docIdsOffset++, &f->lastDocid);
+        b->docIds[b->num] = f->lastDocid;
+        b->totalFreq[b->num] = 0;
+        b->flags[b->num] = 0xFF;
+        b->minDist[b->num] = 1;
+        b->num++;
+    }
+    return b->num;
+}
+
 // Skip to a docid, potentially reading the entry into hit, if the docId matches
 //
 // In this case we don't actually skip to a docId, just check whether it is within our range
@@ -96,7 +116,7 @@ int NumericFilter_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit) {
                 
                 hit->docId = docId;
                 hit->flags = 0xFF;
-                hit->numOffsetVecs = 0;
+                hit->numOffsets = 0;
                 hit->totalFreq = 0;
                 hit->type = H_RAW;
                 return INDEXREAD_OK;
@@ -114,7 +134,7 @@ int NumericFilter_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit) {
     
     if (f->lastDocid == docId) {
         hit->flags = 0xFF;
-        hit->numOffsetVecs = 0;
+        hit->numOffsets = 0;
         hit->totalFreq = 0;
         hit->docId = f->lastDocid;
         return INDEXREAD_OK;
@@ -125,6 +145,22 @@ int NumericFilter_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit) {
         
 }
 
+// filter hits add nothing to the score
+double NumericFilter_MaxScore(void *ctx) {
+    return 0;
+}
+
+// a loaded range has its docIds. An unloaded one can only be probed with SkipTo, so it should
+// never lead an intersection
+size_t NumericFilter_Len(void *ctx) {
+    NumericFilter *f = ctx;
+    return f->isRangeLoaded ? Vector_Size(f->docIds) : __SIZE_MAX__;
+}
+
+size_t NumericFilter_IndexSize(NumericFilter *f) {
+    return f->idx->key ? RedisModule_ValueLength(f->idx->key) : 0;
+}
+
 // the last docId read
 t_docId NumericFilter_LastDocId(void *ctx) {
     NumericFilter *f = ctx;
@@ -140,14 +176,17 @@ inline int NumericFilter_HasNext(void *ctx) {
     return f->docIdsOffset < Vector_Size(f->docIds);
     
 }
-// release the iterator's context and free everything needed
-void NumericFilter_Free(struct indexIterator *self) {
-    NumericFilter *f = self->ctx;
+void NumericFilter_Free(NumericFilter *f) {
     free(f->idx);
     if (f->docIds) {
         Vector_Free(f->docIds);
     }
     free(f);
+}
+
+// release the iterator's context and free everything needed
+void NumericFilterIterator_Free(struct indexIterator *self) {
+    NumericFilter_Free(self->ctx);
     free(self);
 }
 
@@ -162,6 +201,8 @@ NumericFilter *NewNumericFilter(RedisSearchCtx *ctx, FieldSpec *fs, double min,
     f->inclusiveMax = inclusiveMax;
     f->inclusiveMin = inclusiveMin;
     f->lastDocid = 0;
+    f->docIds = NULL;
+    f->loadLimit = NUMERICFILTER_LOAD_THRESHOLD;
     return f;
 }
 
@@ -183,11 +224,11 @@ int _numericFilter_LoadRange(NumericFilter *f) {
                                       f->maxInf ? REDISMODULE_POSITIVE_INFINITE : f->max,
                                       !f->inclusiveMin, !f->inclusiveMax); 
     
-    int n =0;
+    size_t n = 0;
     while(!RedisModule_ZsetRangeEndReached(key)) {
         // abort loading the index if it's over a certain threshold which makes it too expensive
         // to load
-        if (++n > NUMERICFILTER_LOAD_THRESHOLD) {
+        if (++n > f->loadLimit) {
             RedisModule_ZsetRangeStop(key);
             Vector_Free(f->docIds);
             f->docIds = NULL;
@@ -218,11 +259,15 @@ IndexIterator *NewNumericFilterIterator(NumericFilter *f) {
     _numericFilter_LoadRange(f);
     IndexIterator *ret = malloc(sizeof(IndexIterator));
     ret->ctx = f;
-    ret->Free = NumericFilter_Free;
+    ret->Free = NumericFilterIterator_Free;
     ret->HasNext = NumericFilter_HasNext;
     ret->LastDocId = NumericFilter_LastDocId;
     ret->Read = NumericFilter_Read;
     ret->SkipTo = NumericFilter_SkipTo;
+    ret->ReadBatch = NumericFilter_ReadBatch;
+    ret->MaxScore = NumericFilter_MaxScore;
+    ret->SetMinScore = NULL;
+    ret->Len = NumericFilter_Len;
     return ret;
 }
 
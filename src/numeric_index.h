@@ -28,9 +28,14 @@ typedef struct {
     
     // tells us which strategy was used - loading the range or filtering one by one
     int isRangeLoaded;    
+    // ranges with more docIds than this are filtered one by one and not loaded
+    size_t loadLimit;
 } NumericFilter;
 
+// the load limit of filters the query planner knows nothing about
 #define NUMERICFILTER_LOAD_THRESHOLD 500
+// checking a single docId against the range costs about as much as loading this many docIds of it
+#define NUMERICFILTER_PROBE_COST 4
 
 NumericIndex *NewNumericIndex(RedisSearchCtx *ctx, FieldSpec *sp);
 
@@ -40,11 +45,18 @@ int NumerIndex_Add(NumericIndex *idx, t_docId docId, double score);
 
 int NumericFilter_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit);
 int NumericFilter_Read(void *ctx, IndexHit *e);
+int NumericFilter_ReadBatch(void *ctx, IndexHitBatch *b);
 int NumericFilter_HasNext(void *ctx);
 t_docId NumericFilter_LastDocId(void *ctx);
+double NumericFilter_MaxScore(void *ctx);
+size_t NumericFilter_Len(void *ctx);
+/* The number of documents in the filter's numeric index, which bounds the size of its range */
+size_t NumericFilter_IndexSize(NumericFilter *f);
 
 
 NumericFilter *NewNumericFilter(RedisSearchCtx *ctx, FieldSpec *fs, double min, double max, int inclusiveMin, int inclusiveMax);
+/* Free a filter that was never turned into an iterator. Iterators free their filter themselves */
+void NumericFilter_Free(NumericFilter *f);
 
 IndexIterator *NewNumericFilterIterator(NumericFilter *f);
 
@@ -0,0 +1,226 @@
+#include "pfor.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PFOR_X86
+#include <immintrin.h>
+#endif
+
+static int pfor_initialized = 0;
+static PForKernel pfor_best = PFOR_Scalar;
+static PForKernel pfor_kernel = PFOR_Scalar;
+
+static void pfor_init() {
+#ifdef PFOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        pfor_best = PFOR_AVX2;
+    }
+#endif
+    pfor_kernel = pfor_best;
+    pfor_initialized = 1;
+}
+
+PForKernel PFOR_GetKernel() {
+    if (!pfor_initialized) pfor_init();
+    return pfor_kernel;
+}
+
+PForKernel PFOR_SetKernel(PForKernel k) {
+    if (!pfor_initialized) pfor_init();
+    pfor_kernel = k > pfor_best ? pfor_best : k;
+    return pfor_kernel;
+}
+
+/* The number of bits needed to hold v */
+static inline int pfor_bits(u_int32_t v) {
+    return v ? 32 - __builtin_clz(v) : 0;
+}
+
+static inline u_int32_t pfor_mask(int b) {
+    return b >= 32 ? 0xffffffff : (1U << b) - 1;
+}
+
+/* Pack the b bits of each integer starting at bit shift into out, as a little endian bit stream.
+Returns the number of bytes written */
+static size_t pfor_pack(const u_int32_t *in, u_int32_t n, int b, int shift, u_char *out) {
+    u_int64_t acc = 0;
+    int nbits = 0;
+    u_char *p = out;
+    u_int32_t mask = pfor_mask(b);
+    for (u_int32_t i = 0; i < n; i++) {
+        acc |= (u_int64_t)((in[i] >> shift) & mask) << nbits;
+        nbits += b;
+        while (nbits >= 8) {
+            *p++ = acc;
+            acc >>= 8;
+            nbits -= 8;
+        }
+    }
+    if (nbits > 0) {
+        *p++ = acc;
+    }
+    return p - out;
+}
+
+/* Unpack n integers of b bits each, reading no further than end. Each integer is read with a
+single unaligned 64 bit load, so only the last few need a slower byte by byte read */
+static void pfor_unpackScalar(const u_char *in, const u_char *end, u_int32_t from, u_int32_t n,
+                              int b, u_int32_t *out) {
+    u_int32_t mask = pfor_mask(b);
+    size_t avail = end - in;
+    u_int32_t i = from;
+    for (; i < n; i++) {
+        size_t bit = (size_t)i * b;
+        if ((bit >> 3) + 8 > avail) {
+            break;
+        }
+        u_int64_t w;
+        memcpy(&w, in + (bit >> 3), 8);
+        out[i] = (w >> (bit & 7)) & mask;
+    }
+    for (; i < n; i++) {
+        size_t bit = (size_t)i * b;
+        u_int64_t w = 0;
+        for (size_t j = 0; j < 8 && (bit >> 3) + j < avail; j++) {
+            w |= (u_int64_t)in[(bit >> 3) + j] << (8 * j);
+        }
+        out[i] = (w >> (bit & 7)) & mask;
+    }
+}
+
+#ifdef PFOR_X86
+/* Unpack 8 integers at a time, gathering the 32 bit words that hold them and shifting each by its
+own offset. A word holds a whole integer only if b + 7 <= 32, wider integers are left to the
+scalar kernel. Returns the number of integers unpacked */
+__attribute__((target("avx2")))
+static u_int32_t pfor_unpackAVX2(const u_char *in, const u_char *end, u_int32_t n, int b,
+                                 u_int32_t *out) {
+    if (b > 25) {
+        return 0;
+    }
+    size_t avail = end - in;
+    const __m256i step = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                            _mm256_set1_epi32(b));
+    const __m256i mask = _mm256_set1_epi32(pfor_mask(b));
+    const __m256i seven = _mm256_set1_epi32(7);
+    u_int32_t i = 0;
+    // the last integer of each group must have a whole word to gather
+    for (; i + 8 <= n && (((size_t)(i + 7) * b) >> 3) + 4 <= avail; i += 8) {
+        __m256i bits = _mm256_add_epi32(_mm256_set1_epi32(i * b), step);
+        __m256i words = _mm256_i32gather_epi32((const int *)in, _mm256_srli_epi32(bits, 3), 1);
+        __m256i v = _mm256_srlv_epi32(words, _mm256_and_si256(bits, seven));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_and_si256(v, mask));
+    }
+    return i;
+}
+#endif
+
+static void pfor_unpack(const u_char *in, const u_char *end, u_int32_t n, int b, u_int32_t *out) {
+    u_int32_t i = 0;
+#ifdef PFOR_X86
+    if (pfor_kernel == PFOR_AVX2) {
+        i = pfor_unpackAVX2(in, end, n, b, out);
+    }
+#endif
+    pfor_unpackScalar(in, end, i, n, b, out);
+}
+
+size_t PFOR_Encode(const u_int32_t *in, u_int32_t n, u_char *out) {
+    // count the integers of each bit width
+    u_int32_t hist[33] = {0};
+    int maxb = 0;
+    for (u_int32_t i = 0; i < n; i++) {
+        int bits = pfor_bits(in[i]);
+        hist[bits]++;
+        if (bits > maxb) maxb = bits;
+    }
+
+    // find the width that makes for the smallest block, counting the exceptions of each
+    int b = maxb;
+    size_t best = ((size_t)n * maxb + 7) / 8;
+    u_int32_t exceptions = 0;
+    for (int w = maxb - 1; w >= 0; w--) {
+        exceptions += hist[w + 1];
+        if (exceptions > 255) break;
+        size_t sz = ((size_t)n * w + 7) / 8 + exceptions + (exceptions * (maxb - w) + 7) / 8;
+        if (sz < best) {
+            best = sz;
+            b = w;
+        }
+    }
+
+    u_char *p = out;
+    u_char pos[PFOR_MAX_BLOCK];
+    u_int32_t high[PFOR_MAX_BLOCK];
+    u_int32_t e = 0;
+    for (u_int32_t i = 0; i < n && b < 32; i++) {
+        if (in[i] >> b) {
+            pos[e] = i;
+            high[e++] = in[i];
+        }
+    }
+    *p++ = b;
+    *p++ = e;
+    *p++ = e ? maxb - b : 0;
+    p += pfor_pack(in, n, b, 0, p);
+    memcpy(p, pos, e);
+    p += e;
+    if (e) {
+        p += pfor_pack(high, e, maxb - b, b, p);
+    }
+    return p - out;
+}
+
+size_t PFOR_EncodeDelta(const u_int32_t *in, u_int32_t n, u_int32_t prev, u_char *out) {
+    u_int32_t deltas[PFOR_MAX_BLOCK];
+    for (u_int32_t i = 0; i < n; i++) {
+        deltas[i] = in[i] - prev;
+        prev = in[i];
+    }
+    return PFOR_Encode(deltas, n, out);
+}
+
+size_t PFOR_Decode(const u_char *in, const u_char *end, u_int32_t n, u_int32_t *out) {
+    if (!pfor_initialized) pfor_init();
+
+    if (end < in || end - in < 3 || n > PFOR_MAX_BLOCK) {
+        return 0;
+    }
+    int b = in[0], e = in[1], hb = in[2];
+    if (b > 32 || hb > 32 || (e && b + hb > 32)) {
+        return 0;
+    }
+    const u_char *p = in + 3;
+    size_t packed = ((size_t)n * b + 7) / 8;
+    size_t highPacked = ((size_t)e * hb + 7) / 8;
+    if ((size_t)(end - p) < packed + e + highPacked) {
+        return 0;
+    }
+
+    pfor_unpack(p, end, n, b, out);
+    p += packed;
+
+    // patch the exceptions' high bits in
+    const u_char *pos = p;
+    p += e;
+    u_int32_t high[PFOR_MAX_BLOCK];
+    pfor_unpackScalar(p, end, 0, e, hb, high);
+    for (int j = 0; j < e; j++) {
+        if (pos[j] < n) {
+            out[pos[j]] |= high[j] << b;
+        }
+    }
+    return p + highPacked - in;
+}
+
+size_t PFOR_DecodeDelta(const u_char *in, const u_char *end, u_int32_t n, u_int32_t prev,
+                        u_int32_t *out) {
+    size_t sz = PFOR_Decode(in, end, n, out);
+    if (sz) {
+        for (u_int32_t i = 0; i < n; i++) {
+            out[i] = prev += out[i];
+        }
+    }
+    return sz;
+}
@@ -0,0 +1,57 @@
+#ifndef __PFOR_H__
+#define __PFOR_H__
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Patched frame of reference (PForDelta) encoding of small blocks of 32 bit integers.
+All the integers of a block are bit packed with the same width b, chosen to minimize the size of
+the block. The few integers that do not fit in b bits are exceptions: their low b bits are packed
+with the rest, and their positions and high bits are written after the packed integers, to be
+patched in after unpacking.
+
+A block is encoded as:
+
+    b | number of exceptions | exceptions' high bits width | packed integers |
+    exception positions | packed exceptions' high bits
+
+Unpacking has no branches per integer. With AVX2 we unpack 8 integers at a time by gathering the
+32 bit words holding them and shifting each one by its own bit offset */
+
+// The maximal number of integers in a block, since exception positions are kept in a byte
+#define PFOR_MAX_BLOCK 256
+
+/* The maximal encoded size of a block of n integers */
+#define PFOR_MAX_SIZE(n) (3 + (n) * 4 + (n) + (n) * 4)
+
+/* Encode a block of n integers into out, which should have room for at least PFOR_MAX_SIZE(n)
+bytes. Returns the number of bytes written */
+size_t PFOR_Encode(const u_int32_t *in, u_int32_t n, u_char *out);
+
+/* Encode a block of n ascending integers as the deltas between them, with the first delta taken
+from prev. Returns the number of bytes written */
+size_t PFOR_EncodeDelta(const u_int32_t *in, u_int32_t n, u_int32_t prev, u_char *out);
+
+/* Decode a block of n integers from in, reading no further than end. Returns the number of bytes
+read, or 0 if the input is truncated */
+size_t PFOR_Decode(const u_char *in, const u_char *end, u_int32_t n, u_int32_t *out);
+
+/* Decode a block of n integers encoded with PFOR_EncodeDelta, adding them up starting from prev.
+Returns the number of bytes read, or 0 if the input is truncated */
+size_t PFOR_DecodeDelta(const u_char *in, const u_char *end, u_int32_t n, u_int32_t prev,
+                        u_int32_t *out);
+
+/* The unpacking kernels available on this machine, the best one is used by PFOR_Decode */
+typedef enum {
+    PFOR_Scalar,
+    PFOR_AVX2,
+} PForKernel;
+
+/* Get the kernel PFOR_Decode dispatches to */
+PForKernel PFOR_GetKernel();
+
+/* Force unpacking with a given kernel, or with the best available one if it is not supported
+by the CPU. Returns the kernel actually selected. This is used for testing and benchmarking */
+PForKernel PFOR_SetKernel(PForKernel k);
+
+#endif
@@ -47,6 +47,338 @@ class SearchTestCase(ModuleTestCase('../module.so')):
             self.assertEqual(res[1], "doc2")
             self.assertEqual(res[2], "doc1") 
             
+    def testBlockEncoding(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'blocks', 'title', 10.0, 'body', 1.0))
+            for i in xrange(300):
+                self.assertOk(r.execute_command('ft.add', 'idx', 'doc%d' % i, 1.0, 'fields',
+                                     'title', 'hello world' if i % 3 == 0 else 'hello kitty',
+                                     'body', 'lorem ipsum'))
+            
+            # block encoded indexes keep their skip entries inline 
+            self.assertExists(r, 'ft:idx/hello')
+            self.assertFalse(r.exists('si:idx/hello'))
+            
+            res = r.execute_command('ft.search', 'idx', 'hello world', 'verbatim', 'nocontent')
+            self.assertEqual(100, res[0])
+            res = r.execute_command('ft.search', 'idx', '"hello kitty"', 'verbatim', 'nocontent')
+            self.assertEqual(200, res[0])
+
+    def testNoTotal(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'blocks', 'title', 10.0, 'body', 1.0))
+            for i in xrange(1000):
+                # only a few documents have the words in their title and score high
+                self.assertOk(r.execute_command('ft.add', 'idx', 'doc%d' % i, 1.0, 'fields',
+                                     'title' if i % 100 == 0 else 'body', 'hello world'))
+
+            for q in ('hello', 'hello world', '"hello world"'):
+                res = r.execute_command('ft.search', 'idx', q, 'verbatim', 'nocontent')
+                self.assertEqual(1000, res[0])
+                # skipping the blocks that can't score high enough returns the same results
+                pruned = r.execute_command('ft.search', 'idx', q, 'verbatim', 'nocontent', 'nototal')
+                self.assertEqual(res[1:], pruned[1:])
+                self.assertTrue(10 <= pruned[0] <= 1000)
+
+    def testExplainProfile(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'title', 10.0, 'body', 1.0))
+            for i in xrange(100):
+                self.assertOk(r.execute_command('ft.add', 'idx', 'doc%d' % i, 1.0, 'fields',
+                                     'title', 'hello world' if i % 2 else 'hello'))
+
+            plan = r.execute_command('ft.explain', 'idx', 'hello world hello', 'verbatim')
+            self.assertEqual(['INTERSECT (50 docs) {', '  hello (100 docs)', '  world (50 docs)', '}'],
+                             plan.splitlines())
+            
+            res = r.execute_command('ft.search', 'idx', 'hello world', 'verbatim', 'nocontent')
+            profiled = r.execute_command('ft.profile', 'idx', 'hello world', 'verbatim', 'nocontent')
+            self.assertEqual(2, len(profiled))
+            self.assertEqual(res, profiled[0])
+            
+            prof = dict(zip(profiled[1][::2], profiled[1][1::2]))
+            root = dict(zip(prof['iterators'][::2], prof['iterators'][1::2]))
+            self.assertEqual('INTERSECT', root['stage'])
+            self.assertEqual(50, root['hits'])
+            for child in root['children']:
+                child = dict(zip(child[::2], child[1::2]))
+                self.assertEqual(1, child['opened'])
+                self.assertTrue(child['postings decoded'] >= 50)
+            
+            # the other terms of an intersection with a missing term are never opened
+            profiled = r.execute_command('ft.profile', 'idx', 'hello nosuchterm', 'verbatim')
+            self.assertEqual(0, profiled[0][0])
+            root = profiled[1][-1]
+            for child in root[root.index('children') + 1]:
+                self.assertEqual(0, child[child.index('opened') + 1])
+
+    def testBM25Scorer(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'title', 10.0, 'body', 1.0))
+            # hello is the most frequent word of both documents, but one is much longer
+            self.assertOk(r.execute_command('ft.add', 'idx', 'long', 1.0, 'fields',
+                                            'body', 'hello ' + ' '.join('word%d' % i for i in xrange(100))))
+            self.assertOk(r.execute_command('ft.add', 'idx', 'short', 1.0, 'fields',
+                                            'body', 'hello world'))
+
+            res = r.execute_command('ft.search', 'idx', 'hello', 'nocontent', 'scorer', 'bm25')
+            self.assertEqual([2L, 'short', 'long'], res)
+            res = r.execute_command('ft.search', 'idx', 'hello', 'nocontent', 'scorer', 'tfidf')
+            self.assertEqual(2, res[0])
+            with self.assertRaises(redis.ResponseError):
+                r.execute_command('ft.search', 'idx', 'hello', 'scorer', 'nosuchscorer')
+
+    def testStopwords(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'stopwords', 2, 'Foo', 'bar', 
+                                            'title', 1.0))
+            self.assertOk(r.execute_command('ft.add', 'idx', 'doc1', 1.0, 'fields',
+                                            'title', 'foo the hello BAR'))
+
+            # the index's own stopwords replace the default ones
+            self.assertExists(r, 'ft:idx/the')
+            self.assertFalse(r.exists('ft:idx/foo'))
+            self.assertFalse(r.exists('ft:idx/bar'))
+            self.assertEqual(1, r.execute_command('ft.search', 'idx', 'the hello', 'nocontent')[0])
+
+            # the list is kept between commands, until the index is created again or dropped
+            self.assertOk(r.execute_command('ft.create', 'idx', 'stopwords', 2, 'foo', 'hello',
+                                            'title', 1.0))
+            self.assertOk(r.execute_command('ft.add', 'idx', 'doc2', 1.0, 'fields',
+                                            'title', 'hello bar'))
+            self.assertExists(r, 'ft:idx/bar')
+            self.assertOk(r.execute_command('ft.drop', 'idx'))
+            self.assertOk(r.execute_command('ft.create', 'idx', 'title', 1.0))
+            self.assertOk(r.execute_command('ft.add', 'idx', 'doc3', 1.0, 'fields',
+                                            'title', 'the foo'))
+            self.assertExists(r, 'ft:idx/foo')
+            self.assertFalse(r.exists('ft:idx/the'))
+
+            # an empty list indexes every word
+            self.assertOk(r.execute_command('ft.create', 'idx2', 'stopwords', 0, 'title', 1.0))
+            self.assertOk(r.execute_command('ft.add', 'idx2', 'doc2', 1.0, 'fields',
+                                            'title', 'to be or not to be'))
+            self.assertExists(r, 'ft:idx2/be')
+
+            with self.assertRaises(redis.ResponseError):
+                r.execute_command('ft.create', 'idx3', 'stopwords', 3, 'foo', 'title', 1.0)
+            with self.assertRaises(redis.ResponseError):
+                r.execute_command('ft.create', 'idx3', 'stopwords', '', 'title', 1.0)
+
+            # fields named like options follow SCHEMA, and are loaded as fields
+            self.assertOk(r.execute_command('ft.create', 'idx4', 'nofreqs', 'schema', 
+                                            'stopwords', 1.0, 'blocks', 1.0))
+            self.assertOk(r.execute_command('ft.add', 'idx4', 'doc4', 1.0, 'fields',
+                                            'blocks', 'hello world'))
+            res = r.execute_command('ft.search', 'idx4', 'hello', 'infields', 1, 'blocks')
+            self.assertEqual(1, res[0])
+
+    def testWriteBuffer(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'writebuffer', 'title', 10.0, 'body', 1.0))
+            for i in xrange(100):
+                self.assertOk(r.execute_command('ft.add', 'idx', 'doc%d' % i, 1.0, 'fields',
+                                                'title', 'hello world' if i % 2 else 'hello kitty'))
+
+            # the postings are in the segment, and searches find them there
+            self.assertFalse(r.exists('ft:idx/hello'))
+            res = r.execute_command('ft.search', 'idx', 'hello', 'nocontent', 'limit', 0, 100)
+            self.assertEqual(100, res[0])
+            res = r.execute_command('ft.search', 'idx', '"hello kitty"', 'nocontent', 'limit', 0, 100)
+            self.assertEqual(50, res[0])
+
+            self.assertTrue(r.execute_command('ft.flush', 'idx') >= 200)
+            self.assertExists(r, 'ft:idx/hello')
+            self.assertEqual(0, r.execute_command('ft.flush', 'idx'))
+            self.assertEqual(res, r.execute_command('ft.search', 'idx', '"hello kitty"', 'nocontent',
+                                                    'limit', 0, 100))
+
+            # terms with postings both flushed and in the segment are read from both
+            for i in xrange(100, 110):
+                self.assertOk(r.execute_command('ft.add', 'idx', 'doc%d' % i, 1.0, 'fields',
+                                                'title', 'hello kitty'))
+            res = r.execute_command('ft.search', 'idx', 'hello kitty', 'nocontent', 'limit', 0, 100)
+            self.assertEqual(60, res[0])
+            res = r.execute_command('ft.search', 'idx', 'hello', 'nocontent', 'scorer', 'bm25')
+            self.assertEqual(110, res[0])
+
+            self.assertOk(r.execute_command('ft.drop', 'idx'))
+            self.assertEqual(0, r.execute_command('ft.flush', 'idx'))
+
+    def testWriteBufferLost(self):
+        with self.redis() as r:
+            r.flushall()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'writebuffer', 'title', 1.0))
+            for i in xrange(10):
+                self.assertOk(r.execute_command('ft.add', 'idx', 'doc%d' % i, 1.0, 'fields',
+                                                'title', 'hello world'))
+            self.assertExists(r, '__sg:idx__')
+
+            # the segment belongs to db 0, so moving the keys to db 1 leaves them without it, 
+            # like a restart does
+            r.execute_command('swapdb', 0, 1)
+            r.execute_command('select', 1)
+            res = r.execute_command('ft.search', 'idx', 'hello', 'nocontent')
+            self.assertEqual(0, res[0])
+
+            # the documents whose postings were lost can be added again, once
+            self.assertOk(r.execute_command('ft.add', 'idx', 'doc0', 1.0, 'fields',
+                                            'title', 'hello world'))
+            with self.assertRaises(redis.ResponseError):
+                r.execute_command('ft.add', 'idx', 'doc0', 1.0, 'fields', 'title', 'hello world')
+            self.assertEqual(2, r.execute_command('ft.flush', 'idx'))
+
+            # flushing the new segment doesn't forget the documents lost before it
+            self.assertExists(r, '__sg:idx__')
+            self.assertOk(r.execute_command('ft.add', 'idx', 'doc1', 1.0, 'fields',
+                                            'title', 'hello world'))
+            res = r.execute_command('ft.search', 'idx', 'hello', 'nocontent')
+            self.assertEqual(2, res[0])
+
+            self.assertOk(r.execute_command('ft.drop', 'idx'))
+            self.assertFalse(r.exists('__sg:idx__'))
+            r.execute_command('select', 0)
+            r.flushall()
+
+    def testMultiAdd(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'title', 10.0, 'body', 1.0))
+            self.assertOk(r.execute_command('ft.create', 'single', 'title', 10.0, 'body', 1.0))
+            args = []
+            for i in xrange(100):
+                title = 'hello world' if i % 3 == 0 else 'hello kitty'
+                args += ['doc%d' % i, 1.0, 2, 'title', title, 'body', 'lorem ipsum %d' % i]
+                # document keys are global, so the ones of the other index are prefixed
+                self.assertOk(r.execute_command('ft.add', 'single', 'single:doc%d' % i, 1.0, 'fields',
+                                                'title', title, 'body', 'lorem ipsum %d' % i))
+            # doc0 is in the batch twice
+            args += ['doc0', 1.0, 1, 'title', 'hello']
+            res = r.execute_command('ft.madd', 'idx', 'nosave', 'docs', *args)
+            stats = dict(zip(res[::2], res[1::2]))
+            self.assertEqual(100, stats['docs'])
+            self.assertEqual(1, stats['failed'])
+            self.assertTrue(0 < stats['terms'] < stats['postings'])
+            self.assertTrue(stats['postings'] >= 400)
+
+            # the index is the same as the one of the documents added one by one
+            for q in ('hello', 'kitty', '"hello world"', 'ipsum', '17'):
+                res = r.execute_command('ft.search', 'single', q, 'nocontent', 'limit', 0, 100)
+                self.assertEqual([res[0]] + [k[len('single:'):] for k in res[1:]],
+                                 r.execute_command('ft.search', 'idx', q, 'nocontent', 'limit', 0, 100))
+
+            with self.assertRaises(redis.ResponseError):
+                r.execute_command('ft.madd', 'idx', 'docs', 'doc200', 1.0, 2, 'title', 'hello')
+            with self.assertRaises(redis.ResponseError):
+                r.execute_command('ft.madd', 'idx', 'docs', 'doc200', 2.0, 1, 'title', 'hello')
+
+    def testSearchAfter(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'title', 10.0, 'body', 1.0))
+            # documents with the same scores are ranked by docId
+            for i in xrange(100):
+                self.assertOk(r.execute_command('ft.add', 'idx', 'doc%d' % i, 1.0 / (1 + i % 7), 'fields',
+                                                'title', 'hello world', 'body', 'lorem ipsum'))
+
+            expected = r.execute_command('ft.search', 'idx', 'hello', 'nocontent', 'limit', 0, 100)
+            res = r.execute_command('ft.search', 'idx', 'hello', 'nocontent', 'limit', 0, 7, 'withcursor')
+            self.assertEqual(9, len(res))
+            ids = res[1:-1]
+            while res[-1] is not None:
+                res = r.execute_command('ft.search', 'idx', 'hello', 'nocontent', 'limit', 0, 7,
+                                        'after', res[-1])
+                self.assertEqual(100, res[0])
+                ids += res[1:-1]
+            self.assertEqual(expected[1:], ids)
+
+            with self.assertRaises(redis.ResponseError):
+                r.execute_command('ft.search', 'idx', 'hello', 'after', 'nosuchcursor')
+
+    def testSplitOffsets(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'splitoffsets', 'title', 10.0, 'body', 1.0))
+            for i in xrange(300):
+                self.assertOk(r.execute_command('ft.add', 'idx', 'doc%d' % i, 1.0, 'fields',
+                                     'title', 'hello world' if i % 3 == 0 else 'hello kitty',
+                                     'body', 'lorem ipsum'))
+
+            # offset vectors are kept in their own key
+            self.assertExists(r, 'ft:idx/hello')
+            self.assertExists(r, 'ov:idx/hello')
+
+            res = r.execute_command('ft.search', 'idx', 'hello', 'verbatim', 'nocontent')
+            self.assertEqual(300, res[0])
+            res = r.execute_command('ft.search', 'idx', '"hello kitty"', 'verbatim', 'nocontent')
+            self.assertEqual(200, res[0])
+            res = r.execute_command('ft.search', 'idx', '"kitty hello"', 'verbatim', 'nocontent')
+            self.assertEqual(0, res[0])
+
+    def testPForCodec(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'pfor', 'title', 10.0, 'body', 1.0))
+            for i in xrange(300):
+                self.assertOk(r.execute_command('ft.add', 'idx', 'doc%d' % i, 1.0, 'fields',
+                                     'title', 'hello world' if i % 3 == 0 else 'hello kitty',
+                                     'body', 'lorem ipsum'))
+
+            # pfor implies block encoding
+            self.assertExists(r, 'ft:idx/hello')
+            self.assertFalse(r.exists('si:idx/hello'))
+
+            res = r.execute_command('ft.search', 'idx', 'hello world', 'verbatim', 'nocontent')
+            self.assertEqual(100, res[0])
+            res = r.execute_command('ft.search', 'idx', '"hello kitty"', 'verbatim', 'nocontent')
+            self.assertEqual(200, res[0])
+
+    def testEntryLayouts(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'nooffsets', 'nofields', 'nofreqs',
+                                            'title', 10.0, 'body', 1.0))
+            for i in xrange(300):
+                self.assertOk(r.execute_command('ft.add', 'idx', 'doc%d' % i, 1.0, 'fields',
+                                     'title', 'hello world' if i % 3 == 0 else 'hello kitty',
+                                     'body', 'lorem ipsum'))
+
+            res = r.execute_command('ft.search', 'idx', 'hello world', 'verbatim', 'nocontent')
+            self.assertEqual(100, res[0])
+            # without offsets phrases match their words anywhere
+            res = r.execute_command('ft.search', 'idx', '"kitty hello"', 'verbatim', 'nocontent')
+            self.assertEqual(200, res[0])
+            # and without fields every field matches
+            res = r.execute_command('ft.search', 'idx', 'lorem', 'verbatim', 'infields', 1, 'title', 'nocontent')
+            self.assertEqual(300, res[0])
+
+    def testOptimizeBitmaps(self):
+        with self.redis() as r:
+            r.flushdb()
+            self.assertOk(r.execute_command('ft.create', 'idx', 'title', 10.0, 'body', 1.0))
+            for i in xrange(2000):
+                self.assertOk(r.execute_command('ft.add', 'idx', 'doc%d' % i, 1.0, 'fields',
+                                     'title', 'hello world' if i % 3 == 0 else 'hello kitty',
+                                     'body', 'lorem ipsum' if i % 100 == 0 else 'foo bar'))
+
+            r.execute_command('ft.optimize', 'idx')
+            # frequent terms get a bitmap, rare ones don't
+            self.assertExists(r, 'bm:idx/hello')
+            self.assertFalse(r.exists('bm:idx/lorem'))
+
+            res = r.execute_command('ft.search', 'idx', 'hello world', 'verbatim', 'nocontent')
+            self.assertEqual(667, res[0])
+            res = r.execute_command('ft.search', 'idx', 'hello lorem', 'verbatim', 'nocontent')
+            self.assertEqual(20, res[0])
+            res = r.execute_command('ft.search', 'idx', '"hello kitty"', 'verbatim', 'nocontent')
+            self.assertEqual(1333, res[0])
+
     def testExact(self):
         with self.redis() as r:
             r.flushdb()
@@ -161,6 +493,14 @@ class SearchTestCase(ModuleTestCase('../module.so')):
             res = r.execute_command('ft.search', 'idx', 'hello kitty', "nocontent", 
                                     "filter", "score", "-inf", "+inf" )
             self.assertEqual(100, res[0])
+
+            # repeated terms are matched once, and a missing term matches nothing
+            res = r.execute_command('ft.search', 'idx', 'hello kitty hello', "nocontent", 
+                                    "filter", "score", 0, 50 )
+            self.assertEqual(51, res[0])
+            res = r.execute_command('ft.search', 'idx', 'hello nosuchterm', "nocontent", 
+                                    "filter", "score", 0, 50 )
+            self.assertEqual(0, res[0])
                                                 
                                                                                    
                                     
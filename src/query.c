@@ -4,38 +4,61 @@
 #include <string.h>
 #include <math.h>
 #include <sys/param.h>
+#include <time.h>
 
 #include "index.h"
 #include "tokenize.h"
 #include "redis_index.h"
 #include "util/logging.h"
-#include "util/heap.h"
 #include "query.h"
+#include "topk.h"
+#include "doc_bitmap.h"
+#include "rmutil/sds.h"
 
 void QueryStage_Free(QueryStage *s) {
   // recursively free the child stages
   for (int i = 0; i < s->nchildren; i++) {
     QueryStage_Free(s->children[i]);
   }
-  // free the children array
+  // the term is strdupped, so needs to be freed. Numeric filters are owned by their iterators, 
+  // unless the stage was never evaluated
+  if (s->value && s->valueFreeable) {
+    if (s->op == Q_NUMERIC) {
+      NumericFilter_Free(s->value);
+    } else {
+      free(s->value);
+    }
+  }
+  // the index of a term the planner opened but that was never evaluated
+  if (s->termBuf) {
+    RedisBufferFree(s->termBuf);
+  }
+  // everything else of arena stages goes with their arena
+  if (s->arena) {
+    return;
+  }
   if (s->children) {
     free(s->children);
   }
-  // the term is strdupped, so needs to be freed
-  if (s->value && s->valueFreeable) {
-    free(s->value);
+  if (s->profile) {
+    free(s->profile);
   }
   free(s);
 }
 
-QueryStage *__newQueryStage(void *value, QueryOp op, int freeable) {
-  QueryStage *s = malloc(sizeof(QueryStage));
+QueryStage *__newQueryStage(Arena *arena, void *value, QueryOp op, int freeable) {
+  QueryStage *s = arena ? Arena_Alloc(arena, sizeof(QueryStage)) : malloc(sizeof(QueryStage));
+  s->arena = arena;
   s->children = NULL;
   s->nchildren = 0;
   s->op = op;
   s->value = value;
   s->valueFreeable = freeable;
   s->parent = NULL;
+  s->numDocs = QUERYSTAGE_UNKNOWN_DOCS;
+  s->termBuf = NULL;
+  s->termHeader = (IndexHeader){0};
+  s->profile = NULL;
   return s;
 }
 
@@ -48,22 +71,51 @@ QueryStage *NewTokenStage(Query *q, QueryToken *qt) {
     
     if (stemmed && strncasecmp(stemmed, qt->s, qt->len)) {
       // Create a new union
-      QueryStage *us = NewLogicStage(Q_UNION);
+      QueryStage *us = NewLogicStage(q, Q_UNION);
 
       // Add the token and the ste as the union's children
-      QueryStage_AddChild(us, __newQueryStage((char *)qt->s, Q_LOAD, 1));
-      QueryStage_AddChild(us, __newQueryStage(strndup(stemmed, sl), Q_LOAD, 1));
+      QueryStage_AddChild(us, NewTermStage(q, (char *)qt->s));
+      QueryStage_AddChild(us, NewTermStage(q, q->arena ? Arena_Strndup(q->arena, stemmed, sl)
+                                                       : strndup(stemmed, sl)));
       return us;
     }
   }
   
-  return __newQueryStage((char *)qt->s, Q_LOAD, 1);
+  return NewTermStage(q, (char *)qt->s);
+}
+
+QueryStage *NewTermStage(Query *q, char *term) {
+  // terms of arena queries are in the arena too
+  return __newQueryStage(q->arena, term, Q_LOAD, q->arena == NULL);
 }
 
-QueryStage *NewLogicStage(QueryOp op) { return __newQueryStage(NULL, op, 0); }
+QueryStage *NewLogicStage(Query *q, QueryOp op) { return __newQueryStage(q->arena, NULL, op, 0); }
 
-QueryStage *NewNumericStage(NumericFilter *flt) {
-  return __newQueryStage(flt, Q_NUMERIC, 0);
+QueryStage *NewNumericStage(Query *q, NumericFilter *flt) {
+  return __newQueryStage(q->arena, flt, Q_NUMERIC, 1);
+}
+
+/* Is the stage a part of an exact phrase */
+static int queryStage_inExact(QueryStage *stage) {
+  for (QueryStage *s = stage->parent; s != NULL; s = s->parent) {
+    if (s->op == Q_EXACT) return 1;
+  }
+  return 0;
+}
+
+/* Score the postings of a reader with the scorer of the query */
+static void query_SetScoring(Query *q, IndexReader *ir) {
+  if (q->norms) {
+    IR_SetNorms(ir, q->norms, q->totalDocs);
+  } else if (q->totalDocs) {
+    IR_SetTotalDocs(ir, q->totalDocs);
+  }
+}
+
+/* Open the inverted index of a term stage and read its header. The planner does this for every
+term it estimates, so evaluating the stage does not open the term key again */
+static void queryStage_OpenTerm(Query *q, QueryStage *s) {
+  s->termBuf = Redis_OpenTermBuffer(q->ctx, s->value, &s->termHeader);
 }
 
 IndexIterator *query_EvalLoadStage(Query *q, QueryStage *stage) {
@@ -73,13 +125,73 @@ IndexIterator *query_EvalLoadStage(Query *q, QueryStage *stage) {
   int isSingleWord =
       q->numTokens == 1 && q->fieldMask == 0xff && q->root->nchildren == 1;
 
-  IndexReader *ir = Redis_OpenReader(q->ctx, stage->value, q->docTable,
-                                     isSingleWord, q->fieldMask);
+  // the postings of the term that are not flushed yet
+  SegmentTerm *st = q->segment ? Segment_GetTerm(q->segment, stage->value) : NULL;
+
+  // stages the planner did not get to are opened now
+  if (stage->numDocs == QUERYSTAGE_UNKNOWN_DOCS) {
+    queryStage_OpenTerm(q, stage);
+  }
+
+  // very frequent terms may have a bitmap, which we can use if we don't need their offsets. 
+  // Bitmaps don't have the postings of the segment
+  if (!isSingleWord && !queryStage_inExact(stage) && st == NULL && stage->termBuf != NULL) {
+    BitmapReader *br = Redis_OpenBitmapReader(q->ctx, stage->value, &stage->termHeader, 
+                                              q->fieldMask);
+    if (br != NULL) {
+      if (q->norms) {
+        BR_SetNorms(br, q->norms, q->totalDocs);
+      } else if (q->totalDocs) {
+        BR_SetTotalDocs(br, q->totalDocs);
+      }
+      return NewBitmapIterator(br);
+    }
+  }
+
+  // the score index only has the persisted postings. The reader takes over the term's index
+  IndexReader *ir = NULL;
+  if (stage->termBuf != NULL) {
+    ir = Redis_OpenTermReader(q->ctx, stage->value, stage->termBuf, q->docTable,
+                              isSingleWord && st == NULL, q->fieldMask, q->arena);
+    stage->termBuf = NULL;
+  }
+  if (st == NULL) {
+    if (ir == NULL) {
+      return NULL;
+    }
+    query_SetScoring(q, ir);
+    return NewReadIterator(ir);
+  }
+
+  // the segment only has documents newer than the persisted ones, so a union of the two 
+  // readers yields the postings of the term in order. The idf counts the documents of both
+  IndexReader *sr = SegmentTerm_OpenReader(st, q->docTable, q->fieldMask, q->arena);
   if (ir == NULL) {
-    return NULL;
+    query_SetScoring(q, sr);
+    return NewReadIterator(sr);
   }
+  u_int32_t docFreq = ir->docFreq + sr->docFreq;
+  IR_SetDocFreq(ir, docFreq);
+  IR_SetDocFreq(sr, docFreq);
+  query_SetScoring(q, ir);
+  query_SetScoring(q, sr);
+  IndexIterator **its = Arena_Calloc(q->arena, 2, sizeof(IndexIterator *));
+  its[0] = NewReadIterator(ir);
+  its[1] = NewReadIterator(sr);
+  return NewUnionIterator(its, 2, q->docTable, q->arena);
+}
 
-  return NewReadIterator(ir);
+/* Evaluate the children of an intersection. If the planner found that one of them can't match
+anything, neither can the intersection, so none of them are opened */
+static IndexIterator **query_EvalIntersectChildren(Query *q, QueryStage *stage) {
+  IndexIterator **iters = Arena_Calloc(q->arena, stage->nchildren, sizeof(IndexIterator *));
+  if (stage->numDocs == 0) {
+    return iters;
+  }
+  for (int i = 0; i < stage->nchildren; i++) {
+    iters[i] = Query_EvalStage(q, stage->children[i]);
+  }
+  return iters;
 }
 
 IndexIterator *query_EvalIntersectStage(Query *q, QueryStage *stage) {
@@ -90,19 +202,18 @@ IndexIterator *query_EvalIntersectStage(Query *q, QueryStage *stage) {
   }
 
   // recursively eval the children
-  IndexIterator **iters = calloc(stage->nchildren, sizeof(IndexIterator *));
-  for (int i = 0; i < stage->nchildren; i++) {
-    iters[i] = Query_EvalStage(q, stage->children[i]);
-  }
+  IndexIterator **iters = query_EvalIntersectChildren(q, stage);
 
   IndexIterator *ret = NewIntersecIterator(iters, stage->nchildren, 0,
-                                           q->docTable, q->fieldMask);
+                                           q->docTable, q->fieldMask, q->arena);
   return ret;
 }
 
 IndexIterator *query_EvalNumericStage(Query *q, QueryStage *stage) {
   NumericFilter *nf = stage->value;
 
+  // the iterator owns the filter from now on
+  stage->valueFreeable = 0;
   return NewNumericFilterIterator(nf);
 }
 
@@ -113,12 +224,12 @@ IndexIterator *query_EvalUnionStage(Query *q, QueryStage *stage) {
   }
 
   // recursively eval the children
-  IndexIterator **iters = calloc(stage->nchildren, sizeof(IndexIterator *));
+  IndexIterator **iters = Arena_Calloc(q->arena, stage->nchildren, sizeof(IndexIterator *));
   for (int i = 0; i < stage->nchildren; i++) {
     iters[i] = Query_EvalStage(q, stage->children[i]);
   }
 
-  IndexIterator *ret = NewUnionIterator(iters, stage->nchildren, q->docTable);
+  IndexIterator *ret = NewUnionIterator(iters, stage->nchildren, q->docTable, q->arena);
   return ret;
 }
 
@@ -128,98 +239,390 @@ IndexIterator *query_EvalExactIntersectStage(Query *q, QueryStage *stage) {
   if (stage->nchildren == 1) {
     return Query_EvalStage(q, stage->children[0]);
   }
-  IndexIterator **iters = calloc(stage->nchildren, sizeof(IndexIterator *));
-  for (int i = 0; i < stage->nchildren; i++) {
-    iters[i] = Query_EvalStage(q, stage->children[i]);
-  }
+  IndexIterator **iters = query_EvalIntersectChildren(q, stage);
 
-  IndexIterator *ret = NewIntersecIterator(iters, stage->nchildren, 1,
-                                           q->docTable, q->fieldMask);
+  // indexes without offsets can't tell phrases apart, so we match all the words anywhere
+  int exact = !(q->ctx->spec->flags & Index_NoOffsets);
+  IndexIterator *ret = NewIntersecIterator(iters, stage->nchildren, exact,
+                                           q->docTable, q->fieldMask, q->arena);
   return ret;
 }
 
+double Query_Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* A profile iterator wraps the iterator of a stage, and counts the calls to it and the time
+they take in the stage's profile */
+typedef struct {
+  IndexIterator *child;
+  QueryStageProfile *prof;
+  // the reader of the child, if it reads the index of a term
+  IndexReader *reader;
+} ProfileContext;
+
+static int PI_Read(void *ctx, IndexHit *hit) {
+  ProfileContext *pc = ctx;
+  double start = Query_Now();
+  int rc = pc->child->Read(pc->child->ctx, hit);
+  pc->prof->time += Query_Now() - start;
+  pc->prof->numRead++;
+  if (rc == INDEXREAD_OK) pc->prof->numHits++;
+  return rc;
+}
+
+static int PI_SkipTo(void *ctx, u_int32_t docId, IndexHit *hit) {
+  ProfileContext *pc = ctx;
+  double start = Query_Now();
+  int rc = pc->child->SkipTo(pc->child->ctx, docId, hit);
+  pc->prof->time += Query_Now() - start;
+  pc->prof->numSkipTo++;
+  if (rc == INDEXREAD_OK) pc->prof->numHits++;
+  return rc;
+}
+
+static int PI_ReadBatch(void *ctx, IndexHitBatch *b) {
+  ProfileContext *pc = ctx;
+  double start = Query_Now();
+  int n = IndexIterator_ReadBatch(pc->child, b);
+  pc->prof->time += Query_Now() - start;
+  pc->prof->numBatches++;
+  pc->prof->numHits += n;
+  return n;
+}
+
+static t_docId PI_LastDocId(void *ctx) {
+  ProfileContext *pc = ctx;
+  return pc->child->LastDocId(pc->child->ctx);
+}
+
+static int PI_HasNext(void *ctx) {
+  ProfileContext *pc = ctx;
+  return pc->child->HasNext(pc->child->ctx);
+}
+
+static double PI_MaxScore(void *ctx) {
+  ProfileContext *pc = ctx;
+  return IndexIterator_MaxScore(pc->child);
+}
+
+static void PI_SetMinScore(void *ctx, double minScore) {
+  ProfileContext *pc = ctx;
+  pc->child->SetMinScore(pc->child->ctx, minScore);
+}
+
+static size_t PI_Len(void *ctx) {
+  ProfileContext *pc = ctx;
+  return pc->child->Len(pc->child->ctx);
+}
+
+static void PI_Free(IndexIterator *it) {
+  ProfileContext *pc = it->ctx;
+  // the reader is gone once the child is freed
+  if (pc->reader) {
+    IR_GetStats(pc->reader, &pc->prof->reader);
+  }
+  // the profile iterator itself is in the query's arena
+  pc->child->Free(pc->child);
+}
+
+/* Wrap the iterator of a stage with a profile iterator */
+static IndexIterator *query_ProfileStage(Query *q, QueryStage *s, IndexIterator *child) {
+  s->profile = Arena_Calloc(q->arena, 1, sizeof(QueryStageProfile));
+  s->profile->opened = child != NULL;
+  s->profile->bitmap = IsBitmapIterator(child);
+  if (child == NULL || s->profile->bitmap) {
+    return child;
+  }
+
+  ProfileContext *pc = Arena_Alloc(q->arena, sizeof(ProfileContext));
+  pc->child = child;
+  pc->prof = s->profile;
+  // read iterators have their reader as their context. Terms with postings in the write segment
+  // are read with a union, and not counted
+  pc->reader = IsReadIterator(child) ? child->ctx : NULL;
+
+  IndexIterator *it = Arena_Alloc(q->arena, sizeof(IndexIterator));
+  it->ctx = pc;
+  it->Read = PI_Read;
+  it->SkipTo = PI_SkipTo;
+  it->ReadBatch = PI_ReadBatch;
+  it->LastDocId = PI_LastDocId;
+  it->HasNext = PI_HasNext;
+  it->MaxScore = PI_MaxScore;
+  it->SetMinScore = child->SetMinScore ? PI_SetMinScore : NULL;
+  it->Len = PI_Len;
+  it->Free = PI_Free;
+  return it;
+}
+
 IndexIterator *Query_EvalStage(Query *q, QueryStage *s) {
+  IndexIterator *it = NULL;
   switch (s->op) {
     case Q_LOAD:
-      return query_EvalLoadStage(q, s);
+      it = query_EvalLoadStage(q, s);
+      break;
     case Q_INTERSECT:
-      return query_EvalIntersectStage(q, s);
+      it = query_EvalIntersectStage(q, s);
+      break;
     case Q_EXACT:
-      return query_EvalExactIntersectStage(q, s);
+      it = query_EvalExactIntersectStage(q, s);
+      break;
     case Q_UNION:
-      return query_EvalUnionStage(q, s);
+      it = query_EvalUnionStage(q, s);
+      break;
     case Q_NUMERIC:
-      return query_EvalNumericStage(q, s);
+      it = query_EvalNumericStage(q, s);
+      break;
   }
 
-  return NULL;
+  if (q->profile) {
+    it = query_ProfileStage(q, s, it);
+  }
+  return it;
 }
 
 void QueryStage_AddChild(QueryStage *parent, QueryStage *child) {
-  parent->children =
-      realloc(parent->children, sizeof(QueryStage *) * (parent->nchildren + 1));
+  int n = parent->nchildren;
+  if (parent->arena == NULL) {
+    parent->children = realloc(parent->children, sizeof(QueryStage *) * (n + 1));
+  } else if (n == 0 || (n >= QUERYSTAGE_MIN_CHILDREN && (n & (n - 1)) == 0)) {
+    // arena arrays can't grow in place, so their capacity is doubled whenever they are full
+    QueryStage **children =
+        Arena_Alloc(parent->arena, sizeof(QueryStage *) * MAX(n * 2, QUERYSTAGE_MIN_CHILDREN));
+    if (n) memcpy(children, parent->children, n * sizeof(QueryStage *));
+    parent->children = children;
+  }
   parent->children[parent->nchildren++] = child;
   child->parent = parent;
 }
 
 
 
+/* Are two stages the same, i.e. do they match the same documents with the same scores */
+static int queryStage_Equal(QueryStage *a, QueryStage *b) {
+  if (a->op != b->op || a->nchildren != b->nchildren) return 0;
+  if (a->op == Q_LOAD && strcmp(a->value, b->value)) return 0;
+  if (a->op == Q_NUMERIC && a->value != b->value) return 0;
+
+  for (int i = 0; i < a->nchildren; i++) {
+    if (!queryStage_Equal(a->children[i], b->children[i])) return 0;
+  }
+  return 1;
+}
+
+/* Add a child to an intersection or a union being rewritten. Children of the same op as the
+parent, or with a single child, are spliced into it, and children that are already there are
+dropped, as matching them twice matches the same documents */
+static void queryStage_adoptChild(QueryStage *s, QueryStage *child) {
+  if ((child->op == Q_INTERSECT || child->op == Q_UNION) &&
+      (child->op == s->op || child->nchildren == 1)) {
+    for (int i = 0; i < child->nchildren; i++) {
+      queryStage_adoptChild(s, child->children[i]);
+    }
+    child->nchildren = 0;
+    QueryStage_Free(child);
+    return;
+  }
+
+  for (int i = 0; i < s->nchildren; i++) {
+    if (queryStage_Equal(s->children[i], child)) {
+      QueryStage_Free(child);
+      return;
+    }
+  }
+  QueryStage_AddChild(s, child);
+}
+
+void QueryStage_Rewrite(QueryStage *s) {
+  for (int i = 0; i < s->nchildren; i++) {
+    QueryStage_Rewrite(s->children[i]);
+  }
+
+  // phrases need all their words, in order, so they are left as they are
+  if (s->op != Q_INTERSECT && s->op != Q_UNION) {
+    return;
+  }
+
+  QueryStage **children = s->children;
+  int n = s->nchildren;
+  s->children = NULL;
+  s->nchildren = 0;
+  for (int i = 0; i < n; i++) {
+    queryStage_adoptChild(s, children[i]);
+  }
+  if (s->arena == NULL) free(children);
+}
+
+/* Estimate the number of documents each stage can match, bottom up. Terms are counted from their
+index headers, which stay open for evaluating them, and numeric filters by the size of their index. An intersection matches at most 
+as many documents as its smallest child, so once a child matches nothing the rest are not looked 
+at */
+static size_t queryStage_Estimate(Query *q, QueryStage *s) {
+  size_t n = 0;
+  switch (s->op) {
+    case Q_LOAD: {
+      queryStage_OpenTerm(q, s);
+      n = s->termHeader.numDocs;
+      SegmentTerm *st = q->segment ? Segment_GetTerm(q->segment, s->value) : NULL;
+      if (st) n += st->w->ndocs;
+      break;
+    }
+    case Q_NUMERIC:
+      n = NumericFilter_IndexSize(s->value);
+      break;
+    case Q_UNION:
+      for (int i = 0; i < s->nchildren; i++) {
+        size_t c = queryStage_Estimate(q, s->children[i]);
+        n = n + c < n ? QUERYSTAGE_UNKNOWN_DOCS : n + c;
+      }
+      break;
+    case Q_INTERSECT:
+    case Q_EXACT:
+      n = s->nchildren > 0 ? QUERYSTAGE_UNKNOWN_DOCS : 0;
+      for (int i = 0; i < s->nchildren && n > 0; i++) {
+        n = MIN(n, queryStage_Estimate(q, s->children[i]));
+      }
+      break;
+  }
+  s->numDocs = n;
+  return n;
+}
+
+/* Pick the strategy of the numeric filters of intersections. A filter either loads its whole
+range, or checks the docIds the rest of the intersection yields one by one, so it loads the range
+only if that is cheaper than checking all of them. A filter with nothing else to intersect with
+always loads its range */
+static void queryStage_PlanFilters(QueryStage *s) {
+  for (int i = 0; i < s->nchildren; i++) {
+    queryStage_PlanFilters(s->children[i]);
+  }
+  if (s->op != Q_INTERSECT && s->op != Q_EXACT) {
+    return;
+  }
+
+  size_t candidates = QUERYSTAGE_UNKNOWN_DOCS;
+  for (int i = 0; i < s->nchildren; i++) {
+    if (s->children[i]->op != Q_NUMERIC) {
+      candidates = MIN(candidates, s->children[i]->numDocs);
+    }
+  }
+  for (int i = 0; i < s->nchildren; i++) {
+    if (s->children[i]->op == Q_NUMERIC) {
+      NumericFilter *f = s->children[i]->value;
+      f->loadLimit = candidates > QUERYSTAGE_UNKNOWN_DOCS / NUMERICFILTER_PROBE_COST
+                         ? QUERYSTAGE_UNKNOWN_DOCS
+                         : candidates * NUMERICFILTER_PROBE_COST;
+    }
+  }
+}
+
+void Query_Plan(Query *q) {
+  if (q->root == NULL) return;
+
+  QueryStage_Rewrite(q->root);
+  q->totalDocs = q->docTable ? DocTable_NumDocs(q->docTable) : 0;
+  if (q->scorer == QUERY_SCORER_BM25 && q->norms == NULL) {
+    q->norms = Redis_LoadDocNorms(q->ctx);
+  }
+  if (q->ctx && (q->ctx->spec->flags & Index_WriteBuffer)) {
+    q->segment = Segment_Get(q->ctx, 0);
+  }
+  queryStage_Estimate(q, q->root);
+  queryStage_PlanFilters(q->root);
+}
+
 Query *NewQuery(RedisSearchCtx *ctx, const char *query, size_t len, int offset,
                 int limit, u_char fieldMask, int verbatim, const char *lang) {
-  Query *ret = calloc(1, sizeof(Query));
+  // the query lives in its own arena, with everything else it allocates until it is freed
+  Arena *arena = NewArena(QUERY_ARENA_BLOCK_SIZE);
+  Query *ret = Arena_Calloc(arena, 1, sizeof(Query));
+  ret->arena = arena;
   ret->ctx = ctx;
   ret->len = len;
   ret->limit = limit;
   ret->fieldMask = fieldMask;
   ret->offset = offset;
-  ret->raw = strndup(query, len);
-  ret->root = __newQueryStage(NULL, Q_INTERSECT, 0);
+  ret->raw = Arena_Strndup(arena, query, len);
+  ret->root = NewLogicStage(ret, Q_INTERSECT);
   ret->numTokens = 0;
   ret->stemmer = NULL;
   if (!verbatim) {
-    ret->stemmer = NewStemmer(SnowballStemmer, lang ? lang : DEFAULT_LANGUAGE);  
+    ret->stemmer = GetStemmer(SnowballStemmer, lang ? lang : DEFAULT_LANGUAGE);
   }
   
   return ret;
 }
 
-void __queryStage_Print(QueryStage *qs, int depth) {
+/* Append a stage and its children to an explanation of the query, indented by their depth */
+static sds queryStage_Explain(sds s, QueryStage *qs, int depth) {
   for (int i = 0; i < depth; i++) {
-    printf("  ");
+    s = sdscat(s, "  ");
   }
   switch (qs->op) {
     case Q_EXACT:
-      printf("EXACT {\n");
+      s = sdscat(s, "EXACT");
       break;
     case Q_LOAD:
-      printf("{%s", (char *)qs->value);
+      s = sdscat(s, qs->value);
       break;
     case Q_INTERSECT:
-      printf("INTERSECT {\n");
+      s = sdscat(s, "INTERSECT");
       break;
     case Q_NUMERIC: {
       NumericFilter *f = qs->value;
-      printf("NUMERIC {%f < x < %f", f->min, f->max);
+      s = sdscatprintf(s, "NUMERIC %s%g %g%s", f->inclusiveMin ? "[" : "(", f->min, f->max, 
+                       f->inclusiveMax ? "]" : ")");
     } break;
     case Q_UNION:
-      printf("UNION {\n");
+      s = sdscat(s, "UNION");
       break;
   }
-
-  for (int i = 0; i < qs->nchildren; i++) {
-    __queryStage_Print(qs->children[i], depth + 1);
+  if (qs->numDocs != QUERYSTAGE_UNKNOWN_DOCS) {
+    s = sdscatprintf(s, " (%zd docs)", qs->numDocs);
+  }
+  if (qs->op == Q_NUMERIC) {
+    NumericFilter *f = qs->value;
+    if (f->loadLimit == QUERYSTAGE_UNKNOWN_DOCS) {
+      s = sdscat(s, " load");
+    } else {
+      s = sdscatprintf(s, " load up to %zd, or probe", f->loadLimit);
+    }
   }
 
   if (qs->nchildren > 0) {
+    s = sdscat(s, " {\n");
+    for (int i = 0; i < qs->nchildren; i++) {
+      s = queryStage_Explain(s, qs->children[i], depth + 1);
+    }
     for (int i = 0; i < depth; i++) {
-      printf("  ");
+      s = sdscat(s, "  ");
     }
+    s = sdscat(s, "}");
+  }
+  return sdscat(s, "\n");
+}
+
+char *Query_Explain(Query *q) {
+  sds s = sdsempty();
+  if (q->root != NULL) {
+    s = queryStage_Explain(s, q->root, 0);
+  }
+  return s;
+}
+
+void Query_EnableProfile(Query *q) {
+  if (q->profile == NULL) {
+    q->profile = Arena_Calloc(q->arena, 1, sizeof(QueryProfile));
   }
-  printf("}\n");
 }
 
 int Query_Tokenize(Query *q) {
   QueryTokenizer t = NewQueryTokenizer(q->raw, q->len);
+  t.arena = q->arena;
+  if (q->ctx) t.stopwords = q->ctx->spec->stopwords;
 
   QueryStage *current = q->root;
   while (QueryTokenizer_HasNext(&t)) {
@@ -234,7 +637,7 @@ int Query_Tokenize(Query *q) {
       }
       case T_QUOTE:
         if (current->op != Q_EXACT) {
-          QueryStage *ns = NewLogicStage(Q_EXACT);
+          QueryStage *ns = NewLogicStage(q, Q_EXACT);
           QueryStage_AddChild(current, ns);
           current = ns;
         } else {  // end of quote
@@ -251,42 +654,33 @@ int Query_Tokenize(Query *q) {
     if (current == NULL) break;
   }
 
-  //__queryStage_Print(q->root, 0);
-
   return q->numTokens;
 }
 
 void Query_Free(Query *q) {
   QueryStage_Free(q->root);
-  if (q->stemmer) {
-    q->stemmer->Free(q->stemmer);
+  if (q->norms) {
+    DocNorms_Free(q->norms);
   }
-  free(q->raw);
-  free(q);
+  Arena_Free(q->arena);
 }
 
-/* Compare hits for sorting in the heap during traversal of the top N */
-static int cmpHits(const void *e1, const void *e2, const void *udata) {
-  const IndexHit *h1 = e1, *h2 = e2;
-
-  if (h1->totalFreq < h2->totalFreq) {
-    return 1;
-  } else if (h1->totalFreq > h2->totalFreq) {
-    return -1;
-  }
-  return h1->docId - h2->docId;
+/* Factor the minimal distance between the hit's terms (and TBD - other factors) in the hit's
+score. This is done only for the root iterator */
+static inline double processHitScore(double totalFreq, int minDist) {
+  return totalFreq / ((double)minDist * minDist);
 }
-/* Factor document score (and TBD - other factors) in the hit's score.
-This is done only for the root iterator */
-double processHitScore(IndexHit *h, DocTable *dt) {
-  // for exact hits we don't need to calculate minimal offset dist
-  int md =
-      h->type == H_EXACT ? 1 : VV_MinDistance(h->offsetVecs, h->numOffsetVecs);
-  return (h->totalFreq) / pow((double)md, 2);
+
+/* Add the time since *t to *total, and restart *t */
+static inline void query_Lap(double *total, double *t) {
+  double now = Query_Now();
+  *total += now - *t;
+  *t = now;
 }
 
 QueryResult *Query_Execute(Query *query) {
-  //__queryStage_Print(query->root, 0);
+  QueryProfile *prof = query->profile;
+  double start = prof ? Query_Now() : 0;
   QueryResult *res = malloc(sizeof(QueryResult));
   res->error = 0;
   res->errorString = NULL;
@@ -294,12 +688,14 @@ QueryResult *Query_Execute(Query *query) {
   res->ids = NULL;
   res->numIds = 0;
 
-  int num = query->offset + query->limit;
-  heap_t *pq = malloc(heap_sizeof(num));
-  heap_init(pq, cmpHits, NULL, num);
+  // the top results we need to page through. A page after a cursor needs only its own
+  int num = query->after ? query->limit : query->offset + query->limit;
+  TopK top;
+  TopK_Init(&top, Arena_Alloc(query->arena, num * sizeof(TopKEntry)), num);
 
   //  start lazy evaluation of all query steps
   IndexIterator *it = NULL;
+  Query_Plan(query);
   if (query->root != NULL) {
     it = Query_EvalStage(query, query->root);
   }
@@ -311,69 +707,74 @@ QueryResult *Query_Execute(Query *query) {
     return res;
   }
 
-  IndexHit *pooledHit = NULL;
-  // iterate the root iterator and push everything to the PQ
-  while (1) {
-    // TODO - Use static allocation
-    if (pooledHit == NULL) {
-      pooledHit = malloc(sizeof(IndexHit));
-    }
-    IndexHit *h = pooledHit;
-    IndexHit_Init(h);
-    int rc = it->Read(it->ctx, h);
-
-    if (rc == INDEXREAD_EOF) {
-      break;
-    } else if (rc == INDEXREAD_NOTFOUND) {
-      continue;
+  // iterate the root iterator in batches and offer everything to the top results
+  IndexHitBatch *batch = Arena_Alloc(query->arena, sizeof(IndexHitBatch));
+  double minScore = -1;
+  batch->minScore = -1;
+  double t = start;
+  while (IndexIterator_ReadBatch(it, batch) > 0) {
+    if (prof) query_Lap(&prof->iterate, &t);
+    
+    // score the whole batch, and then offer its hits to the top results
+    for (int i = 0; i < batch->num; i++) {
+      batch->totalFreq[i] = processHitScore(batch->totalFreq[i], batch->minDist[i]);
     }
-
-    h->totalFreq = processHitScore(h, query->docTable);
-
-    ++res->totalResults;
-
-    if (heap_count(pq) < heap_size(pq)) {
-      heap_offerx(pq, h);
-      pooledHit = NULL;
+    res->totalResults += batch->num;
+    if (prof) query_Lap(&prof->score, &t);
+    
+    if (query->after) {
+      // the results up to the cursor were on the previous pages
+      QueryCursor *c = query->after;
+      for (int i = 0; i < batch->num; i++) {
+        double score = batch->totalFreq[i];
+        if (score < c->score || (score == c->score && batch->docIds[i] > c->docId)) {
+          TopK_Push(&top, score, batch->docIds[i]);
+        }
+      }
     } else {
-      IndexHit *qh = heap_peek(pq);
-      if (qh->totalFreq < h->totalFreq) {
-        pooledHit = heap_poll(pq);
-        heap_offerx(pq, h);
-        // IndexHit_Terminate(pooledHit);
-      } else {
-        pooledHit = h;
-        // IndexHit_Terminate(pooledHit);
+      for (int i = 0; i < batch->num; i++) {
+        TopK_Push(&top, batch->totalFreq[i], batch->docIds[i]);
       }
     }
-  }
 
-  if (pooledHit) {
-    free(pooledHit);
+    // once the top results are full, a hit has to score above the lowest of them to get in. 
+    // Scores are at most totalFreq, so the iterators can skip whatever has no totalFreq above that
+    if (query->noTotal && it->SetMinScore && TopK_Full(&top) && top.threshold > minScore) {
+      minScore = top.threshold;
+      it->SetMinScore(it->ctx, minScore);
+    }
+    // hits are still counted, but the ones that can't get in are not scored by the distance 
+    // between their terms
+    if (TopK_Full(&top)) {
+      batch->minScore = top.threshold;
+    }
+    if (prof) query_Lap(&prof->heap, &t);
   }
+  if (prof) query_Lap(&prof->iterate, &t);
 
   it->Free(it);
+  if (prof) query_Lap(&prof->iterate, &t);
 
-  // Reverse the results into the final result
-  size_t n = MIN(heap_count(pq), query->limit);
+  // the page is the n lowest of the top results, best first
+  TopK_Sort(&top);
+  size_t n = MIN(top.num, query->limit);
   res->numIds = n;
   res->ids = calloc(n, sizeof(RedisModuleString *));
 
   for (int i = 0; i < n; ++i) {
-    IndexHit *h = heap_poll(pq);
-    LG_DEBUG("Popping %d freq %f", h->docId, h->totalFreq);
-    res->ids[n - i - 1] = Redis_GetDocKey(query->ctx, h->docId);
-    free(h);
+    TopKEntry *e = &top.entries[top.num - n + i];
+    LG_DEBUG("Result %d freq %f", e->docId, e->score);
+    res->ids[i] = Redis_GetDocKey(query->ctx, e->docId);
   }
-
-  // if we still have something in the heap (meaning offset > 0), we need to
-  // poll...
-  while (heap_count(pq) > 0) {
-    IndexHit *h = heap_poll(pq);
-    free(h);
+  if (n > 0) {
+    res->last.score = top.entries[top.num - 1].score;
+    res->last.docId = top.entries[top.num - 1].docId;
   }
 
-  heap_free(pq);
+  if (prof) {
+    query_Lap(&prof->heap, &t);
+    prof->total = t - start;
+  }
   return res;
 }
 
@@ -381,3 +782,24 @@ void QueryResult_Free(QueryResult *q) {
   free(q->ids);
   free(q);
 }
+
+char *QueryCursor_Format(QueryCursor *c) {
+  // the score is kept bit for bit, so the next page compares it to the same scores exactly
+  u_int64_t bits;
+  memcpy(&bits, &c->score, sizeof(bits));
+  return sdscatprintf(sdsempty(), "%llx.%016llx", (unsigned long long)c->docId,
+                      (unsigned long long)bits);
+}
+
+int QueryCursor_Parse(QueryCursor *c, const char *token) {
+  char *end;
+  if (!isxdigit(*token)) return REDISMODULE_ERR;
+  unsigned long long docId = strtoull(token, &end, 16);
+  if (*end != '.' || strlen(end + 1) != 16 || !isxdigit(end[1])) return REDISMODULE_ERR;
+  u_int64_t bits = strtoull(end + 1, &end, 16);
+  if (*end != '\0') return REDISMODULE_ERR;
+
+  c->docId = docId;
+  memcpy(&c->score, &bits, sizeof(bits));
+  return isnan(c->score) ? REDISMODULE_ERR : REDISMODULE_OK;
+}
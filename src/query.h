@@ -8,6 +8,8 @@
 #include "spec.h"
 #include "redis_index.h"
 #include "numeric_index.h"
+#include "util/arena.h"
+#include "segment.h"
 // QueryOp marks a query stage with its respective "op" in the query processing tree
 typedef enum {
     Q_INTERSECT,
@@ -18,10 +20,35 @@ typedef enum {
 } QueryOp;
 
 
+/* What the iterator of a query stage did during a profiled query execution. Counters of 
+iterators include the work of their children */
+typedef struct {
+    // did the stage have anything to read. Terms that are not in the index have nothing
+    int opened;
+    // bitmaps are not profiled, so that intersections and unions can still merge them directly.
+    // Their work is counted in their parent's time
+    int bitmap;
+    
+    size_t numRead;
+    size_t numSkipTo;
+    size_t numBatches;
+    // the hits the iterator returned, from all the calls
+    size_t numHits;
+    // wall time spent in the iterator, in nanoseconds
+    double time;
+    
+    // the work of the index reader of a term
+    IndexReaderStats reader;
+} QueryStageProfile;
+
 /* A query stage represents a single iterative execution stage of a query.
 the processing of a query is done by chaining multiple query stages in a tree, 
 and combining their inputs and outputs */
 typedef struct queryStage {
+    // the arena of the query the stage is a part of, which owns the stage, its children array and
+    // its term. NULL if they are malloc'd
+    Arena *arena;
+    
     void *value;
     int valueFreeable;
     QueryOp op;
@@ -29,12 +56,65 @@ typedef struct queryStage {
     struct queryStage **children;
     struct queryStage *parent;
     int nchildren;
+    
+    // the most documents the stage can match, as estimated by the planner. QUERYSTAGE_UNKNOWN_DOCS
+    // if the query was not planned
+    size_t numDocs;
+    
+    // the inverted index of a term, opened once by the planner and handed to the term's reader 
+    // when the stage is evaluated. NULL if the term has no index, or once the reader has it
+    Buffer *termBuf;
+    IndexHeader termHeader;
+    
+    // set if the query is profiled and the stage was evaluated
+    QueryStageProfile *profile;
 } QueryStage;
 
+#define QUERYSTAGE_UNKNOWN_DOCS __SIZE_MAX__
+// the capacity of the children arrays of arena stages when their first child is added
+#define QUERYSTAGE_MIN_CHILDREN 4
+// the block size of query arenas. It fits the stages of typical queries, the batch and the PQ of 
+// the default limit
+#define QUERY_ARENA_BLOCK_SIZE 8192
+
 
 
+/* How query results are scored */
+typedef enum {
+    // the stored term frequency times the document score, times the term's idf
+    QUERY_SCORER_TFIDF,
+    // BM25 with the length norms of the documents, times the document score
+    QUERY_SCORER_BM25,
+} QueryScorer;
+
+/* The totals of a profiled query execution, in nanoseconds */
+typedef struct {
+    // reading the hits from the root iterator
+    double iterate;
+    // scoring the hits
+    double score;
+    // keeping the top hits
+    double heap;
+    // loading the documents of the results, by the caller
+    double load;
+    // all of the query execution, from planning to the result
+    double total;
+} QueryProfile;
+
+/* A position in the ranking of results: results are ranked by score, and then by docId. A page of
+results can start after the last result of the previous page, so deep pages don't have to keep 
+all the results before them in the top results */
+typedef struct {
+    double score;
+    t_docId docId;
+} QueryCursor;
+
 /* A Query represents the parse tree and execution plan for a single search query */
 typedef struct query {
+    // everything the query allocates, including itself, its stages and their terms, and the 
+    // structures of its execution. Freed at once with the query
+    Arena *arena;
+    
     // the raw query text
     char *raw;
     // the raw text len
@@ -46,17 +126,37 @@ typedef struct query {
     size_t offset;
     // paging limit
     size_t limit;
+    // if set, only the results ranked after the cursor are returned, and the offset is ignored
+    QueryCursor *after;
         
     // field Id bitmask
     u_char fieldMask;
     
+    // if set, we don't count all the results, and let the iterators skip the hits that can't
+    // make it into the top results
+    int noTotal;
+    
+    // if set, the execution of the query and each of its stages is profiled
+    QueryProfile *profile;
+    
     // the query execution stage at the root of the query    
     QueryStage *root;
     // Document metatdata table, to be used during execution
     DocTable *docTable;
+    // the number of documents in the index, set by the planner from the document table. The idf
+    // of every term is computed from it once, when its reader is opened
+    size_t totalDocs;
+    
+    QueryScorer scorer;
+    // the document norms of BM25 scoring, loaded by the planner. NULL for tf-idf
+    DocNorms *norms;
+    // the write segment of the index, if it has postings not flushed to the inverted indexes yet.
+    // Set by the planner
+    Segment *segment;
     
     RedisSearchCtx *ctx;
     
+    // from the stemmer pool, so it is not freed with the query
     Stemmer *stemmer;
 } Query;
 
@@ -66,6 +166,8 @@ typedef struct queryResult {
     size_t totalResults;
     RedisModuleString **ids;
     size_t numIds;
+    // the position of the last result, that the next page can start after. Set if numIds > 0
+    QueryCursor last;
     int error;
     char *errorString;
 } QueryResult;
@@ -78,8 +180,10 @@ IndexIterator *Query_EvalStage(Query *q, QueryStage *s);
 /* Free the query execution stage and its children recursively */
 void QueryStage_Free(QueryStage *s);
 QueryStage *NewTokenStage(Query *q, QueryToken *qt);
-QueryStage *NewLogicStage(QueryOp op);
-QueryStage *NewNumericStage(NumericFilter *flt);
+/* A stage loading a term, that the stage owns from now on */
+QueryStage *NewTermStage(Query *q, char *term);
+QueryStage *NewLogicStage(Query *q, QueryOp op);
+QueryStage *NewNumericStage(Query *q, NumericFilter *flt);
 
 
 IndexIterator *query_EvalLoadStage(Query *q, QueryStage *stage);
@@ -105,9 +209,36 @@ void Query_Free(Query *q);
 /* Tokenize the raw query and build the execution plan */
 int Query_Tokenize(Query *q);
 
+/* Rewrite a stage tree into an equivalent one that is cheaper to evaluate: nested intersections
+and unions are flattened into their parents, and repeated terms are removed */
+void QueryStage_Rewrite(QueryStage *s);
+
+/* Plan the query before it is evaluated: rewrite its stages, estimate how many documents each 
+stage can match from the terms' index headers, and pick the strategy of numeric filters by it. 
+Intersections with a stage that can match nothing are evaluated without opening their other 
+terms */
+void Query_Plan(Query *q);
+
 /* Lazily execute the parsed query and all its stages, and return a final result object */
 QueryResult *Query_Execute(Query *query); 
 
+/* Start profiling the execution of a query. The totals are put in q->profile, and the counters
+of each stage in its profile */
+void Query_EnableProfile(Query *q);
+
+/* Describe the planned stage tree of the query, one stage per line, with the number of documents 
+each stage is estimated to match. Returns an sds string the caller should free */
+char *Query_Explain(Query *q);
+
+/* Monotonic time in nanoseconds, for profiling */
+double Query_Now();
+
 void QueryResult_Free(QueryResult *q);
 
+/* Format a cursor as an opaque token for the client to pass back. Returns an sds string the
+caller should free */
+char *QueryCursor_Format(QueryCursor *c);
+/* Parse a token formatted by QueryCursor_Format. Returns REDISMODULE_ERR if it is not one */
+int QueryCursor_Parse(QueryCursor *c, const char *token);
+
 #endif
\ No newline at end of file
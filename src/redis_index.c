@@ -2,6 +2,7 @@
 #include "redis_index.h"
 #include "util/logging.h"
 #include "doc_table.h"
+#include "segment.h"
 #include "rmutil/util.h"
 #include "rmutil/strings.h"
 
@@ -25,24 +26,57 @@ RedisModuleString *fmtRedisScoreIndexKey(RedisSearchCtx *ctx, const char *term)
   
   return RMUtil_CreateFormattedString(ctx->redisCtx, SCOREINDEX_KEY_FORMAT, ctx->spec->name, term);
 }
+
+RedisModuleString *fmtRedisOffsetsKey(RedisSearchCtx *ctx, const char *term) {
+  
+  return RMUtil_CreateFormattedString(ctx->redisCtx, OFFSETS_KEY_FORMAT, ctx->spec->name, term);
+}
+
+RedisModuleString *fmtRedisBitmapKey(RedisSearchCtx *ctx, const char *term) {
+  
+  return RMUtil_CreateFormattedString(ctx->redisCtx, BITMAP_KEY_FORMAT, ctx->spec->name, term);
+}
 /**
 * Open a redis index writer on a redis key
 */
+void Redis_IndexEncoding(RedisSearchCtx *ctx, u_int32_t *version, u_int32_t *codec, 
+                         u_int32_t *entryFlags) {
+  *version = INDEX_VERSION_LEGACY;
+  if (ctx->spec->flags & Index_SplitOffsets) {
+    *version = INDEX_VERSION_SPLIT;
+  } else if (ctx->spec->flags & Index_BlockEncoding) {
+    *version = INDEX_VERSION_BLOCKS;
+  }
+  *codec = ctx->spec->flags & Index_PForCodec ? BLOCK_CODEC_PFOR : BLOCK_CODEC_SVB;
+  *entryFlags = (ctx->spec->flags & Index_NoOffsets ? INDEX_ENTRY_NOOFFSETS : 0) |
+                (ctx->spec->flags & Index_NoFields ? INDEX_ENTRY_NOFIELDS : 0) |
+                (ctx->spec->flags & Index_NoFreqs ? INDEX_ENTRY_NOFREQS : 0);
+  // without offsets there's nothing to split out
+  if (*version == INDEX_VERSION_SPLIT && (*entryFlags & INDEX_ENTRY_NOOFFSETS)) {
+    *version = INDEX_VERSION_BLOCKS;
+  }
+}
+
 IndexWriter *Redis_OpenWriter(RedisSearchCtx *ctx, const char *term) {
   
   // Open the index writer
   RedisModuleString *termKey = fmtRedisTermKey(ctx, term);
   BufferWriter bw = NewRedisWriter(ctx->redisCtx, termKey);
   //RedisModule_FreeString(ctx->redisCtx, termKey);
-  // Open the skip index writer
+  
+  // Existing terms keep the version they were created with, new ones use the spec's encoding
+  IndexHeader h;
+  u_int32_t version, codec, entryFlags;
+  Redis_IndexEncoding(ctx, &version, &codec, &entryFlags);
+  if (indexReadHeader(bw.buf, &h) && h.size > 0) {
+    version = h.version;
+  }
+  
+  // Open the skip index writer. Block encoded indexes have an entry per block in it
+  BufferWriter skw = {NULL, redisWriterWrite, redisWriterTruncate, RedisBufferFree};
   termKey = fmtRedisSkipIndexKey(ctx, term);
   Buffer*sb = NewRedisBuffer(ctx->redisCtx, fmtRedisSkipIndexKey(ctx, term), BUFFER_WRITE);
-  BufferWriter skw = {
-        sb,
-        redisWriterWrite,
-        redisWriterTruncate,
-        RedisBufferFree,
-    };
+  skw.buf = sb;
   //RedisModule_FreeString(ctx->redisCtx, termKey);
   if (sb->cap > sizeof(u_int32_t)) {
     u_int32_t len;
@@ -55,14 +89,25 @@ IndexWriter *Redis_OpenWriter(RedisSearchCtx *ctx, const char *term) {
   // Open the score index writer
   ScoreIndexWriter scw = NewScoreIndexWriter(NewRedisWriter(ctx->redisCtx, fmtRedisScoreIndexKey(ctx, term)));
   //RedisModule_FreeString(ctx->redisCtx, termKey);
-  IndexWriter *w = NewIndexWriterBuf(bw, skw, scw);
+  
+  // Open the offsets stream writer of split indexes. The writer seeks to its end
+  BufferWriter ow = {NULL, redisWriterWrite, redisWriterTruncate, RedisBufferFree};
+  if (version == INDEX_VERSION_SPLIT) {
+    ow = NewRedisWriter(ctx->redisCtx, fmtRedisOffsetsKey(ctx, term));
+  }
+  IndexWriter *w = NewIndexWriterBuf(bw, skw, ow, scw, version, codec, entryFlags);
   return w;
 }
 
 void Redis_CloseWriter(IndexWriter *w) {
   IW_Close(w);
   RedisBufferFree(w->bw.buf);
-  RedisBufferFree(w->skipIndexWriter.buf);
+  if (w->skipIndexWriter.buf) {
+    RedisBufferFree(w->skipIndexWriter.buf);
+  }
+  if (w->offsetsWriter.buf) {
+    RedisBufferFree(w->offsetsWriter.buf);
+  }
   RedisBufferFree(w->scoreWriter.bw.buf);
   free(w);  
 }
@@ -93,20 +138,63 @@ ScoreIndex *LoadRedisScoreIndex(RedisSearchCtx *ctx, const char *term) {
 
 
 IndexReader *Redis_OpenReader(RedisSearchCtx *ctx, const char *term, DocTable *dt, 
-                              int singleWordMode, u_char fieldMask) {
+                              int singleWordMode, u_char fieldMask, Arena *arena) {
   Buffer *b = NewRedisBuffer(ctx->redisCtx, fmtRedisTermKey(ctx, term), BUFFER_READ);
   if (b == NULL) {  // not found
     return NULL;
   }
+  return Redis_OpenTermReader(ctx, term, b, dt, singleWordMode, fieldMask, arena);
+}
+
+IndexReader *Redis_OpenTermReader(RedisSearchCtx *ctx, const char *term, Buffer *b, DocTable *dt,
+                                  int singleWordMode, u_char fieldMask, Arena *arena) {
   SkipIndex *si = NULL;
   ScoreIndex *sci = NULL;
   if (singleWordMode) {
     sci = LoadRedisScoreIndex(ctx, term);
   } else {
+    // block encoded indexes have an entry per block. Ones written before that have none, and their
+    // readers walk the block headers instead
     si = LoadRedisSkipIndex(ctx, term);
   } 
   
-  return NewIndexReaderBuf(b, si, dt, singleWordMode, sci, fieldMask);
+  IndexReader *ir = NewIndexReaderBuf(b, si, dt, singleWordMode, sci, fieldMask, arena);
+  // the offsets stream is only needed if we look at term offsets
+  if (ir->header.version == INDEX_VERSION_SPLIT && !singleWordMode) {
+    ir->offsetsBuf = NewRedisBuffer(ctx->redisCtx, fmtRedisOffsetsKey(ctx, term), BUFFER_READ);
+  }
+  return ir;
+}
+
+Buffer *Redis_OpenTermBuffer(RedisSearchCtx *ctx, const char *term, IndexHeader *h) {
+  *h = (IndexHeader){0};
+  Buffer *b = NewRedisBuffer(ctx->redisCtx, fmtRedisTermKey(ctx, term), BUFFER_READ);
+  if (b == NULL) {
+    return NULL;
+  }
+  // readers read the header again, so they get the buffer from its start
+  indexReadHeader(b, h);
+  BufferSeek(b, 0);
+  return b;
+}
+
+BitmapReader *Redis_OpenBitmapReader(RedisSearchCtx *ctx, const char *term, const IndexHeader *h,
+                                     u_char fieldMask) {
+  Buffer *b = NewRedisBuffer(ctx->redisCtx, fmtRedisBitmapKey(ctx, term), BUFFER_READ);
+  DocBitmap *bm = NewDocBitmap(b);
+  if (bm == NULL) {
+    if (b) RedisBufferFree(b);
+    return NULL;
+  }
+  
+  // make sure no documents were added to the term since the bitmap was built
+  if (!DocBitmap_Matches(bm, h)) {
+    RedisBufferFree(b);
+    free(bm);
+    return NULL;
+  }
+  
+  return NewBitmapReader(bm, fieldMask);
 }
 
 void Redis_CloseReader(IndexReader *r) {
@@ -117,6 +205,9 @@ void Redis_CloseReader(IndexReader *r) {
   if (r->skipIdx != NULL) {
     free(r->skipIdx);
   }
+  if (r->offsetsBuf != NULL) {
+    RedisBufferFree(r->offsetsBuf);
+  }
   if (r->scoreIndex!=NULL) {
     ScoreIndex_Free(r->scoreIndex);
   }
@@ -143,21 +234,8 @@ t_docId Redis_GetDocId(RedisSearchCtx *ctx, RedisModuleString *docKey,
 
   // not found - increment the global id counter and set in the map
   if (RedisModule_CallReplyType(rep) == REDISMODULE_REPLY_NULL) {
-    RedisModuleCallReply *increp =
-        RedisModule_Call(ctx->redisCtx, "INCR", "c", REDISINDEX_DOCIDCOUNTER);
-    if (rep == NULL) return 0;
-
-    long long ll = RedisModule_CallReplyInteger(increp);
-    RedisModuleString *ls = RedisModule_CreateStringFromLongLong(ctx->redisCtx, ll);
-    
-    // map docId => key
-    RedisModule_Call(ctx->redisCtx, "HSET", "css", REDISINDEX_DOCIDS_MAP,
-                     ls, docKey);
-    // map key => docId                
-    RedisModule_Call(ctx->redisCtx, "HSET", "css", REDISINDEX_DOCKEY_MAP,
-                    docKey, ls);                     
     *isnew = 1;
-    return (t_docId)ll;
+    return Redis_NewDocId(ctx, docKey);
   }
 
   // just convert the response to a number and return it
@@ -172,6 +250,23 @@ t_docId Redis_GetDocId(RedisSearchCtx *ctx, RedisModuleString *docKey,
 }
 
 
+t_docId Redis_NewDocId(RedisSearchCtx *ctx, RedisModuleString *docKey) {
+  RedisModuleCallReply *increp =
+      RedisModule_Call(ctx->redisCtx, "INCR", "c", REDISINDEX_DOCIDCOUNTER);
+  if (increp == NULL) return 0;
+
+  long long ll = RedisModule_CallReplyInteger(increp);
+  RedisModuleString *ls = RedisModule_CreateStringFromLongLong(ctx->redisCtx, ll);
+  
+  // map docId => key
+  RedisModule_Call(ctx->redisCtx, "HSET", "css", REDISINDEX_DOCIDS_MAP,
+                   ls, docKey);
+  // map key => docId                
+  RedisModule_Call(ctx->redisCtx, "HSET", "css", REDISINDEX_DOCKEY_MAP,
+                  docKey, ls);                     
+  return (t_docId)ll;
+}
+
 RedisModuleString *Redis_GetDocKey(RedisSearchCtx *ctx, t_docId docId) {
   RedisModuleCallReply *rep =
       RedisModule_Call(ctx->redisCtx, "HGET", "cs", REDISINDEX_DOCIDS_MAP,
@@ -252,6 +347,53 @@ int DocTable_PutDocument(DocTable *t, t_docId docId, double score, u_short flags
     
 }
 
+size_t DocTable_NumDocs(DocTable *t) {
+  return t->key ? RedisModule_ValueLength(t->key) : 0;
+}
+
+int Redis_PutDocNorm(RedisSearchCtx *ctx, t_docId docId, u_int32_t len, float maxFreq,
+                     float score) {
+  RedisModuleKey *k = RedisModule_OpenKey(
+      ctx->redisCtx, RMUtil_CreateFormattedString(ctx->redisCtx, DOCNORMS_KEY_FMT, ctx->spec->name),
+      REDISMODULE_READ | REDISMODULE_WRITE);
+  if (k == NULL || (RedisModule_KeyType(k) != REDISMODULE_KEYTYPE_STRING &&
+                    RedisModule_KeyType(k) != REDISMODULE_KEYTYPE_EMPTY)) {
+    return REDISMODULE_ERR;
+  }
+
+  // grow the array up to the docId. Truncating pads with zeros, which is "no record"
+  size_t sz = RedisModule_ValueLength(k);
+  size_t need = sizeof(DocNormsHeader) + ((size_t)docId + 1) * sizeof(DocNorm);
+  if (sz < need && RedisModule_StringTruncate(k, need) == REDISMODULE_ERR) {
+    RedisModule_CloseKey(k);
+    return REDISMODULE_ERR;
+  }
+
+  char *data = RedisModule_StringDMA(k, &sz, REDISMODULE_WRITE);
+  DocNormsHeader *h = (DocNormsHeader *)data;
+  DocNorm *n = (DocNorm *)(data + sizeof(DocNormsHeader)) + docId;
+  DocNorm_Init(n, len, maxFreq, score);
+  h->numDocs++;
+  h->totalLen += len;
+  if (DocNorm_Score(n) > h->maxScore) h->maxScore = DocNorm_Score(n);
+
+  RedisModule_CloseKey(k);
+  return REDISMODULE_OK;
+}
+
+DocNorms *Redis_LoadDocNorms(RedisSearchCtx *ctx) {
+  // the key is left open, as the norms point into its string until the end of the command
+  RedisModuleKey *k = RedisModule_OpenKey(
+      ctx->redisCtx, RMUtil_CreateFormattedString(ctx->redisCtx, DOCNORMS_KEY_FMT, ctx->spec->name),
+      REDISMODULE_READ);
+  if (k == NULL || RedisModule_KeyType(k) != REDISMODULE_KEYTYPE_STRING) {
+    return NewDocNorms(NULL, 0);
+  }
+  size_t len;
+  const char *data = RedisModule_StringDMA(k, &len, REDISMODULE_READ);
+  return NewDocNorms(data, len);
+}
+
 void Document_Free(Document doc) {
     free(doc.fields);
 }
@@ -370,6 +512,28 @@ end:
 
 
 
+/* Build the bitmap of a term if it is dense enough, or delete it if it isn't */
+static void redis_optimizeBitmap(RedisSearchCtx *ctx, const char *term, u_int32_t ndocs, 
+                                 t_docId lastId) {
+    RedisModuleString *bmk = fmtRedisBitmapKey(ctx, term);
+    if (!BITMAP_SHOULD_BUILD(ndocs, lastId)) {
+        RedisModule_Call(ctx->redisCtx, "DEL", "s", bmk);
+        RedisModule_FreeString(ctx->redisCtx, bmk);
+        return;
+    }
+    
+    IndexReader *ir = Redis_OpenReader(ctx, term, NULL, 0, 0xff, NULL);
+    if (ir == NULL) {
+        RedisModule_FreeString(ctx->redisCtx, bmk);
+        return;
+    }
+    BufferWriter bw = NewRedisWriter(ctx->redisCtx, bmk);
+    DocBitmap_Build(ir, &bw);
+    bw.Truncate(bw.buf, 0);
+    RedisBufferFree(bw.buf);
+    Redis_CloseReader(ir);
+}
+
 int Redis_OptimizeScanHandler(RedisModuleCtx *ctx, RedisModuleString *kn, void *opaque) {
     
     //extract the term from the key
@@ -386,6 +550,8 @@ int Redis_OptimizeScanHandler(RedisModuleCtx *ctx, RedisModuleString *kn, void *
     // Open the index writer for the term
     IndexWriter *w = Redis_OpenWriter(sctx, term);
     if (w) {
+        u_int32_t ndocs = w->ndocs;
+        t_docId lastId = w->lastId;
         
         // Truncate the main index buffer to its final size
          w->bw.Truncate(w->bw.buf, 0);
@@ -402,9 +568,19 @@ int Redis_OptimizeScanHandler(RedisModuleCtx *ctx, RedisModuleString *kn, void *
         }
         
         // truncate the skip index
-         w->skipIndexWriter.Truncate(w->skipIndexWriter.buf, 0);
+        if (w->skipIndexWriter.buf) {
+            w->skipIndexWriter.Truncate(w->skipIndexWriter.buf, 0);
+        }
+        
+        // truncate the offsets stream
+        if (w->offsetsWriter.buf) {
+            w->offsetsWriter.Truncate(w->offsetsWriter.buf, 0);
+        }
         
         Redis_CloseWriter(w);
+        
+        // very frequent terms get a bitmap too, the bitmaps of the rest are dropped
+        redis_optimizeBitmap(sctx, term, ndocs, lastId);
     }
     
     RedisModule_FreeString(ctx, pf);
@@ -428,11 +604,15 @@ int Redis_DropScanHandler(RedisModuleCtx *ctx, RedisModuleString *kn, void *opaq
     
     RedisModuleString *sck = fmtRedisScoreIndexKey(sctx, term);
     RedisModuleString *sik = fmtRedisSkipIndexKey(sctx, term);
+    RedisModuleString *ovk = fmtRedisOffsetsKey(sctx, term);
+    RedisModuleString *bmk = fmtRedisBitmapKey(sctx, term);
     
-    RedisModule_Call(ctx, "DEL", "sss", kn, sck, sik);
+    RedisModule_Call(ctx, "DEL", "sssss", kn, sck, sik, ovk, bmk);
      
     RedisModule_FreeString(ctx, sck);
     RedisModule_FreeString(ctx, sik);
+    RedisModule_FreeString(ctx, ovk);
+    RedisModule_FreeString(ctx, bmk);
     free(term);
 
     return REDISMODULE_OK;
@@ -465,6 +645,12 @@ int Redis_DropIndex(RedisSearchCtx *ctx, int deleteDocuments) {
                          REDISINDEX_DOCIDCOUNTER, dmd);
     }
     
+    // the norms describe the documents as the index saw them, so they go with the index, and so 
+    // does the record of documents whose postings went to the write segment
+    RedisModule_Call(ctx->redisCtx, "DEL", "ss", 
+                     RMUtil_CreateFormattedString(ctx->redisCtx, DOCNORMS_KEY_FMT, ctx->spec->name),
+                     RMUtil_CreateFormattedString(ctx->redisCtx, SEGMENT_KEY_FMT, ctx->spec->name));
+    
     RedisModuleString *pf = fmtRedisTermKey(ctx, "*");
     const char *prefix = RedisModule_StringPtrLen(pf, &len);
   
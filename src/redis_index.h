@@ -6,18 +6,45 @@
 #include "spec.h"
 #include "search_ctx.h"
 #include "document.h"
+#include "doc_bitmap.h"
 
 /* Open an index writer on a redis DMA string, for a specific term */
 IndexWriter *Redis_OpenWriter(RedisSearchCtx *ctx, const char *term);
+/* The version, block codec and entry layout new inverted indexes are written with by the spec */
+void Redis_IndexEncoding(RedisSearchCtx *ctx, u_int32_t *version, u_int32_t *codec, 
+                         u_int32_t *entryFlags);
 /* Close the redis index writer */
 void Redis_CloseWriter(IndexWriter *w);
 
 /* Open an inverted index reader on a redis DMA string, for a specific term. 
-If singleWordMode is set to 1, we do not load the skip index, only the score index */
+If singleWordMode is set to 1, we do not load the skip index, only the score index. The reader is
+allocated from the arena if one is given, see NewIndexReaderBuf */
 IndexReader *Redis_OpenReader(RedisSearchCtx *ctx, const char *term, DocTable *dt,
-                               int singleWordMode, u_char fieldMask);
+                               int singleWordMode, u_char fieldMask, Arena *arena);
+/* Open a reader on the inverted index of a term that was already opened with
+Redis_OpenTermBuffer. The reader takes over the buffer */
+IndexReader *Redis_OpenTermReader(RedisSearchCtx *ctx, const char *term, Buffer *b, DocTable *dt,
+                                  int singleWordMode, u_char fieldMask, Arena *arena);
 void Redis_CloseReader(IndexReader *r);
 
+/* Open the inverted index of a term and read its header into h, without opening a reader. 
+Returns NULL, with h zeroed, if the term has no index */
+Buffer *Redis_OpenTermBuffer(RedisSearchCtx *ctx, const char *term, IndexHeader *h);
+
+/* Open the bitmap of a term for reading, given the header of its inverted index. Returns NULL if 
+the term has no bitmap, or if the bitmap was built before the term's inverted index last changed */
+BitmapReader *Redis_OpenBitmapReader(RedisSearchCtx *ctx, const char *term, const IndexHeader *h,
+                                     u_char fieldMask);
+
+/* Write the norms record of a document to the index's norms key: its length in tokens, the
+highest frequency of its terms and its score */
+int Redis_PutDocNorm(RedisSearchCtx *ctx, t_docId docId, u_int32_t len, float maxFreq, 
+                     float score);
+
+/* Load the document norms of the index for BM25 scoring. An index with no norms key loads empty
+norms. The norms reference the key's string, so they are valid until the end of the command */
+DocNorms *Redis_LoadDocNorms(RedisSearchCtx *ctx);
+
 /* Load the skip index entry of a redis term */
 SkipIndex *Redis_LoadSkipIndex(RedisSearchCtx *ctx, const char *term);
 
@@ -26,6 +53,8 @@ SkipIndex *Redis_LoadSkipIndex(RedisSearchCtx *ctx, const char *term);
 #define TERM_KEY_FORMAT "ft:%s/%s"
 #define SKIPINDEX_KEY_FORMAT "si:%s/%s"
 #define SCOREINDEX_KEY_FORMAT "ss:%s/%s"
+#define OFFSETS_KEY_FORMAT "ov:%s/%s"
+#define BITMAP_KEY_FORMAT "bm:%s/%s"
 
 
 typedef int (*ScanFunc)(RedisModuleCtx *ctx, RedisModuleString *keyName, void *opaque);
@@ -56,6 +85,8 @@ int Redis_StatsScanHandler(RedisModuleCtx *ctx, RedisModuleString *kn, void *opa
 */
 RedisModuleString *fmtRedisTermKey(RedisSearchCtx *ctx, const char *term);
 RedisModuleString *fmtRedisSkipIndexKey(RedisSearchCtx *ctx, const char *term);
+RedisModuleString *fmtRedisOffsetsKey(RedisSearchCtx *ctx, const char *term);
+RedisModuleString *fmtRedisBitmapKey(RedisSearchCtx *ctx, const char *term);
 /**
 * Open a redis index writer on a redis key
 */
@@ -73,6 +104,9 @@ void Redis_CloseWriter(IndexWriter *w);
 #define REDISINDEX_DOCIDCOUNTER "__redis_docIdCounter__"
 
 t_docId Redis_GetDocId(RedisSearchCtx *ctx, RedisModuleString *docKey, int *isnew); 
+/* Give a document a new docId, mapping its key to it, e.g. to index it again after its postings were
+lost. Returns 0 on error */
+t_docId Redis_NewDocId(RedisSearchCtx *ctx, RedisModuleString *docKey);
 RedisModuleString *Redis_GetDocKey(RedisSearchCtx *ctx, t_docId docId);
 
 
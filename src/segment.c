@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "segment.h"
+#include "redis_index.h"
+#include "util/logging.h"
+#include "rmutil/sds.h"
+#include "rmutil/strings.h"
+
+KHASH_MAP_INIT_STR(segments, Segment *)
+
+// the segments of all the indexes, by "<db>:<index name>"
+static khash_t(segments) *segments = NULL;
+
+static double segment_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Format the name of the segment of the index of ctx. The caller should free it with sdsfree */
+static sds segment_name(RedisSearchCtx *ctx) {
+    return sdscatprintf(sdsempty(), "%d:%s", RedisModule_GetSelectedDb(ctx->redisCtx), 
+                        ctx->spec->name);
+}
+
+Segment *Segment_Get(RedisSearchCtx *ctx, int create) {
+    if (segments == NULL) {
+        if (!create) return NULL;
+        segments = kh_init(segments);
+    }
+    sds name = segment_name(ctx);
+    khiter_t k = kh_get(segments, segments, name);
+    if (k != kh_end(segments)) {
+        sdsfree(name);
+        return kh_value(segments, k);
+    }
+    if (!create) {
+        sdsfree(name);
+        return NULL;
+    }
+
+    Segment *s = calloc(1, sizeof(Segment));
+    s->terms = kh_init(segterms);
+    int ret;
+    k = kh_put(segments, segments, name, &ret);
+    kh_value(segments, k) = s;
+    return s;
+}
+
+/* The key of the index of ctx keeping the first docId whose postings may not be flushed */
+static RedisModuleString *segment_key(RedisSearchCtx *ctx) {
+    return RMUtil_CreateFormattedString(ctx->redisCtx, SEGMENT_KEY_FMT, ctx->spec->name);
+}
+
+/* The first docId of the index of ctx whose postings may not be flushed, or 0 if there's none */
+static t_docId segment_pendingFrom(RedisSearchCtx *ctx) {
+    RedisModuleCallReply *rep = RedisModule_Call(ctx->redisCtx, "GET", "s", segment_key(ctx));
+    if (rep == NULL || RedisModule_CallReplyType(rep) != REDISMODULE_REPLY_STRING) {
+        return 0;
+    }
+    
+    long long id;
+    if (RedisModule_StringToLongLong(RedisModule_CreateStringFromCallReply(rep), &id) != 
+        REDISMODULE_OK) {
+        return 0;
+    }
+    return (t_docId)id;
+}
+
+void Segment_AddDocuments(RedisSearchCtx *ctx, Segment *s, t_docId docId) {
+    if (s->firstDocId == 0) {
+        s->firstDocId = docId;
+    }
+    if (s->pending) return;
+    
+    // documents lost before keep the key at their first docId
+    RedisModule_Call(ctx->redisCtx, "SET", "slc", segment_key(ctx), (long long)docId, "NX");
+    s->pending = 1;
+}
+
+int Segment_IsLost(RedisSearchCtx *ctx, t_docId docId) {
+    t_docId from = segment_pendingFrom(ctx);
+    if (from == 0 || docId < from) return 0;
+    
+    // the segment of the running server has every document since its first one, in memory or 
+    // flushed
+    Segment *s = Segment_Get(ctx, 0);
+    return s == NULL || s->firstDocId == 0 || docId < s->firstDocId;
+}
+
+void Segment_Add(RedisSearchCtx *ctx, Segment *s, ForwardIndexEntry *e) {
+    SegmentTerm *t = NULL;
+    khiter_t k = kh_get(segterms, s->terms, e->term);
+    if (k == kh_end(s->terms)) {
+        t = calloc(1, sizeof(SegmentTerm));
+        t->term = strdup(e->term);
+        // the postings are read in memory, so they are block encoded whatever the index's
+        // version, and keep the parts of the entries the index keeps
+        u_int32_t version, codec, entryFlags;
+        Redis_IndexEncoding(ctx, &version, &codec, &entryFlags);
+        t->w = NewIndexWriter(64, INDEX_VERSION_BLOCKS, codec, entryFlags);
+        int ret;
+        k = kh_put(segterms, s->terms, t->term, &ret);
+        kh_value(s->terms, k) = t;
+    } else {
+        t = kh_value(s->terms, k);
+    }
+
+    IW_WriteEntry(t->w, e);
+    // write the headers, so readers opened from now on see the entry
+    IW_Close(t->w);
+
+    if (t->numEntries == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 4;
+        t->entries = realloc(t->entries, t->cap * sizeof(ForwardIndexEntry));
+    }
+    ForwardIndexEntry *se = &t->entries[t->numEntries++];
+    *se = *e;
+    se->term = t->term;
+    e->vw = NULL;
+
+    if (s->numPostings++ == 0) {
+        s->since = segment_now();
+    }
+    if (e->docId > s->lastDocId) {
+        s->lastDocId = e->docId;
+    }
+}
+
+SegmentTerm *Segment_GetTerm(Segment *s, const char *term) {
+    khiter_t k = kh_get(segterms, s->terms, term);
+    return k == kh_end(s->terms) ? NULL : kh_value(s->terms, k);
+}
+
+IndexReader *SegmentTerm_OpenReader(SegmentTerm *t, DocTable *dt, u_char fieldMask, Arena *arena) {
+    return NewIndexReaderBuf(NewBuffer(t->w->bw.buf->data, IW_Len(t->w), BUFFER_READ), NULL, dt, 0,
+                             NULL, fieldMask, arena);
+}
+
+int Segment_FlushDue(Segment *s) {
+    return s->numPostings >= SEGMENT_MAX_POSTINGS ||
+           (s->numPostings > 0 && segment_now() - s->since >= SEGMENT_MAX_AGE_MS * 1e6);
+}
+
+static void segmentTerm_Free(SegmentTerm *t) {
+    for (size_t i = 0; i < t->numEntries; i++) {
+        VVW_Free(t->entries[i].vw);
+    }
+    free(t->entries);
+    t->w->scoreWriter.bw.Release(t->w->scoreWriter.bw.buf);
+    IW_Free(t->w);
+    free(t->term);
+    free(t);
+}
+
+size_t Segment_Flush(RedisSearchCtx *ctx, Segment *s, double budgetMs) {
+    double start = segment_now();
+    size_t n = 0;
+    for (khiter_t k = kh_begin(s->terms); k != kh_end(s->terms); ++k) {
+        if (!kh_exist(s->terms, k)) continue;
+        if (budgetMs > 0 && segment_now() - start >= budgetMs * 1e6) break;
+
+        SegmentTerm *t = kh_value(s->terms, k);
+        IndexWriter *w = Redis_OpenWriter(ctx, t->term);
+        for (size_t i = 0; i < t->numEntries; i++) {
+            IW_WriteEntry(w, &t->entries[i]);
+        }
+        Redis_CloseWriter(w);
+
+        n += t->numEntries;
+        kh_del(segterms, s->terms, k);
+        segmentTerm_Free(t);
+    }
+    LG_DEBUG("Flushed %zd postings of %zd\n", n, s->numPostings);
+
+    // what's left is still due, so the next writes go on flushing it
+    s->numPostings -= n;
+    
+    if (s->numPostings == 0 && s->pending) {
+        // documents before the first one of the segment were lost with the segment of a server 
+        // that restarted, and can still be added again
+        t_docId from = segment_pendingFrom(ctx);
+        if (from >= s->firstDocId) {
+            RedisModule_Call(ctx->redisCtx, "DEL", "s", segment_key(ctx));
+        }
+        s->pending = 0;
+    }
+    return n;
+}
+
+void Segment_Drop(RedisSearchCtx *ctx) {
+    if (segments == NULL) return;
+    sds name = segment_name(ctx);
+    khiter_t k = kh_get(segments, segments, name);
+    sdsfree(name);
+    if (k == kh_end(segments)) return;
+
+    Segment *s = kh_value(segments, k);
+    for (khiter_t j = kh_begin(s->terms); j != kh_end(s->terms); ++j) {
+        if (kh_exist(s->terms, j)) {
+            segmentTerm_Free(kh_value(s->terms, j));
+        }
+    }
+    kh_destroy(segterms, s->terms);
+    free(s);
+    sdsfree((sds)kh_key(segments, k));
+    kh_del(segments, segments, k);
+}
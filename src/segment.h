@@ -0,0 +1,100 @@
+#ifndef __SEGMENT_H__
+#define __SEGMENT_H__
+
+#include "index.h"
+#include "forward_index.h"
+#include "search_ctx.h"
+#include "util/khash.h"
+
+/*
+The write segment of an index created with WRITEBUFFER keeps the postings of new documents in
+memory, instead of appending them to the DMA strings of their terms one document at a time.
+
+Every term of the segment has its postings encoded in memory like a block encoded inverted index,
+so queries read them with an ordinary index reader, next to the reader of the term's persisted
+index. The segment only has documents added after everything in the persisted indexes, so the two
+readers never yield the same docId, and a union of them yields the term's postings in order.
+
+Flushing the segment appends the postings of each of its terms to the term's inverted index in
+one go, opening the term's keys and rewriting its headers once. The module API has no timers or
+threads, so segments are flushed by the commands that write to them: once a segment has
+SEGMENT_MAX_POSTINGS postings or its oldest posting is SEGMENT_MAX_AGE_MS old, every write to
+it flushes terms for up to SEGMENT_FLUSH_SLICE_MS, and FT.FLUSH flushes all of it.
+
+Segments live in the module's memory and are not saved with the keys: postings that were not
+flushed are lost when the server restarts, but the documents and their metadata are not. So the
+index keeps the first docId whose postings went to a segment and may not be flushed yet in a key,
+and documents from it on that the segment of the running server never had are taken as lost, and
+can be added again under a new docId. The key is removed once a segment holding all of them since
+that docId is flushed.
+*/
+
+#define SEGMENT_MAX_POSTINGS 100000
+#define SEGMENT_MAX_AGE_MS 1000
+#define SEGMENT_FLUSH_SLICE_MS 5
+
+// the key of an index keeping the first docId whose postings may not be flushed
+#define SEGMENT_KEY_FMT "__sg:%s__"
+
+/* The postings of a term in the segment */
+typedef struct {
+    char *term;
+    // the postings encoded in memory, for queries to read
+    IndexWriter *w;
+    // the entries the postings were encoded from, to append to the term's index when flushed.
+    // Their offset vectors are owned by the segment
+    ForwardIndexEntry *entries;
+    size_t numEntries;
+    size_t cap;
+} SegmentTerm;
+
+KHASH_MAP_INIT_STR(segterms, SegmentTerm *)
+
+typedef struct {
+    khash_t(segterms) *terms;
+    size_t numPostings;
+    // when the oldest posting was added, in ns of CLOCK_MONOTONIC
+    double since;
+    // the highest docId ever added, flushed or not
+    t_docId lastDocId;
+    // the first docId added since the segment was created, flushed or not
+    t_docId firstDocId;
+    // is the index's key set to a docId no higher than the postings in the segment
+    int pending;
+} Segment;
+
+/* Get the write segment of the index of ctx, in the currently selected db. If it has none, a new
+one is created if create is set, otherwise NULL is returned */
+Segment *Segment_Get(RedisSearchCtx *ctx, int create);
+
+/* Record that the postings of documents from docId on are added to the segment, before adding them,
+so that they are known to be lost if the server restarts before they are flushed */
+void Segment_AddDocuments(RedisSearchCtx *ctx, Segment *s, t_docId docId);
+
+/* Were the postings of a document of the index of ctx added to a write segment that was lost when
+the server restarted, so that it is not in the index and may be added again */
+int Segment_IsLost(RedisSearchCtx *ctx, t_docId docId);
+
+/* Add a normalized forward index entry of a new document to the segment. The segment takes the
+entry's offset vector, leaving the entry's vw NULL */
+void Segment_Add(RedisSearchCtx *ctx, Segment *s, ForwardIndexEntry *e);
+
+/* The postings of a term in the segment, or NULL if it has none */
+SegmentTerm *Segment_GetTerm(Segment *s, const char *term);
+
+/* Open a reader on the postings of a term in the segment, allocated from the arena if one is given */
+IndexReader *SegmentTerm_OpenReader(SegmentTerm *t, DocTable *dt, u_char fieldMask, Arena *arena);
+
+/* Should the segment be flushed, as it has too many or too old postings */
+int Segment_FlushDue(Segment *s);
+
+/* Append the postings of the segment's terms to their inverted indexes, one term after the other,
+until they are all flushed or budgetMs milliseconds have passed. A budget of 0 flushes all the
+terms. Once the segment is empty, the index's key of postings not flushed is removed, unless it
+has documents lost before the segment was created. Returns the number of postings flushed */
+size_t Segment_Flush(RedisSearchCtx *ctx, Segment *s, double budgetMs);
+
+/* Discard the segment of the index of ctx, if it has one, e.g. when the index is dropped */
+void Segment_Drop(RedisSearchCtx *ctx);
+
+#endif
@@ -27,39 +27,31 @@ inline int si_isPos(SkipIndex *idx, u_int i, t_docId docId) {
 
 inline SkipEntry *SkipIndex_Find(SkipIndex *idx, t_docId docId, u_int *offset) {
     
-    if (idx == NULL || idx->len == 0 || docId < idx->entries[0].docId) {
+    if (idx == NULL || idx->len == 0 || docId <= idx->entries[0].docId) {
         return NULL;
     } 
-    if (docId > idx->entries[idx->len-1].docId) {
-        *offset = idx->len - 1; 
-        return &idx->entries[idx->len-1];
+    
+    // skips move forward, so we gallop from the last entry we found with doubling steps, and 
+    // binary search the last step. Skipping k entries ahead takes O(log k) comparisons
+    u_int lo = *offset < idx->len && idx->entries[*offset].docId < docId ? *offset : 0;
+    u_int hi = lo + 1, step = 1;
+    while (hi < idx->len && idx->entries[hi].docId < docId) {
+        lo = hi;
+        step <<= 1;
+        hi = lo + step;
+    }
+    if (hi > idx->len) {
+        hi = idx->len;
     }
-    u_int top = idx->len, bottom = *offset;
-    u_int i = bottom;
-    int newi;
-    while (bottom < top) {
-        //LG_DEBUG("top %d, bottom: %d idx %d, i %d, docId %d\n", top, bottom, idx->entries[i].docId, i, docId );
-       if (si_isPos(idx, i, docId)) {
-           //LG_DEBUG("IS POS!\n");
-           *offset = i;
-           return &idx->entries[i];
-       }
-       //LG_DEBUG("NOT POS!\n");
-       
-       if (docId <= idx->entries[i].docId) {
-           top = i ;
-       } else {
-           bottom = i ;
-       }
-       newi = (bottom + top)/2;
-       //LG_DEBUG("top %d, bottom: %d, new i: %d\n", top, bottom, newi);
-       if (newi == i) {
-           break;
-       }
-       i = newi;
+    // entries[lo] is before docId, and entries[hi] is not, if it exists
+    while (hi - lo > 1) {
+        u_int mid = lo + (hi - lo) / 2;
+        if (idx->entries[mid].docId < docId) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
     }
-    // if (i == 0) {
-    //     return &idx->entries[0];
-    // }
-    return NULL;
+    *offset = lo;
+    return &idx->entries[lo];
 }
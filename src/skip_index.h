@@ -33,7 +33,8 @@ Find the closest skip entry for a given docId in a skip index.
 If the an entry is not found we return null.
 
 Otherwise we return the skipEntry that comes before the document, so we can
-skip to it and scan one at a time from it 
+skip to it and scan one at a time from it. The search gallops forward from the entry at
+*offset, the last one found, and leaves the new entry's index there
 */
 SkipEntry *SkipIndex_Find(SkipIndex *idx, t_docId docId, u_int *offset);
 int si_isPos(SkipIndex *idx, u_int i, t_docId docId);
@@ -1,5 +1,6 @@
 #include "spec.h"
 #include "rmutil/strings.h"
+#include "rmutil/sds.h"
 #include "util/logging.h"
 
 #include <math.h>
@@ -19,20 +20,33 @@ FieldSpec *IndexSpec_GetField(IndexSpec *spec, const char *name, size_t len) {
     return NULL;
 };
 
+/* The index options that may precede the field specs, and the flags they set */
+static struct {
+    const char *name;
+    IndexFlags flags;
+} spec_options[] = {
+    {SPEC_BLOCKS_STR, Index_BlockEncoding},
+    // split offsets only make sense with block encoding
+    {SPEC_SPLITOFFSETS_STR, Index_BlockEncoding | Index_SplitOffsets},
+    // so does the block codec
+    {SPEC_PFOR_STR, Index_BlockEncoding | Index_PForCodec},
+    {SPEC_NOOFFSETS_STR, Index_NoOffsets},
+    {SPEC_NOFIELDS_STR, Index_NoFields},
+    {SPEC_NOFREQS_STR, Index_NoFreqs},
+    {SPEC_WRITEBUFFER_STR, Index_WriteBuffer},
+    {NULL, 0},
+};
+
 /* 
 * Parse an index spec from redis command arguments.
 * Returns REDISMODULE_ERR if there's a parsing error.
 * The command only receives the relvant part of argv.
 * 
-* The format currently is <field> <NUMERIC|weight>, <field> <NUMERIC|weight> ... 
+* The format currently is [BLOCKS] [SPLITOFFSETS] ... [STOPWORDS <num> <word> ...] [SCHEMA]
+* <field> <NUMERIC|weight>, <field> <NUMERIC|weight> ... 
 */
 int IndexSpec_ParseRedisArgs(IndexSpec *spec, RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     
-    if (argc % 2) {
-        return RedisModule_WrongArity(ctx);
-    }
-    
-    
     const char *args[argc];
     for (int i = 0; i < argc; i++) {
         args[i] = RedisModule_StringPtrLen(argv[i], NULL);
@@ -41,16 +55,65 @@ int IndexSpec_ParseRedisArgs(IndexSpec *spec, RedisModuleCtx *ctx, RedisModuleSt
     return IndexSpec_Parse(spec, args, argc);
 }
 
-int IndexSpec_Parse(IndexSpec *spec, const char **argv, int argc) {
-    if (argc % 2) {
-        return REDISMODULE_ERR;
+KHASH_MAP_INIT_STR(specstopwords, StopWordList *)
+
+// the stopword lists of the specs loaded so far, by "<db>:<index name>", so that the commands 
+// loading a spec don't build its list every time
+static khash_t(specstopwords) *spec_stopwords = NULL;
+
+/* Format the name an index's stopwords are cached by. The caller should free it with sdsfree */
+static sds spec_cacheName(RedisModuleCtx *ctx, const char *name) {
+    return sdscatprintf(sdsempty(), "%d:%s", RedisModule_GetSelectedDb(ctx), name);
+}
+
+/* Parse a spec, with the index options before the fields if options is set, or the fields alone.
+A list of stopwords of the same length as the cached one, if given, is the cached one */
+static int spec_parse(IndexSpec *spec, const char **argv, int argc, int options, 
+                      StopWordList *cached) {
+    
+    spec->flags = 0;
+    spec->fields = NULL;
+    spec->stopwords = NULL;
+    
+    // parse the index options preceding the field specs, up to the first word that isn't one,
+    // or up to SCHEMA, after which fields may be named like options
+    int i = 0;
+    for (; options && i < argc; i++) {
+        if (!strcasecmp(argv[i], SPEC_SCHEMA_STR)) {
+            i++;
+            break;
+        }
+        // a list of stopwords replacing the default ones, which may be empty
+        if (!strcasecmp(argv[i], SPEC_STOPWORDS_STR)) {
+            char *end = NULL;
+            long n = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : -1;
+            if (spec->stopwords || n < 0 || end == argv[i + 1] || *end != '\0' || 
+                n > argc - i - 2) {
+                goto failure;
+            }
+            spec->stopwords = cached && cached->numWords == (size_t)n ? StopWordList_Retain(cached) :
+                                                                        NewStopWordList(&argv[i + 2], n);
+            i += 1 + n;
+            continue;
+        }
+        int o = 0;
+        while (spec_options[o].name && strcasecmp(argv[i], spec_options[o].name)) o++;
+        if (spec_options[o].name == NULL) {
+            break;
+        }
+        spec->flags |= spec_options[o].flags;
+    }
+    
+    // we need at least one field after the options
+    if (i >= argc || (argc - i) % 2) {
+        goto failure;
     }
     
     int id = 1;
     spec->numFields = 0;
-    spec->fields = calloc(argc/2, sizeof(FieldSpec));
+    spec->fields = calloc((argc - i)/2, sizeof(FieldSpec));
     int n = 0;
-    for (int i = 0; i < argc; i+=2, id *= 2) {
+    for (; i < argc; i+=2, id *= 2) {
         //size_t sz;
         spec->fields[n].name = argv[i];
         double d = 0;
@@ -82,15 +145,23 @@ failure: //on failure free the spec fields array and return an error
     
     free(spec->fields);
     spec->fields =  NULL;
+    StopWordList_Free(spec->stopwords);
+    spec->stopwords = NULL;
     return REDISMODULE_ERR;
     
 }
 
+int IndexSpec_Parse(IndexSpec *spec, const char **argv, int argc) {
+    return spec_parse(spec, argv, argc, 1, NULL);
+}
+
 void IndexSpec_Free(IndexSpec *spec) {
     
     if (spec->fields != NULL) {
         free(spec->fields);
     }
+    StopWordList_Free(spec->stopwords);
+    spec->stopwords = NULL;
 }
 
 /* Saves the spec as a LIST, containing basically the arguments needed to recreate the spec */
@@ -109,6 +180,28 @@ int IndexSpec_Save(RedisModuleCtx *ctx, IndexSpec *sp) {
     }
     
     
+    for (int o = 0; spec_options[o].name != NULL; o++) {
+        if ((sp->flags & spec_options[o].flags) == spec_options[o].flags) {
+            RedisModule_ListPush(k, REDISMODULE_LIST_TAIL, RedisModule_CreateString(ctx, spec_options[o].name, 
+                                                                                    strlen(spec_options[o].name)));
+        }
+    }
+    
+    if (sp->stopwords) {
+        StopWordList *sl = sp->stopwords;
+        RedisModule_ListPush(k, REDISMODULE_LIST_TAIL, RedisModule_CreateString(ctx, SPEC_STOPWORDS_STR, 
+                                                                                strlen(SPEC_STOPWORDS_STR)));
+        RedisModule_ListPush(k, REDISMODULE_LIST_TAIL, RMUtil_CreateFormattedString(ctx, "%zd", sl->numWords));
+        for (size_t i = 0; i < sl->numWords; i++) {
+            RedisModule_ListPush(k, REDISMODULE_LIST_TAIL, RedisModule_CreateString(ctx, sl->words[i], 
+                                                                                    strlen(sl->words[i])));
+        }
+    }
+    
+    // the fields may be named like options
+    RedisModule_ListPush(k, REDISMODULE_LIST_TAIL, RedisModule_CreateString(ctx, SPEC_SCHEMA_STR, 
+                                                                            strlen(SPEC_SCHEMA_STR)));
+    
     for (int i = 0; i < sp->numFields; i++) {
         
         RedisModule_ListPush(k, REDISMODULE_LIST_TAIL, RedisModule_CreateString(ctx, sp->fields[i].name, strlen(sp->fields[i].name)));
@@ -138,10 +231,61 @@ int IndexSpec_Load(RedisModuleCtx *ctx, IndexSpec *sp, const char *name) {
     size_t arrlen = RedisModule_CallReplyLength(resp);
     RedisModuleString *arr[arrlen];
     
+    const char *args[arrlen];
+    int schema = 0;
     for (size_t i = 0; i < arrlen; i++) {
         arr[i] = RedisModule_CreateStringFromCallReply(RedisModule_CallReplyArrayElement(resp, i));
+        args[i] = RedisModule_StringPtrLen(arr[i], NULL);
+        schema |= !strcasecmp(args[i], SPEC_SCHEMA_STR);
     }
-    return IndexSpec_ParseRedisArgs(sp, ctx, arr, arrlen);
+    
+    if (spec_stopwords == NULL) {
+        spec_stopwords = kh_init(specstopwords);
+    }
+    sds cname = spec_cacheName(ctx, name);
+    khiter_t k = kh_get(specstopwords, spec_stopwords, cname);
+    StopWordList *cached = k != kh_end(spec_stopwords) ? kh_value(spec_stopwords, k) : NULL;
+    
+    // specs are saved with SCHEMA before their fields. Specs saved before there were index options
+    // have fields alone, which may be named like options, so they are not parsed for options. 
+    // Specs saved with options but without SCHEMA never parse as fields alone, as their options 
+    // aren't valid weights
+    int rc = REDISMODULE_ERR;
+    if (schema) {
+        rc = spec_parse(sp, args, arrlen, 1, cached);
+    }
+    if (rc != REDISMODULE_OK) {
+        rc = spec_parse(sp, args, arrlen, 0, cached);
+    }
+    if (rc != REDISMODULE_OK) {
+        rc = spec_parse(sp, args, arrlen, 1, cached);
+    }
+    
+    // keep a list we built for the next commands
+    if (rc == REDISMODULE_OK && sp->stopwords != cached) {
+        if (k == kh_end(spec_stopwords)) {
+            int ret;
+            k = kh_put(specstopwords, spec_stopwords, cname, &ret);
+            cname = NULL;
+        } else {
+            StopWordList_Free(cached);
+        }
+        kh_value(spec_stopwords, k) = StopWordList_Retain(sp->stopwords);
+    }
+    sdsfree(cname);
+    return rc;
+}
+
+void IndexSpec_Forget(RedisModuleCtx *ctx, const char *name) {
+    if (spec_stopwords == NULL) return;
+    sds cname = spec_cacheName(ctx, name);
+    khiter_t k = kh_get(specstopwords, spec_stopwords, cname);
+    sdsfree(cname);
+    if (k == kh_end(spec_stopwords)) return;
+    
+    StopWordList_Free(kh_value(spec_stopwords, k));
+    sdsfree((sds)kh_key(spec_stopwords, k));
+    kh_del(specstopwords, spec_stopwords, k);
 }
 
 
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "redismodule.h"
+#include "stopwords.h"
 
 
 typedef enum fieldType {
@@ -25,10 +26,42 @@ typedef struct fieldSpec {
     // TODO: More options here..
 } FieldSpec;
 
+/* Index-wide options, given as keywords before the field specs in FT.CREATE */
+typedef enum {
+    // encode inverted indexes in blocks with inline skip headers
+    Index_BlockEncoding = 0x01,
+    // keep the offset vectors of block encoded indexes in a separate key per term
+    Index_SplitOffsets = 0x02,
+    // bit pack the docIds of sealed blocks with PForDelta instead of Stream VByte
+    Index_PForCodec = 0x04,
+    // leave the offset vectors out of index entries. Exact phrases match as plain intersections
+    Index_NoOffsets = 0x08,
+    // leave the field flags out of index entries. Hits match every field
+    Index_NoFields = 0x10,
+    // leave the frequencies out of index entries. Hits are scored by IDF alone
+    Index_NoFreqs = 0x20,
+    // keep the postings of new documents in an in-memory write segment, see segment.h
+    Index_WriteBuffer = 0x40,
+} IndexFlags;
+
+#define SPEC_BLOCKS_STR "BLOCKS"
+#define SPEC_SPLITOFFSETS_STR "SPLITOFFSETS"
+#define SPEC_PFOR_STR "PFOR"
+#define SPEC_NOOFFSETS_STR "NOOFFSETS"
+#define SPEC_NOFIELDS_STR "NOFIELDS"
+#define SPEC_NOFREQS_STR "NOFREQS"
+#define SPEC_WRITEBUFFER_STR "WRITEBUFFER"
+#define SPEC_STOPWORDS_STR "STOPWORDS"
+// ends the options, so that fields may be named like them
+#define SPEC_SCHEMA_STR "SCHEMA"
+
 typedef struct {
     FieldSpec *fields;
     int numFields;
     const char *name;    
+    IndexFlags flags;
+    // the index's own stopwords, or NULL for the default ones
+    StopWordList *stopwords;
 } IndexSpec;
 
 
@@ -43,7 +76,8 @@ FieldSpec *IndexSpec_GetField(IndexSpec *spec, const char *name, size_t len);
 * Returns REDISMODULE_ERR if there's a parsing error.
 * The command only receives the relvant part of argv.
 * 
-* The format currently is <field> <weight>, <field> <weight> ... 
+* The format currently is [BLOCKS] [SPLITOFFSETS] ... [STOPWORDS <num> <word> ...] [SCHEMA]
+* <field> <weight>, <field> <weight> ... 
 */
 int IndexSpec_ParseRedisArgs(IndexSpec *spec, RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
 
@@ -57,9 +91,14 @@ int IndexSpec_Parse(IndexSpec *s, const char **argv, int argc);
 void IndexSpec_Free(IndexSpec *spec);
 
 
+/* Load the spec of an index saved with IndexSpec_Save. Its stopword list is built once, and kept 
+for the next loads of the spec until IndexSpec_Forget is called */
 int IndexSpec_Load(RedisModuleCtx *ctx, IndexSpec *sp, const char *name);
 int IndexSpec_Save(RedisModuleCtx *ctx, IndexSpec *sp);
 
+/* Drop what is kept of the spec of an index between loads, when it's created again or dropped */
+void IndexSpec_Forget(RedisModuleCtx *ctx, const char *name);
+
 /* 
 * Parse the field mask passed to a query, map field names to a bit mask passed down to the
 * execution engine, detailing which fields the query works on. See FT.SEARCH for API details 
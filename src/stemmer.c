@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <sys/param.h>
+#include <sys/types.h>
 #include "dep/snowball/include/libstemmer.h"
 
 const char *__supportedLanguages[] = {
@@ -61,3 +62,84 @@ Stemmer *NewStemmer(StemmerType type, const char *language) {
   fprintf(stderr, "Invalid stemmer type");
   return NULL;
 }
+
+/* A memoized stem. A slot is empty while its word length is 0 */
+typedef struct {
+  u_char wordLen;
+  u_char stemLen;
+  char word[STEMMER_CACHE_MAX_WORD];
+  char stem[STEMMER_CACHE_MAX_WORD + 1];
+} stemCacheSlot;
+
+/* The context of a pooled stemmer, wrapping the actual one */
+typedef struct {
+  Stemmer *stemmer;
+  stemCacheSlot slots[STEMMER_CACHE_SIZE];
+} stemCache;
+
+// the pooled stemmers, by type and language. NULL stemmers are kept for unsupported languages
+static struct stemmerPoolEntry {
+  StemmerType type;
+  char *language;
+  Stemmer *stemmer;
+  struct stemmerPoolEntry *next;
+} *stemmerPool = NULL;
+
+static const char *__cachedStemmer_Stem(void *ctx, const char *word, size_t len,
+                                        size_t *outlen) {
+  stemCache *c = ctx;
+  if (len == 0 || len > STEMMER_CACHE_MAX_WORD) {
+    return c->stemmer->Stem(c->stemmer->ctx, word, len, outlen);
+  }
+
+  // FNV-1a
+  u_int32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (u_char)word[i]) * 16777619u;
+  }
+  stemCacheSlot *s = &c->slots[h & (STEMMER_CACHE_SIZE - 1)];
+  if (s->wordLen == len && !memcmp(s->word, word, len)) {
+    *outlen = s->stemLen;
+    return s->stem;
+  }
+
+  const char *stem = c->stemmer->Stem(c->stemmer->ctx, word, len, outlen);
+  // failures and stems longer than the slot are not memoized
+  if (stem && *outlen <= STEMMER_CACHE_MAX_WORD) {
+    s->wordLen = len;
+    memcpy(s->word, word, len);
+    s->stemLen = *outlen;
+    memcpy(s->stem, stem, *outlen);
+    s->stem[*outlen] = '\0';
+    return s->stem;
+  }
+  return stem;
+}
+
+static void __cachedStemmer_Free(Stemmer *s) {
+  // pooled stemmers live as long as the process
+}
+
+Stemmer *GetStemmer(StemmerType type, const char *language) {
+  for (struct stemmerPoolEntry *e = stemmerPool; e != NULL; e = e->next) {
+    if (e->type == type && !strcmp(e->language, language)) {
+      return e->stemmer;
+    }
+  }
+
+  struct stemmerPoolEntry *e = calloc(1, sizeof(*e));
+  e->type = type;
+  e->language = strdup(language);
+  Stemmer *inner = NewStemmer(type, language);
+  if (inner) {
+    stemCache *c = calloc(1, sizeof(stemCache));
+    c->stemmer = inner;
+    e->stemmer = malloc(sizeof(Stemmer));
+    e->stemmer->ctx = c;
+    e->stemmer->Stem = __cachedStemmer_Stem;
+    e->stemmer->Free = __cachedStemmer_Free;
+  }
+  e->next = stemmerPool;
+  stemmerPool = e;
+  return e->stemmer;
+}
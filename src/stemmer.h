@@ -18,6 +18,16 @@ typedef struct stemmer {
 } Stemmer;
 Stemmer *NewStemmer(StemmerType type, const char *language);
 
+/* The stems of words up to STEMMER_CACHE_MAX_WORD bytes long are memoized by the stemmers of the
+pool, in a direct mapped cache of STEMMER_CACHE_SIZE slots per language, about 1MB */
+#define STEMMER_CACHE_SIZE 16384
+#define STEMMER_CACHE_MAX_WORD 31
+
+/* Get the stemmer of a language from the process wide pool, creating it on first use. Returns
+NULL if the language has no stemmer. Pooled stemmers are shared, and their Free does nothing. 
+As with any stemmer, a stem returned is only valid until the stemmer's next call */
+Stemmer *GetStemmer(StemmerType type, const char *language);
+
 /* check if a language is supported by our stemmers */
 int IsSupportedLanguage(const char *language, size_t len);
 
@@ -0,0 +1,73 @@
+#include <ctype.h>
+#include <string.h>
+#include "stopwords.h"
+
+const char *DEFAULT_STOPWORDS[] = {
+    "a", "is", "the", "an", "and", "are", "as", "at", "be", "but", "by",
+    "for", "if", "in", "into", "it",
+    "no", "not", "of", "on", "or", "such",
+    "that", "their", "then", "there", "these",
+    "they", "this", "to", "was", "will", "with", NULL
+};
+
+static StopWordList *defaultList = NULL;
+
+static inline u_int64_t stopwords_lengthBit(size_t len) {
+    return 1ULL << (len < 63 ? len : 63);
+}
+
+StopWordList *NewStopWordList(const char **words, size_t num) {
+    StopWordList *sl = calloc(1, sizeof(StopWordList));
+    sl->set = kh_init(stopwords);
+    sl->words = calloc(num, sizeof(char *));
+    sl->refcount = 1;
+    for (size_t i = 0; i < num; i++) {
+        char *w = strdup(words[i]);
+        for (char *p = w; *p; p++) {
+            *p = tolower(*p);
+        }
+
+        int ret;
+        kh_put(stopwords, sl->set, w, &ret);
+        // duplicates are only kept once
+        if (ret == 0) {
+            free(w);
+            continue;
+        }
+        sl->words[sl->numWords++] = w;
+        sl->lengths |= stopwords_lengthBit(strlen(w));
+    }
+    return sl;
+}
+
+StopWordList *DefaultStopWordList() {
+    if (defaultList == NULL) {
+        size_t n = 0;
+        while (DEFAULT_STOPWORDS[n] != NULL) n++;
+        defaultList = NewStopWordList(DEFAULT_STOPWORDS, n);
+    }
+    return defaultList;
+}
+
+int StopWordList_Contains(StopWordList *sl, const char *w, size_t len) {
+    if (sl == NULL) sl = DefaultStopWordList();
+    if (!(sl->lengths & stopwords_lengthBit(len))) {
+        return 0;
+    }
+    return kh_get(stopwords, sl->set, w) != kh_end(sl->set);
+}
+
+StopWordList *StopWordList_Retain(StopWordList *sl) {
+    if (sl != NULL) sl->refcount++;
+    return sl;
+}
+
+void StopWordList_Free(StopWordList *sl) {
+    if (sl == NULL || sl == defaultList || --sl->refcount > 0) return;
+    for (size_t i = 0; i < sl->numWords; i++) {
+        free(sl->words[i]);
+    }
+    free(sl->words);
+    kh_destroy(stopwords, sl->set);
+    free(sl);
+}
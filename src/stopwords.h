@@ -0,0 +1,41 @@
+#ifndef __STOPWORDS_H__
+#define __STOPWORDS_H__
+
+#include <stdlib.h>
+#include "types.h"
+#include "util/khash.h"
+
+KHASH_SET_INIT_STR(stopwords)
+
+/* A set of stopwords, looked up by every token of documents and queries. Words are kept in a hash
+set, and a bitmask of the lengths they have rejects most tokens before they are hashed. The list
+of an index is built when its spec is loaded */
+typedef struct {
+    khash_t(stopwords) *set;
+    // the words as given, lowercased, for saving the list with its spec
+    char **words;
+    size_t numWords;
+    // bit n is set if there is a word of length n. Longer words all set the top bit
+    u_int64_t lengths;
+    // the specs and caches sharing the list
+    int refcount;
+} StopWordList;
+
+/* The stopwords of indexes created without a list of their own */
+extern const char *DEFAULT_STOPWORDS[];
+
+/* Build a list of num words. The words are copied and lowercased */
+StopWordList *NewStopWordList(const char **words, size_t num);
+
+/* The list of DEFAULT_STOPWORDS, built on first use. It must not be freed */
+StopWordList *DefaultStopWordList();
+
+/* Is the lowercase, null terminated word of length len a stopword. A NULL list is the default one */
+int StopWordList_Contains(StopWordList *sl, const char *w, size_t len);
+
+/* Share the list, which is then freed once StopWordList_Free was called for every holder */
+StopWordList *StopWordList_Retain(StopWordList *sl);
+
+void StopWordList_Free(StopWordList *sl);
+
+#endif
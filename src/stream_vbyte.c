@@ -0,0 +1,227 @@
+#include "stream_vbyte.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SVB_X86
+#include <immintrin.h>
+#endif
+
+// the data length of each of the 4 integers described by a control byte, summed up
+static u_char svb_lengths[256];
+// the pshufb masks moving the data bytes of a control byte into 4 little endian integers
+static u_char svb_shuffle[256][16] __attribute__((aligned(16)));
+
+static int svb_initialized = 0;
+static SVBKernel svb_best = SVB_Scalar;
+static SVBKernel svb_kernel = SVB_Scalar;
+
+/* Build the lookup tables and detect the best kernel the CPU supports */
+static void svb_init() {
+    for (int c = 0; c < 256; c++) {
+        int pos = 0;
+        for (int i = 0; i < 4; i++) {
+            int len = ((c >> (2 * i)) & 3) + 1;
+            for (int b = 0; b < 4; b++) {
+                svb_shuffle[c][i * 4 + b] = b < len ? pos + b : 0x80;
+            }
+            pos += len;
+        }
+        svb_lengths[c] = pos;
+    }
+
+#ifdef SVB_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        svb_best = SVB_AVX2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        svb_best = SVB_SSE41;
+    }
+#endif
+    svb_kernel = svb_best;
+    svb_initialized = 1;
+}
+
+SVBKernel SVB_GetKernel() {
+    if (!svb_initialized) svb_init();
+    return svb_kernel;
+}
+
+SVBKernel SVB_SetKernel(SVBKernel k) {
+    if (!svb_initialized) svb_init();
+    svb_kernel = k > svb_best ? svb_best : k;
+    return svb_kernel;
+}
+
+/* The 2 bit control code of an integer, i.e. its byte length minus 1 */
+static inline u_char svb_code(u_int32_t v) {
+    return v < (1 << 8) ? 0 : v < (1 << 16) ? 1 : v < (1 << 24) ? 2 : 3;
+}
+
+size_t SVB_EncodedSize(const u_int32_t *in, u_int32_t n) {
+    size_t sz = (n + 3) / 4;
+    for (u_int32_t i = 0; i < n; i++) {
+        sz += svb_code(in[i]) + 1;
+    }
+    return sz;
+}
+
+static size_t svb_encode(const u_int32_t *in, u_int32_t n, u_int32_t prev, int delta, u_char *out) {
+    u_char *ctrl = out;
+    u_char *data = out + (n + 3) / 4;
+    memset(ctrl, 0, (n + 3) / 4);
+
+    for (u_int32_t i = 0; i < n; i++) {
+        u_int32_t v = delta ? in[i] - prev : in[i];
+        prev = in[i];
+
+        u_char code = svb_code(v);
+        ctrl[i >> 2] |= code << ((i & 3) * 2);
+        for (int b = 0; b <= code; b++) {
+            *data++ = v >> (8 * b);
+        }
+    }
+    return data - out;
+}
+
+size_t SVB_Encode(const u_int32_t *in, u_int32_t n, u_char *out) {
+    return svb_encode(in, n, 0, 0, out);
+}
+
+size_t SVB_EncodeDelta(const u_int32_t *in, u_int32_t n, u_int32_t prev, u_char *out) {
+    return svb_encode(in, n, prev, 1, out);
+}
+
+/* The decoding kernels decode up to n integers from the control bytes at ctrl and the data
+at *datap, advancing *datap and returning the number of integers decoded. If delta is set they
+add up the integers starting from *prev, and leave the last decoded value in *prev.
+The SIMD kernels only decode whole groups that have a full 16 byte load of input left before end,
+and leave the rest to the scalar kernel */
+static u_int32_t svb_decodeScalar(const u_char *ctrl, const u_char **datap, const u_char *end,
+                                  u_int32_t n, u_int32_t *prev, int delta, u_int32_t *out) {
+    const u_char *data = *datap;
+    u_int32_t p = *prev;
+    u_int32_t i = 0;
+    for (; i < n; i++) {
+        int len = ((ctrl[i >> 2] >> ((i & 3) * 2)) & 3) + 1;
+        if (data + len > end) {
+            break;
+        }
+        u_int32_t v = 0;
+        for (int b = 0; b < len; b++) {
+            v |= (u_int32_t)data[b] << (8 * b);
+        }
+        data += len;
+        if (delta) {
+            v += p;
+            p = v;
+        }
+        out[i] = v;
+    }
+    *datap = data;
+    *prev = p;
+    return i;
+}
+
+#ifdef SVB_X86
+__attribute__((target("sse4.1")))
+static u_int32_t svb_decodeSSE41(const u_char *ctrl, const u_char **datap, const u_char *end,
+                                 u_int32_t n, u_int32_t *prev, int delta, u_int32_t *out) {
+    const u_char *data = *datap;
+    __m128i base = _mm_set1_epi32(*prev);
+    u_int32_t i = 0;
+    for (; i + 4 <= n && data + 16 <= end; i += 4) {
+        u_char c = ctrl[i >> 2];
+        __m128i v = _mm_loadu_si128((const __m128i *)data);
+        v = _mm_shuffle_epi8(v, _mm_load_si128((const __m128i *)svb_shuffle[c]));
+        if (delta) {
+            // prefix sum of the 4 deltas, carried over from the previous group
+            v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+            v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+            v = _mm_add_epi32(v, base);
+            base = _mm_shuffle_epi32(v, 0xff);
+        }
+        _mm_storeu_si128((__m128i *)(out + i), v);
+        data += svb_lengths[c];
+    }
+    if (delta) {
+        *prev = _mm_extract_epi32(base, 0);
+    }
+    *datap = data;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static u_int32_t svb_decodeAVX2(const u_char *ctrl, const u_char **datap, const u_char *end,
+                                u_int32_t n, u_int32_t *prev, int delta, u_int32_t *out) {
+    const u_char *data = *datap;
+    __m256i base = _mm256_set1_epi32(*prev);
+    const __m256i last = _mm256_set1_epi32(7);
+    const __m256i mid = _mm256_set1_epi32(3);
+    u_int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        // two groups per iteration, each in its own 128 bit lane
+        u_char c0 = ctrl[i >> 2], c1 = ctrl[(i >> 2) + 1];
+        const u_char *data1 = data + svb_lengths[c0];
+        if (data1 + 16 > end) {
+            break;
+        }
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)data)),
+            _mm_loadu_si128((const __m128i *)data1), 1);
+        __m256i mask = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_load_si128((const __m128i *)svb_shuffle[c0])),
+            _mm_load_si128((const __m128i *)svb_shuffle[c1]), 1);
+        v = _mm256_shuffle_epi8(v, mask);
+        if (delta) {
+            // prefix sums inside each lane, then carry the low lane's sum into the high lane
+            v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+            v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+            __m256i carry = _mm256_blend_epi32(_mm256_setzero_si256(),
+                                               _mm256_permutevar8x32_epi32(v, mid), 0xf0);
+            v = _mm256_add_epi32(_mm256_add_epi32(v, carry), base);
+            base = _mm256_permutevar8x32_epi32(v, last);
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), v);
+        data = data1 + svb_lengths[c1];
+    }
+    if (delta) {
+        *prev = _mm256_extract_epi32(base, 0);
+    }
+    *datap = data;
+    return i;
+}
+#endif
+
+static size_t svb_decode(const u_char *in, const u_char *end, u_int32_t n, u_int32_t prev,
+                         int delta, u_int32_t *out) {
+    if (!svb_initialized) svb_init();
+
+    size_t ctrlLen = (n + 3) / 4;
+    if (end < in || (size_t)(end - in) < ctrlLen) {
+        return 0;
+    }
+    const u_char *ctrl = in, *data = in + ctrlLen;
+
+    // the SIMD kernels always stop on a group boundary, so ctrl stays in sync with i
+    u_int32_t i = 0;
+#ifdef SVB_X86
+    if (svb_kernel == SVB_AVX2) {
+        i += svb_decodeAVX2(ctrl, &data, end, n, &prev, delta, out);
+    }
+    if (svb_kernel >= SVB_SSE41) {
+        i += svb_decodeSSE41(ctrl + (i >> 2), &data, end, n - i, &prev, delta, out + i);
+    }
+#endif
+    i += svb_decodeScalar(ctrl + (i >> 2), &data, end, n - i, &prev, delta, out + i);
+
+    return i == n ? data - in : 0;
+}
+
+size_t SVB_Decode(const u_char *in, const u_char *end, u_int32_t n, u_int32_t *out) {
+    return svb_decode(in, end, n, 0, 0, out);
+}
+
+size_t SVB_DecodeDelta(const u_char *in, const u_char *end, u_int32_t n, u_int32_t prev,
+                       u_int32_t *out) {
+    return svb_decode(in, end, n, prev, 1, out);
+}
@@ -0,0 +1,52 @@
+#ifndef __STREAM_VBYTE_H__
+#define __STREAM_VBYTE_H__
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Stream VByte is a group varint encoding of 32 bit integers, built for SIMD decoding.
+The integers are encoded as two streams: first a control stream with 2 bits per integer holding
+its byte length minus 1, then a data stream of the integers' significant bytes, little endian.
+
+Every control byte describes the lengths of 4 integers, so a single table lookup gives a
+shuffle mask that decodes all 4 of them at once. We decode with AVX2 or SSE4.1 if the CPU
+supports them, and fall back to a scalar loop otherwise */
+
+/* The maximal encoded size of n integers */
+#define SVB_MAX_SIZE(n) (((n) + 3) / 4 + (n) * 4)
+
+/* The encoded size of n integers */
+size_t SVB_EncodedSize(const u_int32_t *in, u_int32_t n);
+
+/* Encode n integers into out, which should have room for at least SVB_MAX_SIZE(n) bytes.
+Returns the number of bytes written */
+size_t SVB_Encode(const u_int32_t *in, u_int32_t n, u_char *out);
+
+/* Encode n ascending integers as the deltas between them, with the first delta taken from
+prev. Returns the number of bytes written */
+size_t SVB_EncodeDelta(const u_int32_t *in, u_int32_t n, u_int32_t prev, u_char *out);
+
+/* Decode n integers from in, reading no further than end. Returns the number of bytes read, or
+0 if the input is truncated */
+size_t SVB_Decode(const u_char *in, const u_char *end, u_int32_t n, u_int32_t *out);
+
+/* Decode n integers encoded with SVB_EncodeDelta, adding them up starting from prev.
+Returns the number of bytes read, or 0 if the input is truncated */
+size_t SVB_DecodeDelta(const u_char *in, const u_char *end, u_int32_t n, u_int32_t prev,
+                       u_int32_t *out);
+
+/* The decoding kernels available on this machine, the best one is used by SVB_Decode */
+typedef enum {
+    SVB_Scalar,
+    SVB_SSE41,
+    SVB_AVX2,
+} SVBKernel;
+
+/* Get the kernel SVB_Decode dispatches to */
+SVBKernel SVB_GetKernel();
+
+/* Force decoding with a given kernel, or with the best available one if it is not supported
+by the CPU. Returns the kernel actually selected. This is used for testing and benchmarking */
+SVBKernel SVB_SetKernel(SVBKernel k);
+
+#endif
@@ -82,7 +82,7 @@ int testDistance() {
 
 
 int testIndexReadWrite() {
-  IndexWriter *w = NewIndexWriter(10000);
+  IndexWriter *w = NewIndexWriter(10000, INDEX_VERSION_LEGACY, BLOCK_CODEC_RAW, INDEX_ENTRY_FULL);
 
   for (int i = 0; i < 100; i++) {
     // if (i % 10000 == 1) {
@@ -165,7 +165,7 @@ int testIndexReadWrite() {
 }
 
 IndexWriter *createIndex(int size, int idStep) {
-   IndexWriter *w = NewIndexWriter(100);
+   IndexWriter *w = NewIndexWriter(100, INDEX_VERSION_LEGACY, BLOCK_CODEC_RAW, INDEX_ENTRY_FULL);
    
   t_docId id = idStep;
   for (int i = 0; i < size; i++) {
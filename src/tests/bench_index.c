@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "../index.h"
+#include "../varint.h"
+#include "../stream_vbyte.h"
+#include "../pfor.h"
+#include "../topk.h"
+#include "../util/heap.h"
+#include "../tokenize.h"
+#include "../stemmer.h"
+
+/* Compare the inverted index encodings: the index size in bytes per posting, and the time it takes
+to read all the postings back, per posting. Run it with the number of postings and the mean gap
+between docIds, e.g. ./bench_index 1000000 8 */
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+IndexWriter *benchIndexSeed(int size, int gap, u_int32_t version, u_int32_t codec, 
+                            u_int32_t entryFlags, unsigned seed) {
+    IndexWriter *w = NewIndexWriter(size * 4, version, codec, entryFlags);
+    srand(seed);
+    t_docId id = 0;
+    for (int i = 0; i < size; i++) {
+        ForwardIndexEntry h;
+        // gaps are mostly small with the occasional large one, like in real posting lists
+        id += 1 + (rand() % 50 == 0 ? rand() % (gap * 20) : rand() % (gap * 2 - 1));
+        h.docId = id;
+        h.flags = 0x01;
+        h.freq = 1 + rand() % 3;
+        h.docScore = 1;
+
+        h.vw = NewVarintVectorWriter(8);
+        for (int n = 0; n < h.freq; n++) {
+            VVW_Write(h.vw, 1 + rand() % 100);
+        }
+        IW_WriteEntry(w, &h);
+        VVW_Free(h.vw);
+    }
+    IW_Close(w);
+    return w;
+}
+
+IndexWriter *benchIndex(int size, int gap, u_int32_t version, u_int32_t codec, 
+                        u_int32_t entryFlags) {
+    return benchIndexSeed(size, gap, version, codec, entryFlags, 1337);
+}
+
+/* Read the whole index in batches, the way single word queries do, and return the ns per posting.
+The postings are scored with BM25 if norms are given */
+double benchRead(IndexWriter *w, DocNorms *norms, int rounds) {
+    IndexHitBatch batch;
+    batch.minScore = -1;
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        IndexReader *ir = NewIndexReader(w->bw.buf->data, IW_Len(w), NULL, NULL, 1, 0xff);
+        if (norms) IR_SetNorms(ir, norms, w->ndocs);
+        double start = now();
+        size_t n = 0;
+        while (IR_ReadBatch(ir, &batch)) {
+            n += batch.num;
+        }
+        double ns = (now() - start) / n;
+        if (r == 0 || ns < best) best = ns;
+        IR_Free(ir);
+    }
+    return best;
+}
+
+/* Open a reader that skips with the index's skip index, like the readers of intersections */
+static IndexReader *benchOpenSkipReader(IndexWriter *w) {
+    SkipIndex *si = NULL;
+    if (w->skipIndexWriter.buf) {
+        BufferSeek(w->skipIndexWriter.buf, 0);
+        si = NewSkipIndex(w->skipIndexWriter.buf);
+    }
+    return NewIndexReader(w->bw.buf->data, IW_Len(w), si, NULL, 0, 0xff);
+}
+
+/* Skip through the whole index to every skew-th docId, like an intersection of a rare term with
+this one does, and return the ns per skip */
+double benchSkipTo(IndexWriter *w, int skew, int rounds) {
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        IndexReader *ir = benchOpenSkipReader(w);
+        IndexHit h = NewIndexHit();
+        double start = now();
+        size_t n = 0;
+        for (t_docId id = skew; ; id += skew, n++) {
+            IndexHit_Init(&h);
+            if (IR_SkipTo(ir, id, &h) == INDEXREAD_EOF) break;
+        }
+        double ns = (now() - start) / n;
+        if (r == 0 || ns < best) best = ns;
+        IR_Free(ir);
+    }
+    return best;
+}
+
+/* Read the intersection of a rare term with a common one, and return the ns per posting of the 
+rare term, which leads the intersection while the common one is skipped to its postings */
+double benchIntersect(IndexWriter *rare, IndexWriter *common, int rounds) {
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        IndexIterator **its = calloc(2, sizeof(IndexIterator *));
+        its[0] = NewReadIterator(benchOpenSkipReader(common));
+        its[1] = NewReadIterator(benchOpenSkipReader(rare));
+        IndexIterator *ii = NewIntersecIterator(its, 2, 0, NULL, 0xff, NULL);
+        IndexHit h = NewIndexHit();
+        double start = now();
+        while (ii->Read(ii->ctx, &h) != INDEXREAD_EOF) {
+            IndexHit_Init(&h);
+        }
+        double ns = (now() - start) / rare->ndocs;
+        if (r == 0 || ns < best) best = ns;
+        ii->Free(ii);
+    }
+    return best;
+}
+
+/* Read a union of num terms, with the same number of postings overall, merging the terms with a
+heap or by scanning them, and return the ns per union hit. Unions are read in batches at the root
+of a query, and with Read when they are inside an intersection */
+double benchUnion(IndexWriter **ws, int num, int useHeap, int batches, int rounds) {
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        IndexIterator **its = calloc(num, sizeof(IndexIterator *));
+        for (int i = 0; i < num; i++) {
+            its[i] = NewReadIterator(NewIndexReader(ws[i]->bw.buf->data, IW_Len(ws[i]), NULL, NULL,
+                                                    1, 0xff));
+        }
+        IndexIterator *ui = NewUnionIterator(its, num, NULL, NULL);
+        ((UnionContext *)ui->ctx)->useHeap = useHeap;
+        IndexHitBatch batch;
+        batch.minScore = -1;
+        IndexHit h = NewIndexHit();
+        double start = now();
+        size_t n = 0;
+        if (batches) {
+            while (IndexIterator_ReadBatch(ui, &batch)) {
+                n += batch.num;
+            }
+        } else {
+            while (ui->Read(ui->ctx, &h) == INDEXREAD_OK) {
+                IndexHit_Init(&h);
+                n++;
+            }
+        }
+        double ns = (now() - start) / n;
+        if (r == 0 || ns < best) best = ns;
+        ui->Free(ui);
+    }
+    return best;
+}
+
+static int benchCmpHits(const void *e1, const void *e2, const void *udata) {
+    const IndexHit *h1 = e1, *h2 = e2;
+    if (h1->totalFreq < h2->totalFreq) {
+        return 1;
+    } else if (h1->totalFreq > h2->totalFreq) {
+        return -1;
+    }
+    return h1->docId - h2->docId;
+}
+
+/* Select the k top scores of num candidates, with a heap of hits from a pool the way queries did
+before the top-k selector, or with the selector, and return the ns per candidate */
+double benchTopK(const double *scores, int num, int k, int useHeap, int rounds) {
+    double best = 0;
+    heap_t *pq = malloc(heap_sizeof(k));
+    IndexHit *pool = malloc(k * sizeof(IndexHit));
+    TopKEntry *entries = malloc(k * sizeof(TopKEntry));
+    for (int r = 0; r < rounds; r++) {
+        TopK t;
+        double start = now();
+        if (useHeap) {
+            heap_init(pq, benchCmpHits, NULL, k);
+            for (int i = 0; i < num; i++) {
+                IndexHit *h = NULL;
+                if (heap_count(pq) < heap_size(pq)) {
+                    h = &pool[heap_count(pq)];
+                    IndexHit_Init(h);
+                } else if (((IndexHit *)heap_peek(pq))->totalFreq < scores[i]) {
+                    h = heap_poll(pq);
+                } else {
+                    continue;
+                }
+                h->docId = i + 1;
+                h->totalFreq = scores[i];
+                heap_offerx(pq, h);
+            }
+            while (heap_count(pq)) {
+                heap_poll(pq);
+            }
+        } else {
+            TopK_Init(&t, entries, k);
+            for (int i = 0; i < num; i++) {
+                TopK_Push(&t, scores[i], i + 1);
+            }
+            TopK_Sort(&t);
+        }
+        double ns = (now() - start) / num;
+        if (r == 0 || ns < best) best = ns;
+    }
+    free(pq);
+    free(pool);
+    free(entries);
+    return best;
+}
+
+static int benchCountToken(void *ctx, Token t) {
+    (*(size_t *)ctx)++;
+    return 0;
+}
+
+/* Tokenize text of the given size a number of times, stemming it if a stemmer is given, and return
+the ns per byte */
+double benchTokenize(const char *text, size_t size, Stemmer *stemmer, int rounds) {
+    char *copy = malloc(size + 1);
+    size_t num = 0;
+    double total = 0;
+    for (int r = 0; r < rounds; r++) {
+        // the text is lowercased and split in place
+        memcpy(copy, text, size + 1);
+        double start = now();
+        tokenize(copy, 1, 1, &num, benchCountToken, stemmer, NULL);
+        total += now() - start;
+    }
+    free(copy);
+    return total / rounds / size;
+}
+
+int main(int argc, char **argv) {
+    int size = argc > 1 ? atoi(argv[1]) : 1000000;
+    int gap = argc > 2 ? atoi(argv[2]) : 8;
+
+    struct {
+        const char *name;
+        u_int32_t version;
+        u_int32_t codec;
+        u_int32_t entryFlags;
+    } configs[] = {
+        {"legacy varint", INDEX_VERSION_LEGACY, BLOCK_CODEC_RAW},
+        {"blocks varint", INDEX_VERSION_BLOCKS, BLOCK_CODEC_RAW},
+        {"blocks svb", INDEX_VERSION_BLOCKS, BLOCK_CODEC_SVB},
+        {"blocks pfor", INDEX_VERSION_BLOCKS, BLOCK_CODEC_PFOR},
+        {"split svb", INDEX_VERSION_SPLIT, BLOCK_CODEC_SVB},
+        {"split pfor", INDEX_VERSION_SPLIT, BLOCK_CODEC_PFOR},
+        {"pfor nooffsets", INDEX_VERSION_BLOCKS, BLOCK_CODEC_PFOR, INDEX_ENTRY_NOOFFSETS},
+        {"pfor ids only", INDEX_VERSION_BLOCKS, BLOCK_CODEC_PFOR, 
+         INDEX_ENTRY_NOOFFSETS | INDEX_ENTRY_NOFIELDS | INDEX_ENTRY_NOFREQS},
+        {NULL},
+    };
+
+    printf("%d postings, mean docId gap %d\n", size, gap);
+    printf("%-16s %14s %14s\n", "encoding", "bytes/posting", "ns/posting");
+    for (int i = 0; configs[i].name != NULL; i++) {
+        IndexWriter *w = benchIndex(size, gap, configs[i].version, configs[i].codec,
+                                   configs[i].entryFlags);
+        printf("%-16s %14.3f %14.3f\n", configs[i].name, (double)IW_Len(w) / size,
+               benchRead(w, NULL, 5));
+        IW_Free(w);
+    }
+
+    // scoring with BM25 reads the norms record of every document, next to tf-idf scoring
+    IndexWriter *w = benchIndex(size, gap, INDEX_VERSION_BLOCKS, BLOCK_CODEC_SVB, 0);
+    size_t sz = sizeof(DocNormsHeader) + ((size_t)w->lastId + 1) * sizeof(DocNorm);
+    char *data = calloc(1, sz);
+    DocNormsHeader *hdr = (DocNormsHeader *)data;
+    DocNorm *recs = (DocNorm *)(data + sizeof(DocNormsHeader));
+    srand(1337);
+    for (t_docId id = 1; id <= w->lastId; id++) {
+        u_int32_t len = 10 + rand() % 1000;
+        DocNorm_Init(&recs[id], len, 3, 1);
+        hdr->numDocs++;
+        hdr->totalLen += len;
+    }
+    hdr->maxScore = 1;
+    DocNorms *norms = NewDocNorms(data, sz);
+    printf("\nScoring, blocks svb, ns/posting\n");
+    printf("%-16s %14.3f\n", "tf-idf", benchRead(w, NULL, 5));
+    printf("%-16s %14.3f\n", "bm25", benchRead(w, norms, 5));
+    DocNorms_Free(norms);
+    free(data);
+    IW_Free(w);
+
+    // intersections of rare terms with this one
+    int skews[] = {10, 100, 1000, 10000};
+    printf("\nSkipTo every n-th docId, ns/skip\n");
+    printf("%-16s %10s %10s %10s %10s\n", "encoding", "n=10", "n=100", "n=1000", "n=10000");
+    for (int i = 0; configs[i].name != NULL; i++) {
+        IndexWriter *w = benchIndex(size, gap, configs[i].version, configs[i].codec,
+                                   configs[i].entryFlags);
+        printf("%-16s", configs[i].name);
+        for (int s = 0; s < 4; s++) {
+            printf(" %10.1f", benchSkipTo(w, skews[s], 3));
+        }
+        printf("\n");
+        IW_Free(w);
+    }
+
+    // the same, through an intersection of a rare term with size/n postings spread over the docIds 
+    // of this one
+    printf("\nRare AND common, common term of %d postings, ns/rare posting\n", size);
+    printf("%-16s %10s %10s %10s %10s\n", "encoding", "n=10", "n=100", "n=1000", "n=10000");
+    for (int i = 0; configs[i].name != NULL; i++) {
+        IndexWriter *w = benchIndex(size, gap, configs[i].version, configs[i].codec,
+                                   configs[i].entryFlags);
+        printf("%-16s", configs[i].name);
+        for (int s = 0; s < 4; s++) {
+            int num = size / skews[s] > 0 ? size / skews[s] : 1;
+            IndexWriter *rare = benchIndexSeed(num, gap * skews[s], configs[i].version, 
+                                               configs[i].codec, configs[i].entryFlags, 42);
+            printf(" %10.1f", benchIntersect(rare, w, 3));
+            IW_Free(rare);
+        }
+        printf("\n");
+        IW_Free(w);
+    }
+
+    // unions of many terms, e.g. a word and its stem or expansions of a prefix
+    int children[] = {2, 8, 64, 512};
+    printf("\nUnion of n terms, %d postings overall, ns/hit\n", size);
+    printf("%-16s %10s %10s %10s %10s\n", "merge", "n=2", "n=8", "n=64", "n=512");
+    IndexWriter **unionWs[4];
+    for (int c = 0; c < 4; c++) {
+        unionWs[c] = malloc(children[c] * sizeof(IndexWriter *));
+        for (int i = 0; i < children[c]; i++) {
+            unionWs[c][i] = benchIndexSeed(size / children[c], gap * children[c], 
+                                           INDEX_VERSION_BLOCKS, BLOCK_CODEC_SVB, 0, 1337 + i);
+        }
+    }
+    // batches are always merged with a heap
+    const char *merges[] = {"heap batches", "scan read", "heap read"};
+    for (int m = 0; m < 3; m++) {
+        printf("%-16s", merges[m]);
+        for (int c = 0; c < 4; c++) {
+            printf(" %10.1f", benchUnion(unionWs[c], children[c], m != 1, m == 0, 3));
+        }
+        printf("\n");
+    }
+    for (int c = 0; c < 4; c++) {
+        for (int i = 0; i < children[c]; i++) {
+            IW_Free(unionWs[c][i]);
+        }
+        free(unionWs[c]);
+    }
+
+    // the top results of a query with size hits, with random scores and with scores that only grow,
+    // which is the worst case as every hit gets in
+    double *scores = malloc(size * sizeof(double));
+    int ks[] = {10, 100, 1000};
+    printf("\nTop k of %d hits, ns/hit\n", size);
+    printf("%-16s %10s %10s %10s\n", "selector", "k=10", "k=100", "k=1000");
+    for (int rising = 0; rising < 2; rising++) {
+        srand(1337);
+        for (int i = 0; i < size; i++) {
+            scores[i] = rising ? i : (double)rand() / RAND_MAX;
+        }
+        for (int useHeap = 1; useHeap >= 0; useHeap--) {
+            printf("%-5s %-10s", useHeap ? "heap" : "topk", rising ? "rising" : "random");
+            for (int k = 0; k < 3; k++) {
+                printf(" %10.2f", benchTopK(scores, size, ks[k], useHeap, 3));
+            }
+            printf("\n");
+        }
+    }
+    free(scores);
+
+    // the docId column alone, as it is the only one the codecs differ in
+    u_int32_t ids[PFOR_MAX_BLOCK];
+    u_char buf[PFOR_MAX_SIZE(PFOR_MAX_BLOCK)];
+    u_int32_t n = INDEX_BLOCK_SIZE;
+    srand(1337);
+    t_docId id = 0;
+    for (u_int32_t i = 0; i < n; i++) {
+        id += 1 + (rand() % 50 == 0 ? rand() % (gap * 20) : rand() % (gap * 2 - 1));
+        ids[i] = id;
+    }
+    int iters = 100000;
+    printf("\ndocId column of %d entries\n", n);
+    printf("%-16s %14s %14s\n", "kernel", "bytes/docId", "ns/docId");
+    for (int k = SVB_Scalar; k <= SVB_AVX2; k++) {
+        if (SVB_SetKernel(k) != k) continue;
+        size_t sz = SVB_EncodeDelta(ids, n, 0, buf);
+        double start = now();
+        for (int it = 0; it < iters; it++) {
+            SVB_DecodeDelta(buf, buf + sz, n, 0, ids);
+        }
+        printf("svb %-12s %14.3f %14.3f\n", k == SVB_Scalar ? "scalar" : k == SVB_SSE41 ? "sse4.1" : "avx2",
+               (double)sz / n, (now() - start) / iters / n);
+    }
+    for (int k = PFOR_Scalar; k <= PFOR_AVX2; k++) {
+        if (PFOR_SetKernel(k) != k) continue;
+        size_t sz = PFOR_EncodeDelta(ids, n, 0, buf);
+        double start = now();
+        for (int it = 0; it < iters; it++) {
+            PFOR_DecodeDelta(buf, buf + sz, n, 0, ids);
+        }
+        printf("pfor %-11s %14.3f %14.3f\n", k == PFOR_Scalar ? "scalar" : "avx2",
+               (double)sz / n, (now() - start) / iters / n);
+    }
+
+    // 1MB of words of 1-10 letters, some capitalized, between spaces and commas
+    size_t textSize = 1 << 20;
+    char *text = malloc(textSize + 1);
+    srand(1337);
+    for (size_t i = 0; i < textSize;) {
+        int len = 1 + rand() % 10;
+        for (int j = 0; j < len && i < textSize; j++) {
+            text[i++] = (rand() % 5 ? 'a' : 'A') + rand() % 26;
+        }
+        if (i < textSize) text[i++] = rand() % 8 ? ' ' : ',';
+    }
+    text[textSize] = 0;
+    printf("\nTokenizing %zd bytes of text\n", textSize);
+    printf("%-16s %14s\n", "kernel", "ns/byte");
+    for (int k = TOK_Scalar; k <= TOK_AVX2; k++) {
+        if (Tokenizer_SetKernel(k) != k) continue;
+        printf("%-16s %14.3f\n", k == TOK_Scalar ? "scalar" : k == TOK_SSE2 ? "sse2" : "avx2",
+               benchTokenize(text, textSize, NULL, 20));
+    }
+
+    // stemming text drawn from a vocabulary of 20000 words of 3-12 letters, with word frequencies 
+    // falling off like in natural language (Zipf's law)
+    int vocabSize = 20000;
+    char (*vocab)[13] = malloc(vocabSize * sizeof(*vocab));
+    for (int v = 0; v < vocabSize; v++) {
+        int len = 3 + rand() % 10;
+        for (int j = 0; j < len; j++) {
+            vocab[v][j] = 'a' + rand() % 26;
+        }
+        vocab[v][len] = 0;
+    }
+    for (size_t i = 0; i < textSize;) {
+        const char *w = vocab[(int)pow(vocabSize, (double)rand() / RAND_MAX) - 1];
+        for (; *w && i < textSize; w++) {
+            text[i++] = *w;
+        }
+        if (i < textSize) text[i++] = ' ';
+    }
+    text[textSize] = 0;
+    Stemmer *stemmer = NewStemmer(SnowballStemmer, "english");
+    printf("%-16s %14.3f\n", "stem", benchTokenize(text, textSize, stemmer, 20));
+    stemmer->Free(stemmer);
+    printf("%-16s %14.3f\n", "stem pooled",
+           benchTokenize(text, textSize, GetStemmer(SnowballStemmer, "english"), 20));
+    free(vocab);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,1451 @@
+#include "test_util.h"
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include "../index.h"
+#include "../varint.h"
+#include "../stream_vbyte.h"
+#include "../pfor.h"
+#include "../doc_bitmap.h"
+#include "../query.h"
+#include "../topk.h"
+#include "../rmutil/sds.h"
+#include "../segment.h"
+#include "../tokenize.h"
+#include "../stemmer.h"
+
+/* Create an in-memory index with size entries, with docIds stepping by idStep, sealing full blocks
+with the given codec and leaving the given parts out of the entries */
+IndexWriter *createLayoutIndex(int size, int idStep, u_int32_t version, u_int32_t codec, 
+                               u_int32_t entryFlags) {
+    IndexWriter *w = NewIndexWriter(100, version, codec, entryFlags);
+
+    t_docId id = idStep;
+    for (int i = 0; i < size; i++) {
+        ForwardIndexEntry h;
+        h.docId = id;
+        h.flags = 0xff;
+        h.freq = 1 + i % 10;
+        h.docScore = 0.1;
+
+        h.vw = NewVarintVectorWriter(8);
+        for (int n = idStep; n < idStep + i % 4; n++) {
+            VVW_Write(h.vw, n);
+        }
+        IW_WriteEntry(w, &h);
+        VVW_Free(h.vw);
+
+        id += idStep;
+    }
+
+    IW_Close(w);
+    return w;
+}
+
+IndexWriter *createCodecIndex(int size, int idStep, u_int32_t version, u_int32_t codec) {
+    return createLayoutIndex(size, idStep, version, codec, INDEX_ENTRY_FULL);
+}
+
+IndexWriter *createIndex(int size, int idStep, u_int32_t version) {
+    return createCodecIndex(size, idStep, version, BLOCK_CODEC_SVB);
+}
+
+IndexReader *openArenaReader(IndexWriter *w, Arena *arena) {
+    SkipIndex *si = NULL;
+    if (w->skipIndexWriter.buf) {
+        BufferSeek(w->skipIndexWriter.buf, 0);
+        si = NewSkipIndex(w->skipIndexWriter.buf);
+    }
+    IndexReader *ir = NewIndexReaderBuf(NewBuffer(w->bw.buf->data, IW_Len(w), BUFFER_READ), si, 
+                                        NULL, 0, NULL, 0xff, arena);
+    if (w->offsetsWriter.buf) {
+        ir->offsetsBuf = NewBuffer(w->offsetsWriter.buf->data, BufferOffset(w->offsetsWriter.buf), 
+                                   BUFFER_READ);
+    }
+    return ir;
+}
+
+IndexReader *openReader(IndexWriter *w) {
+    return openArenaReader(w, NULL);
+}
+
+int testReadAll(u_int32_t version, u_int32_t codec) {
+    IndexWriter *w = createCodecIndex(1000, 3, version, codec);
+    ASSERT(w->ndocs == 1000);
+
+    IndexReader *ir = openReader(w);
+    ASSERT(ir->header.version == version);
+    ASSERT(IR_NumDocs(ir) == 1000);
+
+    IndexHit h = NewIndexHit();
+    t_docId expected = 3;
+    int n = 0;
+    while (IR_Read(ir, &h) != INDEXREAD_EOF) {
+        ASSERT_EQUAL_INT(h.docId, expected, "bad docId");
+        ASSERT(h.numOffsets == 1);
+        OffsetVectorRef *ref = IndexHit_Offsets(&h);
+        ASSERT(ref->len == n % 4);
+        if (ref->len) {
+            VarintVector vv = {ref->data, ref->len, ref->data, BUFFER_READ, 0, NULL};
+            VarintVectorIterator vi = VarIntVector_iter(&vv);
+            ASSERT_EQUAL_INT(VV_Next(&vi), 3);
+        }
+        expected += 3;
+        n++;
+    }
+    ASSERT_EQUAL_INT(n, 1000);
+
+    IR_Free(ir);
+    IW_Free(w);
+    return 0;
+}
+
+int testReadLegacy() { return testReadAll(INDEX_VERSION_LEGACY, BLOCK_CODEC_RAW); }
+int testReadBlocks() { return testReadAll(INDEX_VERSION_BLOCKS, BLOCK_CODEC_SVB); }
+int testReadSplit() { return testReadAll(INDEX_VERSION_SPLIT, BLOCK_CODEC_SVB); }
+int testReadPFor() { return testReadAll(INDEX_VERSION_BLOCKS, BLOCK_CODEC_PFOR); }
+
+int testSkipTo(u_int32_t version, u_int32_t codec) {
+    IndexWriter *w = createCodecIndex(10000, 2, version, codec);
+    IndexReader *ir = openReader(w);
+    IndexHit h = NewIndexHit();
+
+    // hits land on the exact docId
+    for (t_docId id = 10; id < 20000; id += 998) {
+        IndexHit_Init(&h);
+        ASSERT_EQUAL_INT(IR_SkipTo(ir, id, &h), INDEXREAD_OK, "skip failed");
+        ASSERT_EQUAL_INT(h.docId, id);
+        // the offsets should be the ones of the entry we landed on
+        OffsetVectorRef *ref = IndexHit_Offsets(&h);
+        ASSERT_EQUAL_INT(ref->len, (id / 2 - 1) % 4);
+        if (ref->len) {
+            ASSERT_EQUAL_INT(ref->data[0], 2);
+        }
+    }
+
+    // misses land on the next docId
+    IndexHit_Init(&h);
+    ASSERT(IR_SkipTo(ir, 19981, &h) == INDEXREAD_OK);
+    ASSERT_EQUAL_INT(h.docId, 19982);
+    ASSERT_EQUAL_INT(IndexHit_Offsets(&h)->len, 9990 % 4);
+    IndexHit_Init(&h);
+    ASSERT(IR_Read(ir, &h) == INDEXREAD_OK);
+    ASSERT_EQUAL_INT(h.docId, 19984);
+
+    ASSERT(IR_SkipTo(ir, 30000, &h) == INDEXREAD_EOF);
+
+    // block encoded indexes find blocks in their skip index, and walk the block headers without 
+    // one, like keys written before they had skip indexes do
+    if (INDEX_BLOCK_ENCODED(version)) {
+        IndexReaderStats st;
+        IR_GetStats(ir, &st);
+        ASSERT(st.skipIndexHits > 0);
+        
+        IndexReader *walk = openReader(w);
+        SkipIndex_Free(walk->skipIdx);
+        walk->skipIdx = NULL;
+        for (t_docId id = 10; id < 20000; id += 998) {
+            IndexHit_Init(&h);
+            ASSERT_EQUAL_INT(IR_SkipTo(walk, id, &h), INDEXREAD_OK);
+            ASSERT_EQUAL_INT(h.docId, id);
+        }
+        IR_GetStats(walk, &st);
+        ASSERT(st.skipIndexHits == 0 && st.blocksSkipped > 0);
+        IR_Free(walk);
+    }
+
+    IR_Free(ir);
+    IW_Free(w);
+    return 0;
+}
+
+int testSkipToLegacy() { return testSkipTo(INDEX_VERSION_LEGACY, BLOCK_CODEC_RAW); }
+int testSkipToBlocks() { return testSkipTo(INDEX_VERSION_BLOCKS, BLOCK_CODEC_SVB); }
+int testSkipToSplit() { return testSkipTo(INDEX_VERSION_SPLIT, BLOCK_CODEC_SVB); }
+int testSkipToPFor() { return testSkipTo(INDEX_VERSION_SPLIT, BLOCK_CODEC_PFOR); }
+
+int testEntryLayouts() {
+    u_int32_t versions[] = {INDEX_VERSION_LEGACY, INDEX_VERSION_BLOCKS, INDEX_VERSION_SPLIT};
+    for (int v = 0; v < 3; v++) {
+        size_t fullSize = 0;
+        for (u_int32_t ef = 0; ef <= (INDEX_ENTRY_NOOFFSETS | INDEX_ENTRY_NOFIELDS | 
+                                      INDEX_ENTRY_NOFREQS); ef++) {
+            IndexWriter *w = createLayoutIndex(1000, 3, versions[v], BLOCK_CODEC_SVB, ef);
+            // every part we leave out makes the index smaller
+            if (ef == INDEX_ENTRY_FULL) {
+                fullSize = IW_Len(w);
+            } else {
+                ASSERT(IW_Len(w) < fullSize);
+            }
+            
+            IndexReader *ir = openReader(w);
+            ASSERT_EQUAL_INT(ir->header.entryFlags, ef);
+            IndexHit h = NewIndexHit();
+            int n = 0;
+            while (IR_Read(ir, &h) != INDEXREAD_EOF) {
+                ASSERT_EQUAL_INT(h.docId, (n + 1) * 3);
+                ASSERT_EQUAL_INT(h.flags, 0xff);
+                ASSERT_EQUAL_INT(IndexHit_Offsets(&h)->len, 
+                                 ((ef & INDEX_ENTRY_NOOFFSETS) ? 0 : n % 4));
+                if (ef & INDEX_ENTRY_NOFREQS) {
+                    ASSERT(h.totalFreq == IDF(TOTALDOCS_PLACEHOLDER, 1000));
+                }
+                IndexHit_Init(&h);
+                n++;
+            }
+            ASSERT_EQUAL_INT(n, 1000);
+            IR_Free(ir);
+            
+            // skipping lands on the first docId at or after the one we skip to
+            ir = openReader(w);
+            for (t_docId id = 10; id < 3000; id += 301) {
+                IndexHit_Init(&h);
+                ASSERT(IR_SkipTo(ir, id, &h) != INDEXREAD_EOF);
+                ASSERT_EQUAL_INT(h.docId, (id + 2) / 3 * 3);
+            }
+            IR_Free(ir);
+            IW_Free(w);
+        }
+    }
+    return 0;
+}
+
+int testReadModes() {
+    // entries alternate between two fields
+    IndexWriter *w = NewIndexWriter(100, INDEX_VERSION_BLOCKS, BLOCK_CODEC_SVB, INDEX_ENTRY_FULL);
+    for (int i = 0; i < 1000; i++) {
+        ForwardIndexEntry h = {.docId = i + 1, .flags = i % 2 ? 0x01 : 0x02, .freq = 1, 
+                               .docScore = 0.5};
+        h.vw = NewVarintVectorWriter(8);
+        VVW_Write(h.vw, i % 7);
+        IW_WriteEntry(w, &h);
+        VVW_Free(h.vw);
+    }
+    IW_Close(w);
+    
+    // the specialized Read of an iterator gives the same hits as IR_Read in every mode
+    u_char masks[] = {0xff, 0x01, 0x02};
+    for (int singleWord = 0; singleWord < 2; singleWord++) {
+        for (int m = 0; m < 3; m++) {
+            IndexIterator *it = NewReadIterator(NewIndexReader(w->bw.buf->data, IW_Len(w), NULL, 
+                                                               NULL, singleWord, masks[m]));
+            IndexReader *ref = NewIndexReader(w->bw.buf->data, IW_Len(w), NULL, NULL, singleWord, 
+                                              masks[m]);
+            ASSERT(it->Read != IR_Read);
+            IndexHit h1 = NewIndexHit(), h2 = NewIndexHit();
+            int n = 0, rc;
+            while ((rc = it->Read(it->ctx, &h1)) != INDEXREAD_EOF) {
+                ASSERT_EQUAL_INT(IR_Read(ref, &h2), rc);
+                if (rc == INDEXREAD_OK) {
+                    ASSERT_EQUAL_INT(h1.docId, h2.docId);
+                    ASSERT(h1.totalFreq == h2.totalFreq);
+                    ASSERT_EQUAL_INT(h1.numOffsets, h2.numOffsets);
+                    if (!singleWord) {
+                        ASSERT_EQUAL_INT(IndexHit_Offsets(&h1)->data[0], (h1.docId - 1) % 7);
+                    }
+                    n++;
+                }
+                IndexHit_Init(&h1);
+                IndexHit_Init(&h2);
+            }
+            ASSERT_EQUAL_INT(IR_Read(ref, &h2), INDEXREAD_EOF);
+            ASSERT_EQUAL_INT(n, (masks[m] == 0xff ? 1000 : 500));
+            it->Free(it);
+            IR_Free(ref);
+        }
+    }
+    IW_Free(w);
+    return 0;
+}
+
+int testIndexHeader() {
+    // legacy indexes with full entries keep the 12 byte header of the first versions
+    IndexWriter *w = createIndex(100, 1, INDEX_VERSION_LEGACY);
+    u_int32_t *legacy = (u_int32_t *)w->bw.buf->data;
+    ASSERT_EQUAL_INT((int)legacy[0], (int)IW_Len(w));
+    ASSERT_EQUAL_INT((int)legacy[1], 100);
+    ASSERT_EQUAL_INT((int)legacy[2], 100);
+    IndexReader *ir = openReader(w);
+    ASSERT_EQUAL_INT((int)ir->header.size, (int)IW_Len(w));
+    ASSERT_EQUAL_INT((int)BufferOffset(ir->buf), INDEX_HEADER_LEGACY_SIZE);
+    // they don't bound the frequencies
+    ASSERT(ir->header.maxFreq == 0 && IR_MaxScore(ir) == HUGE_VAL);
+    ASSERT_EQUAL_INT((int)IR_NumDocs(ir), 100);
+    IR_Free(ir);
+    IW_Free(w);
+    
+    // the others have an extended header, which is only read with its magic
+    w = createLayoutIndex(100, 1, INDEX_VERSION_LEGACY, BLOCK_CODEC_SVB, INDEX_ENTRY_NOFIELDS);
+    u_int32_t *ext = (u_int32_t *)w->bw.buf->data;
+    ASSERT(ext[0] & INDEX_HEADER_EXTENDED);
+    ASSERT_EQUAL_INT((int)(ext[0] & ~INDEX_HEADER_EXTENDED), (int)IW_Len(w));
+    ASSERT(ext[3] == INDEX_HEADER_MAGIC);
+    ir = openReader(w);
+    ASSERT_EQUAL_INT((int)ir->header.size, (int)IW_Len(w));
+    ASSERT(ir->header.entryFlags == INDEX_ENTRY_NOFIELDS && ir->header.maxFreq > 0);
+    ASSERT_EQUAL_INT((int)BufferOffset(ir->buf), (int)sizeof(IndexHeader));
+    IR_Free(ir);
+    
+    ext[3] = 0;
+    Buffer *b = NewBuffer(w->bw.buf->data, IW_Len(w), BUFFER_READ);
+    IndexHeader h;
+    ASSERT(!indexReadHeader(b, &h));
+    ASSERT(h.size == 0 && h.numDocs == 0 && h.version == 0);
+    free(b);
+    IW_Free(w);
+    return 0;
+}
+
+int testBlockHeaders() {
+    IndexWriter *w = createIndex(INDEX_BLOCK_SIZE * 2 + 5, 1, INDEX_VERSION_BLOCKS);
+    IndexReader *ir = openReader(w);
+
+    // walk the blocks using their headers only
+    BufferSeek(ir->buf, INDEX_HEADER_SIZE(ir->header.version, ir->header.entryFlags));
+    int nblocks = 0, nentries = 0;
+    t_docId lastId = 0;
+    while (IR_HasNext(ir)) {
+        IndexBlockHeader bh;
+        BufferRead(ir->buf, &bh, sizeof(bh));
+        // full blocks are sealed into columns, the open one stays raw
+        int codec = bh.numEntries == INDEX_BLOCK_SIZE ? BLOCK_CODEC_SVB : BLOCK_CODEC_RAW;
+        ASSERT_EQUAL_INT((int)bh.codec, codec);
+        ASSERT(bh.firstId == lastId + 1);
+        ASSERT(bh.lastId == bh.firstId + bh.numEntries - 1);
+        lastId = bh.lastId;
+        nentries += bh.numEntries;
+        BufferSkip(ir->buf, bh.len);
+        nblocks++;
+    }
+    ASSERT_EQUAL_INT(nblocks, 3);
+    ASSERT_EQUAL_INT(nentries, INDEX_BLOCK_SIZE * 2 + 5);
+    ASSERT(ir->header.lastBlock > sizeof(IndexHeader));
+
+    IR_Free(ir);
+    IW_Free(w);
+    return 0;
+}
+
+int testStreamVByte() {
+    u_int32_t n = 1001;
+    u_int32_t *in = malloc(n * sizeof(u_int32_t));
+    u_int32_t *out = malloc(n * sizeof(u_int32_t));
+    u_char *buf = malloc(SVB_MAX_SIZE(n));
+
+    // values of all byte lengths, ascending so we can delta encode them too
+    u_int32_t v = 7;
+    for (u_int32_t i = 0; i < n; i++) {
+        v += (i % 4 == 0 ? 1 : i % 4 == 1 ? 300 : i % 4 == 2 ? 70000 : 1 << 24) + i;
+        in[i] = v;
+    }
+
+    for (int k = SVB_Scalar; k <= SVB_AVX2; k++) {
+        SVB_SetKernel(k);
+
+        size_t sz = SVB_Encode(in, n, buf);
+        ASSERT_EQUAL_INT((int)sz, (int)(SVB_EncodedSize(in, n)));
+        memset(out, 0, n * sizeof(u_int32_t));
+        ASSERT_EQUAL_INT((int)(SVB_Decode(buf, buf + sz, n, out)), (int)sz);
+        ASSERT(memcmp(in, out, n * sizeof(u_int32_t)) == 0);
+
+        sz = SVB_EncodeDelta(in, n, 5, buf);
+        memset(out, 0, n * sizeof(u_int32_t));
+        ASSERT_EQUAL_INT((int)(SVB_DecodeDelta(buf, buf + sz, n, 5, out)), (int)sz);
+        ASSERT(memcmp(in, out, n * sizeof(u_int32_t)) == 0);
+
+        // truncated input is not decoded
+        ASSERT_EQUAL_INT((int)(SVB_DecodeDelta(buf, buf + sz - 1, n, 5, out)), 0);
+    }
+    SVB_SetKernel(SVB_AVX2);
+
+    free(in);
+    free(out);
+    free(buf);
+    return 0;
+}
+
+int testPFor() {
+    u_int32_t n = PFOR_MAX_BLOCK;
+    u_int32_t in[PFOR_MAX_BLOCK], out[PFOR_MAX_BLOCK];
+    u_char buf[PFOR_MAX_SIZE(PFOR_MAX_BLOCK)];
+
+    for (int k = PFOR_Scalar; k <= PFOR_AVX2; k++) {
+        PFOR_SetKernel(k);
+        
+        // small deltas with a few large exceptions, and frames of every width
+        for (int width = 0; width <= 32; width++) {
+            u_int32_t v = 0;
+            for (u_int32_t i = 0; i < n; i++) {
+                u_int32_t d = width == 32 ? 0xffffffff - i : (1U << width) - 1 - i % 3;
+                if (width < 32) d &= (1U << width) - 1;
+                if (i % 37 == 5) d = 1 << 20 | i;
+                v += d;
+                in[i] = v;
+            }
+            size_t sz = PFOR_Encode(in, n, buf);
+            ASSERT(sz <= PFOR_MAX_SIZE(n));
+            memset(out, 0, sizeof(out));
+            ASSERT_EQUAL_INT((int)(PFOR_Decode(buf, buf + sz, n, out)), (int)sz);
+            ASSERT(memcmp(in, out, n * sizeof(u_int32_t)) == 0);
+            
+            // odd block sizes too
+            sz = PFOR_EncodeDelta(in, n - 3, 5, buf);
+            memset(out, 0, sizeof(out));
+            ASSERT_EQUAL_INT((int)(PFOR_DecodeDelta(buf, buf + sz, n - 3, 5, out)), (int)sz);
+            ASSERT(memcmp(in, out, (n - 3) * sizeof(u_int32_t)) == 0);
+            
+            // truncated input is not decoded
+            ASSERT_EQUAL_INT((int)(PFOR_DecodeDelta(buf, buf + sz - 1, n - 3, 5, out)), 0);
+        }
+    }
+    PFOR_SetKernel(PFOR_AVX2);
+    return 0;
+}
+
+int testScoreIndex(u_int32_t version) {
+    IndexWriter *w = createIndex(SCOREINDEX_DELETE_THRESHOLD + 100, 1, version);
+    Buffer *sb = w->scoreWriter.bw.buf;
+    ScoreIndex *sci = NewScoreIndex(NewBuffer(sb->data, sb->cap, BUFFER_READ));
+    ASSERT(sci->header.numEntries == MAX_SCOREINDEX_SIZE);
+
+    IndexReader *ir = NewIndexReaderBuf(NewBuffer(w->bw.buf->data, IW_Len(w), BUFFER_READ),
+                                        NULL, NULL, 1, sci, 0xff, NULL);
+    ASSERT(ir->useScoreIndex);
+
+    // every read should land exactly on the docId of the respective score entry
+    IndexHit h = NewIndexHit();
+    for (int i = 0; i < MAX_SCOREINDEX_SIZE; i++) {
+        IndexHit_Init(&h);
+        ASSERT(IR_Read(ir, &h) == INDEXREAD_OK);
+        ScoreIndexEntry *ent = &sci->entries[i];
+        t_docId expected = INDEX_BLOCK_ENCODED(version) ? ent->docId : ent->docId + 1;
+        ASSERT_EQUAL_INT(h.docId, expected);
+    }
+    ASSERT(IR_Read(ir, &h) == INDEXREAD_EOF);
+
+    IR_Free(ir);
+    IW_Free(w);
+    return 0;
+}
+
+int testScoreIndexLegacy() { return testScoreIndex(INDEX_VERSION_LEGACY); }
+int testScoreIndexBlocks() { return testScoreIndex(INDEX_VERSION_BLOCKS); }
+int testScoreIndexSplit() { return testScoreIndex(INDEX_VERSION_SPLIT); }
+
+int testIntersect(u_int32_t version) {
+    IndexWriter *w = createIndex(100000, 4, version);
+    IndexWriter *w2 = createIndex(100000, 2, version);
+
+    IndexIterator **irs = calloc(2, sizeof(IndexIterator *));
+    irs[0] = NewReadIterator(openReader(w));
+    irs[1] = NewReadIterator(openReader(w2));
+    IndexIterator *ii = NewIntersecIterator(irs, 2, 0, NULL, 0xff, NULL);
+
+    int count = 0;
+    IndexHit h = NewIndexHit();
+    while (ii->Read(ii->ctx, &h) != INDEXREAD_EOF) {
+        ASSERT(h.docId % 4 == 0);
+        ++count;
+        IndexHit_Init(&h);
+    }
+    ASSERT_EQUAL_INT(count, 50000);
+
+    ii->Free(ii);
+    IW_Free(w);
+    IW_Free(w2);
+    return 0;
+}
+
+int testIntersectLegacy() { return testIntersect(INDEX_VERSION_LEGACY); }
+
+int testArenaIterators() {
+    // the readers and iterators of a query are allocated from its arena, and freed with it
+    IndexWriter *w = createIndex(10000, 2, INDEX_VERSION_BLOCKS);
+    IndexWriter *w2 = createIndex(10000, 3, INDEX_VERSION_BLOCKS);
+    Arena *arena = NewArena(ARENA_DEFAULT_BLOCK_SIZE);
+
+    IndexIterator **irs = Arena_Calloc(arena, 2, sizeof(IndexIterator *));
+    irs[0] = NewReadIterator(openArenaReader(w, arena));
+    irs[1] = NewReadIterator(openArenaReader(w2, arena));
+    IndexIterator **its = Arena_Calloc(arena, 2, sizeof(IndexIterator *));
+    its[0] = NewIntersecIterator(irs, 2, 0, NULL, 0xff, arena);
+    its[1] = NewReadIterator(openArenaReader(w, arena));
+    IndexIterator *ui = NewUnionIterator(its, 2, NULL, arena);
+
+    int count = 0;
+    IndexHit h = NewIndexHit();
+    while (ui->Read(ui->ctx, &h) != INDEXREAD_EOF) {
+        ASSERT(h.docId % 2 == 0);
+        ++count;
+        IndexHit_Init(&h);
+    }
+    ASSERT_EQUAL_INT(count, 10000);
+
+    ui->Free(ui);
+    Arena_Free(arena);
+    IW_Free(w);
+    IW_Free(w2);
+    return 0;
+}
+
+int testIntersectManyTerms() {
+    // intersect more terms than an intersection could once hold the offsets of
+    int num = 12;
+    IndexWriter *w = createIndex(1000, 1, INDEX_VERSION_BLOCKS);
+    IndexIterator **irs = calloc(num, sizeof(IndexIterator *));
+    for (int i = 0; i < num; i++) {
+        irs[i] = NewReadIterator(openReader(w));
+    }
+    IndexIterator *ii = NewIntersecIterator(irs, num, 1, NULL, 0xff, NULL);
+    
+    int count = 0;
+    IndexHit h = NewIndexHit();
+    while (ii->Read(ii->ctx, &h) != INDEXREAD_EOF) {
+        ASSERT_EQUAL_INT(h.numOffsets, num);
+        ASSERT(h.type == H_EXACT);
+        // all the terms have the same offsets
+        for (int i = 0; i < num; i++) {
+            ASSERT(IndexHit_Offsets(&h)[i].len == count % 4);
+        }
+        ++count;
+        IndexHit_Init(&h);
+    }
+    ASSERT_EQUAL_INT(count, 1000);
+    
+    ii->Free(ii);
+    IW_Free(w);
+    return 0;
+}
+int testIntersectOrder() {
+    // a frequent term, then a rare one and a missing one
+    IndexWriter *w = createIndex(10000, 1, INDEX_VERSION_BLOCKS);
+    IndexWriter *w2 = createIndex(200, 50, INDEX_VERSION_BLOCKS);
+    IndexIterator **irs = calloc(2, sizeof(IndexIterator *));
+    irs[0] = NewReadIterator(openReader(w));
+    irs[1] = NewReadIterator(openReader(w2));
+    IndexIterator *ii = NewIntersecIterator(irs, 2, 0, NULL, 0xff, NULL);
+    IntersectContext *ic = ii->ctx;
+    
+    // the rare term leads, but the hits keep the offsets in the query order
+    ASSERT_EQUAL_INT(ic->order[0], 1);
+    ASSERT_EQUAL_INT((int)(ii->Len(ic)), 200);
+    int count = 0;
+    IndexHit h = NewIndexHit();
+    while (ii->Read(ii->ctx, &h) != INDEXREAD_EOF) {
+        ASSERT_EQUAL_INT(h.docId, (count + 1) * 50);
+        ASSERT_EQUAL_INT(h.numOffsets, 2);
+        ASSERT_EQUAL_INT(IndexHit_Offsets(&h)[0].len, (h.docId - 1) % 4);
+        ASSERT_EQUAL_INT(IndexHit_Offsets(&h)[1].len, count % 4);
+        ++count;
+        IndexHit_Init(&h);
+    }
+    ASSERT_EQUAL_INT(count, 200);
+    ii->Free(ii);
+    
+    // the intersection is done before it reads anything
+    irs = calloc(3, sizeof(IndexIterator *));
+    irs[0] = NewReadIterator(openReader(w));
+    irs[1] = NewReadIterator(openReader(w2));
+    irs[2] = NULL;
+    ii = NewIntersecIterator(irs, 3, 0, NULL, 0xff, NULL);
+    ASSERT_EQUAL_INT(((IntersectContext *)ii->ctx)->order[0], 2);
+    ASSERT_EQUAL_INT((int)(ii->Len(ii->ctx)), 0);
+    ASSERT_EQUAL_INT(ii->Read(ii->ctx, &h), INDEXREAD_EOF);
+    ASSERT_EQUAL_INT(((IndexReader *)irs[0]->ctx)->lastId, 0);
+    ii->Free(ii);
+    
+    IW_Free(w);
+    IW_Free(w2);
+    return 0;
+}
+
+int testIntersectBlocks() { return testIntersect(INDEX_VERSION_BLOCKS); }
+int testIntersectSplit() { return testIntersect(INDEX_VERSION_SPLIT); }
+
+/* Read an iterator to its end in batches, checking each hit against reading another iterator 
+over the same data hit by hit */
+/* Check that the batches of it have the hits ref reads, and the minimal distances of the ones
+scoring above minScore */
+int checkBatchesAbove(IndexIterator *it, IndexIterator *ref, int expected, double minScore) {
+    IndexHitBatch b;
+    b.minScore = minScore;
+    IndexHit h;
+    int n = 0;
+    while (IndexIterator_ReadBatch(it, &b) > 0) {
+        ASSERT(b.num <= INDEX_BATCH_SIZE);
+        for (int i = 0; i < b.num; i++) {
+            IndexHit_Init(&h);
+            ASSERT(ref->Read(ref->ctx, &h) == INDEXREAD_OK);
+            ASSERT_EQUAL_INT(b.docIds[i], h.docId);
+            ASSERT(b.totalFreq[i] == h.totalFreq);
+            ASSERT_EQUAL_INT(b.minDist[i], (h.totalFreq <= minScore ? 1 : IndexHit_MinDistance(&h)));
+            n++;
+        }
+    }
+    IndexHit_Init(&h);
+    ASSERT(ref->Read(ref->ctx, &h) == INDEXREAD_EOF);
+    ASSERT_EQUAL_INT(n, expected);
+    return 0;
+}
+
+int checkBatches(IndexIterator *it, IndexIterator *ref, int expected) {
+    return checkBatchesAbove(it, ref, expected, -1);
+}
+
+int testReadBatch(u_int32_t version, u_int32_t codec) {
+    IndexWriter *w = createCodecIndex(1000, 3, version, codec);
+    IndexWriter *w2 = createCodecIndex(1500, 2, version, codec);
+    
+    // a single reader
+    IndexIterator *it = NewReadIterator(openReader(w));
+    IndexIterator *ref = NewReadIterator(openReader(w));
+    ASSERT(checkBatches(it, ref, 1000) == 0);
+    it->Free(it);
+    ref->Free(ref);
+
+    // union and intersection of two readers
+    for (int intersect = 0; intersect < 2; intersect++) {
+        IndexIterator *its[2];
+        for (int i = 0; i < 2; i++) {
+            IndexIterator **irs = calloc(2, sizeof(IndexIterator *));
+            irs[0] = NewReadIterator(openReader(w));
+            irs[1] = NewReadIterator(openReader(w2));
+            its[i] = intersect ? NewIntersecIterator(irs, 2, 0, NULL, 0xff, NULL) : 
+                                 NewUnionIterator(irs, 2, NULL, NULL);
+        }
+        // docIds divisible by 3 up to 3000, or by 2 up to 3000
+        ASSERT(checkBatches(its[0], its[1], intersect ? 500 : 2000) == 0);
+        its[0]->Free(its[0]);
+        its[1]->Free(its[1]);
+    }
+    
+    // hits that can't score above the batch's minScore have no distance, but are still returned
+    IndexIterator *its[2];
+    for (int i = 0; i < 2; i++) {
+        IndexIterator **irs = calloc(2, sizeof(IndexIterator *));
+        irs[0] = NewReadIterator(openReader(w));
+        irs[1] = NewReadIterator(openReader(w2));
+        its[i] = NewIntersecIterator(irs, 2, 0, NULL, 0xff, NULL);
+    }
+    ASSERT(checkBatchesAbove(its[0], its[1], 500, IDF(TOTALDOCS_PLACEHOLDER, 1000)) == 0);
+    its[0]->Free(its[0]);
+    its[1]->Free(its[1]);
+
+    IW_Free(w);
+    IW_Free(w2);
+    return 0;
+}
+
+int testReadBatchLegacy() { return testReadBatch(INDEX_VERSION_LEGACY, BLOCK_CODEC_RAW); }
+int testReadBatchBlocks() { return testReadBatch(INDEX_VERSION_BLOCKS, BLOCK_CODEC_SVB); }
+int testReadBatchSplit() { return testReadBatch(INDEX_VERSION_SPLIT, BLOCK_CODEC_SVB); }
+int testReadBatchPFor() { return testReadBatch(INDEX_VERSION_BLOCKS, BLOCK_CODEC_PFOR); }
+
+/* Create an in-memory index whose entries score low, except for the entries of every hot-th block
+of INDEX_BLOCK_SIZE entries */
+IndexWriter *createScoredIndex(int size, int idStep, int hot, u_int32_t version) {
+    IndexWriter *w = NewIndexWriter(100, version, BLOCK_CODEC_PFOR, INDEX_ENTRY_FULL);
+    for (int i = 0; i < size; i++) {
+        int block = i / INDEX_BLOCK_SIZE;
+        ForwardIndexEntry h = {.docId = (i + 1) * idStep, .flags = 0xff, 
+                               .freq = block % hot ? 0.1 + (i % 7) * 0.01 : 0.5 + (i % 5) * 0.1, 
+                               .docScore = 1};
+        h.vw = NewVarintVectorWriter(8);
+        VVW_Write(h.vw, i % 3);
+        IW_WriteEntry(w, &h);
+        VVW_Free(h.vw);
+    }
+    IW_Close(w);
+    return w;
+}
+
+/* Read an iterator in batches after telling it the minimal score we need, checking that it 
+yields every hit of another iterator over the same data that scores above it */
+int checkPruned(IndexIterator *it, IndexIterator *ref, double minScore, int *n, int *nref) {
+    it->SetMinScore(it->ctx, minScore);
+    IndexHitBatch b;
+    b.minScore = -1;
+    IndexHit h = NewIndexHit();
+    int rc = ref->Read(ref->ctx, &h);
+    *n = *nref = 0;
+    while (IndexIterator_ReadBatch(it, &b) > 0) {
+        for (int i = 0; i < b.num; i++) {
+            // the hits we skipped could not score above minScore
+            while (rc == INDEXREAD_OK && h.docId < b.docIds[i]) {
+                ASSERT(h.totalFreq <= minScore);
+                IndexHit_Init(&h);
+                rc = ref->Read(ref->ctx, &h);
+                ++*nref;
+            }
+            ASSERT(rc == INDEXREAD_OK && h.docId == b.docIds[i]);
+            ASSERT(b.totalFreq[i] == h.totalFreq);
+            IndexHit_Init(&h);
+            rc = ref->Read(ref->ctx, &h);
+            ++*nref;
+            ++*n;
+        }
+    }
+    while (rc == INDEXREAD_OK) {
+        ASSERT(h.totalFreq <= minScore);
+        IndexHit_Init(&h);
+        rc = ref->Read(ref->ctx, &h);
+        ++*nref;
+    }
+    return 0;
+}
+
+int testPruning() {
+    int size = INDEX_BLOCK_SIZE * 20;
+    IndexWriter *w = createScoredIndex(size, 1, 4, INDEX_VERSION_BLOCKS);
+    IndexWriter *w2 = createScoredIndex(size, 2, 5, INDEX_VERSION_BLOCKS);
+
+    // the headers bound the frequencies of the entries
+    IndexReader *ir = openReader(w);
+    ASSERT(ir->header.maxFreq > 0.89 * FREQ_QUANTIZE_FACTOR && 
+           ir->header.maxFreq <= 0.9 * FREQ_QUANTIZE_FACTOR);
+    BufferSeek(ir->buf, INDEX_HEADER_SIZE(ir->header.version, ir->header.entryFlags));
+    for (int i = 0; IR_HasNext(ir); i++) {
+        IndexBlockHeader bh;
+        BufferRead(ir->buf, &bh, sizeof(bh));
+        ASSERT((bh.maxFreq > FREQ_QUANTIZE_FACTOR / 2) == (i % 4 == 0));
+        BufferSkip(ir->buf, bh.len);
+    }
+    // both terms have the same best frequency and number of documents
+    double max = IR_MaxScore(ir), low = max / 2;
+    IR_Free(ir);
+
+    // a single reader only reads the hot blocks
+    int n, nref;
+    IndexIterator *it = NewReadIterator(openReader(w));
+    IndexIterator *ref = NewReadIterator(openReader(w));
+    ASSERT(checkPruned(it, ref, low, &n, &nref) == 0);
+    ASSERT_EQUAL_INT(n, size / 4);
+    ASSERT_EQUAL_INT(nref, size);
+    it->Free(it);
+    ref->Free(ref);
+    
+    // legacy indexes have no blocks to skip
+    IndexWriter *lw = createScoredIndex(size, 1, 4, INDEX_VERSION_LEGACY);
+    it = NewReadIterator(openReader(lw));
+    ref = NewReadIterator(openReader(lw));
+    ASSERT(checkPruned(it, ref, low, &n, &nref) == 0);
+    ASSERT_EQUAL_INT(n, size);
+    it->Free(it);
+    ref->Free(ref);
+    IW_Free(lw);
+
+    // unions and intersections pass the minimal score on to their children
+    for (int intersect = 0; intersect < 2; intersect++) {
+        IndexIterator *its[2];
+        for (int i = 0; i < 2; i++) {
+            IndexIterator **irs = calloc(2, sizeof(IndexIterator *));
+            irs[0] = NewReadIterator(openReader(w));
+            irs[1] = NewReadIterator(openReader(w2));
+            its[i] = intersect ? NewIntersecIterator(irs, 2, 0, NULL, 0xff, NULL) : 
+                                 NewUnionIterator(irs, 2, NULL, NULL);
+        }
+        // union hits score as their best child, intersection hits as the sum of the children
+        ASSERT(IndexIterator_MaxScore(its[0]) == (intersect ? max * 2 : max));
+        ASSERT(checkPruned(its[0], its[1], intersect ? max * 1.2 : low, &n, &nref) == 0);
+        ASSERT(n > 0 && n < nref);
+        its[0]->Free(its[0]);
+        its[1]->Free(its[1]);
+    }
+
+    IW_Free(w);
+    IW_Free(w2);
+    return 0;
+}
+
+/* Open a union over num indexes, merging its children with a heap or by scanning them */
+IndexIterator *openUnion(IndexWriter **ws, int num, int useHeap) {
+    IndexIterator **irs = calloc(num, sizeof(IndexIterator *));
+    for (int i = 0; i < num; i++) {
+        irs[i] = NewReadIterator(openReader(ws[i]));
+    }
+    IndexIterator *it = NewUnionIterator(irs, num, NULL, NULL);
+    ((UnionContext *)it->ctx)->useHeap = useHeap;
+    return it;
+}
+
+int testUnionHeap() {
+    // children with overlapping docIds and different scores
+    int num = 20;
+    IndexWriter *ws[num];
+    for (int i = 0; i < num; i++) {
+        ws[i] = createScoredIndex(500 + i * 50, 3 + i % 7, 2 + i % 3, INDEX_VERSION_BLOCKS);
+    }
+    IndexIterator *it = NewUnionIterator(calloc(num, sizeof(IndexIterator *)), num, NULL, NULL);
+    ASSERT(((UnionContext *)it->ctx)->useHeap);
+    it->Free(it);
+    
+    // the heap merges like the linear scan, with Read and in batches
+    IndexIterator *heap = openUnion(ws, num, 1), *linear = openUnion(ws, num, 0);
+    IndexHit h1 = NewIndexHit(), h2 = NewIndexHit();
+    int n = 0;
+    t_docId ids[20000];
+    double freqs[20000];
+    while (heap->Read(heap->ctx, &h1) == INDEXREAD_OK) {
+        ASSERT(linear->Read(linear->ctx, &h2) == INDEXREAD_OK);
+        ASSERT_EQUAL_INT(h1.docId, h2.docId);
+        ASSERT(h1.totalFreq == h2.totalFreq);
+        ids[n] = h1.docId;
+        freqs[n] = h1.totalFreq;
+        IndexHit_Init(&h1);
+        IndexHit_Init(&h2);
+        n++;
+    }
+    ASSERT(linear->Read(linear->ctx, &h2) == INDEXREAD_EOF);
+    heap->Free(heap);
+    linear->Free(linear);
+    
+    heap = openUnion(ws, num, 1);
+    linear = openUnion(ws, num, 0);
+    ASSERT(checkBatches(heap, linear, n) == 0);
+    heap->Free(heap);
+    linear->Free(linear);
+    
+    // skipping finds the docIds the union has, and stops at the next one for the others
+    heap = openUnion(ws, num, 1);
+    int pos = 0;
+    for (t_docId id = 1; ; id += 1 + id % 13) {
+        while (pos < n && ids[pos] < id) pos++;
+        IndexHit_Init(&h1);
+        int rc = heap->SkipTo(heap->ctx, id, &h1);
+        if (pos == n) {
+            ASSERT_EQUAL_INT(rc, INDEXREAD_EOF);
+            break;
+        }
+        ASSERT_EQUAL_INT(h1.docId, ids[pos]);
+        ASSERT_EQUAL_INT(rc, (ids[pos] == id ? INDEXREAD_OK : INDEXREAD_NOTFOUND));
+        ASSERT(rc != INDEXREAD_OK || h1.totalFreq == freqs[pos]);
+    }
+    heap->Free(heap);
+    
+    for (int i = 0; i < num; i++) {
+        IW_Free(ws[i]);
+    }
+    return 0;
+}
+
+/* Build the bitmap of an in-memory index and open an iterator on it */
+IndexIterator *openBitmap(IndexWriter *w) {
+    IndexReader *ir = openReader(w);
+    BufferWriter bw = NewBufferWriter(NewMemoryBuffer(1024, BUFFER_WRITE));
+    DocBitmap_Build(ir, &bw);
+    IR_Free(ir);
+    
+    // the bitmap takes the buffer over
+    Buffer *b = bw.buf;
+    b->cap = BufferOffset(b);
+    BufferSeek(b, 0);
+    DocBitmap *bm = NewDocBitmap(b);
+    if (bm == NULL) return NULL;
+    return NewBitmapIterator(NewBitmapReader(bm, 0xff));
+}
+
+int testBitmap() {
+    // dense docIds go into bitset containers, sparse ones into arrays
+    int steps[] = {1, 3, 20};
+    for (int s = 0; s < 3; s++) {
+        IndexWriter *w = createIndex(100000, steps[s], INDEX_VERSION_BLOCKS);
+        IndexIterator *it = openBitmap(w);
+        ASSERT(it != NULL);
+        DocBitmap *bm = ((BitmapReader *)it->ctx)->bm;
+        ASSERT_EQUAL_INT(bm->num, 100000);
+        ASSERT(bm->containers[0].type == (steps[s] < 16 ? BITMAP_CONTAINER_BITSET : 
+                                                          BITMAP_CONTAINER_ARRAY));
+        IndexHeader h = {0, w->lastId, w->ndocs};
+        ASSERT(DocBitmap_Matches(bm, &h));
+        h.numDocs++;
+        ASSERT(!DocBitmap_Matches(bm, &h));
+        
+        // reading the bitmap gives the same hits as reading the index
+        IndexIterator *ref = NewReadIterator(openReader(w));
+        ASSERT(checkBatches(it, ref, 100000) == 0);
+        it->Free(it);
+        ref->Free(ref);
+        
+        // and so does skipping around in it
+        it = openBitmap(w);
+        ref = NewReadIterator(openReader(w));
+        IndexHit h1 = NewIndexHit(), h2 = NewIndexHit();
+        for (t_docId id = 5; id < 100000 * steps[s] + 10; id += 7 * steps[s] + 1) {
+            int rc = it->SkipTo(it->ctx, id, &h1);
+            int refrc = ref->SkipTo(ref->ctx, id, &h2);
+            ASSERT((rc == INDEXREAD_EOF) == (refrc == INDEXREAD_EOF));
+            if (rc == INDEXREAD_EOF) break;
+            ASSERT_EQUAL_INT(h1.docId, h2.docId);
+            ASSERT_EQUAL_INT(rc, (h1.docId == id ? INDEXREAD_OK : INDEXREAD_NOTFOUND));
+            ASSERT(h1.totalFreq == h2.totalFreq);
+            IndexHit_Init(&h1);
+            IndexHit_Init(&h2);
+        }
+        it->Free(it);
+        ref->Free(ref);
+        IW_Free(w);
+    }
+    return 0;
+}
+
+int testBitmapIntersect() {
+    IndexWriter *w = createIndex(100000, 1, INDEX_VERSION_BLOCKS);
+    IndexWriter *w2 = createIndex(30000, 3, INDEX_VERSION_BLOCKS);
+    IndexWriter *w3 = createIndex(6000, 20, INDEX_VERSION_BLOCKS);
+    
+    // bitmaps intersected and merged directly, against the same bitmaps read one by one. 
+    // The intersection has the docIds divisible by 60 up to 90000, and the union all the docIds up
+    // to 100000 and those divisible by 20 up to 120000
+    for (int intersect = 0; intersect < 2; intersect++) {
+        IndexIterator *its[2];
+        for (int i = 0; i < 2; i++) {
+            IndexIterator **irs = calloc(3, sizeof(IndexIterator *));
+            irs[0] = openBitmap(w);
+            irs[1] = openBitmap(w2);
+            irs[2] = openBitmap(w3);
+            its[i] = intersect ? NewIntersecIterator(irs, 3, 0, NULL, 0xff, NULL) : 
+                                 NewUnionIterator(irs, 3, NULL, NULL);
+        }
+        its[1]->ReadBatch = NULL;
+        ASSERT(checkBatches(its[0], its[1], intersect ? 1500 : 101000) == 0);
+        its[0]->Free(its[0]);
+        its[1]->Free(its[1]);
+    }
+    
+    // a bitmap intersected with a list gives the same docIds as two lists
+    IndexIterator **irs = calloc(2, sizeof(IndexIterator *));
+    irs[0] = openBitmap(w);
+    irs[1] = NewReadIterator(openReader(w2));
+    IndexIterator *ii = NewIntersecIterator(irs, 2, 0, NULL, 0xff, NULL);
+    // the list leads the intersection
+    ASSERT_EQUAL_INT(((IntersectContext *)ii->ctx)->order[0], 1);
+    IndexHit h = NewIndexHit();
+    int count = 0;
+    while (ii->Read(ii->ctx, &h) != INDEXREAD_EOF) {
+        ASSERT_EQUAL_INT(h.docId, (count + 1) * 3);
+        ++count;
+        IndexHit_Init(&h);
+    }
+    ASSERT_EQUAL_INT(count, 30000);
+    ii->Free(ii);
+    
+    IW_Free(w);
+    IW_Free(w2);
+    IW_Free(w3);
+    return 0;
+}
+
+int testReaderStats() {
+    for (u_int32_t version = INDEX_VERSION_LEGACY; version <= INDEX_VERSION_SPLIT; version++) {
+        IndexWriter *w = createIndex(10000, 1, version);
+        
+        // reading everything goes over the whole index once
+        IndexReader *ir = openReader(w);
+        IndexHitBatch batch;
+        batch.minScore = -1;
+        while (IR_ReadBatch(ir, &batch));
+        IndexReaderStats st;
+        IR_GetStats(ir, &st);
+        ASSERT_EQUAL_INT((int)st.decoded, 10000);
+        ASSERT_EQUAL_INT((int)st.bytes, (int)(IW_Len(w) - INDEX_HEADER_SIZE(w->version, w->entryFlags)));
+        ASSERT_EQUAL_INT((int)(st.skipIndexHits + st.blocksSkipped), 0);
+        IR_Free(ir);
+        
+        // skipping to a few docIds jumps over most of it
+        ir = openReader(w);
+        IndexHit h = NewIndexHit();
+        for (t_docId id = 1000; id <= 10000; id += 1000) {
+            IndexHit_Init(&h);
+            ASSERT_EQUAL_INT(IR_SkipTo(ir, id, &h), INDEXREAD_OK);
+        }
+        IR_GetStats(ir, &st);
+        ASSERT(st.decoded < 10000 && st.bytes < IW_Len(w) / 2);
+        ASSERT(st.skipIndexHits + st.blocksSkipped >= 10);
+        IR_Free(ir);
+        IW_Free(w);
+    }
+    return 0;
+}
+
+int testDocNorms() {
+    // quantized lengths keep their order, and are within a few percent of the real length
+    ASSERT_EQUAL_INT(DocNorm_Quantize(0), 0);
+    ASSERT_EQUAL_INT(DocNorm_Quantize(1), 8);
+    for (u_int32_t len = 1; len < 100000; len++) {
+        ASSERT(DocNorm_Quantize(len) >= DocNorm_Quantize(len - 1));
+        double l = DocNorm_Value(DocNorm_Quantize(len));
+        ASSERT(len < 16 || (l > len * 0.95 && l < len * 1.05));
+    }
+
+    // docs 1..200 with term frequencies 1..5 out of a highest frequency of 5. Even docs have 10 
+    // tokens and odd ones 1000, and their scores go down from 1. The last doc has no norms record
+    int num = 200;
+    IndexWriter *w = NewIndexWriter(100, INDEX_VERSION_BLOCKS, BLOCK_CODEC_SVB, INDEX_ENTRY_FULL);
+    size_t sz = sizeof(DocNormsHeader) + (num + 1) * sizeof(DocNorm);
+    char *data = calloc(1, sz);
+    DocNormsHeader *hdr = (DocNormsHeader *)data;
+    DocNorm *recs = (DocNorm *)(data + sizeof(DocNormsHeader));
+    for (t_docId id = 1; id <= num; id++) {
+        double score = 1 - id / 1000.0;
+        ForwardIndexEntry h = {.docId = id, .flags = 0xff, .freq = (1 + id % 5) / 5.0, 
+                               .docScore = score};
+        h.vw = NewVarintVectorWriter(8);
+        VVW_Write(h.vw, 1);
+        IW_WriteEntry(w, &h);
+        VVW_Free(h.vw);
+        if (id < num) {
+            u_int32_t len = id % 2 ? 1000 : 10;
+            DocNorm_Init(&recs[id], len, 5, score);
+            hdr->numDocs++;
+            hdr->totalLen += len;
+            if (DocNorm_Score(&recs[id]) > hdr->maxScore) hdr->maxScore = DocNorm_Score(&recs[id]);
+        }
+    }
+    IW_Close(w);
+    DocNorms *norms = NewDocNorms(data, sz);
+    ASSERT_EQUAL_INT((int)norms->numIds, num + 1);
+
+    double idf = BM25_IDF(1000, num);
+    double avgLen = (double)hdr->totalLen / hdr->numDocs;
+    for (int batches = 0; batches < 2; batches++) {
+        IndexReader *ir = openReader(w);
+        IR_SetNorms(ir, norms, 1000);
+        IndexIterator *it = NewReadIterator(ir);
+        IndexHitBatch b;
+        b.minScore = -1;
+        IndexHit h = NewIndexHit();
+        double scores[num + 1];
+        t_docId id = 0;
+        while (batches ? IndexIterator_ReadBatch(it, &b) > 0 : it->Read(it->ctx, &h) == INDEXREAD_OK) {
+            for (int i = 0; i < (batches ? b.num : 1); i++) {
+                id++;
+                double score = batches ? b.totalFreq[i] : h.totalFreq;
+                ASSERT_EQUAL_INT((int)(batches ? b.docIds[i] : h.docId), (int)id);
+                // the term frequency comes back from the quantized maxFreq, within a few percent
+                double docScore = 1 - id / 1000.0, f = (1 + id % 5) / 5.0 * docScore;
+                double tf = (1 + id % 5) * DocNorm_Value(DocNorm_Quantize(5)) / 5;
+                double k = BM25_K1 * (1 - BM25_B + BM25_B * DocNorm_Value(DocNorm_Quantize(
+                                                                 id % 2 ? 1000 : 10)) / avgLen);
+                double expected = id < num ? docScore * tf * (BM25_K1 + 1) / (tf + k) * idf
+                                           : f * (BM25_K1 + 1) / (f + BM25_K1) * idf;
+                ASSERT(fabs(score - expected) < 1e-3);
+                ASSERT(score <= IR_MaxScore(ir));
+                scores[id] = score;
+            }
+            IndexHit_Init(&h);
+        }
+        ASSERT_EQUAL_INT((int)id, num);
+        // the same frequency scores higher in a shorter document
+        ASSERT(scores[12] > scores[7]);
+        it->Free(it);
+    }
+
+    // without norms the stored frequency is the weight
+    ASSERT(DocNorms_Weight(NULL, 1, 0.25) == 0.25);
+    DocNorms_Free(norms);
+    free(data);
+    IW_Free(w);
+    return 0;
+}
+
+QueryStage *termStage(const char *term) {
+    Query q = {0};
+    QueryToken qt = {strdup(term), strlen(term)};
+    return NewTokenStage(&q, &qt);
+}
+
+QueryStage *logicStage(QueryOp op, int num, ...) {
+    Query q = {0};
+    QueryStage *s = NewLogicStage(&q, op);
+    va_list ap;
+    va_start(ap, num);
+    for (int i = 0; i < num; i++) {
+        QueryStage_AddChild(s, va_arg(ap, QueryStage *));
+    }
+    va_end(ap);
+    return s;
+}
+
+int testQueryRewrite() {
+    // foo (bar (baz | (qux | baz))) (foo) "bar bar" bar
+    QueryStage *root = logicStage(Q_INTERSECT, 5, 
+        termStage("foo"),
+        logicStage(Q_INTERSECT, 2, termStage("bar"), 
+                   logicStage(Q_UNION, 2, termStage("baz"), 
+                              logicStage(Q_UNION, 2, termStage("qux"), termStage("baz")))),
+        logicStage(Q_UNION, 1, termStage("foo")),
+        logicStage(Q_EXACT, 2, termStage("bar"), termStage("bar")),
+        termStage("bar"));
+    QueryStage_Rewrite(root);
+    
+    // foo bar (baz | qux) "bar bar"
+    ASSERT_EQUAL_INT(root->nchildren, 4);
+    ASSERT(!strcmp(root->children[0]->value, "foo"));
+    ASSERT(!strcmp(root->children[1]->value, "bar"));
+    QueryStage *u = root->children[2];
+    ASSERT_EQUAL_INT(u->op, Q_UNION);
+    ASSERT_EQUAL_INT(u->nchildren, 2);
+    ASSERT(!strcmp(u->children[0]->value, "baz"));
+    ASSERT(!strcmp(u->children[1]->value, "qux"));
+    ASSERT(u->parent == root);
+    // phrases keep their repeated words
+    ASSERT_EQUAL_INT(root->children[3]->op, Q_EXACT);
+    ASSERT_EQUAL_INT(root->children[3]->nchildren, 2);
+    
+    QueryStage_Free(root);
+    return 0;
+}
+
+int testArena() {
+    Arena *a = NewArena(128);
+    // small allocations are aligned and packed into the blocks one after the other
+    char *prev = NULL;
+    for (int i = 0; i < 100; i++) {
+        char *p = Arena_Alloc(a, 1 + i % 20);
+        ASSERT_EQUAL_INT((int)((size_t)p % 16), 0);
+        ASSERT(prev == NULL || p != prev);
+        memset(p, i, 1 + i % 20);
+        prev = p;
+    }
+    // large ones get their own block, and the current block is still allocated from
+    char *big = Arena_Calloc(a, 1000, 1);
+    ASSERT(big[0] == 0 && big[999] == 0);
+    char *s = Arena_Strndup(a, "hello world", 5);
+    ASSERT(!strcmp(s, "hello"));
+    ASSERT(a->allocated >= 1000 + 100);
+    Arena_Free(a);
+    return 0;
+}
+
+/* Is a stage tree, and the terms in it, allocated in an arena */
+static int inArena(QueryStage *s, Arena *a) {
+    if (s->arena != a || s->valueFreeable != (s->op == Q_NUMERIC)) return 0;
+    for (int i = 0; i < s->nchildren; i++) {
+        if (!inArena(s->children[i], a) || s->children[i]->parent != s) return 0;
+    }
+    return 1;
+}
+
+int testQueryArena() {
+    const char *qs = "hello \"foo bar\" k1 k2 k3 k4 k5 k6 k7 k8";
+    Query *q = NewQuery(NULL, qs, strlen(qs), 0, 10, 0xff, 1, NULL);
+    Query_Tokenize(q);
+    ASSERT(inArena(q->root, q->arena));
+    // arena children arrays grow past their first capacity
+    ASSERT_EQUAL_INT(q->root->nchildren, 10);
+    ASSERT_EQUAL_INT(q->root->children[1]->op, Q_EXACT);
+    ASSERT_EQUAL_INT(q->root->children[1]->nchildren, 2);
+    ASSERT(!strcmp(q->root->children[9]->value, "k8"));
+    QueryStage_Rewrite(q->root);
+    ASSERT(inArena(q->root, q->arena));
+    Query_Free(q);
+    return 0;
+}
+
+int testTopK() {
+    TopKEntry entries[10];
+    TopK t;
+    TopK_Init(&t, entries, 10);
+    ASSERT(!TopK_Full(&t));
+    // scores cycle so there are ties, which go to the lower docIds
+    for (t_docId id = 1; id <= 1000; id++) {
+        TopK_Push(&t, (id * 7) % 13, id);
+    }
+    ASSERT(TopK_Full(&t));
+    ASSERT(t.threshold == 12);
+    // ties of the threshold don't get in, anything above it does
+    ASSERT(!TopK_Push(&t, 12, 1001));
+    ASSERT(TopK_Push(&t, 100, 1002));
+    TopK_Sort(&t);
+    ASSERT_EQUAL_INT((int)t.entries[0].docId, 1002);
+    // the rest are the 9 lowest docIds that score 12, in order: 11, 24, 37...
+    t_docId prev = 0;
+    for (int i = 1; i < 10; i++) {
+        ASSERT(t.entries[i].score == 12);
+        ASSERT(t.entries[i].docId > prev);
+        prev = t.entries[i].docId;
+    }
+    ASSERT_EQUAL_INT((int)t.entries[1].docId, 11);
+
+    // fewer results than k are all kept, and sorted
+    TopK_Init(&t, entries, 10);
+    TopK_Push(&t, 1, 5);
+    TopK_Push(&t, 3, 6);
+    TopK_Push(&t, 2, 7);
+    ASSERT(!TopK_Full(&t));
+    TopK_Sort(&t);
+    ASSERT_EQUAL_INT(t.num, 3);
+    ASSERT(t.entries[0].docId == 6 && t.entries[1].docId == 7 && t.entries[2].docId == 5);
+
+    // a selector of nothing takes nothing
+    TopK_Init(&t, entries, 0);
+    ASSERT(!TopK_Push(&t, 1, 1));
+    return 0;
+}
+
+int testQueryCursor() {
+    QueryCursor c = {1.0 / 3, 12345}, p;
+    char *s = QueryCursor_Format(&c);
+    ASSERT(QueryCursor_Parse(&p, s) == REDISMODULE_OK);
+    // the score is kept exactly
+    ASSERT(p.score == c.score);
+    ASSERT_EQUAL_INT((int)p.docId, 12345);
+    sdsfree(s);
+
+    const char *bad[] = {"", "nosuchcursor", "12", "12.", "12.3fd5555555555555x", 
+                         "12.3fd555555555555", "-1.3fd5555555555555", "12.7ff8000000000000", NULL};
+    for (int i = 0; bad[i] != NULL; i++) {
+        ASSERT(QueryCursor_Parse(&p, bad[i]) == REDISMODULE_ERR);
+    }
+    return 0;
+}
+
+static int tokenizerJoin(void *ctx, Token t) {
+    sds *s = ctx;
+    *s = sdscatprintf(*s, "%d:%.*s|", t.pos, (int)t.len, t.s);
+    return 0;
+}
+
+/* Tokenize a copy of text with a kernel and a stopword list, returning the tokens joined */
+static sds tokenizerRun(TokenizerKernel k, const char *text, StopWordList *sl) {
+    Tokenizer_SetKernel(k);
+    char *copy = strdup(text);
+    sds s = sdsempty();
+    tokenize(copy, 1, 1, &s, tokenizerJoin, NULL, sl);
+    free(copy);
+    return s;
+}
+
+int testTokenizer() {
+    const char *text = "Hello? world...\tHELLO\nWorld42 is __WAZZ@UP? \xd7\xa9\xd7\x9c\xd7\x95\xd7\x9d "
+                       "ThisIsAVeryLongWordThatSpansSeveralChunks,AndAnother";
+    const char *expected = "1:hello|2:world|3:hello|4:world42|5:wazz|6:up|"
+                           "7:\xd7\xa9\xd7\x9c\xd7\x95\xd7\x9d|"
+                           "8:thisisaverylongwordthatspansseveralchunks|9:andanother|";
+    for (int k = TOK_Scalar; k <= TOK_AVX2; k++) {
+        sds s = tokenizerRun(k, text, NULL);
+        ASSERT(!strcmp(s, expected));
+        sdsfree(s);
+    }
+
+    // every kernel splits and lowercases random bytes the same
+    size_t n = 10000;
+    char *rnd = malloc(n + 1);
+    srand(1337);
+    for (size_t i = 0; i < n; i++) {
+        // mostly letters, in runs long enough for the SIMD kernels
+        rnd[i] = rand() % 8 ? 'A' + rand() % 58 : 1 + rand() % 255;
+    }
+    rnd[n] = 0;
+    sds ref = tokenizerRun(TOK_Scalar, rnd, NULL);
+    for (int k = TOK_SSE2; k <= TOK_AVX2; k++) {
+        sds s = tokenizerRun(k, rnd, NULL);
+        ASSERT(!strcmp(s, ref));
+        sdsfree(s);
+    }
+    sdsfree(ref);
+    free(rnd);
+    Tokenizer_SetKernel(TOK_AVX2);
+
+    char *q = strdup("Hello (world)\t\"foo-bar\" the");
+    QueryTokenizer qt = NewQueryTokenizer(q, strlen(q));
+    const char *words[] = {"Hello", "world", NULL, "foo", "bar", NULL, "the"};
+    QueryTokenType types[] = {T_WORD, T_WORD, T_QUOTE, T_WORD, T_WORD, T_QUOTE, T_STOPWORD};
+    for (int i = 0; i < 7; i++) {
+        ASSERT(QueryTokenizer_HasNext(&qt));
+        QueryToken t = QueryTokenizer_Next(&qt);
+        ASSERT_EQUAL_INT((t.type), (types[i]));
+        if (words[i]) {
+            ASSERT(!strcmp(t.s, words[i]));
+            free((char *)t.s);
+        }
+    }
+    ASSERT(!QueryTokenizer_HasNext(&qt));
+    free(q);
+    return 0;
+}
+
+int testStopWords() {
+    StopWordList *def = DefaultStopWordList();
+    ASSERT(StopWordList_Contains(NULL, "the", 3));
+    ASSERT(StopWordList_Contains(def, "with", 4));
+    ASSERT(!StopWordList_Contains(def, "hello", 5));
+    ASSERT(!StopWordList_Contains(def, "th", 2));
+
+    const char *words[] = {"Foo", "bar", "foo", "averyveryveryveryveryveryveryveryveryveryveryveryverylongword"};
+    StopWordList *sl = NewStopWordList(words, 4);
+    ASSERT_EQUAL_INT((int)sl->numWords, 3);
+    ASSERT(StopWordList_Contains(sl, "foo", 3));
+    ASSERT(StopWordList_Contains(sl, words[3], strlen(words[3])));
+    ASSERT(!StopWordList_Contains(sl, "the", 3));
+
+    sds s = tokenizerRun(TOK_Scalar, "The foo is a BAR baz", sl);
+    ASSERT(!strcmp(s, "1:the|2:is|3:a|4:baz|"));
+    sdsfree(s);
+    // a list shared by a cached spec is freed by its last holder
+    ASSERT(StopWordList_Retain(sl) == sl);
+    StopWordList_Free(sl);
+    ASSERT(StopWordList_Contains(sl, "bar", 3));
+    StopWordList_Free(sl);
+    // the default list is shared
+    StopWordList_Free(def);
+    ASSERT(StopWordList_Contains(NULL, "the", 3));
+
+    // an index's own list is parsed before the fields, and may be empty
+    const char *args[] = {"BLOCKS", "STOPWORDS", "2", "foo", "Bar", "title", "1.0"};
+    IndexSpec sp;
+    ASSERT_EQUAL_INT(IndexSpec_Parse(&sp, args, 7), REDISMODULE_OK);
+    ASSERT_EQUAL_INT(sp.numFields, 1);
+    ASSERT(sp.flags & Index_BlockEncoding);
+    ASSERT(StopWordList_Contains(sp.stopwords, "bar", 3));
+    IndexSpec_Free(&sp);
+
+    ASSERT_EQUAL_INT(IndexSpec_Parse(&sp, &args[1], 4), REDISMODULE_ERR);
+    const char *empty[] = {"STOPWORDS", "0", "title", "1.0"};
+    ASSERT_EQUAL_INT(IndexSpec_Parse(&sp, empty, 4), REDISMODULE_OK);
+    ASSERT(!StopWordList_Contains(sp.stopwords, "the", 3));
+    IndexSpec_Free(&sp);
+
+    const char *bad[] = {"STOPWORDS", "3", "foo", "title", "1.0"};
+    ASSERT_EQUAL_INT(IndexSpec_Parse(&sp, bad, 5), REDISMODULE_ERR);
+    const char *noCount[] = {"STOPWORDS", "", "title", "1.0"};
+    ASSERT_EQUAL_INT(IndexSpec_Parse(&sp, noCount, 4), REDISMODULE_ERR);
+
+    // after SCHEMA, fields may be named like options
+    const char *schema[] = {"NOFREQS", "SCHEMA", "stopwords", "1.0", "blocks", "2.0"};
+    ASSERT_EQUAL_INT(IndexSpec_Parse(&sp, schema, 6), REDISMODULE_OK);
+    ASSERT_EQUAL_INT(sp.flags, Index_NoFreqs);
+    ASSERT_EQUAL_INT(sp.numFields, 2);
+    ASSERT(sp.stopwords == NULL);
+    ASSERT(!strcmp(sp.fields[1].name, "blocks"));
+    IndexSpec_Free(&sp);
+    return 0;
+}
+
+int testStemmerPool() {
+    Stemmer *s = GetStemmer(SnowballStemmer, "english");
+    ASSERT(s != NULL);
+    ASSERT(s == GetStemmer(SnowballStemmer, "english"));
+    ASSERT(GetStemmer(SnowballStemmer, "klingon") == NULL);
+    ASSERT(GetStemmer(SnowballStemmer, "klingon") == NULL);
+
+    // memoized stems are the stems of the stemmer, both on misses and on hits, and words too long
+    // for the cache are stemmed every time
+    Stemmer *ref = NewStemmer(SnowballStemmer, "english");
+    const char *words[] = {"going", "arbitrary", "worlds", "running", "go", "a",
+                           "internationalizationsandmoreinternationalizations"};
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 7; i++) {
+            size_t len = strlen(words[i]), sl, rl;
+            const char *stem = s->Stem(s->ctx, words[i], len, &sl);
+            char *expected = strdup(ref->Stem(ref->ctx, words[i], len, &rl));
+            ASSERT(stem != NULL);
+            ASSERT_EQUAL_INT((int)sl, (int)rl);
+            ASSERT(!strncmp(stem, expected, sl));
+            free(expected);
+        }
+    }
+    ref->Free(ref);
+
+    // freeing a pooled stemmer leaves it in the pool
+    s->Free(s);
+    size_t sl;
+    ASSERT(!strcmp(s->Stem(s->ctx, "worlds", 6, &sl), "world"));
+    return 0;
+}
+
+int testSegment() {
+    // the persisted index has docIds 1..200, and the segment has the documents after them
+    IndexWriter *w = createIndex(200, 1, INDEX_VERSION_BLOCKS);
+    IndexSpec sp = {0};
+    sp.flags = Index_BlockEncoding | Index_NoFields;
+    RedisSearchCtx ctx = {NULL, &sp};
+    Segment s = {0};
+    s.terms = kh_init(segterms);
+    for (t_docId id = 201; id <= 300; id++) {
+        ForwardIndexEntry e = {"hello", id, 0.5, 1, 0x01, NewVarintVectorWriter(8)};
+        VVW_Write(e.vw, 1 + id % 7);
+        Segment_Add(&ctx, &s, &e);
+        // the segment owns the offsets from now on
+        ASSERT(e.vw == NULL);
+    }
+    ASSERT(Segment_GetTerm(&s, "world") == NULL);
+    SegmentTerm *t = Segment_GetTerm(&s, "hello");
+    ASSERT(t != NULL);
+    ASSERT_EQUAL_INT((int)t->numEntries, 100);
+    ASSERT_EQUAL_INT((int)s.numPostings, 100);
+    ASSERT_EQUAL_INT((int)s.lastDocId, 300);
+    // the segment is encoded like the index would be, but always in blocks
+    ASSERT_EQUAL_INT((int)t->w->entryFlags, INDEX_ENTRY_NOFIELDS);
+
+    // a union of the two yields all the postings in order, scored with the same idf
+    IndexReader *ir = openReader(w), *sr = SegmentTerm_OpenReader(t, NULL, 0xff, NULL);
+    IR_SetDocFreq(ir, ir->docFreq + sr->docFreq);
+    IR_SetDocFreq(sr, ir->docFreq);
+    IR_SetTotalDocs(ir, 1000);
+    IR_SetTotalDocs(sr, 1000);
+    ASSERT(ir->idf == sr->idf);
+    ASSERT(ir->idf == IDF(1000, 300));
+    IndexIterator **its = calloc(2, sizeof(IndexIterator *));
+    its[0] = NewReadIterator(ir);
+    its[1] = NewReadIterator(sr);
+    IndexIterator *ui = NewUnionIterator(its, 2, NULL, NULL);
+    IndexHit h = NewIndexHit();
+    t_docId expected = 1;
+    while (ui->Read(ui->ctx, &h) == INDEXREAD_OK) {
+        ASSERT_EQUAL_INT((int)h.docId, (int)expected);
+        expected++;
+        IndexHit_Init(&h);
+    }
+    ASSERT_EQUAL_INT((int)expected, 301);
+    ui->Free(ui);
+    IW_Free(w);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    LOGGING_INIT(L_INFO);
+    TESTFUNC(testReadLegacy);
+    TESTFUNC(testReadBlocks);
+    TESTFUNC(testReadSplit);
+    TESTFUNC(testReadPFor);
+    TESTFUNC(testSkipToLegacy);
+    TESTFUNC(testSkipToBlocks);
+    TESTFUNC(testSkipToSplit);
+    TESTFUNC(testSkipToPFor);
+    TESTFUNC(testEntryLayouts);
+    TESTFUNC(testReadModes);
+    TESTFUNC(testIndexHeader);
+    TESTFUNC(testBlockHeaders);
+    TESTFUNC(testStreamVByte);
+    TESTFUNC(testPFor);
+    TESTFUNC(testScoreIndexLegacy);
+    TESTFUNC(testScoreIndexBlocks);
+    TESTFUNC(testScoreIndexSplit);
+    TESTFUNC(testIntersectLegacy);
+    TESTFUNC(testIntersectBlocks);
+    TESTFUNC(testIntersectSplit);
+    TESTFUNC(testIntersectManyTerms);
+    TESTFUNC(testArenaIterators);
+    TESTFUNC(testIntersectOrder);
+    TESTFUNC(testQueryRewrite);
+    TESTFUNC(testArena);
+    TESTFUNC(testQueryArena);
+    TESTFUNC(testTopK);
+    TESTFUNC(testQueryCursor);
+    TESTFUNC(testSegment);
+    TESTFUNC(testTokenizer);
+    TESTFUNC(testStopWords);
+    TESTFUNC(testStemmerPool);
+    TESTFUNC(testReaderStats);
+    TESTFUNC(testDocNorms);
+    TESTFUNC(testReadBatchLegacy);
+    TESTFUNC(testReadBatchBlocks);
+    TESTFUNC(testReadBatchSplit);
+    TESTFUNC(testReadBatchPFor);
+    TESTFUNC(testPruning);
+    TESTFUNC(testUnionHeap);
+    TESTFUNC(testBitmap);
+    TESTFUNC(testBitmapIntersect);
+    return 0;
+}
@@ -51,9 +51,11 @@ int testTokenize() {
     const char *expected[] = {"hello", "world", "worlds", "world", "going", "go", "wazz", "up", "שלום"};
     ctx.expected = (char **)expected;
     
-    tokenize(txt, 1, 1, &ctx, tokenFunc, 1);
+    Stemmer *s = NewStemmer(SnowballStemmer, "en");
+    tokenize(txt, 1, 1, &ctx, tokenFunc, s, NULL);
     ASSERT(ctx.num == 9);
     
+    s->Free(s);
     free(txt);
     
     return 0;
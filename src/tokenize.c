@@ -1,57 +1,173 @@
 #include <stdlib.h>
 #include <strings.h>
 #include <ctype.h>
+#include <string.h>
 #include "tokenize.h"
 #include "forward_index.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TOK_X86
+#include <immintrin.h>
+#endif
+
+// the character classes of documents and of queries, by byte value
+static u_char tok_docClass[256];
+static u_char tok_queryClass[256];
+
+static int tok_initialized = 0;
+static TokenizerKernel tok_best = TOK_Scalar;
+static TokenizerKernel tok_kernel = TOK_Scalar;
+
+static void tok_initClass(u_char *cls, const char *separators) {
+  for (int c = 0; c < 256; c++) {
+    cls[c] = (c < 0x20 || c == 0x7f) ? TOKCHAR_SEPARATOR : 0;
+    if (c >= 'A' && c <= 'Z') cls[c] |= TOKCHAR_UPPER;
+  }
+  for (const char *p = separators; *p; p++) {
+    cls[(u_char)*p] |= TOKCHAR_SEPARATOR;
+  }
+}
+
+/* Build the lookup tables and detect the best kernel the CPU supports */
+static void tok_init() {
+  tok_initClass(tok_docClass, DEFAULT_SEPARATORS);
+  tok_initClass(tok_queryClass, QUERY_SEPARATORS);
+  tok_queryClass['"'] |= TOKCHAR_QUOTE;
+
+#ifdef TOK_X86
+#ifdef __SSE2__
+  tok_best = TOK_SSE2;
+#endif
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    tok_best = TOK_AVX2;
+  }
+#endif
+  tok_kernel = tok_best;
+  tok_initialized = 1;
+}
+
+TokenizerKernel Tokenizer_GetKernel() {
+  if (!tok_initialized) tok_init();
+  return tok_kernel;
+}
+
+TokenizerKernel Tokenizer_SetKernel(TokenizerKernel k) {
+  if (!tok_initialized) tok_init();
+  tok_kernel = k > tok_best ? tok_best : k;
+  return tok_kernel;
+}
+
+/* Lowercase the word of a document starting at s in place, and return its length */
+static size_t tok_wordScalar(char *s, char *end) {
+  char *p = s;
+  while (p < end) {
+    u_char c = tok_docClass[(u_char)*p];
+    if (c & TOKCHAR_SEPARATOR) break;
+    if (c & TOKCHAR_UPPER) *p += 'a' - 'A';
+    p++;
+  }
+  return p - s;
+}
+
+#ifdef TOK_X86
+#ifdef __SSE2__
+static size_t tok_wordSSE2(char *s, char *end) {
+  char *p = s;
+  // bytes are compared signed, so those of non-ASCII characters are negative
+  const __m128i case_ = _mm_set1_epi8(0x20);
+  const __m128i a = _mm_set1_epi8('a' - 1), z = _mm_set1_epi8('z' + 1);
+  const __m128i d0 = _mm_set1_epi8('0' - 1), d9 = _mm_set1_epi8('9' + 1);
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i l = _mm_or_si128(v, case_);
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(l, a), _mm_cmplt_epi8(l, z));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, d0), _mm_cmplt_epi8(v, d9));
+    __m128i word = _mm_or_si128(_mm_or_si128(letter, digit), _mm_cmplt_epi8(v, _mm_setzero_si128()));
+    _mm_storeu_si128((__m128i *)p, _mm_or_si128(v, _mm_and_si128(letter, case_)));
+
+    u_int32_t seps = ~_mm_movemask_epi8(word) & 0xffff;
+    if (seps) return p - s + __builtin_ctz(seps);
+    p += 16;
+  }
+  return p - s + tok_wordScalar(p, end);
+}
+#endif
+
+__attribute__((target("avx2")))
+static size_t tok_wordAVX2(char *s, char *end) {
+  char *p = s;
+  const __m256i case_ = _mm256_set1_epi8(0x20);
+  const __m256i a = _mm256_set1_epi8('a' - 1), z = _mm256_set1_epi8('z' + 1);
+  const __m256i d0 = _mm256_set1_epi8('0' - 1), d9 = _mm256_set1_epi8('9' + 1);
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i l = _mm256_or_si256(v, case_);
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(l, a), _mm256_cmpgt_epi8(z, l));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, d0), _mm256_cmpgt_epi8(d9, v));
+    __m256i word = _mm256_or_si256(_mm256_or_si256(letter, digit),
+                                   _mm256_cmpgt_epi8(_mm256_setzero_si256(), v));
+    _mm256_storeu_si256((__m256i *)p, _mm256_or_si256(v, _mm256_and_si256(letter, case_)));
+
+    u_int32_t seps = ~(u_int32_t)_mm256_movemask_epi8(word);
+    if (seps) return p - s + __builtin_ctz(seps);
+    p += 32;
+  }
+  return p - s + tok_wordScalar(p, end);
+}
+#endif
+
+static inline size_t tok_word(char *s, char *end) {
+  switch (tok_kernel) {
+#ifdef TOK_X86
+#ifdef __SSE2__
+    case TOK_SSE2:
+      return tok_wordSSE2(s, end);
+#endif
+    case TOK_AVX2:
+      return tok_wordAVX2(s, end);
+#endif
+    default:
+      return tok_wordScalar(s, end);
+  }
+}
+
 int tokenize(const char *text, float score, u_char fieldId, void *ctx,
-             TokenFunc f, Stemmer *s) {
+             TokenFunc f, Stemmer *s, StopWordList *stopwords) {
   TokenizerCtx tctx;
   tctx.text = text;
-  tctx.pos = (char **)&text;
-  tctx.separators = DEFAULT_SEPARATORS;
+  tctx.pos = (char *)text;
+  tctx.end = (char *)text + strlen(text);
   tctx.fieldScore = score;
   tctx.tokenFunc = f;
   tctx.tokenFuncCtx = ctx;
-  tctx.normalize = DefaultNormalize;
   tctx.fieldId = fieldId;
   tctx.stemmer = s;
+  tctx.stopwords = stopwords;
 
   return _tokenize(&tctx);
 }
 
-inline int isStopword(const char *w) {
-  int i = 0;
-  while (stopwords[i] != NULL) {
-    if (!strcmp(w, stopwords[i++])) {
-      return 1;
-    }
-  }
-
-  return 0;
-}
-
 // tokenize the text in the context
 int _tokenize(TokenizerCtx *ctx) {
+  if (!tok_initialized) tok_init();
   u_int pos = 0;
+  char *p = ctx->pos, *end = ctx->end;
+  StopWordList *stopwords = ctx->stopwords ? ctx->stopwords : DefaultStopWordList();
 
-  while (*ctx->pos != NULL) {
-    // get the next token
-    char *tok = strsep(ctx->pos, ctx->separators);
-    // this means we're at the end
-    if (tok == NULL) break;
-
-    // normalize the token
-    size_t tlen;
-    tok = ctx->normalize(tok, &tlen);
+  while (p < end) {
+    // skip to the next word
+    while (p < end && (tok_docClass[(u_char)*p] & TOKCHAR_SEPARATOR)) p++;
+    if (p == end) break;
 
-    // ignore tokens that turn into nothing
-    if (tok == NULL || tlen == 0) {
-      continue;
-    }
+    // lowercase it and null terminate it in place
+    char *tok = p;
+    size_t tlen = tok_word(tok, end);
+    p += tlen;
+    if (p < end) *p++ = '\0';
 
     // skip stopwords
-    if (isStopword(tok)) continue;
+    if (StopWordList_Contains(stopwords, tok, tlen)) continue;
 
     // create the token struct
     Token t = {tok, tlen, ++pos, ctx->fieldScore, ctx->fieldId, DT_WORD};
@@ -75,6 +191,7 @@ int _tokenize(TokenizerCtx *ctx) {
       }
     }
   }
+  ctx->pos = p;
 
   return pos;
 }
@@ -103,7 +220,10 @@ QueryTokenizer NewQueryTokenizer(char *text, size_t len) {
   ret.len = len;
   ret.pos = text;
   ret.normalize = DefaultNormalize;
-  ret.separators = QUERY_SEPARATORS;
+  if (!tok_initialized) tok_init();
+  ret.charClass = tok_queryClass;
+  ret.arena = NULL;
+  ret.stopwords = NULL;
 
   return ret;
 }
@@ -118,7 +238,8 @@ QueryToken QueryTokenizer_Next(QueryTokenizer *t) {
   size_t toklen = 0;
   while (t->pos < end) {
     // if this is a separator - either yield the token or move on
-    if (strchr(t->separators, *t->pos) || iscntrl(*t->pos)) {
+    u_char c = t->charClass[(u_char)*t->pos];
+    if (c & TOKCHAR_SEPARATOR) {
       if (t->pos > currentTok) {
         break;
       } else {
@@ -128,7 +249,7 @@ QueryToken QueryTokenizer_Next(QueryTokenizer *t) {
         continue;
       }
     }
-    if (*t->pos == '\"') {
+    if (c & TOKCHAR_QUOTE) {
       if (t->pos > currentTok) {
         goto word;
       }
@@ -145,8 +266,8 @@ QueryToken QueryTokenizer_Next(QueryTokenizer *t) {
   *t->pos = 0;
   t->pos++;
 word: {
-  char *w = strndup(currentTok, toklen);
-  int stopword = isStopword(w);
+  char *w = t->arena ? Arena_Strndup(t->arena, currentTok, toklen) : strndup(currentTok, toklen);
+  int stopword = StopWordList_Contains(t->stopwords, w, toklen);
   return (QueryToken){
       w, toklen, stopword ? T_STOPWORD : T_WORD,
   };
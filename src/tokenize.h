@@ -9,6 +9,8 @@
 #include "util/khash.h"
 #include "varint.h"
 #include "stemmer.h"
+#include "util/arena.h"
+#include "stopwords.h"
 
 typedef enum {
     DT_WORD,
@@ -41,31 +43,47 @@ typedef int(*TokenFunc)(void *ctx, Token t);
 typedef char*(*NormalizeFunc)(char*, size_t*);
 
 //! " # $ % & ' ( ) * + , - . / : ; < = > ? @ [ \ ] ^ _ ` { | } ~
-#define DEFAULT_SEPARATORS " \t,./(){}[]:;/\\~!@#$%^&*-_=+|'`\"<>?";
-#define QUERY_SEPARATORS " \t,./{}[]:;/\\~!@#$%^&*-_=+()|'<>?";
-static const char *stopwords[] =  {
-            "a", "is", "the", "an", "and", "are", "as", "at", "be", "but", "by",
-            "for", "if", "in", "into", "it",
-            "no", "not", "of", "on", "or", "such",
-            "that", "their", "then", "there", "these",
-            "they", "this", "to", "was", "will", "with", NULL
-    };
-    
+#define DEFAULT_SEPARATORS " \t,./(){}[]:;/\\~!@#$%^&*-_=+|'`\"<>?"
+#define QUERY_SEPARATORS " \t,./{}[]:;/\\~!@#$%^&*-_=+()|'<>?"
+
+/* The classes of a character in the tokenizers' lookup tables. Control characters are always
+separators */
+#define TOKCHAR_SEPARATOR 0x01
+#define TOKCHAR_UPPER 0x02
+#define TOKCHAR_QUOTE 0x04
+
+/* The kernels scanning the words of documents. The SIMD kernels lowercase and look for the end of
+a word 16 or 32 bytes at a time, and rely on DEFAULT_SEPARATORS having all the ASCII punctuation, so
+that ASCII letters and digits are the only ASCII characters of words. Bytes of non-ASCII characters
+are always part of words, and are left as they are */
+typedef enum {
+    TOK_Scalar,
+    TOK_SSE2,
+    TOK_AVX2,
+} TokenizerKernel;
+
+/* The kernel documents are tokenized with, the best the CPU supports unless set otherwise */
+TokenizerKernel Tokenizer_GetKernel();
+
+/* Use a kernel, e.g. to compare them. Returns the kernel used, which is the best the CPU supports
+if it does not support k */
+TokenizerKernel Tokenizer_SetKernel(TokenizerKernel k);
+
 #define STEM_TOKEN_FACTOR 0.2   
-    
-// TODO: Optimize this with trie or something...    
-int isStopword(const char *w);
 
 typedef struct {
     const char *text;
-    char **pos;
-    const char *separators;
+    // the next character to read, and the end of the text. Words are lowercased and
+    // null terminated in place
+    char *pos;
+    char *end;
     double fieldScore;
     int fieldId;
     TokenFunc tokenFunc;
     void *tokenFuncCtx;
-    NormalizeFunc normalize;
     Stemmer *stemmer;
+    // NULL for the default list
+    StopWordList *stopwords;
 } TokenizerCtx;
 
 
@@ -74,10 +92,11 @@ int _tokenize(TokenizerCtx *ctx);
 
 /** The extenral API. Tokenize text, and create tokens with the given score and fieldId.
 TokenFunc is a callback that will be called for each token found
-if doStem is 1, we will add stemming extraction for the text 
+if doStem is 1, we will add stemming extraction for the text.
+Words in the stopword list are skipped, or in the default list if it's NULL
 */
 int tokenize(const char *text, float fieldScore, u_char fieldId, void *ctx, TokenFunc f,
-             Stemmer *s);
+             Stemmer *s, StopWordList *stopwords);
 
 /** A simple text normalizer that convertes all tokens to lowercase and removes accents. 
 Does NOT normalize unicode */
@@ -89,9 +108,13 @@ typedef struct {
     const char *text;
     size_t len;
     char *pos;
-    const char *separators;
+    // the class of every character, see TOKCHAR_*
+    const u_char *charClass;
     NormalizeFunc normalize;
-    
+    // words in the list are T_STOPWORD tokens. NULL for the default list
+    StopWordList *stopwords;
+    // if set, the text of tokens is allocated in the arena. Otherwise it is malloc'd
+    Arena *arena;
 } QueryTokenizer;
 
 /* Quer tokenizer token type */
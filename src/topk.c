@@ -0,0 +1,37 @@
+#include "topk.h"
+
+void TopK_Init(TopK *t, TopKEntry *entries, u_int32_t k) {
+    t->entries = entries;
+    t->k = k;
+    t->num = 0;
+    t->threshold = k ? -HUGE_VAL : HUGE_VAL;
+}
+
+void topk_insert(TopK *t, double score, t_docId docId) {
+    TopKEntry x = {score, docId};
+    TopKEntry *e = t->entries;
+    // sift the new entry up from the end of the heap
+    u_int32_t pos = t->num++;
+    while (pos > 0) {
+        u_int32_t parent = (pos - 1) / 2;
+        if (!topk_worse(&x, &e[parent])) break;
+        e[pos] = e[parent];
+        pos = parent;
+    }
+    e[pos] = x;
+    if (t->num == t->k) {
+        t->threshold = e[0].score;
+    }
+}
+
+void TopK_Sort(TopK *t) {
+    // heap sort: moving the worst result to the end of the heap, one by one, leaves the array 
+    // sorted best first
+    for (u_int32_t n = t->num; n > 1; n--) {
+        TopKEntry worst = t->entries[0];
+        t->entries[0] = t->entries[n - 1];
+        t->entries[n - 1] = worst;
+        topk_siftDown(t->entries, n - 1, 0);
+    }
+    t->threshold = HUGE_VAL;
+}
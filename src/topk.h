@@ -0,0 +1,82 @@
+#ifndef __TOPK_H__
+#define __TOPK_H__
+
+#include <math.h>
+#include "types.h"
+
+/*
+TopK selects the k best results of a query as they are scored. The results are kept inline as
+(score, docId) pairs in a flat array laid out as a binary min-heap, with the worst result at its
+root. A result is better than another if it scores higher, or scores the same and has a lower
+docId.
+
+Once the heap is full, the score of its root is cached as the threshold a candidate has to beat,
+so most candidates of a large result set are rejected with a single compare, and the heap is only
+touched by the ones that get in. Since iterators yield results in increasing docId order, a
+candidate that only ties the threshold can't be better than the root, and is rejected too.
+*/
+
+typedef struct {
+    double score;
+    t_docId docId;
+} TopKEntry;
+
+typedef struct {
+    TopKEntry *entries;
+    u_int32_t k;
+    u_int32_t num;
+    // the score a candidate has to beat to get in. -HUGE_VAL until the heap is full
+    double threshold;
+} TopK;
+
+/* Initialize a selector of the k best results, in an array of k entries provided by the caller */
+void TopK_Init(TopK *t, TopKEntry *entries, u_int32_t k);
+
+/* Is a worse than b */
+static inline int topk_worse(const TopKEntry *a, const TopKEntry *b) {
+    return a->score < b->score || (a->score == b->score && a->docId > b->docId);
+}
+
+/* Sift the entry at pos down the first num entries of the heap */
+static inline void topk_siftDown(TopKEntry *e, u_int32_t num, u_int32_t pos) {
+    TopKEntry x = e[pos];
+    for (;;) {
+        u_int32_t c = 2 * pos + 1;
+        if (c >= num) break;
+        if (c + 1 < num && topk_worse(&e[c + 1], &e[c])) c++;
+        if (!topk_worse(&e[c], &x)) break;
+        e[pos] = e[c];
+        pos = c;
+    }
+    e[pos] = x;
+}
+
+/* Add a result that is known to beat the threshold */
+void topk_insert(TopK *t, double score, t_docId docId);
+
+/* Offer a result to the selector. Returns 1 if it got in */
+static inline int TopK_Push(TopK *t, double score, t_docId docId) {
+    if (score <= t->threshold) {
+        return 0;
+    }
+    if (t->num == t->k) {
+        // replace the worst result, which the candidate beats
+        t->entries[0].score = score;
+        t->entries[0].docId = docId;
+        topk_siftDown(t->entries, t->num, 0);
+        t->threshold = t->entries[0].score;
+        return 1;
+    }
+    topk_insert(t, score, docId);
+    return 1;
+}
+
+/* Is the selector full, i.e. do results have to beat the threshold to get in */
+static inline int TopK_Full(const TopK *t) {
+    return t->num == t->k;
+}
+
+/* Sort the results best first, in place. The selector can't be pushed to anymore */
+void TopK_Sort(TopK *t);
+
+#endif
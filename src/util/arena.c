@@ -0,0 +1,66 @@
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN(x) (((x) + 15) & ~(size_t)15)
+
+static ArenaBlock *arena_newBlock(size_t cap, ArenaBlock *next) {
+    ArenaBlock *b = malloc(sizeof(ArenaBlock) + cap);
+    b->next = next;
+    b->cap = cap;
+    b->used = 0;
+    return b;
+}
+
+Arena *NewArena(size_t blockSize) {
+    // the arena itself is the first allocation of its first block
+    size_t self = ARENA_ALIGN(sizeof(Arena));
+    ArenaBlock *b = arena_newBlock(self + blockSize, NULL);
+    Arena *a = (Arena *)b->data;
+    b->used = self;
+    a->head = b;
+    a->blockSize = blockSize;
+    a->allocated = 0;
+    return a;
+}
+
+void *Arena_Alloc(Arena *a, size_t size) {
+    size = ARENA_ALIGN(size);
+    a->allocated += size;
+    ArenaBlock *b = a->head;
+    if (b->used + size > b->cap) {
+        if (size > a->blockSize) {
+            // large allocations get a block of their own, behind the current one so we keep 
+            // allocating from what's left of it
+            b->next = arena_newBlock(size, b->next);
+            b->next->used = size;
+            return b->next->data;
+        }
+        b = a->head = arena_newBlock(a->blockSize, b);
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+void *Arena_Calloc(Arena *a, size_t num, size_t size) {
+    void *p = Arena_Alloc(a, num * size);
+    memset(p, 0, num * size);
+    return p;
+}
+
+char *Arena_Strndup(Arena *a, const char *s, size_t len) {
+    char *p = Arena_Alloc(a, len + 1);
+    memcpy(p, s, len);
+    p[len] = 0;
+    return p;
+}
+
+void Arena_Free(Arena *a) {
+    // the arena lives in the first block, which is the last one in the list
+    ArenaBlock *b = a->head;
+    while (b) {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+#include <stdlib.h>
+
+/*
+An arena is a bump allocator for memory that lives exactly as long as its owner, e.g. a query.
+Allocations are carved out of large blocks one after the other, and are never freed one by one:
+freeing the arena frees all of them at once.
+*/
+
+typedef struct arenaBlock {
+    struct arenaBlock *next;
+    size_t cap;
+    size_t used;
+    // aligned to 16 bytes, like malloc'd memory
+    char data[] __attribute__((aligned(16)));
+} ArenaBlock;
+
+typedef struct {
+    // the block being allocated from, which links to the ones before it
+    ArenaBlock *head;
+    // the size of new blocks. Allocations larger than that get a block of their own
+    size_t blockSize;
+    // the total bytes allocated from the arena
+    size_t allocated;
+} Arena;
+
+#define ARENA_DEFAULT_BLOCK_SIZE 4096
+
+/* Create a new arena. Its first block is allocated with it, so creating an arena and allocating
+less than blockSize from it mallocs once */
+Arena *NewArena(size_t blockSize);
+
+/* Allocate size bytes, aligned to 16 bytes */
+void *Arena_Alloc(Arena *a, size_t size);
+/* Allocate num * size zeroed bytes */
+void *Arena_Calloc(Arena *a, size_t num, size_t size);
+/* Copy len bytes of a string to the arena, and null terminate them */
+char *Arena_Strndup(Arena *a, const char *s, size_t len);
+
+/* Free the arena and everything allocated from it */
+void Arena_Free(Arena *a);
+
+#endif